@@ -0,0 +1,692 @@
+/**
+ * amqp_standin.c
+ *
+ * Purpose:
+ *   The AMQP 0-9-1 stand-in broker used by bench_publish and the
+ *   subscriber test; see amqp_standin.h. There are no exchanges: every
+ *   method the publisher path sends gets the reply RabbitMQ would give,
+ *   publishes on a channel in confirm mode are acked, and one shared
+ *   queue, filled with standin_enqueue, feeds every consumer.
+ */
+
+#include "amqp_standin.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FRAME_METHOD    1
+#define FRAME_HEADER    2
+#define FRAME_BODY      3
+#define FRAME_HEARTBEAT 8
+#define FRAME_END       0xCE
+
+#define STANDIN_FRAME_MAX    131072
+#define STANDIN_CHANNEL_MAX  2047
+
+// class and method ids
+#define M(class_id, method_id) (((uint32_t)(class_id) << 16) | (method_id))
+#define CONNECTION_START     M(10, 10)
+#define CONNECTION_START_OK  M(10, 11)
+#define CONNECTION_TUNE      M(10, 30)
+#define CONNECTION_TUNE_OK   M(10, 31)
+#define CONNECTION_OPEN      M(10, 40)
+#define CONNECTION_OPEN_OK   M(10, 41)
+#define CONNECTION_CLOSE     M(10, 50)
+#define CONNECTION_CLOSE_OK  M(10, 51)
+#define CHANNEL_OPEN         M(20, 10)
+#define CHANNEL_OPEN_OK      M(20, 11)
+#define CHANNEL_CLOSE        M(20, 40)
+#define CHANNEL_CLOSE_OK     M(20, 41)
+#define QUEUE_DECLARE        M(50, 10)
+#define QUEUE_DECLARE_OK     M(50, 11)
+#define QUEUE_BIND           M(50, 20)
+#define QUEUE_BIND_OK        M(50, 21)
+#define BASIC_QOS            M(60, 10)
+#define BASIC_QOS_OK         M(60, 11)
+#define BASIC_CONSUME        M(60, 20)
+#define BASIC_CONSUME_OK     M(60, 21)
+#define BASIC_CANCEL         M(60, 30)
+#define BASIC_CANCEL_OK      M(60, 31)
+#define BASIC_PUBLISH        M(60, 40)
+#define BASIC_DELIVER        M(60, 60)
+#define BASIC_ACK            M(60, 80)
+#define BASIC_REJECT         M(60, 90)
+#define BASIC_NACK           M(60, 120)
+#define CONFIRM_SELECT       M(85, 10)
+#define CONFIRM_SELECT_OK    M(85, 11)
+
+// how often a connection with a consumer looks for queued messages
+#define STANDIN_DELIVER_POLL_MS 5
+
+// -----------------------------------------------------------------------------
+// The shared queue
+// -----------------------------------------------------------------------------
+typedef struct QueuedMsg {
+    struct QueuedMsg *next;
+    char    *routing_key;
+    char    *content_type;  // NULL = unset
+    void    *body;
+    size_t   len;
+    int      redelivered;
+} QueuedMsg;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static QueuedMsg *queue_head, *queue_tail;
+static StandinStats stats;   // under queue_lock
+
+static void queued_msg_free(QueuedMsg *m) {
+    if (!m) return;
+    free(m->routing_key);
+    free(m->content_type);
+    free(m->body);
+    free(m);
+}
+
+// Puts a chain back at the head, as RabbitMQ does with requeued messages.
+// Caller holds queue_lock.
+static void queue_push_front(QueuedMsg *first, QueuedMsg *last) {
+    last->next = queue_head;
+    queue_head = first;
+    if (!queue_tail) queue_tail = last;
+}
+
+typedef struct {
+    int      open;
+    int      confirm;
+    int      in_content;  // between basic.publish and the last body frame
+    uint64_t body_left;
+    uint64_t published;   // delivery tag of the last complete publish
+    uint64_t acked;
+} Channel;
+
+// A delivery the consumer has not acked yet.
+typedef struct {
+    uint64_t   tag;
+    QueuedMsg *msg;
+} Unacked;
+
+typedef struct {
+    int      fd;
+    int      heartbeat_s;
+    int      confirm_delay_us;
+    int      closing;
+    uint64_t last_sent_ns;
+    char    *in;
+    size_t   in_len;
+    size_t   in_cap;
+    char    *out;
+    size_t   out_len;
+    size_t   out_cap;
+    Channel  ch[STANDIN_CHANNEL_MAX + 1];
+    uint16_t dirty[STANDIN_CHANNEL_MAX + 1]; // channels with unacked publishes
+    int      ndirty;
+    uint64_t last_recv_ns;
+
+    // consuming (one consumer per connection)
+    uint16_t consume_channel;
+    int      consuming;
+    int      consumers;         // consumer tags handed out
+    char     consumer_tag[32];
+    int      qos_prefetch;      // from the latest basic.qos; 0 = unlimited
+    int      prefetch;          // as it was when the consumer started
+    uint64_t next_tag;
+    Unacked *unacked;           // in tag order
+    size_t   nunacked;
+    size_t   unacked_cap;
+} Conn;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint16_t get16(const char *p) {
+    return (uint16_t)(((unsigned char)p[0] << 8) | (unsigned char)p[1]);
+}
+
+static uint32_t get32(const char *p) {
+    return ((uint32_t)get16(p) << 16) | get16(p + 2);
+}
+
+static uint64_t get64(const char *p) {
+    return ((uint64_t)get32(p) << 32) | get32(p + 4);
+}
+
+static void put16(char *p, uint16_t v) {
+    p[0] = (char)(v >> 8);
+    p[1] = (char)v;
+}
+
+static void put32(char *p, uint32_t v) {
+    put16(p, (uint16_t)(v >> 16));
+    put16(p + 2, (uint16_t)v);
+}
+
+static void put64(char *p, uint64_t v) {
+    put32(p, (uint32_t)(v >> 32));
+    put32(p + 4, (uint32_t)v);
+}
+
+// -----------------------------------------------------------------------------
+// Output
+// -----------------------------------------------------------------------------
+static char* out_reserve(Conn *c, size_t n) {
+    if (c->out_len + n > c->out_cap) {
+        size_t cap = c->out_cap ? c->out_cap * 2 : 4096;
+        while (cap < c->out_len + n) cap *= 2;
+        char *grown = realloc(c->out, cap);
+        if (!grown) return NULL;
+        c->out = grown;
+        c->out_cap = cap;
+    }
+    return c->out + c->out_len;
+}
+
+static void send_frame(Conn *c, int type, uint16_t channel, const char *payload, size_t len) {
+    char *p = out_reserve(c, 7 + len + 1);
+    if (!p) return;
+    p[0] = (char)type;
+    put16(p + 1, channel);
+    put32(p + 3, (uint32_t)len);
+    if (len) memcpy(p + 7, payload, len);
+    p[7 + len] = (char)FRAME_END;
+    c->out_len += 7 + len + 1;
+}
+
+static void send_method(Conn *c, uint16_t channel, uint32_t method, const char *args, size_t len) {
+    char payload[4 + 600];
+    if (len > sizeof(payload) - 4) return;
+    put32(payload, method);
+    if (len) memcpy(payload + 4, args, len);
+    send_frame(c, FRAME_METHOD, channel, payload, 4 + len);
+}
+
+static int flush_out(Conn *c) {
+    size_t off = 0;
+    while (off < c->out_len) {
+        ssize_t n = write(c->fd, c->out + off, c->out_len - off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        off += (size_t)n;
+    }
+    if (c->out_len) c->last_sent_ns = now_ns();
+    c->out_len = 0;
+    return 0;
+}
+
+static void send_start(Conn *c) {
+    // version 0-9, empty server-properties, mechanisms "PLAIN", locales "en_US"
+    char args[2 + 4 + 4 + 5 + 4 + 5];
+    char *p = args;
+    *p++ = 0;
+    *p++ = 9;
+    put32(p, 0);
+    p += 4;
+    put32(p, 5);
+    memcpy(p + 4, "PLAIN", 5);
+    p += 9;
+    put32(p, 5);
+    memcpy(p + 4, "en_US", 5);
+    p += 9;
+    send_method(c, 0, CONNECTION_START, args, (size_t)(p - args));
+}
+
+static void send_acks(Conn *c) {
+    if (c->ndirty == 0) return;
+    if (c->confirm_delay_us > 0) {
+        usleep((useconds_t)c->confirm_delay_us);
+    }
+    for (int i = 0; i < c->ndirty; i++) {
+        Channel *ch = &c->ch[c->dirty[i]];
+        char args[9];
+        put64(args, ch->published);
+        args[8] = 1; // multiple
+        send_method(c, c->dirty[i], BASIC_ACK, args, sizeof(args));
+        ch->acked = ch->published;
+    }
+    c->ndirty = 0;
+}
+
+// -----------------------------------------------------------------------------
+// Consuming
+// -----------------------------------------------------------------------------
+static size_t put_shortstr(char *p, const char *s, size_t len) {
+    if (len > 255) len = 255;
+    p[0] = (char)len;
+    memcpy(p + 1, s, len);
+    return 1 + len;
+}
+
+static void send_deliver(Conn *c, uint64_t tag, const QueuedMsg *m) {
+    char args[1 + 32 + 8 + 1 + 1 + 1 + 255];
+    size_t n = put_shortstr(args, c->consumer_tag, strlen(c->consumer_tag));
+    put64(args + n, tag);
+    n += 8;
+    args[n++] = (char)(m->redelivered ? 1 : 0);
+    n += put_shortstr(args + n, "", 0);   // exchange
+    n += put_shortstr(args + n, m->routing_key, strlen(m->routing_key));
+    send_method(c, c->consume_channel, BASIC_DELIVER, args, n);
+
+    // content header: class, weight, body size, property flags, content-type
+    char hdr[2 + 2 + 8 + 2 + 256];
+    put16(hdr, 60);
+    put16(hdr + 2, 0);
+    put64(hdr + 4, m->len);
+    size_t h = 14;
+    if (m->content_type) {
+        put16(hdr + 12, 0x8000);
+        h += put_shortstr(hdr + h, m->content_type, strlen(m->content_type));
+    } else {
+        put16(hdr + 12, 0);
+    }
+    send_frame(c, FRAME_HEADER, c->consume_channel, hdr, h);
+    for (size_t off = 0; off < m->len; off += STANDIN_FRAME_MAX - 8) {
+        size_t chunk = m->len - off < STANDIN_FRAME_MAX - 8 ? m->len - off : STANDIN_FRAME_MAX - 8;
+        send_frame(c, FRAME_BODY, c->consume_channel, (const char*)m->body + off, chunk);
+    }
+}
+
+// Sends queued messages while the consumer's prefetch allows.
+static void deliver_queued(Conn *c) {
+    if (!c->consuming) return;
+    pthread_mutex_lock(&queue_lock);
+    while (queue_head && (c->prefetch == 0 || c->nunacked < (size_t)c->prefetch)) {
+        if (c->nunacked == c->unacked_cap) {
+            size_t cap = c->unacked_cap ? c->unacked_cap * 2 : 64;
+            Unacked *grown = realloc(c->unacked, cap * sizeof(Unacked));
+            if (!grown) break;
+            c->unacked = grown;
+            c->unacked_cap = cap;
+        }
+        QueuedMsg *m = queue_head;
+        queue_head = m->next;
+        if (!queue_head) queue_tail = NULL;
+        m->next = NULL;
+        c->unacked[c->nunacked++] = (Unacked){ ++c->next_tag, m };
+        stats.deliveries++;
+        send_deliver(c, c->next_tag, m);
+    }
+    pthread_mutex_unlock(&queue_lock);
+}
+
+// Settles the unacked delivery `tag`, or with `multiple` every one up to
+// it; settled messages are freed, or put back on the queue in order.
+static void settle(Conn *c, uint64_t tag, int multiple, int requeue) {
+    QueuedMsg *first = NULL, *last = NULL;
+    size_t kept = 0;
+    pthread_mutex_lock(&queue_lock);
+    for (size_t i = 0; i < c->nunacked; i++) {
+        Unacked *u = &c->unacked[i];
+        if (u->tag == tag || (multiple && u->tag < tag)) {
+            if (requeue) {
+                u->msg->redelivered = 1;
+                if (last) last->next = u->msg; else first = u->msg;
+                last = u->msg;
+                stats.requeued++;
+            } else {
+                queued_msg_free(u->msg);
+                stats.acked++;
+            }
+        } else {
+            c->unacked[kept++] = *u;
+        }
+    }
+    c->nunacked = kept;
+    if (first) queue_push_front(first, last);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+// -----------------------------------------------------------------------------
+// Input
+// -----------------------------------------------------------------------------
+static void publish_done(Conn *c, uint16_t channel) {
+    Channel *ch = &c->ch[channel];
+    ch->in_content = 0;
+    if (!ch->confirm) return;
+    if (ch->published++ == ch->acked) {
+        c->dirty[c->ndirty++] = channel;
+    }
+}
+
+// Returns -1 to drop the connection.
+static int on_method(Conn *c, uint16_t channel, const char *p, size_t len) {
+    if (len < 4) return -1;
+    uint32_t method = get32(p);
+    const char *args = p + 4;
+    size_t nargs = len - 4;
+    Channel *ch = &c->ch[channel];
+
+    switch (method) {
+    case CONNECTION_START_OK: {
+        char tune[8];
+        put16(tune, STANDIN_CHANNEL_MAX);
+        put32(tune + 2, STANDIN_FRAME_MAX);
+        put16(tune + 6, 0); // let the client pick the heartbeat
+        send_method(c, 0, CONNECTION_TUNE, tune, sizeof(tune));
+        return 0;
+    }
+    case CONNECTION_TUNE_OK:
+        if (nargs < 8) return -1;
+        c->heartbeat_s = get16(args + 6);
+        return 0;
+    case CONNECTION_OPEN:
+        send_method(c, 0, CONNECTION_OPEN_OK, "", 1); // reserved shortstr
+        return 0;
+    case CONNECTION_CLOSE:
+        send_method(c, 0, CONNECTION_CLOSE_OK, NULL, 0);
+        c->closing = 1;
+        return 0;
+    case CONNECTION_CLOSE_OK:
+        c->closing = 1;
+        return 0;
+    case CHANNEL_OPEN: {
+        if (channel == 0) return -1;
+        memset(ch, 0, sizeof(*ch));
+        ch->open = 1;
+        char reserved[4] = { 0 }; // longstr
+        send_method(c, channel, CHANNEL_OPEN_OK, reserved, sizeof(reserved));
+        return 0;
+    }
+    case CHANNEL_CLOSE:
+        ch->open = 0;
+        send_method(c, channel, CHANNEL_CLOSE_OK, NULL, 0);
+        return 0;
+    case CHANNEL_CLOSE_OK:
+        ch->open = 0;
+        return 0;
+    case CONFIRM_SELECT:
+        if (!ch->open) return -1;
+        ch->confirm = 1;
+        if (nargs < 1 || !(args[0] & 1)) { // no-wait
+            send_method(c, channel, CONFIRM_SELECT_OK, NULL, 0);
+        }
+        return 0;
+    case BASIC_PUBLISH:
+        if (!ch->open) return -1;
+        ch->in_content = 1;
+        ch->body_left = 0;
+        return 0;
+    case QUEUE_DECLARE: {
+        if (!ch->open) return -1;
+        char ok[1 + 15 + 4 + 4];
+        size_t n = put_shortstr(ok, "amq.gen-standin", 15);
+        put32(ok + n, 0);   // message count
+        put32(ok + n + 4, 0); // consumer count
+        send_method(c, channel, QUEUE_DECLARE_OK, ok, n + 8);
+        return 0;
+    }
+    case QUEUE_BIND:
+        if (!ch->open) return -1;
+        send_method(c, channel, QUEUE_BIND_OK, NULL, 0);
+        return 0;
+    case BASIC_QOS:
+        if (!ch->open || nargs < 6) return -1;
+        c->qos_prefetch = get16(args + 4);
+        send_method(c, channel, BASIC_QOS_OK, NULL, 0);
+        return 0;
+    case BASIC_CONSUME: {
+        if (!ch->open || c->consuming) return -1;
+        // like RabbitMQ, a per-consumer prefetch is fixed when the
+        // consumer starts; a later basic.qos does not change it
+        c->consuming = 1;
+        c->consume_channel = channel;
+        c->prefetch = c->qos_prefetch;
+        snprintf(c->consumer_tag, sizeof(c->consumer_tag), "amq.ctag-standin-%d", ++c->consumers);
+        char ok[1 + sizeof(c->consumer_tag)];
+        size_t n = put_shortstr(ok, c->consumer_tag, strlen(c->consumer_tag));
+        send_method(c, channel, BASIC_CONSUME_OK, ok, n);
+        pthread_mutex_lock(&queue_lock);
+        stats.consumes++;
+        pthread_mutex_unlock(&queue_lock);
+        return 0;
+    }
+    case BASIC_CANCEL: {
+        if (!ch->open || nargs < 1) return -1;
+        size_t len = (unsigned char)args[0];
+        if (nargs < 1 + len) return -1;
+        c->consuming = 0;
+        char ok[1 + 255];
+        size_t n = put_shortstr(ok, args + 1, len);
+        send_method(c, channel, BASIC_CANCEL_OK, ok, n);
+        pthread_mutex_lock(&queue_lock);
+        stats.cancels++;
+        pthread_mutex_unlock(&queue_lock);
+        return 0;
+    }
+    case BASIC_ACK:
+        if (nargs < 9) return -1;
+        settle(c, get64(args), args[8] & 1, 0);
+        return 0;
+    case BASIC_NACK:
+        if (nargs < 9) return -1;
+        settle(c, get64(args), args[8] & 1, (args[8] & 2) != 0);
+        return 0;
+    case BASIC_REJECT:
+        if (nargs < 9) return -1;
+        settle(c, get64(args), 0, args[8] & 1);
+        return 0;
+    default:
+        fprintf(stderr, "standin: ignoring method %u.%u on channel %u\n",
+                method >> 16, method & 0xFFFF, channel);
+        return 0;
+    }
+}
+
+static int on_frame(Conn *c, int type, uint16_t channel, const char *p, size_t len) {
+    Channel *ch = &c->ch[channel];
+    switch (type) {
+    case FRAME_METHOD:
+        return on_method(c, channel, p, len);
+    case FRAME_HEADER:
+        if (!ch->in_content || len < 12) return -1;
+        ch->body_left = get64(p + 4);
+        if (ch->body_left == 0) publish_done(c, channel);
+        return 0;
+    case FRAME_BODY:
+        if (!ch->in_content || len > ch->body_left) return -1;
+        ch->body_left -= len;
+        if (ch->body_left == 0) publish_done(c, channel);
+        return 0;
+    case FRAME_HEARTBEAT:
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+// Handles every complete frame in the input buffer.
+static int process_input(Conn *c) {
+    size_t off = 0;
+    while (c->in_len - off >= 8) {
+        const char *f = c->in + off;
+        int type = (unsigned char)f[0];
+        uint16_t channel = get16(f + 1);
+        uint32_t size = get32(f + 3);
+        if (size > STANDIN_FRAME_MAX || channel > STANDIN_CHANNEL_MAX) return -1;
+        if (c->in_len - off < 8 + (size_t)size) break;
+        if ((unsigned char)f[7 + size] != FRAME_END) return -1;
+        if (on_frame(c, type, channel, f + 7, size) != 0) return -1;
+        off += 8 + (size_t)size;
+    }
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+    return 0;
+}
+
+static int read_header(Conn *c) {
+    char hdr[8];
+    size_t got = 0;
+    while (got < sizeof(hdr)) {
+        ssize_t n = read(c->fd, hdr + got, sizeof(hdr) - got);
+        if (n <= 0) return -1;
+        got += (size_t)n;
+    }
+    if (memcmp(hdr, "AMQP\0\0\x09\x01", 8) != 0) {
+        // tell the client which protocol we speak, as the spec asks
+        (void)!write(c->fd, "AMQP\0\0\x09\x01", 8);
+        return -1;
+    }
+    return 0;
+}
+
+static void* conn_main(void *arg) {
+    Conn *c = (Conn*)arg;
+    c->in_cap = 2 * (STANDIN_FRAME_MAX + 8);
+    c->in = malloc(c->in_cap);
+    if (!c->in || read_header(c) != 0) goto done;
+
+    send_start(c);
+    if (flush_out(c) != 0) goto done;
+    c->last_recv_ns = now_ns();
+
+    while (!c->closing) {
+        // heartbeats go out at half the negotiated interval
+        int timeout_ms = c->heartbeat_s > 0 ? c->heartbeat_s * 500 : -1;
+        if (c->consuming) timeout_ms = STANDIN_DELIVER_POLL_MS;
+        struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+        int r = poll(&pfd, 1, timeout_ms);
+        if (r < 0 && errno != EINTR) break;
+
+        if (r > 0) {
+            ssize_t n = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len);
+            if (n <= 0) break;
+            c->in_len += (size_t)n;
+            c->last_recv_ns = now_ns();
+            if (process_input(c) != 0) {
+                fprintf(stderr, "standin: protocol error, closing connection\n");
+                break;
+            }
+            send_acks(c);
+        }
+        // like RabbitMQ, give up on a client that has been silent for two
+        // heartbeat intervals
+        if (c->heartbeat_s > 0 &&
+            now_ns() - c->last_recv_ns >= (uint64_t)c->heartbeat_s * 2000000000ULL) {
+            fprintf(stderr, "standin: missed heartbeats, closing connection\n");
+            pthread_mutex_lock(&queue_lock);
+            stats.heartbeat_timeouts++;
+            pthread_mutex_unlock(&queue_lock);
+            break;
+        }
+        deliver_queued(c);
+        if (c->heartbeat_s > 0 && c->out_len == 0 &&
+            now_ns() - c->last_sent_ns >= (uint64_t)c->heartbeat_s * 500000000ULL) {
+            send_frame(c, FRAME_HEARTBEAT, 0, NULL, 0);
+        }
+        if (flush_out(c) != 0) break;
+    }
+
+done:
+    // unacked deliveries go back on the queue, as with RabbitMQ
+    if (c->nunacked > 0) {
+        settle(c, c->unacked[c->nunacked - 1].tag, 1, 1);
+    }
+    free(c->unacked);
+    close(c->fd);
+    free(c->in);
+    free(c->out);
+    free(c);
+    return NULL;
+}
+
+// -----------------------------------------------------------------------------
+// Listening
+// -----------------------------------------------------------------------------
+int standin_listen(int port, int *bound_port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(fd, 64) != 0 ||
+        getsockname(fd, (struct sockaddr*)&addr, &addr_len) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (bound_port) *bound_port = ntohs(addr.sin_port);
+    return fd;
+}
+
+void standin_serve(int listen_fd, int confirm_delay_us) {
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("standin: accept");
+            return;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        Conn *c = calloc(1, sizeof(Conn));
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->confirm_delay_us = confirm_delay_us;
+        pthread_mutex_lock(&queue_lock);
+        stats.connections++;
+        pthread_mutex_unlock(&queue_lock);
+        c->last_sent_ns = now_ns();
+
+        pthread_t t;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&t, &attr, conn_main, c) != 0) {
+            close(fd);
+            free(c);
+        }
+        pthread_attr_destroy(&attr);
+    }
+}
+
+// -----------------------------------------------------------------------------
+int standin_enqueue(const char *routing_key, const char *content_type, const void *body, size_t len) {
+    QueuedMsg *m = calloc(1, sizeof(QueuedMsg));
+    if (!m) return -1;
+    m->routing_key = strdup(routing_key ? routing_key : "");
+    m->content_type = content_type ? strdup(content_type) : NULL;
+    m->body = malloc(len ? len : 1);
+    if (!m->routing_key || (content_type && !m->content_type) || !m->body) {
+        queued_msg_free(m);
+        return -1;
+    }
+    memcpy(m->body, body, len);
+    m->len = len;
+
+    pthread_mutex_lock(&queue_lock);
+    if (queue_tail) queue_tail->next = m; else queue_head = m;
+    queue_tail = m;
+    pthread_mutex_unlock(&queue_lock);
+    return 0;
+}
+
+void standin_get_stats(StandinStats *out) {
+    if (!out) return;
+    pthread_mutex_lock(&queue_lock);
+    *out = stats;
+    pthread_mutex_unlock(&queue_lock);
+}
@@ -0,0 +1,56 @@
+#ifndef WAGGLE_BENCH_AMQP_STANDIN_H
+#define WAGGLE_BENCH_AMQP_STANDIN_H
+
+#include <stdint.h>
+
+/**
+ * A minimal AMQP 0-9-1 broker for benchmarks and tests. It speaks enough
+ * of the protocol for rabbitmq-c: the connection handshake, channels,
+ * publisher confirms, heartbeats and orderly close, and consuming with
+ * prefetch, cancel and acks. Published messages are discarded and acked.
+ * Like RabbitMQ, it acks with "multiple" once per batch of input read
+ * from the socket rather than once per message, closes connections whose
+ * heartbeats stop, and fixes a consumer's prefetch when it starts.
+ *
+ * Consumers all take from one queue, filled with standin_enqueue; queue
+ * declares and binds succeed but route nothing. Unacked deliveries go
+ * back to its head when they are requeued or their connection closes.
+ */
+
+#include <stddef.h>
+
+typedef struct StandinStats {
+    uint64_t connections;         // accepted
+    uint64_t heartbeat_timeouts;  // connections closed for missed heartbeats
+    uint64_t consumes;            // basic.consume
+    uint64_t cancels;             // basic.cancel
+    uint64_t deliveries;          // basic.deliver, redeliveries included
+    uint64_t acked;               // deliveries acked (or rejected without requeue)
+    uint64_t requeued;            // deliveries put back on the queue
+} StandinStats;
+
+/**
+ * Listens on 127.0.0.1:`port` (0 picks a free port) and stores the bound
+ * port in `*bound_port`. Returns the listening socket, or -1 on error.
+ */
+int standin_listen(int port, int *bound_port);
+
+/**
+ * Serves connections on `listen_fd` forever, one thread per connection.
+ * `confirm_delay_us` holds every batch of acks back by that long, to
+ * mimic a broker that is further away or writing to disk.
+ */
+void standin_serve(int listen_fd, int confirm_delay_us);
+
+/**
+ * Appends a message to the queue consumers take from. `content_type` may
+ * be NULL. Safe from any thread. Returns 0, or -1 if out of memory.
+ */
+int standin_enqueue(const char *routing_key, const char *content_type, const void *body, size_t len);
+
+/**
+ * Copies the stand-in's counters, over all connections so far.
+ */
+void standin_get_stats(StandinStats *out);
+
+#endif
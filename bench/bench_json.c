@@ -0,0 +1,160 @@
+/**
+ * bench_json.c
+ *
+ * Purpose:
+ *   Compares the streaming WaggleMsg JSON encoder against the previous
+ *   cJSON-tree implementation on a typical sensor sample, along with the
+ *   MessagePack encoder.
+ *
+ * Usage:
+ *   bench_json [iterations]
+ */
+
+#include "waggle/wagglemsg.h"
+#include "waggle/buffer.h"
+
+#include <cjson/cJSON.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// The cJSON-based encoder wagglemsg_dump_json used before the streaming one.
+static char* legacy_dump_json(const WaggleMsg *m) {
+    cJSON *root = cJSON_CreateObject();
+    if (!root) {
+        return NULL;
+    }
+    cJSON_AddStringToObject(root, "name", m->name);
+    {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%" PRId64, m->value);
+        cJSON_AddRawToObject(root, "val", buf);
+    }
+    {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%" PRIu64, (uint64_t)m->timestamp);
+        cJSON_AddRawToObject(root, "ts", buf);
+    }
+    cJSON *meta_obj = cJSON_Parse(m->meta);
+    if (!meta_obj) {
+        meta_obj = cJSON_CreateObject();
+    }
+    cJSON_AddItemToObject(root, "meta", meta_obj);
+    char *out = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    return out;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    long iterations = (argc > 1) ? atol(argv[1]) : 1000000;
+
+    WaggleMsg msg = {
+        .name = "env.temperature.htu21d",
+        .value = 2315,
+        .timestamp = 1700000000123456789ULL,
+        .meta = "{\"node\":\"000048b02d15bc7c\",\"sensor\":\"htu21d\",\"units\":\"centidegC\"}",
+    };
+
+    // sanity check: both encoders agree
+    char *a = legacy_dump_json(&msg);
+    char *b = wagglemsg_dump_json(&msg);
+    if (!a || !b || strcmp(a, b) != 0) {
+        fprintf(stderr, "encoders disagree:\n  cjson:  %s\n  stream: %s\n",
+                a ? a : "(null)", b ? b : "(null)");
+        free(a);
+        free(b);
+        return 1;
+    }
+    size_t out_len = strlen(b);
+    free(a);
+    free(b);
+
+    volatile size_t sink = 0;
+
+    uint64_t t0 = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        msg.value = i;
+        char *s = legacy_dump_json(&msg);
+        sink += s[0];
+        free(s);
+    }
+    uint64_t t_cjson = now_ns() - t0;
+
+    t0 = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        msg.value = i;
+        char *s = wagglemsg_dump_json(&msg);
+        sink += s[0];
+        free(s);
+    }
+    uint64_t t_dump = now_ns() - t0;
+
+    WaggleBuf buf;
+    wagglebuf_init(&buf);
+    t0 = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        msg.value = i;
+        wagglebuf_reset(&buf);
+        wagglemsg_encode_json_buf(&msg, &buf);
+        sink += buf.data[0];
+    }
+    uint64_t t_buf = now_ns() - t0;
+    wagglebuf_free(&buf);
+
+    char fixed[512];
+    t0 = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        msg.value = i;
+        sink += wagglemsg_encode_json(&msg, fixed, sizeof(fixed));
+    }
+    uint64_t t_fixed = now_ns() - t0;
+
+    WaggleBuf packed;
+    wagglebuf_init(&packed);
+    wagglemsg_encode_msgpack_buf(&msg, &packed);
+    size_t packed_len = packed.len;
+    t0 = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        msg.value = i;
+        wagglebuf_reset(&packed);
+        wagglemsg_encode_msgpack_buf(&msg, &packed);
+        sink += packed.data[0];
+    }
+    uint64_t t_msgpack = now_ns() - t0;
+    wagglebuf_free(&packed);
+
+    WaggleMsgTemplate tmpl;
+    wagglemsg_template_init_format(&tmpl, WAGGLEMSG_FORMAT_MSGPACK, msg.name, msg.meta);
+    char *tbuf = malloc(wagglemsg_template_bound(&tmpl));
+    t0 = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        sink += wagglemsg_template_write(&tmpl, i, msg.timestamp, tbuf);
+    }
+    uint64_t t_msgpack_tmpl = now_ns() - t0;
+    free(tbuf);
+    wagglemsg_template_free(&tmpl);
+
+    (void)sink;
+    printf("message: %zu bytes, %ld iterations\n", out_len, iterations);
+    printf("%-34s %8.1f ns/msg\n", "cJSON tree (previous)", (double)t_cjson / iterations);
+    printf("%-34s %8.1f ns/msg  (%.1fx)\n", "wagglemsg_dump_json",
+           (double)t_dump / iterations, (double)t_cjson / t_dump);
+    printf("%-34s %8.1f ns/msg  (%.1fx)\n", "wagglemsg_encode_json_buf (reused)",
+           (double)t_buf / iterations, (double)t_cjson / t_buf);
+    printf("%-34s %8.1f ns/msg  (%.1fx)\n", "wagglemsg_encode_json (stack buf)",
+           (double)t_fixed / iterations, (double)t_cjson / t_fixed);
+    printf("%-34s %8.1f ns/msg  (%.1fx, %zu bytes)\n", "wagglemsg_encode_msgpack_buf",
+           (double)t_msgpack / iterations, (double)t_cjson / t_msgpack, packed_len);
+    printf("%-34s %8.1f ns/msg  (%.1fx)\n", "MessagePack template",
+           (double)t_msgpack_tmpl / iterations, (double)t_cjson / t_msgpack_tmpl);
+    return 0;
+}
@@ -0,0 +1,192 @@
+/**
+ * bench_ndjson.c
+ *
+ * Purpose:
+ *   Compares decoding a data.ndjson segment, written by a FilePublisher,
+ *   with the bulk decoder (wagglemsg_decode_ndjson), with
+ *   wagglemsg_load_json per line, and with a cJSON tree per line.
+ *
+ * Usage:
+ *   bench_ndjson [lines] [rounds]
+ */
+
+#include "waggle/wagglemsg.h"
+#include "waggle/buffer.h"
+#include "waggle/filepublisher.h"
+#include "waggle/timeutil.h"
+
+#include <cjson/cJSON.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// The cJSON-based wagglemsg_load_json used before the streaming decoder,
+// reading the file log's "timestamp" as well.
+static WaggleMsg* legacy_load_json(const char *json_str) {
+    cJSON *root = cJSON_Parse(json_str);
+    if (!root) {
+        return NULL;
+    }
+    cJSON *name = cJSON_GetObjectItem(root, "name");
+    cJSON *val  = cJSON_GetObjectItem(root, "val");
+    cJSON *ts   = cJSON_GetObjectItem(root, "ts");
+    cJSON *iso  = cJSON_GetObjectItem(root, "timestamp");
+    cJSON *meta = cJSON_GetObjectItem(root, "meta");
+    uint64_t timestamp = 0;
+    if (cJSON_IsNumber(ts)) {
+        timestamp = (uint64_t)ts->valuedouble;
+    } else if (!cJSON_IsString(iso) ||
+               waggle_parse_iso8601_ns(iso->valuestring, strlen(iso->valuestring), &timestamp) != 0) {
+        cJSON_Delete(root);
+        return NULL;
+    }
+    if (!cJSON_IsString(name) || !cJSON_IsNumber(val)) {
+        cJSON_Delete(root);
+        return NULL;
+    }
+    char *meta_str = (meta && cJSON_IsObject(meta)) ? cJSON_PrintUnformatted(meta) : NULL;
+    WaggleMsg *m = wagglemsg_new(name->valuestring,
+                                 (int64_t)val->valuedouble,
+                                 timestamp,
+                                 meta_str ? meta_str : "{}");
+    free(meta_str);
+    cJSON_Delete(root);
+    return m;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    long lines = (argc > 1) ? atol(argv[1]) : 100000;
+    int rounds = (argc > 2) ? atoi(argv[2]) : 10;
+    if (lines <= 0 || rounds <= 0) {
+        fprintf(stderr, "usage: %s [lines] [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    // a segment of typical sensor samples, written by the file log itself
+    char dir[] = "/tmp/bench_ndjson.XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    char path[sizeof(dir) + 16];
+    snprintf(path, sizeof(path), "%s/data.ndjson", dir);
+    FilePublisher *fp = filepublisher_new(dir);
+    if (!fp) {
+        fprintf(stderr, "could not open %s\n", path);
+        return 1;
+    }
+    for (long i = 0; i < lines; i++) {
+        WaggleMsg msg = {
+            .name = (i % 3 == 0) ? "env.temperature.htu21d" : "env.relative_humidity.htu21d",
+            .value = 2315 + i % 97,
+            .timestamp = 1700000000123456789ULL + (uint64_t)i * 1000003ULL,
+            .meta = "{\"node\":\"000048b02d15bc7c\",\"sensor\":\"htu21d\",\"units\":\"centidegC\"}",
+        };
+        if (filepublisher_log(fp, &msg) != 0) {
+            fprintf(stderr, "could not write %s\n", path);
+            return 1;
+        }
+    }
+    filepublisher_free(fp);
+
+    WaggleBuf in;
+    wagglebuf_init(&in);
+    FILE *f = fopen(path, "rb");
+    char chunk[65536];
+    size_t got;
+    while (f && (got = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        if (wagglebuf_append(&in, chunk, got) != 0) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+    }
+    if (f) fclose(f);
+    unlink(path);
+    rmdir(dir);
+
+    // sanity check: the bulk decoder reads every line of the segment back
+    // exactly, ISO 8601 timestamps included
+    WaggleMsgBatch batch;
+    wagglemsg_batch_init(&batch);
+    if (wagglemsg_decode_ndjson(&batch, in.data, in.len) != lines || batch.invalid != 0 ||
+        batch.msgs[lines - 1].timestamp != 1700000000123456789ULL + (uint64_t)(lines - 1) * 1000003ULL ||
+        batch.msgs[lines - 1].value != 2315 + (lines - 1) % 97) {
+        fprintf(stderr, "bulk decoder failed on the file log's lines\n");
+        return 1;
+    }
+
+    volatile uint64_t sink = 0;
+    char *line = malloc(in.len + 1);
+    if (!line) {
+        return 1;
+    }
+
+    uint64_t t0 = now_ns();
+    long inexact = 0;
+    for (int r = 0; r < rounds; r++) {
+        const char *p = in.data;
+        for (long i = 0; i < lines; i++) {
+            const char *nl = memchr(p, '\n', (size_t)(in.data + in.len - p));
+            size_t n = (size_t)(nl - p);
+            memcpy(line, p, n);
+            line[n] = '\0';
+            WaggleMsg *m = legacy_load_json(line);
+            if (m) {
+                sink += m->timestamp;
+                inexact += (r == 0 && m->timestamp != batch.msgs[i].timestamp);
+                wagglemsg_free(m);
+            }
+            p = nl + 1;
+        }
+    }
+    uint64_t t_cjson = now_ns() - t0;
+
+    t0 = now_ns();
+    for (int r = 0; r < rounds; r++) {
+        const char *p = in.data;
+        for (long i = 0; i < lines; i++) {
+            const char *nl = memchr(p, '\n', (size_t)(in.data + in.len - p));
+            WaggleMsg *m = wagglemsg_load_json_len(p, (size_t)(nl - p));
+            if (m) {
+                sink += m->timestamp;
+                wagglemsg_free(m);
+            }
+            p = nl + 1;
+        }
+    }
+    uint64_t t_load = now_ns() - t0;
+
+    t0 = now_ns();
+    for (int r = 0; r < rounds; r++) {
+        wagglemsg_batch_reset(&batch);
+        wagglemsg_decode_ndjson(&batch, in.data, in.len);
+        sink += batch.msgs[0].timestamp;
+    }
+    uint64_t t_bulk = now_ns() - t0;
+
+    (void)sink;
+    double total = (double)lines * rounds;
+    printf("input: %zu bytes, %ld lines, %d rounds\n", in.len, lines, rounds);
+    printf("%-36s %8.1f ns/msg  (%ld of %ld timestamps inexact)\n", "cJSON tree per line (previous)",
+           (double)t_cjson / total, inexact, lines);
+    printf("%-36s %8.1f ns/msg  (%.1fx)\n", "wagglemsg_load_json_len per line",
+           (double)t_load / total, (double)t_cjson / t_load);
+    printf("%-36s %8.1f ns/msg  (%.1fx, %.0f MB/s)\n", "wagglemsg_decode_ndjson (reused)",
+           (double)t_bulk / total, (double)t_cjson / t_bulk,
+           (double)in.len * rounds / ((double)t_bulk / 1e3));
+
+    free(line);
+    wagglemsg_batch_free(&batch);
+    wagglebuf_free(&in);
+    return 0;
+}
@@ -0,0 +1,328 @@
+/**
+ * bench_publish.c
+ *
+ * Purpose:
+ *   End-to-end publish benchmark: N producer threads call plugin_publish,
+ *   flat out or at a fixed rate each, and the plugin publishes with
+ *   confirms to a broker. By default the broker is the in-process stand-in
+ *   from amqp_standin.c on a loopback port, run in a child process so its
+ *   CPU time is not counted; -H/-P point the benchmark at a real broker.
+ *   -T null or -T memory skip the network to time the queue and encoder
+ *   alone. -e packs messages into envelopes of up to that many; -z
+ *   compresses deliveries with deflate or zstd.
+ *
+ *   Reports producer and confirmed throughput, plugin_publish call latency
+ *   and publish-to-confirm latency (p50/p99/p999), CPU time per message
+ *   and peak RSS.
+ *
+ * Usage:
+ *   bench_publish [-t threads] [-n messages per thread] [-r rate per thread]
+ *                 [-l lanes] [-c] [-f json|msgpack] [-d confirm delay us]
+ *                 [-H host] [-P port] [-T amqp|null|memory] [-e envelope msgs]
+ *                 [-z deflate|zstd]
+ */
+
+#include "waggle/plugin.h"
+#include "waggle/config.h"
+#include "waggle/histogram.h"
+#include "amqp_standin.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DRAIN_TIMEOUT_S 30
+
+typedef struct {
+    Plugin    *plugin;
+    int        id;
+    long       messages;
+    long       rate;      // messages/s; 0 = flat out
+    Histogram *latency;   // plugin_publish call time
+    long       failed;
+} Producer;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t cpu_ns(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+           (uint64_t)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+static void* producer_main(void *arg) {
+    Producer *pr = (Producer*)arg;
+    char name[64];
+    snprintf(name, sizeof(name), "bench.publish.%d", pr->id);
+    const char *meta = "{\"node\":\"000048b02d15bc7c\",\"sensor\":\"bench\"}";
+
+    uint64_t interval = pr->rate > 0 ? 1000000000ULL / (uint64_t)pr->rate : 0;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    for (long i = 0; i < pr->messages; i++) {
+        if (interval) {
+            // an absolute schedule, so a slow call does not lower the rate
+            next.tv_nsec += (long)interval;
+            while (next.tv_nsec >= 1000000000L) {
+                next.tv_nsec -= 1000000000L;
+                next.tv_sec++;
+            }
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) != 0) {
+            }
+        }
+        uint64_t t0 = now_ns();
+        int rc = plugin_publish(pr->plugin, "all", name, i, 1700000000000000000ULL + (uint64_t)i, meta);
+        histogram_record(pr->latency, now_ns() - t0);
+        if (rc != PLUGIN_OK) pr->failed++;
+    }
+    return NULL;
+}
+
+static void print_latency(const char *label, const HistogramSummary *s) {
+    printf("%-22s p50 %8.1f us  p99 %8.1f us  p999 %8.1f us  max %8.1f us\n",
+           label, s->p50 / 1e3, s->p99 / 1e3, s->p999 / 1e3, s->max / 1e3);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-t threads] [-n messages per thread] [-r rate per thread]\n"
+            "       [-l lanes] [-c] [-f json|msgpack] [-d confirm delay us]\n"
+            "       [-H host] [-P port] [-T amqp|null|memory] [-e envelope msgs]\n"
+            "       [-z deflate|zstd]\n", prog);
+}
+
+int main(int argc, char **argv) {
+    int threads = 4;
+    long messages = 250000;
+    long rate = 0;
+    int lanes = 1;
+    int lane_channels = 0;
+    WaggleMsgFormat format = WAGGLEMSG_FORMAT_JSON;
+    int confirm_delay_us = 0;
+    const char *host = NULL;
+    int port = 5672;
+    PluginTransport transport = PLUGIN_TRANSPORT_AMQP;
+    int envelope = 0;
+    WaggleCodec codec = WAGGLE_CODEC_NONE;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:n:r:l:cf:d:H:P:T:e:z:")) != -1) {
+        switch (opt) {
+        case 't': threads = atoi(optarg); break;
+        case 'n': messages = atol(optarg); break;
+        case 'r': rate = atol(optarg); break;
+        case 'l': lanes = atoi(optarg); break;
+        case 'c': lane_channels = 1; break;
+        case 'f':
+            if (strcmp(optarg, "json") == 0) {
+                format = WAGGLEMSG_FORMAT_JSON;
+            } else if (strcmp(optarg, "msgpack") == 0) {
+                format = WAGGLEMSG_FORMAT_MSGPACK;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'd': confirm_delay_us = atoi(optarg); break;
+        case 'e': envelope = atoi(optarg); break;
+        case 'z': {
+            int c = waggle_codec_of_encoding(optarg, strlen(optarg));
+            if (c <= WAGGLE_CODEC_NONE || !waggle_codec_available((WaggleCodec)c)) {
+                fprintf(stderr, "codec %s is not available\n", optarg);
+                return 1;
+            }
+            codec = (WaggleCodec)c;
+            break;
+        }
+        case 'H': host = optarg; break;
+        case 'P': port = atoi(optarg); break;
+        case 'T':
+            if (strcmp(optarg, "amqp") == 0) {
+                transport = PLUGIN_TRANSPORT_AMQP;
+            } else if (strcmp(optarg, "null") == 0) {
+                transport = PLUGIN_TRANSPORT_NULL;
+            } else if (strcmp(optarg, "memory") == 0) {
+                transport = PLUGIN_TRANSPORT_MEMORY;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (threads <= 0 || messages <= 0 || rate < 0 || lanes <= 0 || envelope < 0 ||
+        lanes > PLUGIN_MAX_PUBLISHER_LANES) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Start the stand-in before any thread exists, so fork is safe.
+    pid_t standin = -1;
+    if (!host && transport == PLUGIN_TRANSPORT_AMQP) {
+        int listen_fd = standin_listen(0, &port);
+        if (listen_fd < 0) {
+            perror("standin_listen");
+            return 1;
+        }
+        standin = fork();
+        if (standin < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (standin == 0) {
+            standin_serve(listen_fd, confirm_delay_us);
+            _exit(1);
+        }
+        close(listen_fd);
+    }
+    if (!host) host = "127.0.0.1";
+
+    PluginConfig *config = plugin_config_new("guest", "guest", host, port, "bench_publish");
+    if (!config) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    config->overflow_policy = PLUGIN_OVERFLOW_BLOCK;
+    config->block_timeout_ms = 60000;
+    config->publisher_lanes = lanes;
+    config->lane_mode = lane_channels ? PLUGIN_LANES_CHANNELS : PLUGIN_LANES_CONNECTIONS;
+    config->wire_format = format;
+    config->transport = transport;
+    config->envelope_max_messages = envelope;
+    config->compression = codec;
+
+    Plugin *plugin = plugin_new(config);
+    if (!plugin) {
+        fprintf(stderr, "plugin_new failed\n");
+        return 1;
+    }
+
+    // wait for every lane to connect, so the first messages do not time
+    // the handshake
+    PluginStats st;
+    uint64_t deadline = now_ns() + (uint64_t)DRAIN_TIMEOUT_S * 1000000000ULL;
+    uint64_t lane_threads = lane_channels ? 1 : (uint64_t)lanes;
+    while (plugin_get_stats(plugin, &st) == 0 && st.lanes_connected < lane_threads) {
+        if (now_ns() > deadline) {
+            fprintf(stderr, "could not connect to %s:%d\n", host, port);
+            return 1;
+        }
+        usleep(10000);
+    }
+
+    Producer *producers = calloc((size_t)threads, sizeof(Producer));
+    pthread_t *tids = calloc((size_t)threads, sizeof(pthread_t));
+    if (!producers || !tids) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    uint64_t cpu0 = cpu_ns();
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < threads; i++) {
+        producers[i] = (Producer){ .plugin = plugin, .id = i, .messages = messages, .rate = rate,
+                                   .latency = histogram_new() };
+        if (!producers[i].latency || pthread_create(&tids[i], NULL, producer_main, &producers[i]) != 0) {
+            fprintf(stderr, "could not start producer %d\n", i);
+            return 1;
+        }
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    uint64_t t_produced = now_ns() - t0;
+
+    // every queued message counts once it is confirmed
+    long failed = 0;
+    for (int i = 0; i < threads; i++) {
+        failed += producers[i].failed;
+    }
+    deadline = now_ns() + (uint64_t)DRAIN_TIMEOUT_S * 1000000000ULL;
+    while (plugin_get_stats(plugin, &st) == 0 && st.published_messages < st.enqueued_messages) {
+        if (now_ns() > deadline) {
+            fprintf(stderr, "timed out waiting for confirms\n");
+            break;
+        }
+        usleep(1000);
+    }
+    uint64_t t_confirmed = now_ns() - t0;
+    uint64_t cpu = cpu_ns() - cpu0;
+    plugin_get_stats(plugin, &st);
+
+    Histogram **hs = calloc((size_t)threads, sizeof(Histogram*));
+    if (!hs) return 1;
+    for (int i = 0; i < threads; i++) {
+        hs[i] = producers[i].latency;
+    }
+    HistogramSummary call;
+    histogram_summarize(hs, (size_t)threads, &call);
+
+    long total = (long)threads * messages;
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+
+    printf("threads %d, %ld msgs each, rate %s, lanes %d (%s), %s, ",
+           threads, messages, rate ? "fixed" : "flat out", lanes,
+           lane_channels ? "channels" : "connections", wagglemsg_content_type(format));
+    if (transport == PLUGIN_TRANSPORT_AMQP) {
+        printf("broker %s:%d%s\n", host, port, standin > 0 ? " (stand-in)" : "");
+    } else {
+        printf("%s transport\n", transport == PLUGIN_TRANSPORT_NULL ? "null" : "memory");
+    }
+    if (rate) {
+        printf("%-22s %ld msgs/s per thread\n", "target rate", rate);
+    }
+    printf("%-22s %.0f msgs/s\n", "produced", total / (t_produced / 1e9));
+    printf("%-22s %.0f msgs/s (%" PRIu64 " of %" PRIu64 " confirmed)\n", "confirmed",
+           st.published_messages / (t_confirmed / 1e9), st.published_messages, st.enqueued_messages);
+    if (envelope > 1) {
+        printf("%-22s %.0f deliveries/s (%.1f msgs each)\n", "envelopes",
+               st.published_deliveries / (t_confirmed / 1e9),
+               st.published_deliveries ? (double)st.published_messages / st.published_deliveries : 0.0);
+    }
+    if (codec != WAGGLE_CODEC_NONE) {
+        printf("%-22s %" PRIu64 " deliveries, ratio %.2f, %.0f ns each\n", waggle_codec_encoding(codec),
+               st.compressed_messages,
+               st.compress_out_bytes ? (double)st.compress_in_bytes / st.compress_out_bytes : 0.0,
+               st.compressed_messages ? (double)st.compress_ns / st.compressed_messages : 0.0);
+    }
+    print_latency("plugin_publish call", &call);
+    print_latency("publish to confirm", &st.confirm_latency);
+    print_latency("send to confirm", &st.confirm_rtt);
+    printf("%-22s %.0f ns/msg\n", "cpu", (double)cpu / (double)total);
+    printf("%-22s %ld KiB\n", "peak rss", ru.ru_maxrss);
+    if (failed || st.requeued || st.reconnects) {
+        printf("%-22s %ld failed, %" PRIu64 " requeued, %" PRIu64 " reconnects\n",
+               "errors", failed, st.requeued, st.reconnects);
+    }
+
+    plugin_free(plugin);
+    for (int i = 0; i < threads; i++) {
+        histogram_free(producers[i].latency);
+    }
+    free(hs);
+    free(tids);
+    free(producers);
+    if (standin > 0) {
+        kill(standin, SIGTERM);
+        waitpid(standin, NULL, 0);
+    }
+    return 0;
+}
@@ -38,6 +38,24 @@ int main() {
 
     // Publish an example message
     plugin_publish(p, "all", "test.metric", 123, waggle_get_timestamp_ns(), "{\"example\":\"meta\"}");
+    plugin_publish_double(p, "all", "env.temperature", 23.15, waggle_get_timestamp_ns(), "{\"units\":\"C\"}");
+
+    // Roll fast samples up into per-second min/max/mean before publishing
+    PluginAggregate *vib = plugin_register_aggregate(p, "all", "env.vibration", "{\"units\":\"g\"}",
+                                                     1000, PLUGIN_AGG_MIN | PLUGIN_AGG_MAX | PLUGIN_AGG_MEAN);
+    for (int i = 0; vib && i < 1000; i++) {
+        plugin_aggregate_add(p, vib, 0.01 * (i % 7));
+    }
+
+    // Stamp a burst of readings with one clock read; the timestamps still
+    // increase, so the samples stay distinct and in order
+    WaggleSample burst[8];
+    uint64_t ts[8];
+    waggle_get_timestamps_ns(ts, 8);
+    for (int i = 0; i < 8; i++) {
+        burst[i] = (WaggleSample){ "env.adc.raw", 512 + i, ts[i], NULL };
+    }
+    plugin_publish_batch(p, "all", burst, 8);
 
     // Cleanup
     plugin_free(p);
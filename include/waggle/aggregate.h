@@ -0,0 +1,62 @@
+#ifndef WAGGLE_AGGREGATE_H
+#define WAGGLE_AGGREGATE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/**
+ * Opaque struct for a lock-free accumulator of double samples: count,
+ * sum, min, max and the most recent value.
+ *
+ * Samples land in one of several cache-line-sized stripes picked by the
+ * calling thread, so threads adding to the same accumulator do not
+ * contend. Each stripe holds two accumulators; aggregator_take switches
+ * every stripe to the other one, waits for adds already under way to
+ * finish, and reads the old one, so a sample is counted in exactly one
+ * window without the writers ever blocking.
+ */
+typedef struct Aggregator Aggregator;
+
+/**
+ * The samples of one window. min, max and last are NaN when count is 0.
+ */
+typedef struct AggregateWindow {
+    uint64_t count;
+    double   sum;
+    double   min;
+    double   max;
+    double   last;
+} AggregateWindow;
+
+/**
+ * Creates an empty accumulator. Keeping `last` reads the monotonic clock
+ * on every add, to order samples from different threads; pass 0 if it is
+ * not needed. Returns NULL on failure.
+ */
+Aggregator* aggregator_new(int track_last);
+
+/**
+ * Frees an accumulator. Safe to call with NULL.
+ */
+void aggregator_free(Aggregator *a);
+
+/**
+ * Adds one sample. NaN samples are ignored. Any thread may call this at
+ * any time; it never blocks.
+ */
+void aggregator_add(Aggregator *a, double value);
+
+/**
+ * Closes the current window: stores its samples in `out` and starts an
+ * empty one. Only one thread may call this at a time.
+ */
+void aggregator_take(Aggregator *a, AggregateWindow *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef WAGGLE_BUFFER_H
+#define WAGGLE_BUFFER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+/**
+ * A growable byte buffer meant to be reused across calls, so steady-state
+ * encoding does not allocate. `data` is always NUL-terminated after a
+ * successful append.
+ */
+typedef struct WaggleBuf {
+    char   *data;
+    size_t  len;
+    size_t  cap;
+} WaggleBuf;
+
+/**
+ * Initializes an empty buffer. No memory is allocated until first use.
+ */
+void wagglebuf_init(WaggleBuf *b);
+
+/**
+ * Frees the buffer's memory and leaves it empty.
+ * Safe to call on an initialized, never-used buffer.
+ */
+void wagglebuf_free(WaggleBuf *b);
+
+/**
+ * Sets the length to zero, keeping the allocation.
+ */
+void wagglebuf_reset(WaggleBuf *b);
+
+/**
+ * Ensures room for `extra` more bytes plus a terminating NUL.
+ * Returns 0 on success, nonzero if out of memory.
+ */
+int wagglebuf_reserve(WaggleBuf *b, size_t extra);
+
+/**
+ * Appends `len` bytes.
+ * Returns 0 on success, nonzero if out of memory.
+ */
+int wagglebuf_append(WaggleBuf *b, const void *data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef WAGGLE_COMPRESS_H
+#define WAGGLE_COMPRESS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include "buffer.h"
+
+/**
+ * Message body compression. A compressed body carries the codec's name
+ * as its AMQP content_encoding; the content_type still names what is
+ * inside. Which codecs exist depends on the libraries found at build
+ * time (see waggle_codec_available).
+ */
+typedef enum WaggleCodec {
+    WAGGLE_CODEC_NONE = 0,
+    WAGGLE_CODEC_DEFLATE,   // zlib stream; needs zlib
+    WAGGLE_CODEC_ZSTD       // zstd frame; needs libzstd
+} WaggleCodec;
+
+#define WAGGLE_ENCODING_DEFLATE "deflate"
+#define WAGGLE_ENCODING_ZSTD    "zstd"
+
+/**
+ * Returns nonzero if `codec` was built in. WAGGLE_CODEC_NONE always is.
+ */
+int waggle_codec_available(WaggleCodec codec);
+
+/**
+ * Returns the content encoding for `codec`, or NULL for WAGGLE_CODEC_NONE.
+ */
+const char* waggle_codec_encoding(WaggleCodec codec);
+
+/**
+ * Returns the codec named by a content encoding (`len` bytes, case
+ * ignored): WAGGLE_CODEC_NONE for NULL, "" or "identity", and
+ * WAGGLE_CODEC_DEFLATE for "gzip" as well, since the same decoder reads
+ * both. Returns -1 for anything else.
+ */
+int waggle_codec_of_encoding(const char *encoding, size_t len);
+
+/**
+ * Opaque struct holding compression and decompression state for every
+ * codec, created on first use and reset between messages, so a thread
+ * that keeps one does not allocate per message. Not thread-safe.
+ */
+typedef struct WaggleCodecCtx WaggleCodecCtx;
+
+/**
+ * Creates an empty context. Returns NULL on failure.
+ */
+WaggleCodecCtx* waggle_codec_ctx_new(void);
+
+/**
+ * Frees a context. Safe to call with NULL.
+ */
+void waggle_codec_ctx_free(WaggleCodecCtx *ctx);
+
+/**
+ * Appends `src[0..len)` compressed with `codec` to `out`. `level` is the
+ * codec's compression level; 0 picks its default.
+ * Returns 0 on success, nonzero on failure (including a codec that was
+ * not built in); on failure `out` keeps its previous length.
+ */
+int waggle_compress(WaggleCodecCtx *ctx, WaggleCodec codec, int level,
+                    const void *src, size_t len, WaggleBuf *out);
+
+/**
+ * Appends `src[0..len)` decompressed with `codec` to `out`, failing
+ * rather than producing more than `max_len` bytes (0 = no limit).
+ * Returns 0 on success, nonzero on failure; on failure `out` keeps its
+ * previous length.
+ */
+int waggle_decompress(WaggleCodecCtx *ctx, WaggleCodec codec,
+                      const void *src, size_t len, size_t max_len, WaggleBuf *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -5,14 +5,168 @@
 extern "C" {
 #endif
 
+#include "wagglemsg.h"
+#include "compress.h"
+
+/**
+ * What plugin_publish does when the publish queue is full, either by
+ * message count (queue_capacity) or by bytes (queue_max_bytes).
+ */
+typedef enum {
+    PLUGIN_OVERFLOW_DROP_NEWEST = 0, // discard the message being published
+    PLUGIN_OVERFLOW_DROP_OLDEST,     // discard the oldest queued message to make room
+    PLUGIN_OVERFLOW_BLOCK,           // wait up to block_timeout_ms, then drop
+    PLUGIN_OVERFLOW_SPILL            // append to <spill_dir>/spill.bin, sent once the queue drains
+} PluginOverflowPolicy;
+
+/**
+ * How publisher lanes (PluginConfig.publisher_lanes) reach the broker.
+ */
+typedef enum {
+    PLUGIN_LANES_CONNECTIONS = 0, // one connection and publisher thread per lane
+    PLUGIN_LANES_CHANNELS         // one connection and thread; one channel per lane
+} PluginLaneMode;
+
+/**
+ * What a message is hashed on to pick its publisher lane. Messages that
+ * hash alike are delivered in publish order.
+ */
+typedef enum {
+    PLUGIN_SHARD_SERIES = 0,      // scope and name
+    PLUGIN_SHARD_SCOPE            // scope only
+} PluginShardKey;
+
+/**
+ * Where publisher lanes send messages (see transport.h).
+ */
+typedef enum {
+    PLUGIN_TRANSPORT_AMQP = 0,    // RabbitMQ at host:port
+    PLUGIN_TRANSPORT_NULL,        // nowhere; every message is confirmed at once
+    PLUGIN_TRANSPORT_MEMORY,      // a ring read with plugin_memory_sink
+    PLUGIN_TRANSPORT_FILE         // NDJSON appended to transport_path
+} PluginTransport;
+
+struct TransportOps;
+
 typedef struct {
     char *username;
     char *password;
     char *host;
     int   port;
     char *app_id;
+
+    // Connection. A lost connection is retried after a random delay that
+    // doubles with every failed attempt, from reconnect_min_ms up to
+    // reconnect_max_ms.
+    int   heartbeat_s;         // AMQP heartbeat to negotiate; 0 = none
+    int   connect_timeout_ms;  // TCP connect and AMQP handshake timeout
+    int   tcp_keepalive_s;     // idle time before TCP keepalive probes; 0 = off
+    int   reconnect_min_ms;
+    int   reconnect_max_ms;
+
+    // Publisher tuning. plugin_config_new fills in defaults; callers may
+    // adjust these before handing the config to plugin_new.
+    int   max_inflight;        // unconfirmed deliveries kept in flight per channel
+    int   confirm_timeout_ms;  // unconfirmed deliveries older than this are resent
+    int   queue_capacity;      // max messages waiting for the publisher thread
+    long  queue_max_bytes;     // max payload bytes waiting; 0 = no byte limit
+    PluginOverflowPolicy overflow_policy;
+    int   block_timeout_ms;    // PLUGIN_OVERFLOW_BLOCK wait before dropping
+    char *spill_dir;           // PLUGIN_OVERFLOW_SPILL directory (set with plugin_config_set_spill_dir)
+
+    // Publisher lanes. Each lane has its own queue (or channel) and confirm
+    // window; messages are spread over them by shard_key, so order is kept
+    // per series (or scope) but not across lanes.
+    int   publisher_lanes;     // 1..PLUGIN_MAX_PUBLISHER_LANES
+    PluginLaneMode lane_mode;
+    PluginShardKey shard_key;
+
+    // Encoding of published messages. Each one carries its AMQP
+    // content_type, so consumers can tell JSON and MessagePack apart.
+    WaggleMsgFormat wire_format;
+
+    // Envelopes. With envelope_max_messages > 1 the publisher packs queued
+    // messages for the same scope into one delivery (NDJSON, or MessagePack
+    // maps back to back; see wagglemsg_unpack) of up to that many messages
+    // and envelope_max_bytes, waiting up to envelope_linger_ms for an
+    // envelope to fill. Consumers must unpack them.
+    int   envelope_max_messages;  // 0 or 1 = one message per delivery
+    long  envelope_max_bytes;     // 0 = no byte limit
+    int   envelope_linger_ms;     // 0 = send whatever is queued at once
+
+    // Compression. Deliveries (envelopes included) of at least
+    // compression_min_bytes are compressed on the publisher thread and
+    // carry the codec's content_encoding; any that would not shrink are
+    // sent as they are. A codec that was not built in is ignored.
+    WaggleCodec compression;      // WAGGLE_CODEC_NONE = off
+    int   compression_level;      // 0 = the codec's default
+    long  compression_min_bytes;
+
+    // Transport. Setting transport_ops plugs in a custom one, with
+    // transport_arg passed to its connect, in place of `transport`.
+    PluginTransport transport;
+    char *transport_path;         // PLUGIN_TRANSPORT_FILE (set with plugin_config_set_transport_path)
+    long  memory_sink_capacity;   // PLUGIN_TRANSPORT_MEMORY: newest messages kept
+    const struct TransportOps *transport_ops;
+    void *transport_arg;
+
+    // Optional write-ahead journal for at-least-once delivery across
+    // restarts. Disabled while journal_dir is NULL.
+    char *journal_dir;         // set with plugin_config_set_journal_dir
+    long  journal_segment_bytes;
+    int   journal_sync;        // fdatasync every journal and spill append (survives power loss)
+
+    // Message buffers are recycled through per-size-class free lists that
+    // hold at most this many bytes; 0 = always use malloc.
+    long  slab_cache_bytes;
+
+    // Local log (PYWAGGLE_LOG_DIR). With file_log_async, lines are written
+    // by a background thread in groups instead of on the publishing thread.
+    int   file_log_async;
+    long  file_log_flush_bytes;  // async: write once this much is buffered
+    int   file_log_flush_ms;     // async: ... or once the oldest line is this old
+    int   file_log_sync_ms;      // async: fdatasync at most this often; 0 = never
+    long  file_log_segment_bytes;   // rotate data.ndjson at this size; 0 = never
+    int   file_log_segment_ms;      // rotate data.ndjson after this long; 0 = never
+    int   file_log_compress;        // gzip rotated segments (needs zlib)
+    long  file_log_retention_bytes; // keep at most this much rotated data; 0 = all
+
+    // plugin_upload_file. Workers start on the first upload.
+    char *upload_dir;          // set with plugin_config_set_upload_dir; NULL = uploader default
+    int   upload_workers;
+    int   upload_queue_capacity;
+
+    // plugin_subscribe. The consumer starts on the first subscribe.
+    int   subscribe_prefetch;       // unacked deliveries the broker may send; 0 = unlimited
+    int   subscribe_ack_batch;      // ack (multiple) after this many messages
+    int   subscribe_queue_capacity; // messages waiting for plugin_get_message
+
+    // Publish plugin_get_stats as sys.cwaggle.* metrics (scope "all") this
+    // often; 0 = off. They are sent with plugin_try_publish semantics, so a
+    // full queue drops them rather than application data.
+    int   stats_interval_ms;
 } PluginConfig;
 
+#define PLUGIN_DEFAULT_HEARTBEAT_S        15
+#define PLUGIN_DEFAULT_CONNECT_TIMEOUT_MS 5000
+#define PLUGIN_DEFAULT_TCP_KEEPALIVE_S    15
+#define PLUGIN_DEFAULT_RECONNECT_MIN_MS   250
+#define PLUGIN_DEFAULT_RECONNECT_MAX_MS   30000
+#define PLUGIN_DEFAULT_MAX_INFLIGHT       256
+#define PLUGIN_DEFAULT_CONFIRM_TIMEOUT_MS 5000
+#define PLUGIN_DEFAULT_QUEUE_CAPACITY     65536
+#define PLUGIN_DEFAULT_QUEUE_MAX_BYTES    (64L * 1024 * 1024)
+#define PLUGIN_DEFAULT_BLOCK_TIMEOUT_MS   1000
+#define PLUGIN_MAX_PUBLISHER_LANES        64
+#define PLUGIN_DEFAULT_JOURNAL_SEGMENT_BYTES (16L * 1024 * 1024)
+#define PLUGIN_DEFAULT_SLAB_CACHE_BYTES   (4L * 1024 * 1024)
+#define PLUGIN_DEFAULT_FILE_LOG_FLUSH_BYTES (256L * 1024)
+#define PLUGIN_DEFAULT_FILE_LOG_FLUSH_MS  1000
+#define PLUGIN_DEFAULT_MEMORY_SINK_CAPACITY 65536
+#define PLUGIN_DEFAULT_ENVELOPE_MAX_BYTES (128L * 1024)
+#define PLUGIN_DEFAULT_ENVELOPE_LINGER_MS 5
+#define PLUGIN_DEFAULT_COMPRESSION_MIN_BYTES 1024
+
 /**
  * Allocates and initializes a new PluginConfig.
  *
@@ -25,6 +179,32 @@ PluginConfig* plugin_config_new(const char *username,
                                 int port,
                                 const char *app_id);
 
+/**
+ * Sets the directory used by PLUGIN_OVERFLOW_SPILL. The string is duplicated.
+ * Returns 0 on success, nonzero on failure.
+ */
+int plugin_config_set_spill_dir(PluginConfig *config, const char *dir);
+
+/**
+ * Enables the write-ahead journal in `dir` (NULL disables it). Messages
+ * that were queued but not confirmed when the process stopped are resent
+ * by the next plugin_new using the same directory. The string is duplicated.
+ * Returns 0 on success, nonzero on failure.
+ */
+int plugin_config_set_journal_dir(PluginConfig *config, const char *dir);
+
+/**
+ * Sets the directory plugin_upload_file places files in. The string is
+ * duplicated. Returns 0 on success, nonzero on failure.
+ */
+int plugin_config_set_upload_dir(PluginConfig *config, const char *dir);
+
+/**
+ * Sets the file PLUGIN_TRANSPORT_FILE appends to. The string is
+ * duplicated. Returns 0 on success, nonzero on failure.
+ */
+int plugin_config_set_transport_path(PluginConfig *config, const char *path);
+
 /**
  * Frees a PluginConfig and all its internal strings.
  * Safe to call with NULL.
@@ -1,6 +1,7 @@
 #ifndef WAGGLE_FILEPUBLISHER_H
 #define WAGGLE_FILEPUBLISHER_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include "wagglemsg.h"
 
@@ -13,12 +14,50 @@ extern "C" {
  */
 typedef struct FilePublisher FilePublisher;
 
+#define FILEPUBLISHER_DEFAULT_QUEUE_CAPACITY 65536
+#define FILEPUBLISHER_DEFAULT_FLUSH_BYTES    (256 * 1024)
+#define FILEPUBLISHER_DEFAULT_FLUSH_MS       1000
+
+/**
+ * How a FilePublisher writes. In the default synchronous mode each
+ * filepublisher_log call formats and writes its line before returning.
+ *
+ * In async mode, filepublisher_log only copies the sample into a lock-free
+ * queue. A writer thread formats queued samples into a large aligned
+ * buffer and writes it once flush_bytes have accumulated or flush_ms
+ * after the oldest buffered line, whichever comes first. If the queue is
+ * full the sample is dropped rather than blocking the caller.
+ */
+typedef struct FilePublisherOptions {
+    int    async;
+    size_t queue_capacity;  // async: max samples waiting for the writer
+    size_t flush_bytes;     // async: group commit size threshold
+    int    flush_ms;        // async: group commit time threshold
+    int    sync_ms;         // async: fdatasync at most this often; 0 = never
+
+    // Rotation, compression and retention; see segmentlog.h.
+    size_t segment_bytes;   // rotate data.ndjson at this size; 0 = never
+    int    segment_ms;      // rotate data.ndjson after this long; 0 = never
+    int    compress;        // gzip sealed segments in the background
+    size_t retention_bytes; // delete oldest sealed segments beyond this; 0 = keep all
+} FilePublisherOptions;
+
+/**
+ * Fills `opts` with the defaults (synchronous mode).
+ */
+void filepublisher_options_default(FilePublisherOptions *opts);
+
 /**
  * Creates a new FilePublisher that logs to `<logdir>/data.ndjson`.
  * Returns NULL on error (e.g. can't open file).
  */
 FilePublisher* filepublisher_new(const char *logdir);
 
+/**
+ * Like filepublisher_new, with explicit options (NULL means defaults).
+ */
+FilePublisher* filepublisher_new_with_options(const char *logdir, const FilePublisherOptions *opts);
+
 /**
  * Closes the FilePublisher's file and frees memory.
  * Safe to call with NULL.
@@ -31,6 +70,12 @@ void filepublisher_free(FilePublisher *fp);
  */
 int filepublisher_log(FilePublisher *fp, const WaggleMsg *msg);
 
+/**
+ * Returns how many samples async mode has dropped because its queue was
+ * full. Always 0 in synchronous mode.
+ */
+uint64_t filepublisher_dropped(FilePublisher *fp);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,62 @@
+#ifndef WAGGLE_HISTOGRAM_H
+#define WAGGLE_HISTOGRAM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Opaque struct for a lock-free histogram of uint64 values (e.g. latencies
+ * in nanoseconds), in the style of HdrHistogram.
+ *
+ * Buckets are log-linear: every power of two is split into 16 equal
+ * sub-buckets, so any value is placed within about 6% of itself over the
+ * whole 64-bit range, in a fixed 8 KiB of counters. Recording is a few
+ * relaxed atomic adds; any thread may record or read at any time.
+ */
+typedef struct Histogram Histogram;
+
+/**
+ * Percentiles and totals of one or more histograms. Percentiles report
+ * the upper end of the bucket they fall in, capped at max.
+ */
+typedef struct HistogramSummary {
+    uint64_t count;
+    uint64_t mean;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+} HistogramSummary;
+
+/**
+ * Creates an empty histogram. Returns NULL on failure.
+ */
+Histogram* histogram_new(void);
+
+/**
+ * Frees a histogram. Safe to call with NULL.
+ */
+void histogram_free(Histogram *h);
+
+/**
+ * Adds one value.
+ */
+void histogram_record(Histogram *h, uint64_t value);
+
+/**
+ * Summarizes the values recorded in `n` histograms taken together (NULL
+ * entries are skipped). Values recorded while this runs may or may not
+ * be included.
+ */
+void histogram_summarize(Histogram *const *hs, size_t n, HistogramSummary *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef WAGGLE_JOURNAL_H
+#define WAGGLE_JOURNAL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+/**
+ * Opaque struct for a segmented write-ahead journal of outgoing messages.
+ *
+ * Every queued message is appended to the active segment
+ * (`<dir>/journal-<id>.wal`) before it is handed to the publisher thread.
+ * A segment file is deleted once every record in it has been acked, so
+ * only undelivered messages stay on disk. Segments left over from a
+ * previous run are replayed through journal_replay_next.
+ */
+typedef struct Journal Journal;
+
+/**
+ * Handle for the segment a record was written to. Pass it to journal_ack
+ * once the record no longer needs to be kept.
+ */
+typedef struct JournalSegment JournalSegment;
+
+/**
+ * Opens a journal in `dir`. Segments are rotated once they reach
+ * `segment_bytes`. With `sync` set, every append is followed by
+ * fdatasync so records survive power loss, not just process crashes.
+ * Returns NULL on error.
+ */
+Journal* journal_open(const char *dir, size_t segment_bytes, int sync);
+
+/**
+ * Closes the journal and frees memory. Segments that still hold
+ * unacked records are left on disk for the next run.
+ * Safe to call with NULL.
+ */
+void journal_close(Journal *j);
+
+/**
+ * Appends a record. Thread-safe.
+ * Returns the segment handle for journal_ack, or NULL on error.
+ */
+JournalSegment* journal_append(Journal *j, const char *scope, const char *data, int len);
+
+/**
+ * Marks one record in `seg` as delivered (or deliberately dropped).
+ * Thread-safe. Safe to call with a NULL journal or segment.
+ */
+void journal_ack(Journal *j, JournalSegment *seg);
+
+/**
+ * Returns the next unacked record from a previous run, oldest first.
+ * On success, `*scope` and `*data` point into an internal buffer valid
+ * until the next call, and `*seg` must eventually be passed to journal_ack.
+ * Records failing their checksum end replay of that segment.
+ *
+ * Returns 1 if a record was read, 0 when replay is complete.
+ */
+int journal_replay_next(Journal *j, JournalSegment **seg,
+                        const char **scope, const char **data, int *len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
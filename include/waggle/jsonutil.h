@@ -0,0 +1,116 @@
+#ifndef WAGGLE_JSONUTIL_H
+#define WAGGLE_JSONUTIL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Low-level JSON helpers shared by the WaggleMsg encoders and the file
+ * publisher. None of these allocate.
+ */
+
+/** Max characters json_format_u64 / json_format_i64 write. */
+#define JSON_INT_MAX_CHARS 20
+
+/**
+ * Writes `v` in decimal (no NUL). `buf` needs JSON_INT_MAX_CHARS bytes.
+ * Returns the number of characters written.
+ */
+size_t json_format_u64(char *buf, uint64_t v);
+size_t json_format_i64(char *buf, int64_t v);
+
+/** Max characters json_format_double writes. */
+#define JSON_DOUBLE_MAX_CHARS 32
+
+/**
+ * Writes the shortest decimal that reads back as exactly `v` (no NUL).
+ * The text always has a '.' or an exponent, so it parses as a double
+ * again; NaN and infinities, which JSON cannot spell, are written as
+ * null. `buf` needs JSON_DOUBLE_MAX_CHARS bytes.
+ * Returns the number of characters written.
+ */
+size_t json_format_double(char *buf, double v);
+
+/**
+ * Returns the index of the first byte in `s[0..len)` that must be escaped
+ * inside a JSON string ('"', '\\' or a control character), or `len` if
+ * there is none. Uses SSE2 or NEON when available.
+ */
+size_t json_scan_escape(const char *s, size_t len);
+
+/**
+ * Returns the number of bytes json_escape would write for `s[0..len)`.
+ */
+size_t json_escaped_len(const char *s, size_t len);
+
+/**
+ * Upper bound on the output of json_escape for `len` input bytes.
+ */
+#define JSON_ESCAPED_MAX(len) ((len) * 6)
+
+/**
+ * Writes `s[0..len)` escaped as JSON string contents (without quotes),
+ * matching cJSON's escaping. `dst` needs JSON_ESCAPED_MAX(len) bytes.
+ * Returns the number of bytes written.
+ */
+size_t json_escape(char *dst, const char *s, size_t len);
+
+/**
+ * Checks that `s[0..len)` holds exactly one JSON value, optionally
+ * surrounded by whitespace. On success, `*start`/`*end` (if non-NULL)
+ * delimit the value without the surrounding whitespace.
+ * Returns 0 if valid, nonzero otherwise.
+ */
+int json_validate(const char *s, size_t len, size_t *start, size_t *end);
+
+/**
+ * Returns the length of the JSON value at the start of `s[0..len)` (no
+ * leading whitespace allowed), or 0 if it is not a valid value. Strings
+ * are scanned with json_scan_escape.
+ */
+size_t json_skip_value(const char *s, size_t len);
+
+/**
+ * Parses the decimal digits at the start of `s[0..len)` into `*out`,
+ * exactly (no floating point). Runs of 8 digits are converted at once.
+ * Returns the number of digits consumed, or 0 if there is no digit or
+ * the value does not fit in 64 bits.
+ */
+size_t json_parse_u64(const char *s, size_t len, uint64_t *out);
+
+/** Returned by json_unescape for malformed input. */
+#define JSON_UNESCAPE_ERROR ((size_t)-1)
+
+/**
+ * Writes the decoded contents of a JSON string (without quotes) to `dst`,
+ * turning \uXXXX escapes and surrogate pairs into UTF-8. The output is
+ * never longer than the input, so `dst` needs `len` bytes (it may be `s`
+ * itself). No NUL is written. Returns the number of bytes written, or JSON_UNESCAPE_ERROR.
+ */
+size_t json_unescape(char *dst, const char *s, size_t len);
+
+/** Length of the base64 text for `n` bytes (padded, no NUL). */
+#define JSON_BASE64_LEN(n) (((n) + 2) / 3 * 4)
+
+/**
+ * Writes `src[0..len)` as standard padded base64. `dst` needs
+ * JSON_BASE64_LEN(len) bytes. Returns the number of characters written.
+ */
+size_t json_base64_encode(char *dst, const void *src, size_t len);
+
+/**
+ * Decodes padded base64 from `src[0..len)` into `dst`, which needs
+ * len / 4 * 3 bytes. Returns the number of bytes written, or
+ * JSON_UNESCAPE_ERROR for malformed input.
+ */
+size_t json_base64_decode(void *dst, const char *src, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef WAGGLE_MSGPACK_H
+#define WAGGLE_MSGPACK_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include "buffer.h"
+
+/**
+ * Low-level MessagePack helpers for the binary WaggleMsg encoding.
+ * Writers always pick the shortest form. Only the JSON conversions
+ * allocate (by growing the WaggleBuf they append to).
+ */
+
+/** Max bytes msgpack_write_i64 / msgpack_write_u64 write. */
+#define MSGPACK_INT_MAX_BYTES 9
+
+/** Max bytes of a str, bin or map header. */
+#define MSGPACK_HEADER_MAX_BYTES 5
+
+size_t msgpack_write_map_header(char *dst, uint32_t n);
+size_t msgpack_write_str_header(char *dst, uint32_t len);
+size_t msgpack_write_i64(char *dst, int64_t v);
+size_t msgpack_write_u64(char *dst, uint64_t v);
+size_t msgpack_write_bin_header(char *dst, uint32_t len);
+
+/** Writes `d` as a float 64 (always 9 bytes). */
+size_t msgpack_write_f64(char *dst, double d);
+
+/**
+ * Writes a str header followed by `s[0..len)`. `dst` needs
+ * MSGPACK_HEADER_MAX_BYTES + len bytes. Returns the bytes written.
+ */
+size_t msgpack_write_str(char *dst, const char *s, uint32_t len);
+
+/**
+ * Readers take the input and a position, which advances past the value
+ * on success. They return 0 on success and nonzero if the value is
+ * truncated, of another type, or out of range.
+ */
+int msgpack_read_map_header(const char *s, size_t len, size_t *pos, uint32_t *n);
+int msgpack_read_str(const char *s, size_t len, size_t *pos, const char **str, uint32_t *n);
+int msgpack_read_i64(const char *s, size_t len, size_t *pos, int64_t *out);
+int msgpack_read_u64(const char *s, size_t len, size_t *pos, uint64_t *out);
+int msgpack_read_bin(const char *s, size_t len, size_t *pos, const char **data, uint32_t *n);
+
+/** Reads a float 64, or a float 32 widened to double. */
+int msgpack_read_f64(const char *s, size_t len, size_t *pos, double *out);
+
+/**
+ * Returns the size of the MessagePack value at the start of `s[0..len)`,
+ * or 0 if it is truncated or malformed.
+ */
+size_t msgpack_skip(const char *s, size_t len);
+
+/**
+ * Appends the JSON value in `json[0..len)` (surrounding whitespace
+ * allowed) as MessagePack: objects become maps, arrays arrays, integers
+ * that fit in 64 bits ints, and other numbers float 64.
+ * Returns 0 on success, nonzero for invalid JSON or out of memory.
+ */
+int msgpack_from_json(const char *json, size_t len, WaggleBuf *out);
+
+/**
+ * Appends the MessagePack value at the start of `s[0..len)` as compact
+ * JSON and stores its size in `*used`. Map keys must be strings; bin and
+ * ext values are not supported; NaN and infinities become null.
+ * Returns 0 on success, nonzero otherwise.
+ */
+int msgpack_to_json(const char *s, size_t len, size_t *used, WaggleBuf *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -6,20 +6,114 @@ extern "C" {
 #endif
 
 #include "config.h"
+#include "uploader.h"
+#include "subscriber.h"
+#include "histogram.h"
+#include "transport.h"
+#include <stddef.h>
 #include <stdint.h>
 
+/**
+ * Return codes for plugin_publish and friends.
+ */
+#define PLUGIN_OK              0
+#define PLUGIN_EINVAL         -1  // bad arguments
+#define PLUGIN_ENOMEM         -2  // allocation failed
+#define PLUGIN_EENCODE        -3  // message could not be serialized
+#define PLUGIN_EDROPPED       -4  // queue full; message dropped per overflow policy
+#define PLUGIN_EBACKPRESSURE  -5  // queue full; nothing was queued or dropped
+
 /**
  * Opaque struct for the Plugin object.
  */
 typedef struct Plugin Plugin;
 
+/**
+ * Opaque handle for a registered series; see plugin_register_series.
+ */
+typedef struct PluginSeries PluginSeries;
+
+/**
+ * One sample for plugin_publish_batch. The strings are only read during
+ * the call; meta_json may be NULL for "{}".
+ */
+typedef struct WaggleSample {
+    const char *name;
+    int64_t     value;
+    uint64_t    timestamp;
+    const char *meta_json;
+} WaggleSample;
+
+/**
+ * Snapshot of the publish pipeline counters. Counters are cumulative since
+ * plugin_new; queue_* and *_connected fields are current values. Reading
+ * them takes no locks, so fields may be a few messages apart.
+ */
+typedef struct PluginStats {
+    uint64_t enqueued_messages;// accepted into the in-memory queue
+    uint64_t enqueued_bytes;
+    uint64_t published_messages;// confirmed by the broker
+    uint64_t published_bytes;
+    uint64_t published_deliveries;// transport messages confirmed; fewer than
+                               // published_messages when envelopes are on
+    uint64_t requeued;         // nacked, timed out, or in flight at a disconnect; resent
+
+    // Compression (PluginConfig.compression), over all lanes. in/out count
+    // every delivery considered, including those sent as they were because
+    // they did not shrink, so in / out is the ratio achieved on the wire.
+    uint64_t compressed_messages;// deliveries sent compressed
+    uint64_t compress_in_bytes;  // size of the deliveries considered
+    uint64_t compress_out_bytes; // ... and as sent
+    uint64_t compress_ns;        // publisher thread time spent compressing
+
+    uint64_t dropped_newest;   // rejected by DROP_NEWEST (or a failed spill)
+    uint64_t dropped_oldest;   // evicted by DROP_OLDEST
+    uint64_t dropped_timeout;  // BLOCK policy gave up after block_timeout_ms
+    uint64_t spilled;          // written to the spill file
+    uint64_t backpressure;     // plugin_try_publish calls refused
+    uint64_t queue_messages;   // messages currently queued in memory
+    uint64_t queue_bytes;      // payload bytes currently queued in memory
+    uint64_t spill_bytes;      // unread bytes in the spill file
+    uint64_t slab_hits;        // message buffers reused from the slab pool
+    uint64_t slab_misses;      // message buffers that needed a malloc
+    uint64_t slab_in_use_bytes;// slab bytes held by queued/in-flight messages
+    uint64_t slab_cached_bytes;// slab bytes free for reuse
+    uint64_t file_log_dropped; // local log lines dropped (async mode, queue full)
+
+    // Connection health, summed over publisher lanes.
+    uint64_t connects;         // connections established
+    uint64_t connect_failures; // connection attempts that failed
+    uint64_t disconnects;      // established connections that were lost
+    uint64_t lanes_connected;  // lanes currently connected
+    uint64_t outage_ns;        // time lanes spent disconnected, including now
+    uint64_t last_outage_ns;   // longest lane's most recent completed outage
+    uint64_t reconnects;       // connections made after a lane's first
+
+    // Timestamp clock (waggle_clock_select); process-wide, not per plugin.
+    uint64_t clock_calibrations;// TSC calibrations since the clock was selected
+    uint64_t clock_max_drift_ns;// largest |drift| from CLOCK_REALTIME found by one
+
+    // Delivery latency in nanoseconds, over all lanes. confirm_latency runs
+    // from plugin_publish* to the broker's confirm (spilled and journal-
+    // replayed messages are left out); confirm_rtt from handing a message
+    // to the connection to its confirm.
+    HistogramSummary confirm_latency;
+    HistogramSummary confirm_rtt;
+
+    // plugin_subscribe
+    uint64_t messages_received;// messages handed to the handler or inbox
+    uint64_t messages_invalid; // deliveries (or envelope entries) that could not be decoded
+    uint64_t inbox_messages;   // messages waiting for plugin_get_message
+} PluginStats;
+
 /**
  * Creates a new Plugin instance with the given config.
  * Takes ownership of the config pointer (frees it on plugin_free).
  * Returns NULL on failure.
  *
- * This sets up internal queues and spawns a background thread
- * that connects to RabbitMQ and publishes messages from the queue.
+ * This sets up internal queues and spawns background publisher
+ * threads (one per lane, see PluginConfig.publisher_lanes) that connect
+ * to RabbitMQ and publish messages from the queue.
  */
 Plugin* plugin_new(PluginConfig *config);
 
@@ -34,7 +128,12 @@ void plugin_free(Plugin *plugin);
  * e.g. "all", "dev", etc. name, value, meta are string data. The
  * timestamp is nanoseconds since epoch.
  *
- * Returns 0 on success, nonzero on error.
+ * The message is handed to the publisher thread through a bounded queue.
+ * When the queue is full, PluginConfig.overflow_policy decides whether to
+ * drop, evict, block or spill.
+ *
+ * Returns PLUGIN_OK on success, PLUGIN_EDROPPED if the message was
+ * dropped, or another negative PLUGIN_E* code on error.
  */
 int plugin_publish(Plugin *plugin,
                    const char *scope,
@@ -44,15 +143,224 @@ int plugin_publish(Plugin *plugin,
                    const char *meta_json);
 
 /**
- * Subscribes to one or more topics. Real consumption logic would be
- * implemented in a separate thread or callback approach. For now,
- * this function only calls rabbitmq_subscribe in the background
- * connection.
+ * Like plugin_publish, but never blocks and never applies the overflow
+ * policy. If the queue is full, nothing is queued or logged and
+ * PLUGIN_EBACKPRESSURE is returned so the caller can retry later.
+ */
+int plugin_try_publish(Plugin *plugin,
+                       const char *scope,
+                       const char *name,
+                       int64_t value,
+                       uint64_t timestamp,
+                       const char *meta_json);
+
+/**
+ * Like plugin_publish, for a double value. The JSON encoding writes the
+ * shortest decimal that reads back as the same double; NaN and infinities
+ * are sent as null (JSON) or as-is (MessagePack).
+ */
+int plugin_publish_double(Plugin *plugin,
+                          const char *scope,
+                          const char *name,
+                          double value,
+                          uint64_t timestamp,
+                          const char *meta_json);
+
+/**
+ * Like plugin_publish, for a NUL-terminated string value.
+ */
+int plugin_publish_string(Plugin *plugin,
+                          const char *scope,
+                          const char *name,
+                          const char *value,
+                          uint64_t timestamp,
+                          const char *meta_json);
+
+/**
+ * Like plugin_publish, for a raw bytes value (base64 in JSON, bin in
+ * MessagePack). The bytes are copied once, directly into the queued
+ * message, with no intermediate buffer. If `free_fn` is set, the plugin
+ * owns `data` from this call on and releases it with free_fn(data, arg)
+ * before returning, whether or not the message was queued.
+ */
+int plugin_publish_bytes(Plugin *plugin,
+                         const char *scope,
+                         const char *name,
+                         void *data,
+                         size_t len,
+                         uint64_t timestamp,
+                         const char *meta_json,
+                         WaggleFreeFn free_fn,
+                         void *arg);
+
+/**
+ * Publishes `n` samples under one scope. The batch is encoded into a
+ * single allocation and queued with one ring operation; each sample is
+ * still delivered as its own message.
+ *
+ * If the whole batch does not fit, samples are queued one at a time and
+ * the overflow policy applies to each. Returns PLUGIN_OK if every sample
+ * was queued, otherwise the last error seen (e.g. PLUGIN_EDROPPED).
+ */
+int plugin_publish_batch(Plugin *plugin,
+                         const char *scope,
+                         const WaggleSample *samples,
+                         size_t n);
+
+/**
+ * Sets meta keys (a JSON object, e.g. {"node":"...","sensor":"..."})
+ * that are merged into every series registered afterwards. Keys given
+ * to plugin_register_series take precedence. Does not affect
+ * plugin_publish or series registered earlier.
+ * Returns PLUGIN_OK, or PLUGIN_EINVAL if meta_json is not an object.
+ */
+int plugin_set_default_meta(Plugin *plugin, const char *meta_json);
+
+/**
+ * Registers a (scope, name, meta) combination once, so repeated publishes
+ * skip copying, parsing and re-encoding those strings. meta_json must be
+ * a JSON object (NULL means "{}") and is merged with the default meta.
+ *
+ * The handle is owned by the plugin and stays valid until plugin_free.
+ * Returns NULL on invalid meta or allocation failure.
+ */
+PluginSeries* plugin_register_series(Plugin *plugin,
+                                     const char *scope,
+                                     const char *name,
+                                     const char *meta_json);
+
+/**
+ * Publishes a value for a registered series. Same queueing semantics
+ * and return codes as plugin_publish.
+ */
+int plugin_publish_series(Plugin *plugin,
+                          const PluginSeries *series,
+                          int64_t value,
+                          uint64_t timestamp);
+
+/**
+ * Non-blocking variant of plugin_publish_series; see plugin_try_publish.
+ */
+int plugin_try_publish_series(Plugin *plugin,
+                              const PluginSeries *series,
+                              int64_t value,
+                              uint64_t timestamp);
+
+/**
+ * Publishes `n` values of a registered series, with timestamps[i] going
+ * with values[i]. Same queueing semantics as plugin_publish_batch.
+ */
+int plugin_publish_series_batch(Plugin *plugin,
+                                const PluginSeries *series,
+                                const int64_t *values,
+                                const uint64_t *timestamps,
+                                size_t n);
+
+/**
+ * Reducers for plugin_register_aggregate; combine them with |.
+ */
+#define PLUGIN_AGG_MIN    0x01
+#define PLUGIN_AGG_MAX    0x02
+#define PLUGIN_AGG_MEAN   0x04
+#define PLUGIN_AGG_COUNT  0x08
+#define PLUGIN_AGG_LAST   0x10
+#define PLUGIN_AGG_ALL    0x1f
+
+/**
+ * Opaque handle for a series rolled up before publishing.
+ */
+typedef struct PluginAggregate PluginAggregate;
+
+/**
+ * Registers a series whose samples are summarized on the client instead
+ * of published one by one. Windows are `window_ms` long and aligned to
+ * wall-clock multiples of it (e.g. on every second). When one closes,
+ * each reducer in `reducers` is published as "<name>.<reducer>" (e.g.
+ * "env.temperature.mean"), timestamped with the window's start: count as
+ * an integer, the others as doubles. A window without samples publishes
+ * nothing. The open windows are published by plugin_free.
+ *
+ * meta_json is handled as in plugin_register_series. The handle is owned
+ * by the plugin and stays valid until plugin_free.
+ * Returns NULL on invalid arguments (including a name that leaves no room
+ * for the reducer suffixes within 255 bytes) or allocation failure.
+ */
+PluginAggregate* plugin_register_aggregate(Plugin *plugin,
+                                           const char *scope,
+                                           const char *name,
+                                           const char *meta_json,
+                                           int window_ms,
+                                           unsigned reducers);
+
+/**
+ * Adds a sample to the aggregate's current window. Lock-free and
+ * allocation-free, so it is cheap enough to call at kHz rates from any
+ * number of threads. Returns PLUGIN_OK, or PLUGIN_EINVAL for NaN.
+ */
+int plugin_aggregate_add(Plugin *plugin, PluginAggregate *agg, double value);
+
+/**
+ * Uploads a file in the background and, once it has been placed in the
+ * upload directory, publishes an "upload" message (scope "all") whose
+ * meta is `meta_json` plus "filename". Returns as soon as the job is
+ * queued, so capture and upload overlap.
+ *
+ * `flags` are the UPLOADER_* flags of uploader_upload_file_ex. `done`,
+ * if set, is called on a worker thread after the message is queued.
+ * Poll the returned job with upload_job_status and free it with
+ * upload_job_release. Returns NULL if the upload queue is full or on error.
+ */
+UploadJob* plugin_upload_file(Plugin *plugin,
+                              const char *path,
+                              uint64_t timestamp,
+                              const char *meta_json,
+                              int flags,
+                              UploadDoneFn done,
+                              void *arg);
+
+/**
+ * Fills `out` with a snapshot of the plugin's queue counters.
+ * Returns 0 on success, nonzero on error.
+ */
+int plugin_get_stats(Plugin *plugin, PluginStats *out);
+
+/**
+ * Returns the sink that PLUGIN_TRANSPORT_MEMORY publishes to, or NULL
+ * with another transport. It belongs to the plugin.
+ */
+MemorySink* plugin_memory_sink(Plugin *plugin);
+
+/**
+ * Routes messages from plugin_subscribe to `handler`, called on the
+ * subscriber thread, instead of the inbox. Must be called before the
+ * first plugin_subscribe.
+ * Returns PLUGIN_OK, or PLUGIN_EINVAL if already subscribed.
+ */
+int plugin_set_message_handler(Plugin *plugin, SubscriberHandler handler, void *arg);
+
+/**
+ * Subscribes to one or more topics (routing keys on the "data.topic"
+ * exchange, e.g. "env.temperature" or "sys.#"). The first call starts a
+ * consumer with its own connection; see Subscriber for prefetch and ack
+ * behavior. Messages go to the handler set with plugin_set_message_handler,
+ * or else to an inbox read with plugin_get_message.
  *
  * Returns 0 on success, nonzero on error.
  */
 int plugin_subscribe(Plugin *plugin, const char **topics, int n);
 
+/**
+ * Takes the oldest received message without blocking, or returns NULL
+ * if there is none. Free it with wagglemsg_free.
+ */
+WaggleMsg* plugin_get_message(Plugin *plugin);
+
+/**
+ * Takes up to `max` received messages without blocking.
+ * Returns the number taken.
+ */
+size_t plugin_get_messages(Plugin *plugin, WaggleMsg **out, size_t max);
+
 #ifdef __cplusplus
 }
 #endif
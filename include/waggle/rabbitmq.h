@@ -9,18 +9,87 @@ extern "C" {
 #include "config.h"
 #include <stdint.h>
 
+#define RABBITMQ_MAX_CHANNELS 64
+#define RABBITMQ_STABLE_MIN_MS 1000  // see rabbitmq_stable_uptime_ns
+
 typedef struct RabbitMQConn {
     amqp_connection_state_t conn;
     int connected;
+    int num_channels;           // channels 1..num_channels are open
+    // per channel (index channel - 1): tag the broker will assign to the
+    // next publish on that channel
+    uint64_t next_delivery_tag[RABBITMQ_MAX_CHANNELS];
+
+    // consuming (channel 1)
+    amqp_bytes_t queue;         // private queue, once declared
+    amqp_bytes_t consumer_tag;  // while consuming
+    int consuming;
 } RabbitMQConn;
 
+/**
+ * A publisher confirm received from the broker. With `multiple` set, the
+ * confirm covers every outstanding delivery tag up to and including
+ * `delivery_tag`.
+ */
+typedef struct RabbitMQConfirm {
+    int      channel;
+    uint64_t delivery_tag;
+    int      multiple;
+    int      ack;  // 1 = basic.ack, 0 = basic.nack or basic.reject
+} RabbitMQConfirm;
+
+/**
+ * A message received by rabbitmq_consume. The pointers stay valid until
+ * rabbitmq_delivery_free.
+ */
+typedef struct RabbitMQDelivery {
+    int         channel;
+    uint64_t    delivery_tag;
+    const char *routing_key;    // not NUL-terminated
+    size_t      routing_key_len;
+    const void *body;
+    size_t      body_len;
+    const char *content_type;   // not NUL-terminated; NULL if unset
+    size_t      content_type_len;
+    const char *content_encoding; // not NUL-terminated; NULL if unset
+    size_t      content_encoding_len;
+    amqp_envelope_t envelope;   // owns the data above
+} RabbitMQDelivery;
+
 /**
  * Creates and returns a new RabbitMQ connection using
- * the specified config.
+ * the specified config. Connecting and logging in give up after
+ * config->connect_timeout_ms; config->heartbeat_s is negotiated and
+ * config->tcp_keepalive_s enables keepalive probes on the socket.
  * Returns NULL on failure.
  */
 RabbitMQConn* rabbitmq_conn_create(const PluginConfig *config);
 
+/**
+ * Like rabbitmq_conn_create, but opens channels 1..`channels` (at most
+ * RABBITMQ_MAX_CHANNELS), each with publisher confirms enabled. Delivery
+ * tags are numbered per channel.
+ * Returns NULL on failure.
+ */
+RabbitMQConn* rabbitmq_conn_create_channels(const PluginConfig *config, int channels);
+
+/**
+ * Like rabbitmq_conn_create, but for a connection that only consumes:
+ * channel 1 is opened without publisher confirms.
+ * Returns NULL on failure.
+ */
+RabbitMQConn* rabbitmq_conn_create_consumer(const PluginConfig *config);
+
+/**
+ * Services an idle connection: sends a heartbeat if one is due and checks
+ * that the broker's are still arriving. Call this at least every few
+ * seconds while nothing is being published. Any confirms that arrive are
+ * discarded, so only call it with nothing in flight.
+ *
+ * Returns 0 if the connection is healthy, negative if it failed.
+ */
+int rabbitmq_conn_poll(RabbitMQConn *conn);
+
 /**
  * Closes and frees a RabbitMQ connection handle.
  * Safe to call with NULL.
@@ -29,7 +98,7 @@ void rabbitmq_conn_close(RabbitMQConn *conn);
 
 /**
  * Publishes a message payload to the "to-validator" exchange with
- * the given scope as routing key.
+ * the given scope as routing key, and waits for the broker to confirm it.
  *
  * Returns 0 on success, nonzero on failure.
  */
@@ -42,11 +111,74 @@ int rabbitmq_publish_message(RabbitMQConn *conn,
                      int username_len,
                      int data_len); 
 
+/**
+ * Publishes a message like rabbitmq_publish_message, but does not wait for
+ * the broker to confirm it. The delivery tag assigned to the message is
+ * stored in `*delivery_tag`; match it against rabbitmq_wait_confirm results.
+ *
+ * Returns 0 on success, nonzero on failure.
+ */
+int rabbitmq_publish_message_async(RabbitMQConn *conn,
+                                   const char *app_id,
+                                   const char *username,
+                                   const char *scope,
+                                   const void *data,
+                                   int app_id_len,
+                                   int username_len,
+                                   int data_len,
+                                   uint64_t *delivery_tag);
 
 /**
- * Subscribes to the given topics from the "data.topic" exchange.
- * This is a stub for real subscription logic. For a fully functional
- * consumer, you'd need a receiving thread or callback approach.
+ * rabbitmq_publish_message_async on the given channel (1..num_channels),
+ * with `content_type` and `content_encoding` as the AMQP properties of
+ * the same name (NULL = unset). The delivery tag is only meaningful together with the channel.
+ *
+ * Returns 0 on success, nonzero on failure.
+ */
+int rabbitmq_publish_message_on(RabbitMQConn *conn,
+                                int channel,
+                                const char *app_id,
+                                const char *username,
+                                const char *scope,
+                                const void *data,
+                                int app_id_len,
+                                int username_len,
+                                int data_len,
+                                const char *content_type,
+                                const char *content_encoding,
+                                uint64_t *delivery_tag);
+
+/**
+ * Waits up to `timeout_ms` for the next publisher confirm on any channel. A timeout of 0
+ * only picks up confirms that have already arrived.
+ *
+ * Returns 0 when a confirm was stored in `*out`, 1 on timeout, and a
+ * negative value if the connection failed.
+ */
+int rabbitmq_wait_confirm(RabbitMQConn *conn, int timeout_ms, RabbitMQConfirm *out);
+
+
+/**
+ * Returns how long to wait before reconnect attempt number `attempt`
+ * (0 = first retry): a random delay in [cap/2, cap], where cap doubles
+ * each attempt from config->reconnect_min_ms up to reconnect_max_ms.
+ * `seed` is the caller's rand_r state.
+ */
+int rabbitmq_reconnect_delay_ms(const PluginConfig *config, int attempt, unsigned int *seed);
+
+/**
+ * Returns how long a connection has to stay up before its loss resets the
+ * reconnect backoff: three heartbeat intervals, and no less than
+ * reconnect_max_ms or RABBITMQ_STABLE_MIN_MS. A broker that accepts the
+ * connection and drops it again right away keeps backing off.
+ */
+uint64_t rabbitmq_stable_uptime_ns(const PluginConfig *config);
+
+/**
+ * Binds the given topics (routing keys, e.g. "env.temperature" or
+ * "sys.#") from the "data.topic" exchange to the connection's private
+ * queue, declaring it on first use. The queue is exclusive and goes away
+ * with the connection, so topics must be bound again after a reconnect.
  *
  * Returns 0 on success, nonzero on failure.
  */
@@ -54,6 +186,54 @@ int rabbitmq_subscribe(RabbitMQConn *conn,
                        const char **topics,
                        int n);
 
+/**
+ * Starts consuming the private queue on channel 1 with manual acks. At most
+ * `prefetch` deliveries (0 = unlimited) are sent before they are acked.
+ * Topics may be bound before or after.
+ *
+ * Returns 0 on success, nonzero on failure.
+ */
+int rabbitmq_consume_start(RabbitMQConn *conn, int prefetch);
+
+/**
+ * Cancels the consumer started by rabbitmq_consume_start, so the broker
+ * sends nothing more; deliveries it sent before answering still arrive
+ * through rabbitmq_consume, and unacked ones can still be acked. Call
+ * rabbitmq_consume_start again to resume.
+ *
+ * Returns 0 on success, nonzero on failure.
+ */
+int rabbitmq_consume_cancel(RabbitMQConn *conn);
+
+/**
+ * Waits up to `timeout_ms` for the next delivery. Also services
+ * heartbeats. On success, free `*out` with rabbitmq_delivery_free.
+ *
+ * Returns 0 when a delivery was stored in `*out`, 1 on timeout, and a
+ * negative value if the connection failed.
+ */
+int rabbitmq_consume(RabbitMQConn *conn, int timeout_ms, RabbitMQDelivery *out);
+
+/**
+ * Releases a delivery returned by rabbitmq_consume.
+ */
+void rabbitmq_delivery_free(RabbitMQDelivery *delivery);
+
+/**
+ * Acks `delivery_tag` on `channel`; with `multiple`, also every earlier
+ * unacked delivery on that channel.
+ * Returns 0 on success, nonzero on failure.
+ */
+int rabbitmq_ack(RabbitMQConn *conn, int channel, uint64_t delivery_tag, int multiple);
+
+/**
+ * Rejects a single delivery. Without `requeue` the broker drops it (or
+ * dead-letters it), e.g. because it could not be decoded; with it, the
+ * delivery goes back on the queue to be delivered again.
+ * Returns 0 on success, nonzero on failure.
+ */
+int rabbitmq_reject(RabbitMQConn *conn, int channel, uint64_t delivery_tag, int requeue);
+
 #ifdef __cplusplus
 }
 #endif
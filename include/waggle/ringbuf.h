@@ -0,0 +1,83 @@
+#ifndef WAGGLE_RINGBUF_H
+#define WAGGLE_RINGBUF_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+/**
+ * Opaque struct for a bounded ring of pointers.
+ *
+ * Any number of threads may push concurrently. Popping is lock-free and
+ * also safe from several threads, though the ring is tuned for a single
+ * consumer that drains it in bulk and sleeps only when it is empty.
+ */
+typedef struct RingBuf RingBuf;
+
+/**
+ * Creates a ring holding at least `capacity` pointers (rounded up to a
+ * power of two). All slots are allocated up front.
+ * Returns NULL on failure.
+ */
+RingBuf* ringbuf_new(size_t capacity);
+
+/**
+ * Frees the ring. Items still inside are not freed.
+ * Safe to call with NULL.
+ */
+void ringbuf_free(RingBuf *rb);
+
+/**
+ * Returns the number of slots in the ring.
+ */
+size_t ringbuf_capacity(const RingBuf *rb);
+
+/**
+ * Returns the number of items currently queued. This is a snapshot and
+ * may already be stale when it returns.
+ */
+size_t ringbuf_size(const RingBuf *rb);
+
+/**
+ * Pushes `item` (must not be NULL). Wakes the consumer if it is idle.
+ * Returns 0 on success, -1 if the ring is full.
+ */
+int ringbuf_push(RingBuf *rb, void *item);
+
+/**
+ * Pushes all `n` items as one contiguous run, or none of them. Claims
+ * the slots with a single CAS and wakes the consumer at most once.
+ * Returns 0 on success, -1 if there is not room for all of them.
+ */
+int ringbuf_push_bulk(RingBuf *rb, void *const *items, size_t n);
+
+/**
+ * Pops the oldest item. Returns NULL if the ring is empty.
+ */
+void* ringbuf_pop(RingBuf *rb);
+
+/**
+ * Pops up to `max` items into `out`, oldest first.
+ * Returns the number of items popped.
+ */
+size_t ringbuf_pop_bulk(RingBuf *rb, void **out, size_t max);
+
+/**
+ * Blocks until the ring is non-empty, ringbuf_wake is called, or
+ * `timeout_ms` passes. Meant for the consumer thread.
+ * Returns 1 if items are available, 0 otherwise.
+ */
+int ringbuf_wait(RingBuf *rb, int timeout_ms);
+
+/**
+ * Wakes a consumer blocked in ringbuf_wait, e.g. at shutdown.
+ */
+void ringbuf_wake(RingBuf *rb);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef WAGGLE_SEGMENTLOG_H
+#define WAGGLE_SEGMENTLOG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Opaque struct for an append-only line log split into segments.
+ *
+ * Lines are appended to `<dir>/data.ndjson`. When rotation is enabled and
+ * the file reaches segment_bytes or has been open for segment_ms, it is
+ * sealed: renamed to `data-<first_ts>.ndjson`, recorded in
+ * `<dir>/manifest.ndjson`, and (if enabled) gzip-compressed by a
+ * background thread. Sealed segments beyond retention_bytes are deleted,
+ * oldest first.
+ *
+ * Each manifest line describes one sealed segment:
+ *   {"file":"data-....ndjson.gz","first_ts":N,"last_ts":N,"lines":N,"bytes":N}
+ * with timestamps in nanoseconds since epoch. A segment left over from a
+ * run without rotation has first_ts = last_ts = lines = 0 (unknown).
+ *
+ * All functions are thread-safe.
+ */
+typedef struct SegmentLog SegmentLog;
+
+typedef struct SegmentLogOptions {
+    size_t segment_bytes;    // rotate at this size; 0 = no size limit
+    int    segment_ms;       // rotate after this long; 0 = no time limit
+    int    compress;         // gzip sealed segments (needs zlib)
+    size_t retention_bytes;  // max bytes of sealed segments; 0 = keep all
+} SegmentLogOptions;
+
+/**
+ * Opens (or creates) the log in `dir`. With neither segment_bytes nor
+ * segment_ms set this is a plain append-only data.ndjson and no manifest
+ * is kept. `opts` may be NULL for that behavior.
+ * Returns NULL on failure.
+ */
+SegmentLog* segmentlog_open(const char *dir, const SegmentLogOptions *opts);
+
+/**
+ * Appends `len` bytes holding `lines` complete lines whose timestamps lie
+ * in [first_ts, last_ts], then rotates if a limit was reached.
+ * Returns 0 on success, nonzero on write error.
+ */
+int segmentlog_write(SegmentLog *log, const char *buf, size_t len,
+                     uint64_t first_ts, uint64_t last_ts, size_t lines);
+
+/**
+ * Rotates the active segment if its segment_ms has passed, even when
+ * nothing is being written. Call periodically from a background thread.
+ */
+void segmentlog_tick(SegmentLog *log);
+
+/**
+ * fdatasync()s the active segment.
+ */
+int segmentlog_sync(SegmentLog *log);
+
+/**
+ * Waits for pending compression, closes the active segment (without
+ * sealing it) and frees the log. Safe to call with NULL.
+ */
+void segmentlog_close(SegmentLog *log);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef WAGGLE_SLAB_H
+#define WAGGLE_SLAB_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Opaque struct for a pool of size-classed buffers.
+ *
+ * Blocks are rounded up to a power-of-two class (64 B to 64 KiB) and, when
+ * released, go back on that class's lock-free free list instead of to
+ * malloc. Any thread may allocate or release. Requests above the largest
+ * class, or releases into a full free list, fall through to malloc/free.
+ */
+typedef struct SlabPool SlabPool;
+
+/**
+ * Occupancy counters for a SlabPool. hits/misses are cumulative; the
+ * byte counts are current values, measured in whole class sizes.
+ */
+typedef struct SlabStats {
+    uint64_t hits;          // allocations served from a free list
+    uint64_t misses;        // allocations that had to call malloc
+    uint64_t in_use_bytes;  // handed out and not yet released
+    uint64_t cached_bytes;  // sitting in free lists
+    uint64_t cache_limit;   // most bytes the free lists may hold
+} SlabStats;
+
+/**
+ * Creates a pool whose free lists hold at most about `cache_bytes` in
+ * total, split evenly across classes. 0 disables caching, so every
+ * allocation goes to malloc (stats are still kept).
+ * Returns NULL on failure.
+ */
+SlabPool* slab_pool_new(size_t cache_bytes);
+
+/**
+ * Frees the pool and every cached block. Blocks still in use must not be
+ * released afterwards. Safe to call with NULL.
+ */
+void slab_pool_free(SlabPool *pool);
+
+/**
+ * Returns a block of at least `size` bytes, aligned like malloc.
+ * Returns NULL if out of memory.
+ */
+void* slab_alloc(SlabPool *pool, size_t size);
+
+/**
+ * Returns a block from slab_alloc to its pool. Safe to call with NULL.
+ */
+void slab_release(void *ptr);
+
+/**
+ * Fills `out` with the pool's counters.
+ */
+void slab_pool_stats(SlabPool *pool, SlabStats *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef WAGGLE_SPILLFILE_H
+#define WAGGLE_SPILLFILE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+/**
+ * Opaque struct for an on-disk overflow FIFO of (scope, data) records.
+ * Used to hold messages that did not fit in the in-memory publish queue.
+ * Appends and reads are thread-safe.
+ */
+typedef struct SpillFile SpillFile;
+
+/**
+ * Opens (or creates) `<dir>/spill.bin`. Records left over from a previous
+ * run are kept and will be returned by spillfile_read. With `sync` set,
+ * every append is followed by fdatasync so records survive power loss.
+ * Returns NULL on error.
+ */
+SpillFile* spillfile_open(const char *dir, int sync);
+
+/**
+ * Closes the spill file and frees memory. Unread records stay on disk.
+ * Safe to call with NULL.
+ */
+void spillfile_close(SpillFile *sf);
+
+/**
+ * Appends one record.
+ * Returns 0 on success, nonzero on error.
+ */
+int spillfile_append(SpillFile *sf, const char *scope, const char *data, int len);
+
+/**
+ * Reads the oldest unread record. On success, `*scope` and `*data` point
+ * into an internal buffer that stays valid until the next call.
+ * The file is truncated by the first call that finds every record read,
+ * so a record is on disk until the caller has come back for the next one.
+ *
+ * Returns 1 if a record was read, 0 if the file is empty, negative on error.
+ */
+int spillfile_read(SpillFile *sf, const char **scope, const char **data, int *len);
+
+/**
+ * Returns the number of unread bytes in the spill file.
+ */
+size_t spillfile_pending(SpillFile *sf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
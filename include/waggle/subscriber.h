@@ -0,0 +1,110 @@
+#ifndef WAGGLE_SUBSCRIBER_H
+#define WAGGLE_SUBSCRIBER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "config.h"
+#include "wagglemsg.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define SUBSCRIBER_DEFAULT_PREFETCH       256
+#define SUBSCRIBER_DEFAULT_ACK_BATCH      64
+#define SUBSCRIBER_DEFAULT_QUEUE_CAPACITY 4096
+
+/**
+ * Opaque struct for a consumer of the "data.topic" exchange.
+ *
+ * A background thread keeps its own connection, binds the subscribed
+ * topics to a private queue, and receives with up to prefetch unacked
+ * deliveries. Acks are sent in batches (basic.ack with multiple set) once
+ * ack_batch messages were handed over, or when the queue goes quiet.
+ * The queue belongs to the connection, so messages published while it
+ * is down are not seen; after a reconnect every topic is bound again.
+ *
+ * Each delivery is decoded according to its content type (JSON or
+ * MessagePack, see WaggleMsgFormat) and either passed to the handler or
+ * pushed onto a bounded lock-free inbox for subscriber_poll. While the
+ * inbox is full the consumer is cancelled, so the broker stops sending;
+ * deliveries already on the way are held back unacked (up to another
+ * inbox's worth; any beyond that are requeued), the connection is still
+ * serviced and heartbeats answered, and consumption resumes once the
+ * application has caught up.
+ */
+typedef struct Subscriber Subscriber;
+
+/**
+ * Called on the subscriber thread for each message. `msg` and `topic`
+ * (the routing key) are only valid during the call.
+ */
+typedef void (*SubscriberHandler)(const WaggleMsg *msg, const char *topic, void *arg);
+
+typedef struct SubscriberOptions {
+    int prefetch;        // unacked deliveries the broker may send; 0 = unlimited
+    int ack_batch;       // ack after this many messages
+    int queue_capacity;  // inbox size when there is no handler
+} SubscriberOptions;
+
+typedef struct SubscriberStats {
+    uint64_t received;        // deliveries handed to the handler or inbox
+    uint64_t invalid;         // deliveries that could not be decoded (rejected)
+    uint64_t acks;            // basic.ack frames sent
+    uint64_t pauses;          // times a full inbox stopped consumption
+    uint64_t requeued;        // deliveries handed back to the broker while
+                              // stopped, past a full inbox's worth held
+    uint64_t inbox_messages;  // messages waiting for subscriber_poll
+} SubscriberStats;
+
+/**
+ * Fills `opts` with the SUBSCRIBER_DEFAULT_* values.
+ */
+void subscriber_options_default(SubscriberOptions *opts);
+
+/**
+ * Starts a subscriber using the connection settings in `config`, which
+ * must outlive it. With a `handler`, messages go to it; otherwise they
+ * are queued for subscriber_poll. `opts` may be NULL for defaults.
+ * Returns NULL on failure.
+ */
+Subscriber* subscriber_new(const PluginConfig *config,
+                           const SubscriberOptions *opts,
+                           SubscriberHandler handler,
+                           void *arg);
+
+/**
+ * Adds topics (routing keys such as "env.temperature" or "sys.#").
+ * They are bound by the subscriber thread shortly after; the strings are
+ * copied. Returns 0 on success, nonzero on failure.
+ */
+int subscriber_add_topics(Subscriber *s, const char **topics, int n);
+
+/**
+ * Takes the oldest message from the inbox without blocking, or returns
+ * NULL if it is empty (or a handler is set). Free it with wagglemsg_free.
+ */
+WaggleMsg* subscriber_poll(Subscriber *s);
+
+/**
+ * Takes up to `max` messages from the inbox without blocking.
+ * Returns the number taken.
+ */
+size_t subscriber_poll_bulk(Subscriber *s, WaggleMsg **out, size_t max);
+
+/**
+ * Fills `out` with the subscriber's counters.
+ */
+void subscriber_stats(Subscriber *s, SubscriberStats *out);
+
+/**
+ * Stops the thread, closes the connection and frees any messages still
+ * in the inbox. Safe to call with NULL.
+ */
+void subscriber_free(Subscriber *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -5,14 +5,111 @@
 extern "C" {
 #endif
 
+#include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
+#ifndef __cplusplus
+  #include <stdatomic.h>
+#endif
+
+/**
+ * Clocks behind waggle_get_timestamp_ns. The choice is process-wide.
+ */
+typedef enum WaggleClock {
+    WAGGLE_CLOCK_REALTIME = 0,  // clock_gettime(CLOCK_REALTIME); the default
+    WAGGLE_CLOCK_REALTIME_COARSE,// CLOCK_REALTIME_COARSE: cheapest system
+                                // clock, but only as fine as the kernel tick
+    WAGGLE_CLOCK_TSC            // the CPU's counter (invariant TSC on x86-64,
+                                // CNTVCT_EL0 on arm64), calibrated against
+                                // CLOCK_REALTIME; no system call or vDSO
+} WaggleClock;
 
 /**
- * Returns current time in nanoseconds since Unix epoch.
- * On most Unix-like systems, uses clock_gettime().
+ * Timestamp clock state and drift. Drift is CLOCK_REALTIME minus what the
+ * TSC clock predicted, measured at each calibration; only
+ * WAGGLE_CLOCK_TSC has any.
+ */
+typedef struct WaggleClockStats {
+    WaggleClock clock;          // clock in use
+    uint64_t resolution_ns;     // smallest step the clock can show
+    uint64_t counter_hz;        // counter frequency (TSC only)
+    uint64_t calibrations;      // calibrations since the clock was selected
+    uint64_t steps;             // calibrations that jumped to CLOCK_REALTIME
+                                // instead of slewing towards it
+    int64_t  last_drift_ns;     // drift at the latest calibration
+    int64_t  max_drift_ns;      // drift of largest magnitude, slews only
+    uint64_t batch_adjusted;    // waggle_get_timestamps_ns batches moved
+                                // past the clock to stay increasing
+} WaggleClockStats;
+
+/**
+ * Returns current time in nanoseconds since Unix epoch, read from the
+ * clock picked with waggle_clock_select. Successive calls are not
+ * guaranteed to increase; see waggle_get_timestamps_ns.
  */
 uint64_t waggle_get_timestamp_ns(void);
 
+/**
+ * Fills `out[0..n)` with timestamps for a batch of samples taken together,
+ * from one clock reading. They increase by 1 ns each and always start
+ * after the last timestamp any earlier call handed out, so timestamps from
+ * this function are strictly increasing process-wide, even with a coarse
+ * clock or after the wall clock is set back. Safe from any thread.
+ */
+void waggle_get_timestamps_ns(uint64_t *out, size_t n);
+
+/**
+ * Returns nonzero if `clock` can be used on this machine.
+ * WAGGLE_CLOCK_TSC needs an x86-64 CPU with an invariant TSC, or arm64.
+ */
+int waggle_clock_available(WaggleClock clock);
+
+/**
+ * Switches waggle_get_timestamp_ns to `clock`. Selecting WAGGLE_CLOCK_TSC
+ * calibrates it first, which sleeps for about 10 ms; after that it
+ * recalibrates about once a second, from whichever thread reads it at the
+ * time, and slews gradually rather than jumping unless CLOCK_REALTIME
+ * itself jumped. Selecting a clock resets the calibration statistics.
+ * Returns 0 on success, -1 if the clock is not available (the current one
+ * is kept).
+ */
+int waggle_clock_select(WaggleClock clock);
+
+/**
+ * Returns the clock in use.
+ */
+WaggleClock waggle_clock_current(void);
+
+/**
+ * Fills `out` with the clock's state and drift statistics.
+ */
+void waggle_clock_get_stats(WaggleClockStats *out);
+
+/**
+ * Returns a monotonic clock reading in nanoseconds, for measuring
+ * durations. Unrelated to wall-clock time.
+ */
+uint64_t waggle_get_monotonic_ns(void);
+
+#ifndef __cplusplus
+/**
+ * Sleeps for `ms` milliseconds on `cond`, which must use CLOCK_MONOTONIC,
+ * waking early once `*stop` is set. Whoever sets `*stop` must do it while
+ * holding `lock` and then broadcast `cond`.
+ */
+void waggle_wait_stop(pthread_mutex_t *lock, pthread_cond_t *cond, _Atomic int *stop, int ms);
+#endif
+
+/**
+ * Parses an ISO 8601 UTC time of `len` bytes, as the local file log writes
+ * it ("2025-01-01T10:00:00.123456789Z"), into nanoseconds since Unix
+ * epoch. The fraction may have any number of digits (beyond 9 are
+ * ignored); the zone may be "Z", "+HH:MM", "+HHMM" or missing (UTC), and
+ * a space may stand in for the "T".
+ * Returns 0 on success, -1 if it is malformed or before 1970.
+ */
+int waggle_parse_iso8601_ns(const char *s, size_t len, uint64_t *out);
+
 /**
  * Returns current time in a human-readable string, e.g. "2025-01-01 10:00:00"
  * Just a helper for debugging/logging. Not required for the main logic.
@@ -0,0 +1,151 @@
+#ifndef WAGGLE_TRANSPORT_H
+#define WAGGLE_TRANSPORT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+
+/**
+ * One message handed to a transport. `channel` and the strings are set by
+ * the caller; publish_batch fills in `delivery_tag`.
+ */
+typedef struct TransportMessage {
+    int          channel;       // 1..channels
+    const char  *scope;         // routing key, NUL-terminated
+    const void  *data;
+    size_t       len;
+    const char  *content_type;  // NULL = unset
+    const char  *content_encoding; // NULL = not compressed
+    uint64_t     delivery_tag;
+} TransportMessage;
+
+/**
+ * A confirm reported by poll_confirms. With `multiple` set, it covers
+ * every outstanding tag on the channel up to and including `delivery_tag`.
+ */
+typedef struct TransportConfirm {
+    int      channel;
+    uint64_t delivery_tag;
+    int      multiple;
+    int      ack;  // 1 = delivered, 0 = refused (the message is resent)
+} TransportConfirm;
+
+/**
+ * Where publisher lanes send messages. A lane calls connect once per
+ * connection attempt and close when the connection is done with; the
+ * other calls take the connection handle connect returned and are only
+ * made from that lane's thread.
+ *
+ * Delivery tags follow AMQP publisher confirms: numbered per channel, one
+ * apart, starting from the value connect stores in first_tags.
+ */
+typedef struct TransportOps {
+    const char *name;
+
+    /**
+     * Opens a connection with channels 1..`channels` and stores each
+     * channel's first delivery tag in first_tags[channel - 1]. `arg` is
+     * PluginConfig.transport_arg (or the built-in transport's state).
+     * Returns the connection handle, or NULL on failure.
+     */
+    void* (*connect)(void *arg, const PluginConfig *config, int channels, uint64_t *first_tags);
+
+    /**
+     * Sends msgs[0..n) in order and assigns their delivery tags. Returns
+     * how many were sent; fewer than `n` means the connection failed
+     * after those.
+     */
+    size_t (*publish_batch)(void *conn, TransportMessage *msgs, size_t n);
+
+    /**
+     * Stores up to `max` confirms in `out`, waiting up to `timeout_ms`
+     * for the first (0 = only those already received). Also keeps an
+     * idle connection alive. Returns the number stored, or negative if
+     * the connection failed.
+     */
+    int (*poll_confirms)(void *conn, int timeout_ms, TransportConfirm *out, int max);
+
+    /**
+     * Closes and frees a connection. Messages not yet confirmed are
+     * resent on the next connection.
+     */
+    void (*close)(void *conn);
+} TransportOps;
+
+/**
+ * The built-in transports (PluginConfig.transport):
+ *   amqp    publishes to RabbitMQ with publisher confirms (rabbitmq.c)
+ *   null    confirms every message without sending it anywhere
+ *   memory  keeps the newest messages in a MemorySink; arg is the sink
+ *   file    appends every message to the file at arg (a path) and
+ *           confirms once it is written, as NDJSON with one line per
+ *           message (MessagePack and envelopes are split and converted,
+ *           compressed bodies decompressed; one that does not decompress
+ *           is not sent)
+ */
+extern const TransportOps transport_amqp;
+extern const TransportOps transport_null;
+extern const TransportOps transport_memory;
+extern const TransportOps transport_file;
+
+/**
+ * Opaque struct for the memory transport's ring of received messages.
+ * When it is full, each new message replaces the oldest.
+ */
+typedef struct MemorySink MemorySink;
+
+/**
+ * A message taken out of a MemorySink. Release it with
+ * memory_sink_record_free.
+ */
+typedef struct MemorySinkRecord {
+    char   *scope;
+    char   *content_type;  // NULL if unset
+    char   *content_encoding; // NULL if unset
+    void   *data;
+    size_t  len;
+} MemorySinkRecord;
+
+/**
+ * Creates a sink that keeps the newest `capacity` messages.
+ * Returns NULL on failure.
+ */
+MemorySink* memory_sink_new(size_t capacity);
+
+/**
+ * Frees a sink and the messages in it. Safe to call with NULL.
+ */
+void memory_sink_free(MemorySink *sink);
+
+/**
+ * Moves up to `max` of the oldest messages into `out`. Returns the
+ * number moved.
+ */
+size_t memory_sink_take(MemorySink *sink, MemorySinkRecord *out, size_t max);
+
+/**
+ * Frees the buffers of a record filled in by memory_sink_take.
+ */
+void memory_sink_record_free(MemorySinkRecord *rec);
+
+/**
+ * Drops every message in the sink.
+ */
+void memory_sink_clear(MemorySink *sink);
+
+/**
+ * Messages received in total, and how many of those were replaced
+ * before being taken.
+ */
+uint64_t memory_sink_received(MemorySink *sink);
+uint64_t memory_sink_overwritten(MemorySink *sink);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -20,6 +20,12 @@ Uploader* uploader_new(const char *root);
  */
 void uploader_free(Uploader *u);
 
+/**
+ * Flags for uploader_upload_file_ex.
+ */
+#define UPLOADER_MOVE  0x1  // caller hands over src_path; it is renamed (or copied and removed)
+#define UPLOADER_LINK  0x2  // caller will not modify src_path; a hardlink may be used
+
 /**
  * Uploads a file (copy from `src_path` into the upload root).
  * The timestamp can be used to name or meta-tag the file.
@@ -30,6 +36,95 @@ int uploader_upload_file(Uploader *u,
                          const char *src_path,
                          int64_t timestamp);
 
+/**
+ * Like uploader_upload_file, choosing the cheapest way to place the file:
+ * rename (UPLOADER_MOVE) or hardlink (UPLOADER_LINK) within one
+ * filesystem, otherwise a reflink, an in-kernel copy (copy_file_range or
+ * sendfile), or finally a read/write loop.
+ *
+ * Returns 0 on success, nonzero on failure.
+ */
+int uploader_upload_file_ex(Uploader *u,
+                            const char *src_path,
+                            int64_t timestamp,
+                            int flags);
+
+/**
+ * Asynchronous uploads: a small worker pool fed by a bounded job queue.
+ * Submitting returns immediately with a job handle that can be polled,
+ * and an optional callback runs on the worker thread when the job ends.
+ */
+typedef struct UploadQueue UploadQueue;
+typedef struct UploadJob UploadJob;
+
+typedef enum {
+    UPLOAD_PENDING = 0,
+    UPLOAD_RUNNING,
+    UPLOAD_DONE,
+    UPLOAD_FAILED
+} UploadStatus;
+
+#define UPLOADER_DEFAULT_WORKERS        2
+#define UPLOADER_DEFAULT_QUEUE_CAPACITY 64
+
+/**
+ * Called on a worker thread when a job finishes. `rc` is the
+ * uploader_upload_file_ex result; `dst_path` is where the file was placed,
+ * or NULL on failure. The job's status is updated after this returns.
+ */
+typedef void (*UploadDoneFn)(UploadJob *job, int rc, const char *dst_path, void *arg);
+
+/**
+ * Starts `workers` threads uploading through `u`, with room for
+ * `capacity` waiting jobs (<= 0 picks the defaults). `u` must outlive
+ * the queue. Returns NULL on failure.
+ */
+UploadQueue* upload_queue_new(Uploader *u, int workers, int capacity);
+
+/**
+ * Finishes all queued jobs, stops the workers and frees the queue.
+ * Safe to call with NULL.
+ */
+void upload_queue_free(UploadQueue *q);
+
+/**
+ * Queues an upload (see uploader_upload_file_ex for `flags`). The caller
+ * owns the returned handle and must pass it to upload_job_release.
+ * Returns NULL if the queue is full or on allocation failure.
+ */
+UploadJob* upload_queue_submit(UploadQueue *q,
+                               const char *src_path,
+                               int64_t timestamp,
+                               int flags,
+                               UploadDoneFn done,
+                               void *arg);
+
+/**
+ * Blocks until every queued and running job has finished.
+ */
+void upload_queue_wait(UploadQueue *q);
+
+/**
+ * Returns the job's current status.
+ */
+UploadStatus upload_job_status(const UploadJob *job);
+
+/**
+ * Returns the upload result once the job has finished, otherwise -1.
+ */
+int upload_job_result(const UploadJob *job);
+
+/**
+ * Returns where the file was placed once the job is UPLOAD_DONE,
+ * otherwise NULL. Valid until the handle is released.
+ */
+const char* upload_job_path(const UploadJob *job);
+
+/**
+ * Drops the caller's reference to a job. Safe to call with NULL.
+ */
+void upload_job_release(UploadJob *job);
+
 #ifdef __cplusplus
 }
 #endif
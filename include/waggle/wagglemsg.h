@@ -5,11 +5,66 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
+#include "buffer.h"
+
+/**
+ * Wire encodings of a WaggleMsg. Published messages carry the matching
+ * content type (WAGGLEMSG_CONTENT_TYPE_*) as their AMQP content_type.
+ *
+ * The MessagePack form is a map with the same four keys as the JSON form,
+ *   {"name": str, "val": value, "ts": uint, "meta": map}
+ * with integers in their shortest encoding and meta converted from JSON
+ * (see msgpack_from_json). A typical sensor sample is about 30% smaller
+ * than its JSON.
+ */
+typedef enum WaggleMsgFormat {
+    WAGGLEMSG_FORMAT_JSON = 0,
+    WAGGLEMSG_FORMAT_MSGPACK
+} WaggleMsgFormat;
+
+#define WAGGLEMSG_CONTENT_TYPE_JSON    "application/json"
+#define WAGGLEMSG_CONTENT_TYPE_MSGPACK "application/msgpack"
+
+/**
+ * Envelopes: one body carrying many messages of the same scope, in
+ * publish order. A JSON envelope is NDJSON, one message per line; a
+ * MessagePack envelope is the messages' maps back to back. Split them
+ * with wagglemsg_unpack.
+ */
+#define WAGGLEMSG_CONTENT_TYPE_NDJSON      "application/x-ndjson"
+#define WAGGLEMSG_CONTENT_TYPE_MSGPACK_SEQ "application/x-msgpack-seq"
+
+/**
+ * Which field of a WaggleMsg holds its value. How each type appears on
+ * the wire:
+ *
+ *   type    JSON "val"                    MessagePack "val"
+ *   INT     integer                       int
+ *   DOUBLE  number with '.' or exponent   float 64
+ *           (null for NaN and infinities)
+ *   STRING  string                        str
+ *   BYTES   {"base64":"..."}              bin
+ */
+typedef enum WaggleValueType {
+    WAGGLE_VALUE_INT = 0,  // value
+    WAGGLE_VALUE_DOUBLE,   // dvalue
+    WAGGLE_VALUE_STRING,   // data, NUL-terminated; data_len excludes the NUL
+    WAGGLE_VALUE_BYTES     // data[0..data_len)
+} WaggleValueType;
+
+/**
+ * Releases a buffer handed over to a message or to the plugin.
+ */
+typedef void (*WaggleFreeFn)(void *data, void *arg);
 
 /**
  * A lightweight structure to represent the Waggle message:
  *   name, value, timestamp, meta
+ *
+ * A zero-initialized message holds an int in `value`; set `type` and the
+ * matching field for other values.
  */
 typedef struct WaggleMsg {
     char   *name;
@@ -18,6 +73,13 @@ typedef struct WaggleMsg {
     // For the meta dictionary, we store as a single JSON-encoded string for simplicity.
     // Real code might store as a map or cJSON pointer, etc.
     char   *meta;
+
+    WaggleValueType type;
+    double   dvalue;
+    void    *data;
+    size_t   data_len;
+    WaggleFreeFn data_free;  // how wagglemsg_free releases data; NULL = free()
+    void    *data_free_arg;
 } WaggleMsg;
 
 /**
@@ -29,11 +91,53 @@ WaggleMsg* wagglemsg_new(const char *name,
                          uint64_t timestamp,
                          const char *meta_json);
 
+/**
+ * Like wagglemsg_new, for a double value.
+ */
+WaggleMsg* wagglemsg_new_double(const char *name,
+                                double value,
+                                uint64_t timestamp,
+                                const char *meta_json);
+
+/**
+ * Like wagglemsg_new, for a string value (copied).
+ */
+WaggleMsg* wagglemsg_new_string(const char *name,
+                                const char *value,
+                                uint64_t timestamp,
+                                const char *meta_json);
+
+/**
+ * Like wagglemsg_new, for a bytes value. With a `free_fn`, the message
+ * takes `data` over without copying and releases it with
+ * free_fn(data, arg) in wagglemsg_free; it does so right away if the
+ * message cannot be created. Without one, the bytes are copied.
+ */
+WaggleMsg* wagglemsg_new_bytes(const char *name,
+                               void *data,
+                               size_t len,
+                               uint64_t timestamp,
+                               const char *meta_json,
+                               WaggleFreeFn free_fn,
+                               void *arg);
+
 /**
  * Frees all memory for a WaggleMsg.
  */
 void wagglemsg_free(WaggleMsg *m);
 
+/**
+ * Upper bound on the bytes wagglemsg_write_value_json writes for `m`.
+ */
+size_t wagglemsg_value_json_bound(const WaggleMsg *m);
+
+/**
+ * Writes m's value as the JSON for "val" (see WaggleValueType). `dst`
+ * needs wagglemsg_value_json_bound() bytes. Not NUL-terminated.
+ * Returns the number of bytes written.
+ */
+size_t wagglemsg_write_value_json(char *dst, const WaggleMsg *m);
+
 /**
  * Serializes a WaggleMsg into JSON. Caller must free the returned string.
  * Returns NULL on failure.
@@ -41,19 +145,207 @@ void wagglemsg_free(WaggleMsg *m);
  * Example JSON:
  * {
  *   "name": "some.metric",
- *   "val":  "1234",
+ *   "val":  1234,
  *   "ts":   1234567890000000000,
  *   "meta": { "label1": "foo", ... }
  * }
  */
 char* wagglemsg_dump_json(const WaggleMsg *m);
 
+/**
+ * Serializes a WaggleMsg into `buf` with snprintf semantics: returns the
+ * length of the full JSON text (excluding the NUL). The text is written
+ * only if it fits, i.e. the return value is less than `bufsize`.
+ * Does not allocate.
+ */
+size_t wagglemsg_encode_json(const WaggleMsg *m, char *buf, size_t bufsize);
+
+/**
+ * Appends the JSON for a WaggleMsg to a reusable buffer. Once the buffer
+ * has grown to fit, repeated calls do not allocate.
+ * Returns 0 on success, nonzero on failure.
+ */
+int wagglemsg_encode_json_buf(const WaggleMsg *m, WaggleBuf *out);
+
+/**
+ * Pre-encoded JSON for a fixed (name, meta) pair, so repeated messages
+ * only format their value and timestamp. The prefix holds
+ * `{"name":"...","val":` and the suffix holds `,"meta":{...}}`.
+ */
+typedef struct WaggleMsgTemplate {
+    WaggleMsgFormat format;
+    char   *prefix;
+    size_t  prefix_len;
+    char   *suffix;
+    size_t  suffix_len;
+} WaggleMsgTemplate;
+
+/**
+ * Builds a template for `name` and `meta_json`. Unlike wagglemsg_new, the
+ * meta must be valid JSON; it is stored verbatim.
+ * Returns 0 on success, nonzero on failure (including invalid meta).
+ */
+int wagglemsg_template_init(WaggleMsgTemplate *t, const char *name, const char *meta_json);
+
+/**
+ * Like wagglemsg_template_init, producing `format` instead of JSON. For
+ * MessagePack the prefix and suffix hold the encoded map entries around
+ * the value and timestamp.
+ */
+int wagglemsg_template_init_format(WaggleMsgTemplate *t,
+                                   WaggleMsgFormat format,
+                                   const char *name,
+                                   const char *meta_json);
+
+/**
+ * Frees a template's buffers. Safe to call on a zeroed template.
+ */
+void wagglemsg_template_free(WaggleMsgTemplate *t);
+
+/**
+ * Upper bound on the bytes wagglemsg_template_write produces.
+ */
+size_t wagglemsg_template_bound(const WaggleMsgTemplate *t);
+
+/**
+ * Writes the encoding of one (value, timestamp) sample into `dst`, which
+ * must hold wagglemsg_template_bound() bytes. Not NUL-terminated.
+ * Returns the number of bytes written.
+ */
+size_t wagglemsg_template_write(const WaggleMsgTemplate *t, int64_t value, uint64_t timestamp, char *dst);
+
 /**
  * Deserializes JSON into a WaggleMsg structure.
  * Returns NULL on failure.
+ *
+ * The type of "val" follows WaggleValueType: integers that fit in int64
+ * are read exactly and other numbers as doubles (null as NaN). For values
+ * other than INT, `value` still holds the number truncated to an integer,
+ * or a string's integer contents, or 0. "ts" is an exact uint64 (a string
+ * holding one is accepted too); without it, the local file log's ISO 8601
+ * "timestamp" is read instead. "meta" is kept
+ * as written if it is an object or array, and is "{}" otherwise.
  */
 WaggleMsg* wagglemsg_load_json(const char *json_str);
 
+/**
+ * Like wagglemsg_load_json, for `len` bytes that need not be
+ * NUL-terminated (e.g. an AMQP message body).
+ */
+WaggleMsg* wagglemsg_load_json_len(const char *json, size_t len);
+
+/**
+ * Appends the MessagePack encoding of a WaggleMsg to `out`. Meta that is
+ * not valid JSON is encoded as an empty map.
+ * Returns 0 on success, nonzero on failure.
+ */
+int wagglemsg_encode_msgpack_buf(const WaggleMsg *m, WaggleBuf *out);
+
+/**
+ * Deserializes the MessagePack encoding of a WaggleMsg. "meta" is turned
+ * back into compact JSON. Returns NULL on failure.
+ */
+WaggleMsg* wagglemsg_load_msgpack(const void *data, size_t len);
+
+/**
+ * Deserializes `len` bytes in the given format. Returns NULL on failure.
+ */
+WaggleMsg* wagglemsg_load(const void *data, size_t len, WaggleMsgFormat format);
+
+/**
+ * Returns the content type for `format`.
+ */
+const char* wagglemsg_content_type(WaggleMsgFormat format);
+
+/**
+ * Returns the format named by a content type (`len` bytes, parameters
+ * such as "; charset=utf-8" ignored), or -1 if it is not one of ours.
+ */
+int wagglemsg_format_of_content_type(const char *content_type, size_t len);
+
+/**
+ * Guesses the format of an encoded message from its first byte: JSON
+ * starts with '{' (or whitespace), MessagePack with a map header.
+ */
+WaggleMsgFormat wagglemsg_detect_format(const void *data, size_t len);
+
+typedef struct WaggleMsgBlock WaggleMsgBlock;
+
+/**
+ * Messages decoded in bulk by wagglemsg_decode_ndjson and friends. The name, meta and
+ * value data live in blocks owned by the batch, so decoding does not
+ * allocate per message. The messages stay valid until the next
+ * wagglemsg_batch_reset or wagglemsg_batch_free and must not be passed
+ * to wagglemsg_free.
+ */
+typedef struct WaggleMsgBatch {
+    WaggleMsg      *msgs;     // decoded messages, in input order
+    size_t          count;
+    size_t          cap;
+    size_t          invalid;  // non-blank lines that did not decode
+    WaggleMsgBlock *blocks;   // string storage
+} WaggleMsgBatch;
+
+/**
+ * Initializes an empty batch. No memory is allocated until first use.
+ */
+void wagglemsg_batch_init(WaggleMsgBatch *b);
+
+/**
+ * Drops all messages, keeping the most recent string block and the
+ * message array for reuse.
+ */
+void wagglemsg_batch_reset(WaggleMsgBatch *b);
+
+/**
+ * Frees the batch's memory and leaves it empty.
+ */
+void wagglemsg_batch_free(WaggleMsgBatch *b);
+
+/**
+ * Decodes newline-delimited JSON messages (one per line, as in a
+ * data.ndjson segment) from `data[0..len)` and appends them to `b`.
+ * A final line without a newline is decoded as well, so a caller reading
+ * in chunks should pass only complete lines. A single message body is a
+ * one-line input. Lines that do not decode are skipped and counted in
+ * b->invalid.
+ *
+ * The input is parsed in one pass without building a tree, with the same
+ * rules as wagglemsg_load_json.
+ * Returns the number of messages appended, or -1 if out of memory.
+ */
+long wagglemsg_decode_ndjson(WaggleMsgBatch *b, const char *data, size_t len);
+
+/**
+ * Decodes MessagePack maps stored back to back (a MessagePack envelope)
+ * and appends them to `b`. Values that are not messages are skipped and
+ * counted in b->invalid; decoding stops at a truncated value.
+ * Returns the number of messages appended, or -1 if out of memory.
+ */
+long wagglemsg_decode_msgpack_seq(WaggleMsgBatch *b, const void *data, size_t len);
+
+/**
+ * Returns the envelope content type for messages in `format`.
+ */
+const char* wagglemsg_envelope_content_type(WaggleMsgFormat format);
+
+/**
+ * Returns the format of the messages in an envelope content type (`len`
+ * bytes, parameters ignored), or -1 if it is not an envelope.
+ */
+int wagglemsg_envelope_of_content_type(const char *content_type, size_t len);
+
+/**
+ * Splits a message body into `b`, whatever it carries: an envelope is
+ * unpacked into its messages, and anything else is decoded as a single
+ * message in the format its content type names (or, for an unknown or
+ * missing content type, the format detected from the body). A body that
+ * does not decode is counted in b->invalid.
+ * Returns the number of messages appended, or -1 if out of memory.
+ */
+long wagglemsg_unpack(WaggleMsgBatch *b, const void *data, size_t len,
+                      const char *content_type, size_t content_type_len);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,40 @@
+#include "waggle/buffer.h"
+#include <stdlib.h>
+#include <string.h>
+
+void wagglebuf_init(WaggleBuf *b) {
+    b->data = NULL;
+    b->len = 0;
+    b->cap = 0;
+}
+
+void wagglebuf_free(WaggleBuf *b) {
+    free(b->data);
+    wagglebuf_init(b);
+}
+
+void wagglebuf_reset(WaggleBuf *b) {
+    b->len = 0;
+    if (b->data) b->data[0] = '\0';
+}
+
+int wagglebuf_reserve(WaggleBuf *b, size_t extra) {
+    size_t need = b->len + extra + 1;
+    if (need <= b->cap) return 0;
+
+    size_t cap = b->cap ? b->cap : 256;
+    while (cap < need) cap *= 2;
+    char *nd = realloc(b->data, cap);
+    if (!nd) return -1;
+    b->data = nd;
+    b->cap = cap;
+    return 0;
+}
+
+int wagglebuf_append(WaggleBuf *b, const void *data, size_t len) {
+    if (wagglebuf_reserve(b, len) != 0) return -1;
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    b->data[b->len] = '\0';
+    return 0;
+}
@@ -0,0 +1,304 @@
+/**
+ * compress.c
+ *
+ * Purpose:
+ *   One-shot compression of message bodies with reusable codec state:
+ *   deflate (zlib) and zstd, each compiled in only when its library was
+ *   found at build time.
+ */
+
+#include "waggle/compress.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#ifdef WAGGLE_HAVE_ZLIB
+  #include <zlib.h>
+#endif
+#ifdef WAGGLE_HAVE_ZSTD
+  #include <zstd.h>
+  #ifndef ZSTD_CLEVEL_DEFAULT
+    #define ZSTD_CLEVEL_DEFAULT 3
+  #endif
+#endif
+
+#ifdef DEBUG
+  #define DBGPRINT(...) do { fprintf(stderr, "[DEBUG compress] "); fprintf(stderr, __VA_ARGS__); } while(0)
+#else
+  #define DBGPRINT(...) do {} while(0)
+#endif
+
+// output grows at least this much per step while decompressing
+#define DECOMPRESS_CHUNK 4096
+
+struct WaggleCodecCtx {
+#ifdef WAGGLE_HAVE_ZLIB
+    z_stream   deflate;
+    int        deflate_ready;
+    int        deflate_level;  // the level `deflate` was set up with
+    z_stream   inflate;
+    int        inflate_ready;
+#endif
+#ifdef WAGGLE_HAVE_ZSTD
+    ZSTD_CCtx *zstd_c;
+    ZSTD_DCtx *zstd_d;
+#endif
+    int        unused;         // keeps the struct non-empty without codecs
+};
+
+int waggle_codec_available(WaggleCodec codec) {
+    switch (codec) {
+    case WAGGLE_CODEC_NONE:
+        return 1;
+#ifdef WAGGLE_HAVE_ZLIB
+    case WAGGLE_CODEC_DEFLATE:
+        return 1;
+#endif
+#ifdef WAGGLE_HAVE_ZSTD
+    case WAGGLE_CODEC_ZSTD:
+        return 1;
+#endif
+    default:
+        return 0;
+    }
+}
+
+const char* waggle_codec_encoding(WaggleCodec codec) {
+    switch (codec) {
+    case WAGGLE_CODEC_DEFLATE: return WAGGLE_ENCODING_DEFLATE;
+    case WAGGLE_CODEC_ZSTD:    return WAGGLE_ENCODING_ZSTD;
+    default:                   return NULL;
+    }
+}
+
+static int encoding_is(const char *encoding, size_t len, const char *name) {
+    return len == strlen(name) && strncasecmp(encoding, name, len) == 0;
+}
+
+int waggle_codec_of_encoding(const char *encoding, size_t len) {
+    if (!encoding || len == 0 || encoding_is(encoding, len, "identity")) {
+        return WAGGLE_CODEC_NONE;
+    }
+    if (encoding_is(encoding, len, WAGGLE_ENCODING_DEFLATE) || encoding_is(encoding, len, "gzip")) {
+        return WAGGLE_CODEC_DEFLATE;
+    }
+    if (encoding_is(encoding, len, WAGGLE_ENCODING_ZSTD)) {
+        return WAGGLE_CODEC_ZSTD;
+    }
+    return -1;
+}
+
+WaggleCodecCtx* waggle_codec_ctx_new(void) {
+    WaggleCodecCtx *ctx = calloc(1, sizeof(WaggleCodecCtx));
+    if (!ctx) {
+        DBGPRINT("waggle_codec_ctx_new: out of memory\n");
+    }
+    return ctx;
+}
+
+void waggle_codec_ctx_free(WaggleCodecCtx *ctx) {
+    if (!ctx) return;
+#ifdef WAGGLE_HAVE_ZLIB
+    if (ctx->deflate_ready) deflateEnd(&ctx->deflate);
+    if (ctx->inflate_ready) inflateEnd(&ctx->inflate);
+#endif
+#ifdef WAGGLE_HAVE_ZSTD
+    ZSTD_freeCCtx(ctx->zstd_c);
+    ZSTD_freeDCtx(ctx->zstd_d);
+#endif
+    free(ctx);
+}
+
+// Restores `out` to `len` bytes after a failed call.
+static int fail(WaggleBuf *out, size_t len) {
+    out->len = len;
+    if (out->data) out->data[len] = '\0';
+    return -1;
+}
+
+#if defined(WAGGLE_HAVE_ZLIB) || defined(WAGGLE_HAVE_ZSTD)
+// Room for `want` more bytes, at most up to `max_len` in total (0 = no
+// limit) beyond `base`. Returns the room made, 0 if the limit is reached
+// or memory ran out.
+static size_t grow_output(WaggleBuf *out, size_t base, size_t want, size_t max_len) {
+    if (max_len) {
+        size_t produced = out->len - base;
+        if (produced >= max_len) return 0;
+        if (want > max_len - produced) want = max_len - produced;
+    }
+    if (wagglebuf_reserve(out, want) != 0) return 0;
+    size_t room = out->cap - out->len - 1; // reserve keeps a byte for the NUL
+    if (max_len && room > max_len - (out->len - base)) room = max_len - (out->len - base);
+    return room;
+}
+#endif
+
+// -----------------------------------------------------------------------------
+// deflate
+// -----------------------------------------------------------------------------
+#ifdef WAGGLE_HAVE_ZLIB
+static int deflate_body(WaggleCodecCtx *ctx, int level, const void *src, size_t len, WaggleBuf *out) {
+    if (len > UINT_MAX) return -1;
+    if (level == 0) level = Z_DEFAULT_COMPRESSION;
+    z_stream *zs = &ctx->deflate;
+    if (ctx->deflate_ready && ctx->deflate_level != level) {
+        deflateEnd(zs);
+        ctx->deflate_ready = 0;
+    }
+    if (!ctx->deflate_ready) {
+        memset(zs, 0, sizeof(*zs));
+        if (deflateInit(zs, level) != Z_OK) return -1;
+        ctx->deflate_ready = 1;
+        ctx->deflate_level = level;
+    } else if (deflateReset(zs) != Z_OK) {
+        return -1;
+    }
+
+    uLong bound = deflateBound(zs, (uLong)len);
+    if (bound > UINT_MAX || wagglebuf_reserve(out, bound) != 0) return -1;
+    zs->next_in = (Bytef*)src;
+    zs->avail_in = (uInt)len;
+    zs->next_out = (Bytef*)(out->data + out->len);
+    zs->avail_out = (uInt)bound;
+    if (deflate(zs, Z_FINISH) != Z_STREAM_END) return -1;
+    out->len += bound - zs->avail_out;
+    out->data[out->len] = '\0';
+    return 0;
+}
+
+static int inflate_body(WaggleCodecCtx *ctx, const void *src, size_t len, size_t max_len, WaggleBuf *out) {
+    if (len > UINT_MAX) return -1;
+    z_stream *zs = &ctx->inflate;
+    if (!ctx->inflate_ready) {
+        memset(zs, 0, sizeof(*zs));
+        // 15 + 32: a zlib or gzip header, detected automatically
+        if (inflateInit2(zs, 15 + 32) != Z_OK) return -1;
+        ctx->inflate_ready = 1;
+    } else if (inflateReset(zs) != Z_OK) {
+        return -1;
+    }
+
+    size_t base = out->len;
+    zs->next_in = (Bytef*)src;
+    zs->avail_in = (uInt)len;
+    size_t want = len * 4 > DECOMPRESS_CHUNK ? len * 4 : DECOMPRESS_CHUNK;
+    while (1) {
+        size_t room = grow_output(out, base, want, max_len);
+        if (room == 0) return -1;
+        if (room > UINT_MAX) room = UINT_MAX;
+        zs->next_out = (Bytef*)(out->data + out->len);
+        zs->avail_out = (uInt)room;
+        int rc = inflate(zs, Z_NO_FLUSH);
+        out->len += room - zs->avail_out;
+        if (rc == Z_STREAM_END) break;
+        if (rc != Z_OK && rc != Z_BUF_ERROR) return -1;
+        if (zs->avail_out != 0) return -1; // input ran out: truncated
+        want = out->len - base; // double what we have so far
+    }
+    out->data[out->len] = '\0';
+    return 0;
+}
+#endif
+
+// -----------------------------------------------------------------------------
+// zstd
+// -----------------------------------------------------------------------------
+#ifdef WAGGLE_HAVE_ZSTD
+static int zstd_compress_body(WaggleCodecCtx *ctx, int level, const void *src, size_t len, WaggleBuf *out) {
+    if (!ctx->zstd_c && !(ctx->zstd_c = ZSTD_createCCtx())) return -1;
+    size_t bound = ZSTD_compressBound(len);
+    if (wagglebuf_reserve(out, bound) != 0) return -1;
+    size_t n = ZSTD_compressCCtx(ctx->zstd_c, out->data + out->len, bound, src, len,
+                                 level ? level : ZSTD_CLEVEL_DEFAULT);
+    if (ZSTD_isError(n)) {
+        DBGPRINT("zstd: %s\n", ZSTD_getErrorName(n));
+        return -1;
+    }
+    out->len += n;
+    out->data[out->len] = '\0';
+    return 0;
+}
+
+// Streams the input, so frames without a stored content size (from other
+// producers) decode too.
+static int zstd_decompress_body(WaggleCodecCtx *ctx, const void *src, size_t len, size_t max_len, WaggleBuf *out) {
+    if (!ctx->zstd_d && !(ctx->zstd_d = ZSTD_createDCtx())) return -1;
+    ZSTD_DCtx_reset(ctx->zstd_d, ZSTD_reset_session_only);
+
+    size_t base = out->len;
+    ZSTD_inBuffer in = { src, len, 0 };
+    size_t want = len * 4 > DECOMPRESS_CHUNK ? len * 4 : DECOMPRESS_CHUNK;
+    while (1) {
+        size_t room = grow_output(out, base, want, max_len);
+        if (room == 0) return -1;
+        ZSTD_outBuffer o = { out->data + out->len, room, 0 };
+        size_t rc = ZSTD_decompressStream(ctx->zstd_d, &o, &in);
+        out->len += o.pos;
+        if (ZSTD_isError(rc)) {
+            DBGPRINT("zstd: %s\n", ZSTD_getErrorName(rc));
+            return -1;
+        }
+        if (rc == 0 && in.pos == in.size) break; // last frame complete
+        if (in.pos == in.size && o.pos < o.size) return -1; // truncated
+        want = out->len - base;
+    }
+    out->data[out->len] = '\0';
+    return 0;
+}
+#endif
+
+// -----------------------------------------------------------------------------
+// Dispatch
+// -----------------------------------------------------------------------------
+int waggle_compress(WaggleCodecCtx *ctx, WaggleCodec codec, int level,
+                    const void *src, size_t len, WaggleBuf *out) {
+    if (!ctx || !out || (!src && len)) return -1;
+    size_t before = out->len;
+    int rc = -1;
+    switch (codec) {
+#ifdef WAGGLE_HAVE_ZLIB
+    case WAGGLE_CODEC_DEFLATE:
+        rc = deflate_body(ctx, level, src, len, out);
+        break;
+#endif
+#ifdef WAGGLE_HAVE_ZSTD
+    case WAGGLE_CODEC_ZSTD:
+        rc = zstd_compress_body(ctx, level, src, len, out);
+        break;
+#endif
+    default:
+        (void)level;
+        break;
+    }
+    return rc == 0 ? 0 : fail(out, before);
+}
+
+int waggle_decompress(WaggleCodecCtx *ctx, WaggleCodec codec,
+                      const void *src, size_t len, size_t max_len, WaggleBuf *out) {
+    if (!ctx || !out || (!src && len)) return -1;
+    size_t before = out->len;
+    int rc = -1;
+    switch (codec) {
+    case WAGGLE_CODEC_NONE:
+        rc = (max_len && len > max_len) ? -1 : wagglebuf_append(out, len ? src : "", len);
+        break;
+#ifdef WAGGLE_HAVE_ZLIB
+    case WAGGLE_CODEC_DEFLATE:
+        rc = inflate_body(ctx, src, len, max_len, out);
+        break;
+#endif
+#ifdef WAGGLE_HAVE_ZSTD
+    case WAGGLE_CODEC_ZSTD:
+        rc = zstd_decompress_body(ctx, src, len, max_len, out);
+        break;
+#endif
+    default:
+        (void)max_len;
+        break;
+    }
+    return rc == 0 ? 0 : fail(out, before);
+}
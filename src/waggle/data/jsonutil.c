@@ -0,0 +1,552 @@
+#include "waggle/jsonutil.h"
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+  #define JSON_SIMD_SSE2 1
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+  #include <arm_neon.h>
+  #define JSON_SIMD_NEON 1
+#endif
+
+#define JSON_MAX_DEPTH 1000 // same nesting limit as cJSON
+
+// -----------------------------------------------------------------------------
+// Integers
+// -----------------------------------------------------------------------------
+static const char DIGITS2[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static int count_digits(uint64_t v) {
+    int n = 1;
+    for (;;) {
+        if (v < 10) return n;
+        if (v < 100) return n + 1;
+        if (v < 1000) return n + 2;
+        if (v < 10000) return n + 3;
+        v /= 10000;
+        n += 4;
+    }
+}
+
+size_t json_format_u64(char *buf, uint64_t v) {
+    int n = count_digits(v);
+    char *p = buf + n;
+    while (v >= 100) {
+        unsigned i = (unsigned)(v % 100) * 2;
+        v /= 100;
+        *--p = DIGITS2[i + 1];
+        *--p = DIGITS2[i];
+    }
+    if (v >= 10) {
+        unsigned i = (unsigned)v * 2;
+        *--p = DIGITS2[i + 1];
+        *--p = DIGITS2[i];
+    } else {
+        *--p = (char)('0' + v);
+    }
+    return (size_t)n;
+}
+
+size_t json_format_i64(char *buf, int64_t v) {
+    if (v < 0) {
+        buf[0] = '-';
+        return 1 + json_format_u64(buf + 1, (uint64_t)0 - (uint64_t)v);
+    }
+    return json_format_u64(buf, (uint64_t)v);
+}
+
+// -----------------------------------------------------------------------------
+// String escaping
+// -----------------------------------------------------------------------------
+static inline int needs_escape(unsigned char c) {
+    return c < 0x20 || c == '"' || c == '\\';
+}
+
+size_t json_scan_escape(const char *s, size_t len) {
+    size_t i = 0;
+#if defined(JSON_SIMD_SSE2)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    const __m128i ctrl = _mm_set1_epi8(0x1F);
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash));
+        // v <= 0x1F (unsigned) <=> min(v, 0x1F) == v
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(v, ctrl), v));
+        int mask = _mm_movemask_epi8(m);
+        if (mask) {
+            return i + (size_t)__builtin_ctz((unsigned)mask);
+        }
+    }
+#elif defined(JSON_SIMD_NEON)
+    const uint8x16_t quote = vdupq_n_u8('"');
+    const uint8x16_t bslash = vdupq_n_u8('\\');
+    const uint8x16_t ctrl = vdupq_n_u8(0x20);
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t*)(s + i));
+        uint8x16_t m = vorrq_u8(vceqq_u8(v, quote), vceqq_u8(v, bslash));
+        m = vorrq_u8(m, vcltq_u8(v, ctrl));
+        // narrow each byte lane to a nibble so the mask fits in 64 bits
+        uint8x8_t nib = vshrn_n_u16(vreinterpretq_u16_u8(m), 4);
+        uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(nib), 0);
+        if (bits) {
+            return i + (size_t)(__builtin_ctzll(bits) >> 2);
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        if (needs_escape((unsigned char)s[i])) return i;
+    }
+    return len;
+}
+
+size_t json_escaped_len(const char *s, size_t len) {
+    size_t out = 0;
+    size_t i = 0;
+    while (i < len) {
+        size_t run = json_scan_escape(s + i, len - i);
+        out += run;
+        i += run;
+        if (i >= len) break;
+
+        unsigned char c = (unsigned char)s[i++];
+        switch (c) {
+        case '"': case '\\': case '\b': case '\f':
+        case '\n': case '\r': case '\t':
+            out += 2;
+            break;
+        default:
+            out += 6;
+            break;
+        }
+    }
+    return out;
+}
+
+size_t json_escape(char *dst, const char *s, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    char *out = dst;
+    size_t i = 0;
+    while (i < len) {
+        size_t run = json_scan_escape(s + i, len - i);
+        memcpy(out, s + i, run);
+        out += run;
+        i += run;
+        if (i >= len) break;
+
+        unsigned char c = (unsigned char)s[i++];
+        *out++ = '\\';
+        switch (c) {
+        case '"':  *out++ = '"';  break;
+        case '\\': *out++ = '\\'; break;
+        case '\b': *out++ = 'b';  break;
+        case '\f': *out++ = 'f';  break;
+        case '\n': *out++ = 'n';  break;
+        case '\r': *out++ = 'r';  break;
+        case '\t': *out++ = 't';  break;
+        default:
+            *out++ = 'u';
+            *out++ = '0';
+            *out++ = '0';
+            *out++ = hex[c >> 4];
+            *out++ = hex[c & 0xF];
+            break;
+        }
+    }
+    return (size_t)(out - dst);
+}
+
+// -----------------------------------------------------------------------------
+// Validation
+// -----------------------------------------------------------------------------
+typedef struct {
+    const char *s;
+    size_t      len;
+    size_t      pos;
+} JsonCursor;
+
+static void skip_ws(JsonCursor *c) {
+    while (c->pos < c->len) {
+        char ch = c->s[c->pos];
+        if (ch != ' ' && ch != '\t' && ch != '\n' && ch != '\r') break;
+        c->pos++;
+    }
+}
+
+static int is_hex(char ch) {
+    return (ch >= '0' && ch <= '9') || (ch >= 'a' && ch <= 'f') || (ch >= 'A' && ch <= 'F');
+}
+
+static int is_digit(char ch) {
+    return ch >= '0' && ch <= '9';
+}
+
+static int validate_string(JsonCursor *c) {
+    c->pos++; // opening quote
+    while (c->pos < c->len) {
+        c->pos += json_scan_escape(c->s + c->pos, c->len - c->pos);
+        if (c->pos >= c->len) return -1;
+
+        unsigned char ch = (unsigned char)c->s[c->pos];
+        if (ch == '"') {
+            c->pos++;
+            return 0;
+        }
+        if (ch < 0x20) return -1;
+
+        // backslash escape
+        if (++c->pos >= c->len) return -1;
+        switch (c->s[c->pos]) {
+        case '"': case '\\': case '/': case 'b':
+        case 'f': case 'n':  case 'r': case 't':
+            c->pos++;
+            break;
+        case 'u':
+            if (c->pos + 4 >= c->len) return -1;
+            for (int k = 1; k <= 4; k++) {
+                if (!is_hex(c->s[c->pos + k])) return -1;
+            }
+            c->pos += 5;
+            break;
+        default:
+            return -1;
+        }
+    }
+    return -1;
+}
+
+static int validate_number(JsonCursor *c) {
+    if (c->pos < c->len && c->s[c->pos] == '-') c->pos++;
+    if (c->pos >= c->len) return -1;
+    if (c->s[c->pos] == '0') {
+        c->pos++;
+    } else if (is_digit(c->s[c->pos])) {
+        while (c->pos < c->len && is_digit(c->s[c->pos])) c->pos++;
+    } else {
+        return -1;
+    }
+    if (c->pos < c->len && c->s[c->pos] == '.') {
+        c->pos++;
+        if (c->pos >= c->len || !is_digit(c->s[c->pos])) return -1;
+        while (c->pos < c->len && is_digit(c->s[c->pos])) c->pos++;
+    }
+    if (c->pos < c->len && (c->s[c->pos] == 'e' || c->s[c->pos] == 'E')) {
+        c->pos++;
+        if (c->pos < c->len && (c->s[c->pos] == '+' || c->s[c->pos] == '-')) c->pos++;
+        if (c->pos >= c->len || !is_digit(c->s[c->pos])) return -1;
+        while (c->pos < c->len && is_digit(c->s[c->pos])) c->pos++;
+    }
+    return 0;
+}
+
+static int validate_literal(JsonCursor *c, const char *lit, size_t n) {
+    if (c->len - c->pos < n || memcmp(c->s + c->pos, lit, n) != 0) return -1;
+    c->pos += n;
+    return 0;
+}
+
+static int validate_value(JsonCursor *c, int depth);
+
+static int validate_container(JsonCursor *c, int depth, char close, int is_object) {
+    if (depth >= JSON_MAX_DEPTH) return -1;
+    c->pos++; // opening bracket
+    skip_ws(c);
+    if (c->pos < c->len && c->s[c->pos] == close) {
+        c->pos++;
+        return 0;
+    }
+    for (;;) {
+        if (is_object) {
+            if (c->pos >= c->len || c->s[c->pos] != '"' || validate_string(c) != 0) return -1;
+            skip_ws(c);
+            if (c->pos >= c->len || c->s[c->pos] != ':') return -1;
+            c->pos++;
+            skip_ws(c);
+        }
+        if (validate_value(c, depth + 1) != 0) return -1;
+        skip_ws(c);
+        if (c->pos >= c->len) return -1;
+        if (c->s[c->pos] == ',') {
+            c->pos++;
+            skip_ws(c);
+            continue;
+        }
+        if (c->s[c->pos] == close) {
+            c->pos++;
+            return 0;
+        }
+        return -1;
+    }
+}
+
+static int validate_value(JsonCursor *c, int depth) {
+    if (c->pos >= c->len) return -1;
+    switch (c->s[c->pos]) {
+    case '{': return validate_container(c, depth, '}', 1);
+    case '[': return validate_container(c, depth, ']', 0);
+    case '"': return validate_string(c);
+    case 't': return validate_literal(c, "true", 4);
+    case 'f': return validate_literal(c, "false", 5);
+    case 'n': return validate_literal(c, "null", 4);
+    default:  return validate_number(c);
+    }
+}
+
+int json_validate(const char *s, size_t len, size_t *start, size_t *end) {
+    if (!s) return -1;
+    JsonCursor c = { s, len, 0 };
+    skip_ws(&c);
+    size_t value_start = c.pos;
+    if (validate_value(&c, 0) != 0) return -1;
+    size_t value_end = c.pos;
+    skip_ws(&c);
+    if (c.pos != len) return -1;
+
+    if (start) *start = value_start;
+    if (end) *end = value_end;
+    return 0;
+}
+
+size_t json_skip_value(const char *s, size_t len) {
+    if (!s) return 0;
+    JsonCursor c = { s, len, 0 };
+    if (validate_value(&c, 0) != 0) return 0;
+    return c.pos;
+}
+
+// -----------------------------------------------------------------------------
+// Parsing
+// -----------------------------------------------------------------------------
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+// Converts 8 ASCII digits with three multiplies instead of eight. Returns
+// nonzero if all 8 bytes were digits.
+static inline int parse_8digits(const char *p, uint64_t *out) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    // each byte is 0x30..0x39 iff its high nibble is 3 both before and
+    // after adding 6
+    uint64_t hi = (v & 0xF0F0F0F0F0F0F0F0ULL) |
+                  (((v + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4);
+    if (hi != 0x3333333333333333ULL) return 0;
+    v -= 0x3030303030303030ULL;
+    v = (v * 10) + (v >> 8);
+    v = (((v & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+         (((v >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+    *out = v;
+    return 1;
+}
+#endif
+
+size_t json_parse_u64(const char *s, size_t len, uint64_t *out) {
+    uint64_t v = 0;
+    size_t i = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // 19 digits always fit, so whole chunks need no overflow check
+    uint64_t chunk;
+    while (i + 8 <= len && i + 8 <= 19 && parse_8digits(s + i, &chunk)) {
+        v = v * 100000000ULL + chunk;
+        i += 8;
+    }
+#endif
+    for (; i < len && is_digit(s[i]); i++) {
+        if (__builtin_mul_overflow(v, 10, &v) ||
+            __builtin_add_overflow(v, (uint64_t)(s[i] - '0'), &v)) {
+            return 0;
+        }
+    }
+    if (i == 0) return 0;
+    *out = v;
+    return i;
+}
+
+static int hex_value(char ch) {
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    return -1;
+}
+
+static long parse_hex4(const char *s) {
+    long v = 0;
+    for (int k = 0; k < 4; k++) {
+        int h = hex_value(s[k]);
+        if (h < 0) return -1;
+        v = (v << 4) | h;
+    }
+    return v;
+}
+
+static size_t utf8_encode(char *dst, unsigned long cp) {
+    if (cp < 0x80) {
+        dst[0] = (char)cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        dst[0] = (char)(0xC0 | (cp >> 6));
+        dst[1] = (char)(0x80 | (cp & 0x3F));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        dst[0] = (char)(0xE0 | (cp >> 12));
+        dst[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        dst[2] = (char)(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    dst[0] = (char)(0xF0 | (cp >> 18));
+    dst[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+    dst[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    dst[3] = (char)(0x80 | (cp & 0x3F));
+    return 4;
+}
+
+size_t json_unescape(char *dst, const char *s, size_t len) {
+    char *out = dst;
+    size_t i = 0;
+    while (i < len) {
+        size_t run = json_scan_escape(s + i, len - i);
+        memmove(out, s + i, run);
+        out += run;
+        i += run;
+        if (i >= len) break;
+
+        if (s[i] != '\\' || i + 1 >= len) return JSON_UNESCAPE_ERROR;
+        char e = s[i + 1];
+        i += 2;
+        switch (e) {
+        case '"':  *out++ = '"';  break;
+        case '\\': *out++ = '\\'; break;
+        case '/':  *out++ = '/';  break;
+        case 'b':  *out++ = '\b'; break;
+        case 'f':  *out++ = '\f'; break;
+        case 'n':  *out++ = '\n'; break;
+        case 'r':  *out++ = '\r'; break;
+        case 't':  *out++ = '\t'; break;
+        case 'u': {
+            if (len - i < 4) return JSON_UNESCAPE_ERROR;
+            long cp = parse_hex4(s + i);
+            i += 4;
+            if (cp < 0 || (cp >= 0xDC00 && cp <= 0xDFFF)) return JSON_UNESCAPE_ERROR;
+            if (cp >= 0xD800 && cp <= 0xDBFF) {
+                // high surrogate: must be followed by \uDC00..\uDFFF
+                if (len - i < 6 || s[i] != '\\' || s[i + 1] != 'u') return JSON_UNESCAPE_ERROR;
+                long lo = parse_hex4(s + i + 2);
+                if (lo < 0xDC00 || lo > 0xDFFF) return JSON_UNESCAPE_ERROR;
+                i += 6;
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+            }
+            out += utf8_encode(out, (unsigned long)cp);
+            break;
+        }
+        default:
+            return JSON_UNESCAPE_ERROR;
+        }
+    }
+    return (size_t)(out - dst);
+}
+
+// -----------------------------------------------------------------------------
+// Doubles
+// -----------------------------------------------------------------------------
+size_t json_format_double(char *buf, double v) {
+    if (!isfinite(v)) {
+        memcpy(buf, "null", 4);
+        return 4;
+    }
+
+    // whole numbers are common readings and need no search
+    if (v == floor(v) && fabs(v) < 1e15 && !(v == 0 && signbit(v))) {
+        size_t n = json_format_i64(buf, (int64_t)v);
+        memcpy(buf + n, ".0", 2);
+        return n + 2;
+    }
+
+    // a normal double rounded to 15 significant digits gives its shortest
+    // form whenever that is 15 digits or fewer (%g drops trailing zeros),
+    // so only 16 and 17 are left to try. Subnormals carry fewer digits and
+    // need the full search.
+    char tmp[JSON_DOUBLE_MAX_CHARS];
+    int n = 0;
+    for (int prec = fabs(v) < DBL_MIN ? 1 : 15; prec <= 17; prec++) {
+        n = snprintf(tmp, sizeof(tmp), "%.*g", prec, v);
+        if (prec == 17 || strtod(tmp, NULL) == v) break;
+    }
+    memcpy(buf, tmp, (size_t)n);
+    if (!memchr(tmp, '.', (size_t)n) && !memchr(tmp, 'e', (size_t)n)) {
+        memcpy(buf + n, ".0", 2);
+        n += 2;
+    }
+    return (size_t)n;
+}
+
+// -----------------------------------------------------------------------------
+// Base64
+// -----------------------------------------------------------------------------
+static const char B64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+size_t json_base64_encode(char *dst, const void *src, size_t len) {
+    const unsigned char *in = (const unsigned char*)src;
+    char *out = dst;
+    size_t i = 0;
+    for (; i + 3 <= len; i += 3) {
+        uint32_t v = ((uint32_t)in[i] << 16) | ((uint32_t)in[i + 1] << 8) | in[i + 2];
+        *out++ = B64[v >> 18];
+        *out++ = B64[(v >> 12) & 0x3F];
+        *out++ = B64[(v >> 6) & 0x3F];
+        *out++ = B64[v & 0x3F];
+    }
+    if (i < len) {
+        uint32_t v = (uint32_t)in[i] << 16;
+        if (i + 1 < len) v |= (uint32_t)in[i + 1] << 8;
+        *out++ = B64[v >> 18];
+        *out++ = B64[(v >> 12) & 0x3F];
+        *out++ = i + 1 < len ? B64[(v >> 6) & 0x3F] : '=';
+        *out++ = '=';
+    }
+    return (size_t)(out - dst);
+}
+
+static int b64_value(char ch) {
+    if (ch >= 'A' && ch <= 'Z') return ch - 'A';
+    if (ch >= 'a' && ch <= 'z') return ch - 'a' + 26;
+    if (ch >= '0' && ch <= '9') return ch - '0' + 52;
+    if (ch == '+') return 62;
+    if (ch == '/') return 63;
+    return -1;
+}
+
+size_t json_base64_decode(void *dst, const char *src, size_t len) {
+    if (len % 4 != 0) return JSON_UNESCAPE_ERROR;
+    unsigned char *out = (unsigned char*)dst;
+    for (size_t i = 0; i < len; i += 4) {
+        int last = i + 4 == len;
+        int pad = 0;
+        if (last && src[i + 3] == '=') pad = src[i + 2] == '=' ? 2 : 1;
+
+        uint32_t v = 0;
+        for (int k = 0; k < 4 - pad; k++) {
+            int d = b64_value(src[i + k]);
+            if (d < 0) return JSON_UNESCAPE_ERROR;
+            v = (v << 6) | (uint32_t)d;
+        }
+        v <<= 6 * pad;
+        *out++ = (unsigned char)(v >> 16);
+        if (pad < 2) *out++ = (unsigned char)(v >> 8);
+        if (pad < 1) *out++ = (unsigned char)v;
+    }
+    return (size_t)(out - (unsigned char*)dst);
+}
@@ -0,0 +1,618 @@
+#include "waggle/msgpack.h"
+#include "waggle/jsonutil.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MSGPACK_MAX_DEPTH 1000 // same nesting limit as the JSON validator
+
+// -----------------------------------------------------------------------------
+// Writers
+// -----------------------------------------------------------------------------
+static inline void put_be16(char *dst, uint16_t v) {
+    dst[0] = (char)(v >> 8);
+    dst[1] = (char)v;
+}
+
+static inline void put_be32(char *dst, uint32_t v) {
+    dst[0] = (char)(v >> 24);
+    dst[1] = (char)(v >> 16);
+    dst[2] = (char)(v >> 8);
+    dst[3] = (char)v;
+}
+
+static inline void put_be64(char *dst, uint64_t v) {
+    put_be32(dst, (uint32_t)(v >> 32));
+    put_be32(dst + 4, (uint32_t)v);
+}
+
+// fixmap/fixarray take up to 15 entries in the tag byte
+static size_t write_container_header(char *dst, uint32_t n, unsigned char fix, unsigned char tag16) {
+    if (n < 16) {
+        dst[0] = (char)(fix | n);
+        return 1;
+    }
+    if (n <= 0xFFFF) {
+        dst[0] = (char)tag16;
+        put_be16(dst + 1, (uint16_t)n);
+        return 3;
+    }
+    dst[0] = (char)(tag16 + 1);
+    put_be32(dst + 1, n);
+    return 5;
+}
+
+size_t msgpack_write_map_header(char *dst, uint32_t n) {
+    return write_container_header(dst, n, 0x80, 0xde);
+}
+
+static size_t write_array_header(char *dst, uint32_t n) {
+    return write_container_header(dst, n, 0x90, 0xdc);
+}
+
+size_t msgpack_write_str_header(char *dst, uint32_t len) {
+    if (len < 32) {
+        dst[0] = (char)(0xa0 | len);
+        return 1;
+    }
+    if (len <= 0xFF) {
+        dst[0] = (char)0xd9;
+        dst[1] = (char)len;
+        return 2;
+    }
+    if (len <= 0xFFFF) {
+        dst[0] = (char)0xda;
+        put_be16(dst + 1, (uint16_t)len);
+        return 3;
+    }
+    dst[0] = (char)0xdb;
+    put_be32(dst + 1, len);
+    return 5;
+}
+
+size_t msgpack_write_str(char *dst, const char *s, uint32_t len) {
+    size_t h = msgpack_write_str_header(dst, len);
+    memcpy(dst + h, s, len);
+    return h + len;
+}
+
+size_t msgpack_write_u64(char *dst, uint64_t v) {
+    if (v < 0x80) {
+        dst[0] = (char)v;
+        return 1;
+    }
+    if (v <= 0xFF) {
+        dst[0] = (char)0xcc;
+        dst[1] = (char)v;
+        return 2;
+    }
+    if (v <= 0xFFFF) {
+        dst[0] = (char)0xcd;
+        put_be16(dst + 1, (uint16_t)v);
+        return 3;
+    }
+    if (v <= 0xFFFFFFFFULL) {
+        dst[0] = (char)0xce;
+        put_be32(dst + 1, (uint32_t)v);
+        return 5;
+    }
+    dst[0] = (char)0xcf;
+    put_be64(dst + 1, v);
+    return 9;
+}
+
+size_t msgpack_write_i64(char *dst, int64_t v) {
+    if (v >= 0) {
+        return msgpack_write_u64(dst, (uint64_t)v);
+    }
+    if (v >= -32) {
+        dst[0] = (char)(int8_t)v; // negative fixint
+        return 1;
+    }
+    if (v >= INT8_MIN) {
+        dst[0] = (char)0xd0;
+        dst[1] = (char)(int8_t)v;
+        return 2;
+    }
+    if (v >= INT16_MIN) {
+        dst[0] = (char)0xd1;
+        put_be16(dst + 1, (uint16_t)(int16_t)v);
+        return 3;
+    }
+    if (v >= INT32_MIN) {
+        dst[0] = (char)0xd2;
+        put_be32(dst + 1, (uint32_t)(int32_t)v);
+        return 5;
+    }
+    dst[0] = (char)0xd3;
+    put_be64(dst + 1, (uint64_t)v);
+    return 9;
+}
+
+size_t msgpack_write_bin_header(char *dst, uint32_t len) {
+    if (len <= 0xFF) {
+        dst[0] = (char)0xc4;
+        dst[1] = (char)len;
+        return 2;
+    }
+    if (len <= 0xFFFF) {
+        dst[0] = (char)0xc5;
+        put_be16(dst + 1, (uint16_t)len);
+        return 3;
+    }
+    dst[0] = (char)0xc6;
+    put_be32(dst + 1, len);
+    return 5;
+}
+
+size_t msgpack_write_f64(char *dst, double d) {
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    dst[0] = (char)0xcb;
+    put_be64(dst + 1, bits);
+    return 9;
+}
+
+// -----------------------------------------------------------------------------
+// Readers
+// -----------------------------------------------------------------------------
+static inline uint64_t get_be(const char *s, int n) {
+    uint64_t v = 0;
+    for (int i = 0; i < n; i++) {
+        v = (v << 8) | (unsigned char)s[i];
+    }
+    return v;
+}
+
+// Reads an integer of any width. `*neg` is set for negative values, whose
+// two's complement is returned in `*bits`.
+static int read_int(const char *s, size_t len, size_t *pos, int *neg, uint64_t *bits) {
+    if (*pos >= len) return -1;
+    unsigned char tag = (unsigned char)s[*pos];
+    size_t n;
+    *neg = 0;
+    if (tag < 0x80) {
+        *bits = tag;
+        n = 0;
+    } else if (tag >= 0xe0) {
+        *bits = (uint64_t)(int64_t)(int8_t)tag;
+        *neg = 1;
+        n = 0;
+    } else if (tag >= 0xcc && tag <= 0xcf) {
+        n = (size_t)1 << (tag - 0xcc);
+        if (len - *pos - 1 < n) return -1;
+        *bits = get_be(s + *pos + 1, (int)n);
+    } else if (tag >= 0xd0 && tag <= 0xd3) {
+        n = (size_t)1 << (tag - 0xd0);
+        if (len - *pos - 1 < n) return -1;
+        uint64_t v = get_be(s + *pos + 1, (int)n);
+        int shift = 64 - 8 * (int)n;
+        // sign-extend from n bytes
+        int64_t sv = shift ? (int64_t)(v << shift) >> shift : (int64_t)v;
+        *bits = (uint64_t)sv;
+        *neg = sv < 0;
+    } else {
+        return -1;
+    }
+    *pos += 1 + n;
+    return 0;
+}
+
+int msgpack_read_i64(const char *s, size_t len, size_t *pos, int64_t *out) {
+    size_t p = *pos;
+    int neg;
+    uint64_t bits;
+    if (read_int(s, len, &p, &neg, &bits) != 0) return -1;
+    if (!neg && bits > (uint64_t)INT64_MAX) return -1;
+    *out = (int64_t)bits;
+    *pos = p;
+    return 0;
+}
+
+int msgpack_read_u64(const char *s, size_t len, size_t *pos, uint64_t *out) {
+    size_t p = *pos;
+    int neg;
+    uint64_t bits;
+    if (read_int(s, len, &p, &neg, &bits) != 0 || neg) return -1;
+    *out = bits;
+    *pos = p;
+    return 0;
+}
+
+int msgpack_read_map_header(const char *s, size_t len, size_t *pos, uint32_t *n) {
+    if (*pos >= len) return -1;
+    unsigned char tag = (unsigned char)s[*pos];
+    if ((tag & 0xf0) == 0x80) {
+        *n = tag & 0x0f;
+        *pos += 1;
+        return 0;
+    }
+    size_t w = tag == 0xde ? 2 : tag == 0xdf ? 4 : 0;
+    if (w == 0 || len - *pos - 1 < w) return -1;
+    *n = (uint32_t)get_be(s + *pos + 1, (int)w);
+    *pos += 1 + w;
+    return 0;
+}
+
+// Reads a str (tag8 0xd9) or bin (tag8 0xc4) header and the bytes after it.
+static int read_sized(const char *s, size_t len, size_t *pos, unsigned char tag8,
+                      const char **str, uint32_t *n) {
+    if (*pos >= len) return -1;
+    unsigned char tag = (unsigned char)s[*pos];
+    size_t w;
+    uint64_t slen;
+    if (tag8 == 0xd9 && (tag & 0xe0) == 0xa0) {
+        w = 0;
+        slen = tag & 0x1f;
+    } else if (tag >= tag8 && tag <= tag8 + 2) {
+        w = (size_t)1 << (tag - tag8);
+        if (len - *pos - 1 < w) return -1;
+        slen = get_be(s + *pos + 1, (int)w);
+    } else {
+        return -1;
+    }
+    size_t start = *pos + 1 + w;
+    if (len - start < slen) return -1;
+    *str = s + start;
+    *n = (uint32_t)slen;
+    *pos = start + slen;
+    return 0;
+}
+
+int msgpack_read_str(const char *s, size_t len, size_t *pos, const char **str, uint32_t *n) {
+    return read_sized(s, len, pos, 0xd9, str, n);
+}
+
+int msgpack_read_bin(const char *s, size_t len, size_t *pos, const char **data, uint32_t *n) {
+    return read_sized(s, len, pos, 0xc4, data, n);
+}
+
+int msgpack_read_f64(const char *s, size_t len, size_t *pos, double *out) {
+    if (*pos >= len) return -1;
+    unsigned char tag = (unsigned char)s[*pos];
+    size_t n = tag == 0xcb ? 8 : tag == 0xca ? 4 : 0;
+    if (n == 0 || len - *pos - 1 < n) return -1;
+    uint64_t bits = get_be(s + *pos + 1, (int)n);
+    if (n == 8) {
+        memcpy(out, &bits, sizeof(*out));
+    } else {
+        uint32_t b32 = (uint32_t)bits;
+        float f;
+        memcpy(&f, &b32, sizeof(f));
+        *out = f;
+    }
+    *pos += 1 + n;
+    return 0;
+}
+
+size_t msgpack_skip(const char *s, size_t len) {
+    size_t pos = 0;
+    uint64_t remaining = 1;
+    while (remaining > 0) {
+        remaining--;
+        if (pos >= len) return 0;
+        unsigned char tag = (unsigned char)s[pos];
+        size_t avail = len - pos - 1;
+        uint64_t payload = 0;   // bytes after the header
+        size_t hdr = 1;
+        uint64_t children = 0;
+
+        if (tag < 0x80 || tag >= 0xe0 || tag == 0xc0 || tag == 0xc2 || tag == 0xc3) {
+            // fixint, nil, bool
+        } else if (tag < 0x90) {
+            children = 2 * (uint64_t)(tag & 0x0f);
+        } else if (tag < 0xa0) {
+            children = tag & 0x0f;
+        } else if (tag < 0xc0) {
+            payload = tag & 0x1f;
+        } else if (tag == 0xca) {
+            payload = 4;
+        } else if (tag == 0xcb) {
+            payload = 8;
+        } else if (tag >= 0xcc && tag <= 0xcf) {
+            payload = (uint64_t)1 << (tag - 0xcc);
+        } else if (tag >= 0xd0 && tag <= 0xd3) {
+            payload = (uint64_t)1 << (tag - 0xd0);
+        } else if (tag >= 0xd4 && tag <= 0xd8) {
+            payload = 1 + ((uint64_t)1 << (tag - 0xd4)); // fixext: type + data
+        } else {
+            size_t w;
+            switch (tag) {
+            case 0xc4: case 0xd9: w = 1; break; // bin8, str8
+            case 0xc5: case 0xda: w = 2; break;
+            case 0xc6: case 0xdb: w = 4; break;
+            case 0xc7: w = 1; break;            // ext8
+            case 0xc8: w = 2; break;
+            case 0xc9: w = 4; break;
+            case 0xdc: case 0xde: w = 2; break; // array16, map16
+            case 0xdd: case 0xdf: w = 4; break;
+            default: return 0;                  // 0xc1 is never used
+            }
+            if (avail < w) return 0;
+            uint64_t n = get_be(s + pos + 1, (int)w);
+            hdr += w;
+            if (tag >= 0xc7 && tag <= 0xc9) {
+                payload = n + 1;                // ext type byte
+            } else if (tag == 0xdc || tag == 0xdd) {
+                children = n;
+            } else if (tag == 0xde || tag == 0xdf) {
+                children = 2 * n;
+            } else {
+                payload = n;
+            }
+        }
+
+        if (len - pos < hdr || len - pos - hdr < payload) return 0;
+        pos += hdr + (size_t)payload;
+        // every child takes at least one byte
+        if (children > len - pos) return 0;
+        remaining += children;
+    }
+    return pos;
+}
+
+// -----------------------------------------------------------------------------
+// JSON -> MessagePack
+// -----------------------------------------------------------------------------
+typedef struct {
+    const char *s;
+    size_t      len;
+    size_t      pos;
+} JsonIn;
+
+static void skip_ws(JsonIn *in) {
+    while (in->pos < in->len) {
+        char ch = in->s[in->pos];
+        if (ch != ' ' && ch != '\t' && ch != '\n' && ch != '\r') break;
+        in->pos++;
+    }
+}
+
+static int from_json_string(JsonIn *in, WaggleBuf *out) {
+    size_t n = json_skip_value(in->s + in->pos, in->len - in->pos);
+    if (n < 2) return -1;
+    size_t raw = n - 2;
+    if (wagglebuf_reserve(out, MSGPACK_HEADER_MAX_BYTES + raw) != 0) return -1;
+
+    // unescape after the largest header, then move it next to the real one
+    char *dst = out->data + out->len;
+    size_t m = json_unescape(dst + MSGPACK_HEADER_MAX_BYTES, in->s + in->pos + 1, raw);
+    if (m == JSON_UNESCAPE_ERROR || m > UINT32_MAX) return -1;
+    size_t h = msgpack_write_str_header(dst, (uint32_t)m);
+    memmove(dst + h, dst + MSGPACK_HEADER_MAX_BYTES, m);
+    out->len += h + m;
+    in->pos += n;
+    return 0;
+}
+
+static int from_json_number(JsonIn *in, WaggleBuf *out) {
+    const char *tok = in->s + in->pos;
+    size_t n = json_skip_value(tok, in->len - in->pos);
+    if (n == 0 || wagglebuf_reserve(out, 9) != 0) return -1;
+    in->pos += n;
+
+    int neg = tok[0] == '-';
+    uint64_t mag;
+    if (json_parse_u64(tok + neg, n - neg, &mag) == n - neg &&
+        (!neg || mag <= (uint64_t)INT64_MAX + 1)) {
+        char *dst = out->data + out->len;
+        out->len += neg ? msgpack_write_i64(dst, (int64_t)((uint64_t)0 - mag))
+                        : msgpack_write_u64(dst, mag);
+        return 0;
+    }
+
+    // fraction, exponent or too large for an int
+    char buf[512];
+    if (n >= sizeof(buf)) return -1;
+    memcpy(buf, tok, n);
+    buf[n] = '\0';
+    out->len += msgpack_write_f64(out->data + out->len, strtod(buf, NULL));
+    return 0;
+}
+
+static int from_json_value(JsonIn *in, WaggleBuf *out, int depth);
+
+static int from_json_container(JsonIn *in, WaggleBuf *out, int depth, int is_object) {
+    if (depth >= MSGPACK_MAX_DEPTH) return -1;
+    char close = is_object ? '}' : ']';
+
+    // the entry count is only known at the end, so leave room for the
+    // largest header and close the gap afterwards
+    if (wagglebuf_reserve(out, MSGPACK_HEADER_MAX_BYTES) != 0) return -1;
+    size_t hdr = out->len;
+    out->len += MSGPACK_HEADER_MAX_BYTES;
+
+    uint64_t n = 0;
+    in->pos++;
+    skip_ws(in);
+    if (in->pos < in->len && in->s[in->pos] == close) {
+        in->pos++;
+    } else {
+        for (;;) {
+            if (is_object) {
+                if (in->pos >= in->len || in->s[in->pos] != '"' || from_json_string(in, out) != 0) return -1;
+                skip_ws(in);
+                if (in->pos >= in->len || in->s[in->pos] != ':') return -1;
+                in->pos++;
+                skip_ws(in);
+            }
+            if (from_json_value(in, out, depth + 1) != 0) return -1;
+            n++;
+            skip_ws(in);
+            if (in->pos >= in->len) return -1;
+            if (in->s[in->pos] == ',') {
+                in->pos++;
+                skip_ws(in);
+                continue;
+            }
+            if (in->s[in->pos] != close) return -1;
+            in->pos++;
+            break;
+        }
+    }
+    if (n > UINT32_MAX) return -1;
+
+    char head[MSGPACK_HEADER_MAX_BYTES];
+    size_t h = is_object ? msgpack_write_map_header(head, (uint32_t)n)
+                         : write_array_header(head, (uint32_t)n);
+    size_t body = out->len - hdr - MSGPACK_HEADER_MAX_BYTES;
+    memmove(out->data + hdr + h, out->data + hdr + MSGPACK_HEADER_MAX_BYTES, body);
+    memcpy(out->data + hdr, head, h);
+    out->len = hdr + h + body;
+    out->data[out->len] = '\0';
+    return 0;
+}
+
+static int from_json_literal(JsonIn *in, WaggleBuf *out, const char *lit, size_t n, char tag) {
+    if (in->len - in->pos < n || memcmp(in->s + in->pos, lit, n) != 0) return -1;
+    in->pos += n;
+    return wagglebuf_append(out, &tag, 1);
+}
+
+static int from_json_value(JsonIn *in, WaggleBuf *out, int depth) {
+    if (in->pos >= in->len) return -1;
+    switch (in->s[in->pos]) {
+    case '{': return from_json_container(in, out, depth, 1);
+    case '[': return from_json_container(in, out, depth, 0);
+    case '"': return from_json_string(in, out);
+    case 't': return from_json_literal(in, out, "true", 4, (char)0xc3);
+    case 'f': return from_json_literal(in, out, "false", 5, (char)0xc2);
+    case 'n': return from_json_literal(in, out, "null", 4, (char)0xc0);
+    default:  return from_json_number(in, out);
+    }
+}
+
+int msgpack_from_json(const char *json, size_t len, WaggleBuf *out) {
+    if (!json || !out) return -1;
+    size_t start = out->len;
+    JsonIn in = { json, len, 0 };
+    skip_ws(&in);
+    if (from_json_value(&in, out, 0) != 0 || (skip_ws(&in), in.pos != len)) {
+        out->len = start;
+        if (out->data) out->data[start] = '\0';
+        return -1;
+    }
+    out->data[out->len] = '\0';
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// MessagePack -> JSON
+// -----------------------------------------------------------------------------
+static int append_json_string(WaggleBuf *out, const char *s, size_t n) {
+    if (wagglebuf_reserve(out, JSON_ESCAPED_MAX(n) + 2) != 0) return -1;
+    char *dst = out->data + out->len;
+    *dst++ = '"';
+    dst += json_escape(dst, s, n);
+    *dst++ = '"';
+    out->len = (size_t)(dst - out->data);
+    return 0;
+}
+
+// Shortest of %.15g / %.17g that reads back as the same value, like cJSON.
+static int append_json_double(WaggleBuf *out, double d, int is_float) {
+    char buf[JSON_DOUBLE_MAX_CHARS];
+    size_t n;
+    if (is_float && isfinite(d)) {
+        n = (size_t)snprintf(buf, sizeof(buf), "%.9g", d);
+    } else {
+        n = json_format_double(buf, d);
+    }
+    return wagglebuf_append(out, buf, n);
+}
+
+static int to_json_value(const char *s, size_t len, size_t *pos, WaggleBuf *out, int depth) {
+    if (depth >= MSGPACK_MAX_DEPTH || *pos >= len) return -1;
+    unsigned char tag = (unsigned char)s[*pos];
+
+    if (tag < 0x80 || tag >= 0xe0 || (tag >= 0xcc && tag <= 0xd3)) {
+        int neg;
+        uint64_t bits;
+        if (read_int(s, len, pos, &neg, &bits) != 0) return -1;
+        char buf[JSON_INT_MAX_CHARS + 1];
+        size_t n = neg ? json_format_i64(buf, (int64_t)bits) : json_format_u64(buf, bits);
+        return wagglebuf_append(out, buf, n);
+    }
+    if ((tag & 0xe0) == 0xa0 || (tag >= 0xd9 && tag <= 0xdb)) {
+        const char *str;
+        uint32_t n;
+        if (msgpack_read_str(s, len, pos, &str, &n) != 0) return -1;
+        return append_json_string(out, str, n);
+    }
+
+    int is_map = (tag & 0xf0) == 0x80 || tag == 0xde || tag == 0xdf;
+    int is_array = (tag & 0xf0) == 0x90 || tag == 0xdc || tag == 0xdd;
+    if (is_map || is_array) {
+        uint64_t n;
+        if ((tag & 0xe0) == 0x80) {
+            n = tag & 0x0f;
+            *pos += 1;
+        } else {
+            size_t w = (tag == 0xdc || tag == 0xde) ? 2 : 4;
+            if (len - *pos - 1 < w) return -1;
+            n = get_be(s + *pos + 1, (int)w);
+            *pos += 1 + w;
+        }
+        if (wagglebuf_append(out, is_map ? "{" : "[", 1) != 0) return -1;
+        for (uint64_t i = 0; i < n; i++) {
+            if (i > 0 && wagglebuf_append(out, ",", 1) != 0) return -1;
+            if (is_map) {
+                const char *key;
+                uint32_t klen;
+                if (msgpack_read_str(s, len, pos, &key, &klen) != 0 ||
+                    append_json_string(out, key, klen) != 0 ||
+                    wagglebuf_append(out, ":", 1) != 0) {
+                    return -1;
+                }
+            }
+            if (to_json_value(s, len, pos, out, depth + 1) != 0) return -1;
+        }
+        return wagglebuf_append(out, is_map ? "}" : "]", 1);
+    }
+
+    switch (tag) {
+    case 0xc0:
+        *pos += 1;
+        return wagglebuf_append(out, "null", 4);
+    case 0xc2:
+        *pos += 1;
+        return wagglebuf_append(out, "false", 5);
+    case 0xc3:
+        *pos += 1;
+        return wagglebuf_append(out, "true", 4);
+    case 0xca: {
+        if (len - *pos - 1 < 4) return -1;
+        uint32_t bits = (uint32_t)get_be(s + *pos + 1, 4);
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        *pos += 5;
+        return append_json_double(out, f, 1);
+    }
+    case 0xcb: {
+        if (len - *pos - 1 < 8) return -1;
+        uint64_t bits = get_be(s + *pos + 1, 8);
+        double d;
+        memcpy(&d, &bits, sizeof(d));
+        *pos += 9;
+        return append_json_double(out, d, 0);
+    }
+    default:
+        return -1; // bin, ext, 0xc1
+    }
+}
+
+int msgpack_to_json(const char *s, size_t len, size_t *used, WaggleBuf *out) {
+    if (!s || !out) return -1;
+    size_t start = out->len;
+    size_t pos = 0;
+    if (to_json_value(s, len, &pos, out, 0) != 0 || wagglebuf_reserve(out, 0) != 0) {
+        out->len = start;
+        if (out->data) out->data[start] = '\0';
+        return -1;
+    }
+    out->data[out->len] = '\0';
+    if (used) *used = pos;
+    return 0;
+}
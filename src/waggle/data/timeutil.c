@@ -1,6 +1,30 @@
+/**
+ * timeutil.c
+ *
+ * Purpose:
+ *   Wall-clock and monotonic time. The wall clock is CLOCK_REALTIME,
+ *   CLOCK_REALTIME_COARSE, or the CPU's counter turned into nanoseconds
+ *   with a multiply and shift, calibrated against CLOCK_REALTIME by
+ *   whichever reader finds the calibration due.
+ */
+
 #include "waggle/timeutil.h"
-#include <time.h>
+
+#include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <time.h>
+
+#if defined(__x86_64__)
+  #include <cpuid.h>
+  #include <x86intrin.h>
+  #define HAVE_COUNTER 1
+#elif defined(__aarch64__)
+  #define HAVE_COUNTER 1
+#else
+  #define HAVE_COUNTER 0
+#endif
 
 #ifdef DEBUG
   #define DBGPRINT(...) do { fprintf(stderr, "[DEBUG timeutil] "); fprintf(stderr, __VA_ARGS__); } while(0)
@@ -8,13 +32,461 @@
   #define DBGPRINT(...) do {} while(0)
 #endif
 
+#define NS_PER_SEC          1000000000ULL
+#define CALIB_SHIFT         32                 // ns = ticks * mult >> CALIB_SHIFT
+#define CALIB_INTERVAL_NS   NS_PER_SEC         // recalibrate this often
+#define CALIB_WARMUP_NS     10000000ULL        // first calibration's span
+#define CALIB_TRIES         5                  // readings per calibration point
+#define CALIB_STEP_NS       1000000            // drift beyond this is a clock jump
+
+static _Atomic int current_clock = WAGGLE_CLOCK_REALTIME;
+
+static _Atomic uint64_t stat_counter_hz;
+static _Atomic uint64_t stat_calibrations;
+static _Atomic uint64_t stat_steps;
+static _Atomic int64_t  stat_last_drift;
+static _Atomic int64_t  stat_max_drift;
+static _Atomic uint64_t stat_batch_adjusted;
+
+static _Atomic uint64_t last_batch_ns;       // last timestamp a batch got
+
+static inline uint64_t posix_ns(clockid_t id) {
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+#ifdef CLOCK_REALTIME_COARSE
+  #define COARSE_CLOCK_ID CLOCK_REALTIME_COARSE
+#else
+  #define COARSE_CLOCK_ID CLOCK_REALTIME
+#endif
+
+// -----------------------------------------------------------------------------
+// CPU counter
+// -----------------------------------------------------------------------------
+#if HAVE_COUNTER
+// Counter calibration, read under a sequence lock: `calib_seq` is odd while it
+// is being written.
+static _Atomic uint32_t calib_seq;
+static _Atomic uint64_t calib_base_tsc;
+static _Atomic uint64_t calib_base_ns;
+static _Atomic uint64_t calib_mult;
+static _Atomic uint64_t calib_due_tsc;        // next calibration from here
+static _Atomic int      calibrating;          // held by the one calibrating
+
+// The last calibration's reading of both clocks; written only while
+// holding `calibrating`.
+static uint64_t anchor_tsc;
+static uint64_t anchor_ns;
+
+typedef struct {
+    uint64_t base_tsc;
+    uint64_t base_ns;
+    uint64_t mult;
+    uint64_t due_tsc;
+} Calibration;
+
+static inline uint64_t read_counter(void) {
+#if defined(__x86_64__)
+    return __rdtsc();
+#else
+    uint64_t v;
+    __asm__ __volatile__("isb\n\tmrs %0, cntvct_el0" : "=r"(v) :: "memory");
+    return v;
+#endif
+}
+
+static int counter_available(void) {
+#if defined(__x86_64__)
+    // CPUID 0x80000007 EDX bit 8: the TSC ticks at a constant rate in
+    // every P- and C-state, so it can stand in for a clock
+    unsigned a, b, c, d;
+    return __get_cpuid(0x80000007, &a, &b, &c, &d) && (d & (1u << 8));
+#else
+    return 1; // the generic timer is always there for user space on arm64
+#endif
+}
+
+static inline uint64_t counter_to_ns(const Calibration *c, uint64_t tsc) {
+    // another core's counter may read a few ticks behind the base
+    uint64_t delta = tsc > c->base_tsc ? tsc - c->base_tsc : 0;
+    return c->base_ns + (uint64_t)(((unsigned __int128)delta * c->mult) >> CALIB_SHIFT);
+}
+
+static inline void calibration_load(Calibration *c) {
+    while (1) {
+        uint32_t seq = atomic_load_explicit(&calib_seq, memory_order_acquire);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        c->base_tsc = atomic_load_explicit(&calib_base_tsc, memory_order_relaxed);
+        c->base_ns  = atomic_load_explicit(&calib_base_ns, memory_order_relaxed);
+        c->mult     = atomic_load_explicit(&calib_mult, memory_order_relaxed);
+        c->due_tsc  = atomic_load_explicit(&calib_due_tsc, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&calib_seq, memory_order_relaxed) == seq) return;
+    }
+}
+
+static void calibration_store(const Calibration *c) {
+    uint32_t seq = atomic_load_explicit(&calib_seq, memory_order_relaxed);
+    atomic_store_explicit(&calib_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&calib_base_tsc, c->base_tsc, memory_order_relaxed);
+    atomic_store_explicit(&calib_base_ns, c->base_ns, memory_order_relaxed);
+    atomic_store_explicit(&calib_mult, c->mult, memory_order_relaxed);
+    atomic_store_explicit(&calib_due_tsc, c->due_tsc, memory_order_relaxed);
+    atomic_store_explicit(&calib_seq, seq + 2, memory_order_release);
+}
+
+static void calibration_lock(void) {
+    int expected = 0;
+    while (!atomic_compare_exchange_weak_explicit(&calibrating, &expected, 1,
+                                                  memory_order_acquire, memory_order_relaxed)) {
+        expected = 0;
+        sched_yield();
+    }
+}
+
+static void calibration_unlock(void) {
+    atomic_store_explicit(&calibrating, 0, memory_order_release);
+}
+
+// Reads both clocks as close together as we can: the counter on either
+// side of CLOCK_REALTIME, keeping the tightest of a few tries.
+static void read_pair(uint64_t *tsc, uint64_t *ns) {
+    uint64_t best = UINT64_MAX;
+    for (int i = 0; i < CALIB_TRIES; i++) {
+        uint64_t t0 = read_counter();
+        uint64_t n = posix_ns(CLOCK_REALTIME);
+        uint64_t t1 = read_counter();
+        if (t1 - t0 < best) {
+            best = t1 - t0;
+            *tsc = t0 + (t1 - t0) / 2;
+            *ns = n;
+        }
+    }
+}
+
+// ns per tick << CALIB_SHIFT, from two readings
+static uint64_t mult_of(uint64_t ticks, uint64_t ns) {
+    return (uint64_t)(((unsigned __int128)ns << CALIB_SHIFT) / ticks);
+}
+
+static uint64_t ticks_of(uint64_t ns, uint64_t mult) {
+    return (uint64_t)(((unsigned __int128)ns << CALIB_SHIFT) / mult);
+}
+
+// Measures the counter rate over CALIB_WARMUP_NS and starts afresh from
+// there. Returns 0 on success, -1 if the counter did not advance.
+static int calibrate_start(void) {
+    uint64_t tsc0, ns0, tsc1, ns1;
+    calibration_lock();
+    read_pair(&tsc0, &ns0);
+    struct timespec ts = { 0, CALIB_WARMUP_NS };
+    nanosleep(&ts, NULL);
+    read_pair(&tsc1, &ns1);
+    if (tsc1 <= tsc0 || ns1 <= ns0) {
+        calibration_unlock();
+        DBGPRINT("calibrate_start: counter did not advance.\n");
+        return -1;
+    }
+
+    Calibration c;
+    c.mult = mult_of(tsc1 - tsc0, ns1 - ns0);
+    c.base_tsc = tsc1;
+    c.base_ns = ns1;
+    c.due_tsc = tsc1 + ticks_of(CALIB_INTERVAL_NS, c.mult);
+    calibration_store(&c);
+    anchor_tsc = tsc1;
+    anchor_ns = ns1;
+
+    atomic_store(&stat_counter_hz, ticks_of(NS_PER_SEC, c.mult));
+    atomic_store(&stat_calibrations, 1);
+    atomic_store(&stat_steps, 0);
+    atomic_store(&stat_last_drift, 0);
+    atomic_store(&stat_max_drift, 0);
+    calibration_unlock();
+    DBGPRINT("calibrate_start: counter at %llu Hz.\n",
+             (unsigned long long)atomic_load(&stat_counter_hz));
+    return 0;
+}
+
+// Compares the running conversion with CLOCK_REALTIME and re-aims it. A
+// small drift is slewed out over the next interval, starting from where
+// the old conversion is now, so readings never step back; a large one
+// means the wall clock itself was set, and the conversion jumps to it.
+static void calibrate(void) {
+    int expected = 0;
+    if (!atomic_compare_exchange_strong_explicit(&calibrating, &expected, 1,
+                                                 memory_order_acquire, memory_order_relaxed)) {
+        return; // someone else is on it; keep using the old conversion
+    }
+    Calibration c;
+    calibration_load(&c);
+    if (read_counter() < c.due_tsc) {
+        calibration_unlock();
+        return;
+    }
+
+    uint64_t tsc, ns;
+    read_pair(&tsc, &ns);
+    uint64_t predicted = counter_to_ns(&c, tsc);
+    int64_t drift = (int64_t)(ns - predicted);
+
+    // the rate since the last calibration, free of the previous slew
+    uint64_t rate = c.mult;
+    if (tsc > anchor_tsc && ns > anchor_ns) {
+        rate = mult_of(tsc - anchor_tsc, ns - anchor_ns);
+    }
+
+    if (drift > CALIB_STEP_NS || drift < -CALIB_STEP_NS) {
+        // that rate spans the jump too, so keep the old one
+        c.base_ns = ns;
+        atomic_fetch_add_explicit(&stat_steps, 1, memory_order_relaxed);
+    } else {
+        uint64_t interval = ticks_of(CALIB_INTERVAL_NS, rate);
+        __int128 slewed = (__int128)rate + ((__int128)drift << CALIB_SHIFT) / (__int128)interval;
+        c.mult = slewed > 0 ? (uint64_t)slewed : rate;
+        c.base_ns = predicted;
+        int64_t max = atomic_load_explicit(&stat_max_drift, memory_order_relaxed);
+        if ((drift < 0 ? -drift : drift) > (max < 0 ? -max : max)) {
+            atomic_store_explicit(&stat_max_drift, drift, memory_order_relaxed);
+        }
+        atomic_store_explicit(&stat_counter_hz, ticks_of(NS_PER_SEC, rate), memory_order_relaxed);
+    }
+    c.base_tsc = tsc;
+    c.due_tsc = tsc + ticks_of(CALIB_INTERVAL_NS, c.mult);
+    calibration_store(&c);
+    anchor_tsc = tsc;
+    anchor_ns = ns;
+
+    atomic_store_explicit(&stat_last_drift, drift, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stat_calibrations, 1, memory_order_relaxed);
+    calibration_unlock();
+}
+
+static inline uint64_t counter_ns(void) {
+    uint64_t tsc = read_counter();
+    Calibration c;
+    calibration_load(&c);
+    if (tsc >= c.due_tsc) {
+        calibrate();
+    }
+    return counter_to_ns(&c, tsc);
+}
+#else
+static int counter_available(void) { return 0; }
+static int calibrate_start(void) { return -1; }
+static inline uint64_t counter_ns(void) { return posix_ns(CLOCK_REALTIME); }
+#endif
+
+// -----------------------------------------------------------------------------
+// Public API
+// -----------------------------------------------------------------------------
 uint64_t waggle_get_timestamp_ns(void) {
-    DBGPRINT("waggle_get_timestamp_ns() called.\n");
+    switch (atomic_load_explicit(&current_clock, memory_order_relaxed)) {
+    case WAGGLE_CLOCK_REALTIME_COARSE:
+        return posix_ns(COARSE_CLOCK_ID);
+    case WAGGLE_CLOCK_TSC:
+        return counter_ns();
+    default:
+        return posix_ns(CLOCK_REALTIME);
+    }
+}
+
+void waggle_get_timestamps_ns(uint64_t *out, size_t n) {
+    if (!out || n == 0) return;
+    uint64_t now = waggle_get_timestamp_ns();
+    uint64_t last = atomic_load_explicit(&last_batch_ns, memory_order_relaxed);
+    uint64_t start;
+    do {
+        start = now > last ? now : last + 1;
+    } while (!atomic_compare_exchange_weak_explicit(&last_batch_ns, &last, start + n - 1,
+                                                    memory_order_relaxed, memory_order_relaxed));
+    if (start != now) {
+        atomic_fetch_add_explicit(&stat_batch_adjusted, 1, memory_order_relaxed);
+    }
+    for (size_t i = 0; i < n; i++) {
+        out[i] = start + i;
+    }
+}
+
+int waggle_clock_available(WaggleClock clock) {
+    switch (clock) {
+    case WAGGLE_CLOCK_REALTIME:
+        return 1;
+    case WAGGLE_CLOCK_REALTIME_COARSE:
+#ifdef CLOCK_REALTIME_COARSE
+        return 1;
+#else
+        return 0;
+#endif
+    case WAGGLE_CLOCK_TSC:
+        return counter_available();
+    default:
+        return 0;
+    }
+}
+
+int waggle_clock_select(WaggleClock clock) {
+    if (!waggle_clock_available(clock)) {
+        DBGPRINT("waggle_clock_select: clock %d not available.\n", (int)clock);
+        return -1;
+    }
+    if (clock == WAGGLE_CLOCK_TSC && calibrate_start() != 0) {
+        return -1;
+    }
+    if (clock != WAGGLE_CLOCK_TSC) {
+        atomic_store(&stat_counter_hz, 0);
+        atomic_store(&stat_calibrations, 0);
+        atomic_store(&stat_steps, 0);
+        atomic_store(&stat_last_drift, 0);
+        atomic_store(&stat_max_drift, 0);
+    }
+    atomic_store(&current_clock, (int)clock);
+    return 0;
+}
+
+WaggleClock waggle_clock_current(void) {
+    return (WaggleClock)atomic_load(&current_clock);
+}
+
+void waggle_clock_get_stats(WaggleClockStats *out) {
+    if (!out) return;
+    out->clock          = waggle_clock_current();
+    out->counter_hz     = atomic_load(&stat_counter_hz);
+    out->calibrations   = atomic_load(&stat_calibrations);
+    out->steps          = atomic_load(&stat_steps);
+    out->last_drift_ns  = atomic_load(&stat_last_drift);
+    out->max_drift_ns   = atomic_load(&stat_max_drift);
+    out->batch_adjusted = atomic_load(&stat_batch_adjusted);
+
+    if (out->clock == WAGGLE_CLOCK_TSC) {
+        uint64_t hz = out->counter_hz;
+        out->resolution_ns = hz ? (NS_PER_SEC + hz - 1) / hz : 1;
+    } else {
+        struct timespec res;
+        clockid_t id = out->clock == WAGGLE_CLOCK_REALTIME_COARSE ? COARSE_CLOCK_ID : CLOCK_REALTIME;
+        clock_getres(id, &res);
+        out->resolution_ns = (uint64_t)res.tv_sec * NS_PER_SEC + res.tv_nsec;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// ISO 8601
+// -----------------------------------------------------------------------------
+// Reads exactly `n` digits at s[*i].
+static int read_digits(const char *s, size_t len, size_t *i, int n, int *out) {
+    if (len - *i < (size_t)n) return -1;
+    int v = 0;
+    for (int k = 0; k < n; k++) {
+        char c = s[*i + k];
+        if (c < '0' || c > '9') return -1;
+        v = v * 10 + (c - '0');
+    }
+    *i += n;
+    *out = v;
+    return 0;
+}
+
+static int expect(const char *s, size_t len, size_t *i, char c) {
+    if (*i >= len || s[*i] != c) return -1;
+    (*i)++;
+    return 0;
+}
+
+// Days from 1970-01-01 to a date in the proleptic Gregorian calendar.
+static int64_t days_from_civil(int y, int m, int d) {
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+int waggle_parse_iso8601_ns(const char *s, size_t len, uint64_t *out) {
+    if (!s || !out) return -1;
+    size_t i = 0;
+    int year, mon, day, hour, min, sec;
+    if (read_digits(s, len, &i, 4, &year) || expect(s, len, &i, '-') ||
+        read_digits(s, len, &i, 2, &mon) || expect(s, len, &i, '-') ||
+        read_digits(s, len, &i, 2, &day)) {
+        return -1;
+    }
+    if (i >= len || (s[i] != 'T' && s[i] != 't' && s[i] != ' ')) return -1;
+    i++;
+    if (read_digits(s, len, &i, 2, &hour) || expect(s, len, &i, ':') ||
+        read_digits(s, len, &i, 2, &min) || expect(s, len, &i, ':') ||
+        read_digits(s, len, &i, 2, &sec)) {
+        return -1;
+    }
+    if (mon < 1 || mon > 12 || day < 1 || day > 31 || hour > 23 || min > 59 || sec > 60) {
+        return -1;
+    }
+
+    uint64_t frac = 0;
+    if (i < len && (s[i] == '.' || s[i] == ',')) {
+        i++;
+        int digits = 0;
+        while (i < len && s[i] >= '0' && s[i] <= '9') {
+            if (digits < 9) {
+                frac = frac * 10 + (uint64_t)(s[i] - '0');
+                digits++;
+            }
+            i++;
+        }
+        if (digits == 0) return -1;
+        while (digits++ < 9) frac *= 10;
+    }
+
+    int64_t offset = 0; // seconds east of UTC
+    if (i < len && (s[i] == 'Z' || s[i] == 'z')) {
+        i++;
+    } else if (i < len && (s[i] == '+' || s[i] == '-')) {
+        int sign = s[i++] == '-' ? -1 : 1;
+        int oh, om;
+        if (read_digits(s, len, &i, 2, &oh)) return -1;
+        if (i < len && s[i] == ':') i++;
+        if (read_digits(s, len, &i, 2, &om) || oh > 23 || om > 59) return -1;
+        offset = sign * (oh * 3600 + om * 60);
+    }
+    if (i != len) return -1;
+
+    int64_t secs = days_from_civil(year, mon, day) * 86400 + hour * 3600 + min * 60 + sec - offset;
+    if (secs < 0) return -1;
+    *out = (uint64_t)secs * NS_PER_SEC + frac;
+    return 0;
+}
+
+uint64_t waggle_get_monotonic_ns(void) {
     struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
     return (uint64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
+void waggle_wait_stop(pthread_mutex_t *lock, pthread_cond_t *cond, _Atomic int *stop, int ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(lock);
+    while (!atomic_load(stop)) {
+        if (pthread_cond_timedwait(cond, lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(lock);
+}
+
 void waggle_format_time(char *buf, int bufsize) {
     DBGPRINT("waggle_format_time() called.\n");
     if (!buf || bufsize < 1) {
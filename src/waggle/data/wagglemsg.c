@@ -1,10 +1,14 @@
 #include "waggle/wagglemsg.h"
+#include "waggle/jsonutil.h"
+#include "waggle/msgpack.h"
+#include "waggle/timeutil.h"
 #include <inttypes.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <cjson/cJSON.h>
+#include <strings.h>
 
 WaggleMsg* wagglemsg_new(const char *name,
                          int64_t value,
@@ -30,111 +34,1287 @@ WaggleMsg* wagglemsg_new(const char *name,
     return m;
 }
 
+WaggleMsg* wagglemsg_new_double(const char *name,
+                                double value,
+                                uint64_t timestamp,
+                                const char *meta_json) {
+    WaggleMsg *m = wagglemsg_new(name, 0, timestamp, meta_json);
+    if (m) {
+        m->type = WAGGLE_VALUE_DOUBLE;
+        m->dvalue = value;
+    }
+    return m;
+}
+
+WaggleMsg* wagglemsg_new_string(const char *name,
+                                const char *value,
+                                uint64_t timestamp,
+                                const char *meta_json) {
+    if (!value) {
+        return NULL;
+    }
+    WaggleMsg *m = wagglemsg_new(name, 0, timestamp, meta_json);
+    if (!m) {
+        return NULL;
+    }
+    m->type = WAGGLE_VALUE_STRING;
+    m->data = strdup(value);
+    m->data_len = strlen(value);
+    if (!m->data) {
+        wagglemsg_free(m);
+        return NULL;
+    }
+    return m;
+}
+
+WaggleMsg* wagglemsg_new_bytes(const char *name,
+                               void *data,
+                               size_t len,
+                               uint64_t timestamp,
+                               const char *meta_json,
+                               WaggleFreeFn free_fn,
+                               void *arg) {
+    WaggleMsg *m = NULL;
+    if (data || len == 0) {
+        m = wagglemsg_new(name, 0, timestamp, meta_json);
+    }
+    if (!m) {
+        if (free_fn) {
+            free_fn(data, arg);
+        }
+        return NULL;
+    }
+    m->type = WAGGLE_VALUE_BYTES;
+    m->data_len = len;
+    if (free_fn) {
+        m->data = data;
+        m->data_free = free_fn;
+        m->data_free_arg = arg;
+    } else {
+        m->data = malloc(len ? len : 1);
+        if (!m->data) {
+            wagglemsg_free(m);
+            return NULL;
+        }
+        if (len) {
+            memcpy(m->data, data, len);
+        }
+    }
+    return m;
+}
+
 void wagglemsg_free(WaggleMsg *m) {
     if (m) {
         free(m->name);
         free(m->meta);
+        if (m->data_free) {
+            m->data_free(m->data, m->data_free_arg);
+        } else {
+            free(m->data);
+        }
         free(m);
     }
 }
 
+// -----------------------------------------------------------------------------
+// Values
+// -----------------------------------------------------------------------------
+#define JSON_BYTES_FIXED_LEN (sizeof("{\"base64\":\"\"}") - 1)
+
+size_t wagglemsg_value_json_bound(const WaggleMsg *m) {
+    switch (m->type) {
+    case WAGGLE_VALUE_DOUBLE: return JSON_DOUBLE_MAX_CHARS;
+    case WAGGLE_VALUE_STRING: return 2 + JSON_ESCAPED_MAX(m->data ? m->data_len : 0);
+    case WAGGLE_VALUE_BYTES:  return JSON_BYTES_FIXED_LEN + JSON_BASE64_LEN(m->data ? m->data_len : 0);
+    default:                  return JSON_INT_MAX_CHARS;
+    }
+}
+
+// exact length of what wagglemsg_write_value_json writes
+static size_t value_json_len(const WaggleMsg *m) {
+    char tmp[JSON_DOUBLE_MAX_CHARS];
+    switch (m->type) {
+    case WAGGLE_VALUE_DOUBLE: return json_format_double(tmp, m->dvalue);
+    case WAGGLE_VALUE_STRING: return 2 + (m->data ? json_escaped_len(m->data, m->data_len) : 0);
+    case WAGGLE_VALUE_BYTES:  return wagglemsg_value_json_bound(m);
+    default:                  return json_format_i64(tmp, m->value);
+    }
+}
+
+size_t wagglemsg_write_value_json(char *dst, const WaggleMsg *m) {
+    char *out = dst;
+    switch (m->type) {
+    case WAGGLE_VALUE_DOUBLE:
+        return json_format_double(dst, m->dvalue);
+    case WAGGLE_VALUE_STRING:
+        *out++ = '"';
+        if (m->data) {
+            out += json_escape(out, m->data, m->data_len);
+        }
+        *out++ = '"';
+        return (size_t)(out - dst);
+    case WAGGLE_VALUE_BYTES:
+        memcpy(out, "{\"base64\":\"", 11);
+        out += 11;
+        if (m->data) {
+            out += json_base64_encode(out, m->data, m->data_len);
+        }
+        memcpy(out, "\"}", 2);
+        out += 2;
+        return (size_t)(out - dst);
+    default:
+        return json_format_i64(dst, m->value);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// JSON encoding
+//
+// Writes {"name":...,"val":...,"ts":...,"meta":...} directly, without building
+// a cJSON tree. meta is validated and copied through verbatim (invalid meta
+// becomes {}), so the output matches the old cJSON path for compact input.
+// -----------------------------------------------------------------------------
+typedef struct {
+    const char *name;
+    size_t      name_len;
+    const char *meta;
+    size_t      meta_len;
+} JsonParts;
+
+#define JSON_FIXED_LEN (sizeof("{\"name\":\"\",\"val\":,\"ts\":,\"meta\":}") - 1)
+
+static void json_parts_init(JsonParts *p, const WaggleMsg *m) {
+    p->name = m->name ? m->name : "";
+    p->name_len = strlen(p->name);
+
+    size_t start, end;
+    size_t meta_len = m->meta ? strlen(m->meta) : 0;
+    if (m->meta && json_validate(m->meta, meta_len, &start, &end) == 0) {
+        p->meta = m->meta + start;
+        p->meta_len = end - start;
+    } else {
+        p->meta = "{}";
+        p->meta_len = 2;
+    }
+}
+
+static size_t json_parts_bound(const JsonParts *p, const WaggleMsg *m) {
+    return JSON_FIXED_LEN + JSON_ESCAPED_MAX(p->name_len) + wagglemsg_value_json_bound(m)
+         + JSON_INT_MAX_CHARS + p->meta_len;
+}
+
+// dst must hold json_parts_bound() bytes
+static size_t json_parts_write(char *dst, const JsonParts *p, const WaggleMsg *m) {
+    char *out = dst;
+    memcpy(out, "{\"name\":\"", 9);
+    out += 9;
+    out += json_escape(out, p->name, p->name_len);
+    memcpy(out, "\",\"val\":", 8);
+    out += 8;
+    out += wagglemsg_write_value_json(out, m);
+    memcpy(out, ",\"ts\":", 6);
+    out += 6;
+    out += json_format_u64(out, m->timestamp);
+    memcpy(out, ",\"meta\":", 8);
+    out += 8;
+    memcpy(out, p->meta, p->meta_len);
+    out += p->meta_len;
+    *out++ = '}';
+    return (size_t)(out - dst);
+}
+
+size_t wagglemsg_encode_json(const WaggleMsg *m, char *buf, size_t bufsize) {
+    if (!m) return 0;
+
+    JsonParts parts;
+    json_parts_init(&parts, m);
+
+    if (buf && bufsize > json_parts_bound(&parts, m)) {
+        size_t n = json_parts_write(buf, &parts, m);
+        buf[n] = '\0';
+        return n;
+    }
+
+    // might not fit: work out the exact size first
+    char tmp[JSON_INT_MAX_CHARS];
+    size_t need = JSON_FIXED_LEN
+                + json_escaped_len(parts.name, parts.name_len)
+                + value_json_len(m)
+                + json_format_u64(tmp, m->timestamp)
+                + parts.meta_len;
+    if (buf && bufsize > need) {
+        size_t n = json_parts_write(buf, &parts, m);
+        buf[n] = '\0';
+    }
+    return need;
+}
+
+int wagglemsg_encode_json_buf(const WaggleMsg *m, WaggleBuf *out) {
+    if (!m || !out) return -1;
+
+    JsonParts parts;
+    json_parts_init(&parts, m);
+    if (wagglebuf_reserve(out, json_parts_bound(&parts, m)) != 0) {
+        return -2;
+    }
+    out->len += json_parts_write(out->data + out->len, &parts, m);
+    out->data[out->len] = '\0';
+    return 0;
+}
+
 char* wagglemsg_dump_json(const WaggleMsg *m) {
     if (!m) {
         return NULL;
     }
 
-    cJSON *root = cJSON_CreateObject();
-    if (!root) {
+    JsonParts parts;
+    json_parts_init(&parts, m);
+    char *out = malloc(json_parts_bound(&parts, m) + 1);
+    if (!out) {
         return NULL;
     }
+    size_t n = json_parts_write(out, &parts, m);
+    out[n] = '\0';
+    return out; // caller must free
+}
+
+// -----------------------------------------------------------------------------
+// Templates
+// -----------------------------------------------------------------------------
+int wagglemsg_template_init(WaggleMsgTemplate *t, const char *name, const char *meta_json) {
+    return wagglemsg_template_init_format(t, WAGGLEMSG_FORMAT_JSON, name, meta_json);
+}
 
-    // Add name as a string
-    cJSON_AddStringToObject(root, "name", m->name);
+static int msgpack_template_init(WaggleMsgTemplate *t, const char *name, const char *meta_json);
 
-    // For val and ts, add them as "raw" text to avoid scientific notation
-    {
-        char buf[32];
-        snprintf(buf, sizeof(buf), "%" PRId64, m->value);
-        cJSON_AddRawToObject(root, "val", buf);
+int wagglemsg_template_init_format(WaggleMsgTemplate *t,
+                                   WaggleMsgFormat format,
+                                   const char *name,
+                                   const char *meta_json) {
+    if (!t || !name || !meta_json) {
+        return -1;
     }
-    {
-        char buf[32];
-        snprintf(buf, sizeof(buf), "%" PRIu64, (uint64_t)m->timestamp);
-        cJSON_AddRawToObject(root, "ts", buf);
+    memset(t, 0, sizeof(*t));
+    if (format == WAGGLEMSG_FORMAT_MSGPACK) {
+        return msgpack_template_init(t, name, meta_json);
     }
 
-    // Parse meta JSON and attach
-    cJSON *meta_obj = cJSON_Parse(m->meta);
-    if (!meta_obj) {
-        meta_obj = cJSON_CreateObject();
+    size_t start, end;
+    if (json_validate(meta_json, strlen(meta_json), &start, &end) != 0) {
+        return -2;
     }
-    cJSON_AddItemToObject(root, "meta", meta_obj);
 
-    // Convert to unformatted string
-    char *out = cJSON_PrintUnformatted(root);
-    cJSON_Delete(root);
-    return out; // caller must free
+    size_t name_len = strlen(name);
+    t->prefix = malloc(9 + JSON_ESCAPED_MAX(name_len) + 8 + 1);
+    t->suffix = malloc(8 + (end - start) + 1 + 1);
+    if (!t->prefix || !t->suffix) {
+        wagglemsg_template_free(t);
+        return -3;
+    }
+
+    char *out = t->prefix;
+    memcpy(out, "{\"name\":\"", 9);
+    out += 9;
+    out += json_escape(out, name, name_len);
+    memcpy(out, "\",\"val\":", 8);
+    out += 8;
+    *out = '\0';
+    t->prefix_len = (size_t)(out - t->prefix);
+
+    out = t->suffix;
+    memcpy(out, ",\"meta\":", 8);
+    out += 8;
+    memcpy(out, meta_json + start, end - start);
+    out += end - start;
+    *out++ = '}';
+    *out = '\0';
+    t->suffix_len = (size_t)(out - t->suffix);
+    return 0;
 }
 
-WaggleMsg* wagglemsg_load_json(const char *json_str) {
-    if (!json_str) {
-        return NULL;
+void wagglemsg_template_free(WaggleMsgTemplate *t) {
+    if (!t) return;
+    free(t->prefix);
+    free(t->suffix);
+    memset(t, 0, sizeof(*t));
+}
+
+size_t wagglemsg_template_bound(const WaggleMsgTemplate *t) {
+    if (t->format == WAGGLEMSG_FORMAT_MSGPACK) {
+        return t->prefix_len + MSGPACK_INT_MAX_BYTES + 3 + MSGPACK_INT_MAX_BYTES + t->suffix_len;
+    }
+    return t->prefix_len + JSON_INT_MAX_CHARS + 6 + JSON_INT_MAX_CHARS + t->suffix_len;
+}
+
+size_t wagglemsg_template_write(const WaggleMsgTemplate *t, int64_t value, uint64_t timestamp, char *dst) {
+    char *out = dst;
+    memcpy(out, t->prefix, t->prefix_len);
+    out += t->prefix_len;
+    if (t->format == WAGGLEMSG_FORMAT_MSGPACK) {
+        out += msgpack_write_i64(out, value);
+        memcpy(out, "\xa2ts", 3);
+        out += 3;
+        out += msgpack_write_u64(out, timestamp);
+        memcpy(out, t->suffix, t->suffix_len);
+        out += t->suffix_len;
+        return (size_t)(out - dst);
+    }
+    out += json_format_i64(out, value);
+    memcpy(out, ",\"ts\":", 6);
+    out += 6;
+    out += json_format_u64(out, timestamp);
+    memcpy(out, t->suffix, t->suffix_len);
+    out += t->suffix_len;
+    return (size_t)(out - dst);
+}
+
+// -----------------------------------------------------------------------------
+// JSON decoding
+//
+// Reads the message object in one pass without building a cJSON tree.
+// Strings are scanned with json_scan_escape, integers are parsed exactly, and
+// meta is validated and kept as a slice of the input. The decoded strings (and
+// base64 bytes) are never longer than the input they came from, which lets the
+// bulk decoder size its storage up front.
+// -----------------------------------------------------------------------------
+typedef struct {
+    const char *name;      // string contents, still escaped
+    size_t      name_len;
+    WaggleValueType type;
+    int64_t     value;
+    double      dvalue;
+    const char *str;       // STRING: contents, still escaped; BYTES: base64
+    size_t      str_len;
+    uint64_t    timestamp;
+    const char *meta;      // NULL means "{}"
+    size_t      meta_len;
+} MsgFields;
+
+enum {
+    FIELD_NAME = 1,
+    FIELD_VAL  = 2,
+    FIELD_TS   = 4,
+    FIELD_META = 8,
+    FIELD_TIMESTAMP = 16, // the local file log's ISO 8601 "timestamp"
+};
+
+static size_t skip_ws(const char *s, size_t len, size_t i) {
+    while (i < len && (s[i] == ' ' || s[i] == '\t' || s[i] == '\n' || s[i] == '\r')) i++;
+    return i;
+}
+
+// Scans the string starting at the quote s[i]. Sets the length of its
+// contents and whether they hold escapes, and returns the index just past
+// the closing quote, or 0 on error.
+static size_t scan_string(const char *s, size_t len, size_t i, size_t *n, int *escaped) {
+    size_t start = ++i;
+    *escaped = 0;
+    for (;;) {
+        i += json_scan_escape(s + i, len - i);
+        if (i >= len || (unsigned char)s[i] < 0x20) return 0;
+        if (s[i] == '"') break;
+        *escaped = 1;
+        i += 2; // backslash and the escaped character
+        if (i > len) return 0;
+    }
+    *n = i - start;
+    return i + 1;
+}
+
+// Parses an integer at s[i]: a JSON number or a string holding one.
+// Fractions and exponents are truncated toward zero, as a cast would.
+// Returns the index just past it, or 0 if it is not an integer or is out
+// of range for int64 (or uint64 when negatives are not allowed).
+static size_t parse_integer(const char *s, size_t len, size_t i, int allow_negative, uint64_t *out) {
+    int quoted = s[i] == '"';
+    if (quoted) i++;
+    size_t start = i;
+    int neg = 0;
+    if (i < len && s[i] == '-') {
+        neg = 1;
+        i++;
+    }
+    uint64_t mag;
+    size_t n = json_parse_u64(s + i, len - i, &mag);
+    if (n == 0) return 0;
+    i += n;
+
+    if (i < len && (s[i] == '.' || s[i] == 'e' || s[i] == 'E')) {
+        char buf[64];
+        size_t tok = json_skip_value(s + start, len - start);
+        if (tok == 0 || tok >= sizeof(buf)) return 0;
+        memcpy(buf, s + start, tok);
+        buf[tok] = '\0';
+        double d = strtod(buf, NULL);
+        if (allow_negative) {
+            if (!(d >= -9223372036854775808.0 && d < 9223372036854775808.0)) return 0;
+            *out = (uint64_t)(int64_t)d;
+        } else {
+            if (!(d > -1.0 && d < 18446744073709551616.0)) return 0;
+            *out = d > 0 ? (uint64_t)d : 0;
+        }
+        i = start + tok;
+    } else if (!neg) {
+        if (allow_negative && mag > (uint64_t)INT64_MAX) return 0;
+        *out = mag;
+    } else {
+        if (allow_negative ? mag > (uint64_t)INT64_MAX + 1 : mag != 0) return 0;
+        *out = (uint64_t)0 - mag;
+    }
+
+    if (quoted) {
+        if (i >= len || s[i] != '"') return 0;
+        i++;
+    }
+    return i;
+}
+
+// Parses "val" at s[i] into f. Integers that fit in int64 are INT and other
+// numbers DOUBLE, with `value` set to the truncated number when it fits, as
+// older readers expect. A string holding an integer sets `value` too.
+// Returns the index just past the value, or 0 on error.
+static size_t parse_value(const char *s, size_t len, size_t i, MsgFields *f) {
+    f->type = WAGGLE_VALUE_INT;
+    f->value = 0;
+    f->dvalue = 0;
+
+    if (s[i] == '"') {
+        int escaped;
+        size_t end = scan_string(s, len, i, &f->str_len, &escaped);
+        if (end == 0) return 0;
+        f->type = WAGGLE_VALUE_STRING;
+        f->str = s + i + 1;
+        uint64_t v;
+        if (parse_integer(s, len, i, 1, &v) == end) f->value = (int64_t)v;
+        return end;
+    }
+
+    if (s[i] == '{') {
+        // {"base64":"..."}
+        size_t j = skip_ws(s, len, i + 1);
+        if (len - j < 8 || memcmp(s + j, "\"base64\"", 8) != 0) return 0;
+        j = skip_ws(s, len, j + 8);
+        if (j >= len || s[j] != ':') return 0;
+        j = skip_ws(s, len, j + 1);
+        if (j >= len || s[j] != '"') return 0;
+        int escaped;
+        f->str = s + j + 1;
+        j = scan_string(s, len, j, &f->str_len, &escaped);
+        if (j == 0 || escaped) return 0;
+        j = skip_ws(s, len, j);
+        if (j >= len || s[j] != '}') return 0;
+        f->type = WAGGLE_VALUE_BYTES;
+        return j + 1;
+    }
+
+    if (len - i >= 4 && memcmp(s + i, "null", 4) == 0) {
+        // what NaN and infinities are written as
+        f->type = WAGGLE_VALUE_DOUBLE;
+        f->dvalue = NAN;
+        return i + 4;
+    }
+
+    if (s[i] != '-' && (s[i] < '0' || s[i] > '9')) return 0;
+    size_t tok = json_skip_value(s + i, len - i);
+    if (tok == 0) return 0;
+    int neg = s[i] == '-';
+    uint64_t mag;
+    size_t n = json_parse_u64(s + i + neg, tok - neg, &mag);
+    if (n == tok - neg && mag <= (uint64_t)INT64_MAX + neg) {
+        f->value = neg ? (int64_t)((uint64_t)0 - mag) : (int64_t)mag;
+        return i + tok;
+    }
+
+    char buf[512];
+    if (tok >= sizeof(buf)) return 0;
+    memcpy(buf, s + i, tok);
+    buf[tok] = '\0';
+    f->type = WAGGLE_VALUE_DOUBLE;
+    f->dvalue = strtod(buf, NULL);
+    if (f->dvalue >= -9223372036854775808.0 && f->dvalue < 9223372036854775808.0) {
+        f->value = (int64_t)f->dvalue;
+    }
+    return i + tok;
+}
+
+static int match_key(const char *key, size_t n) {
+    switch (n) {
+    case 2: return memcmp(key, "ts", 2) == 0 ? FIELD_TS : 0;
+    case 3: return memcmp(key, "val", 3) == 0 ? FIELD_VAL : 0;
+    case 4:
+        if (memcmp(key, "name", 4) == 0) return FIELD_NAME;
+        if (memcmp(key, "meta", 4) == 0) return FIELD_META;
+        return 0;
+    case 9: return memcmp(key, "timestamp", 9) == 0 ? FIELD_TIMESTAMP : 0;
+    default: return 0;
+    }
+}
+
+// Parses the file log's "timestamp" at s[i]: an ISO 8601 string, or a
+// number of nanoseconds. Returns the index just past it, or 0 on error.
+static size_t parse_iso_timestamp(const char *s, size_t len, size_t i, uint64_t *out) {
+    if (s[i] != '"') return parse_integer(s, len, i, 0, out);
+    size_t n;
+    int escaped;
+    size_t end = scan_string(s, len, i, &n, &escaped);
+    if (end == 0 || escaped || waggle_parse_iso8601_ns(s + i + 1, n, out) != 0) return 0;
+    return end;
+}
+
+// Decodes the message object starting at s[i]. If a key repeats, the
+// first one counts, as with cJSON_GetObjectItem. The time is "ts", or
+// failing that the local file log's "timestamp". Returns the index just
+// past the closing brace, or 0 on error.
+static size_t decode_object(const char *s, size_t len, size_t i, MsgFields *f) {
+    int have = 0;
+    uint64_t iso_ts = 0;
+    f->meta = NULL;
+    f->meta_len = 0;
+
+    if (i >= len || s[i] != '{') return 0;
+    i = skip_ws(s, len, i + 1);
+    for (;;) {
+        if (i >= len || s[i] != '"') return 0;
+        const char *key = s + i + 1;
+        size_t key_len;
+        int escaped;
+        i = scan_string(s, len, i, &key_len, &escaped);
+        if (i == 0) return 0;
+        // an escaped key longer than this cannot spell a known one
+        char unescaped[32];
+        int field = 0;
+        if (!escaped) {
+            field = match_key(key, key_len);
+        } else if (key_len <= sizeof(unescaped)) {
+            key_len = json_unescape(unescaped, key, key_len);
+            if (key_len == JSON_UNESCAPE_ERROR) return 0;
+            field = match_key(unescaped, key_len);
+        }
+        if (field & have) field = 0;
+
+        i = skip_ws(s, len, i);
+        if (i >= len || s[i] != ':') return 0;
+        i = skip_ws(s, len, i + 1);
+        if (i >= len) return 0;
+
+        size_t n;
+        switch (field) {
+        case FIELD_NAME:
+            if (s[i] != '"') return 0;
+            f->name = s + i + 1;
+            i = scan_string(s, len, i, &f->name_len, &escaped);
+            break;
+        case FIELD_VAL:
+            i = parse_value(s, len, i, f);
+            break;
+        case FIELD_TS:
+            i = parse_integer(s, len, i, 0, &f->timestamp);
+            break;
+        case FIELD_TIMESTAMP:
+            i = parse_iso_timestamp(s, len, i, &iso_ts);
+            break;
+        default:
+            n = json_skip_value(s + i, len - i);
+            if (n == 0) return 0;
+            if (field == FIELD_META && (s[i] == '{' || s[i] == '[')) {
+                f->meta = s + i;
+                f->meta_len = n;
+            }
+            i += n;
+            break;
+        }
+        if (i == 0) return 0;
+        have |= field;
+
+        i = skip_ws(s, len, i);
+        if (i >= len) return 0;
+        if (s[i] == ',') {
+            i = skip_ws(s, len, i + 1);
+            continue;
+        }
+        if (s[i] != '}') return 0;
+        i++;
+        break;
+    }
+
+    if ((have & (FIELD_NAME | FIELD_VAL)) != (FIELD_NAME | FIELD_VAL)) return 0;
+    if (!(have & FIELD_TS)) {
+        if (!(have & FIELD_TIMESTAMP)) return 0;
+        f->timestamp = iso_ts;
+    }
+    return i;
+}
+
+// Bytes write_strings needs for the value of `f`, at most its encoded length.
+static size_t value_size(const MsgFields *f) {
+    switch (f->type) {
+    case WAGGLE_VALUE_STRING: return f->str_len + 1;
+    case WAGGLE_VALUE_BYTES:  return f->str_len / 4 * 3;
+    default:                  return 0;
+    }
+}
+
+// Writes the NUL-terminated name and meta, and the value's data. `name`
+// needs f->name_len + 1 bytes, `meta` f->meta_len + 1 (at least 3) and
+// `data` value_size(f). Sets `*data_len`. Returns 0 on success.
+static int write_strings(const MsgFields *f, char *name, char *meta, char *data, size_t *data_len) {
+    size_t n = json_unescape(name, f->name, f->name_len);
+    if (n == JSON_UNESCAPE_ERROR) return -1;
+    name[n] = '\0';
+    if (f->meta) {
+        memcpy(meta, f->meta, f->meta_len);
+        meta[f->meta_len] = '\0';
+    } else {
+        memcpy(meta, "{}", 3);
     }
 
-    cJSON *root = cJSON_Parse(json_str);
-    if (!root) {
+    *data_len = 0;
+    if (f->type == WAGGLE_VALUE_STRING) {
+        n = json_unescape(data, f->str, f->str_len);
+        if (n == JSON_UNESCAPE_ERROR) return -1;
+        data[n] = '\0';
+        *data_len = n;
+    } else if (f->type == WAGGLE_VALUE_BYTES) {
+        n = json_base64_decode(data, f->str, f->str_len);
+        if (n == JSON_UNESCAPE_ERROR) return -1;
+        *data_len = n;
+    }
+    return 0;
+}
+
+// Copies the decoded value fields other than data into `m`.
+static void set_value(WaggleMsg *m, const MsgFields *f) {
+    m->type = f->type;
+    m->value = f->value;
+    m->dvalue = f->dvalue;
+    m->timestamp = f->timestamp;
+}
+
+WaggleMsg* wagglemsg_load_json_len(const char *json, size_t len) {
+    if (!json) {
         return NULL;
     }
 
-    cJSON *name = cJSON_GetObjectItem(root, "name");
-    cJSON *val  = cJSON_GetObjectItem(root, "val");
-    cJSON *ts   = cJSON_GetObjectItem(root, "ts");
-    cJSON *meta = cJSON_GetObjectItem(root, "meta");
+    MsgFields f;
+    size_t end = decode_object(json, len, skip_ws(json, len, 0), &f);
+    if (end == 0 || skip_ws(json, len, end) != len) {
+        return NULL;
+    }
 
-    // name must be string, val/ts can be raw or number
-    if (!cJSON_IsString(name) || !val || !ts) {
-        cJSON_Delete(root);
+    size_t meta_len = f.meta ? f.meta_len : 2;
+    size_t data_size = value_size(&f);
+    WaggleMsg *m = (WaggleMsg*)calloc(1, sizeof(WaggleMsg));
+    if (!m) {
+        return NULL;
+    }
+    set_value(m, &f);
+    m->name = malloc(f.name_len + 1);
+    m->meta = malloc(meta_len + 1);
+    if (data_size) {
+        m->data = malloc(data_size);
+    }
+    if (!m->name || !m->meta || (data_size && !m->data) ||
+        write_strings(&f, m->name, m->meta, m->data, &m->data_len) != 0) {
+        wagglemsg_free(m);
         return NULL;
     }
+    return m;
+}
 
-    // Extract val
-    int64_t int64_val = 0;
-    if (cJSON_IsNumber(val)) {
-        int64_val = (int64_t)val->valuedouble; // fallback if cJSON parsed as number
-    } else if (cJSON_IsRaw(val) || cJSON_IsString(val)) {
-        int64_val = strtoll(val->valuestring, NULL, 10);
-    } else {
-        cJSON_Delete(root);
+WaggleMsg* wagglemsg_load_json(const char *json_str) {
+    if (!json_str) {
         return NULL;
     }
+    return wagglemsg_load_json_len(json_str, strlen(json_str));
+}
+
+// -----------------------------------------------------------------------------
+// MessagePack
+//
+// The same four entries as the JSON form, in the same order. meta is converted
+// from JSON on the way out and back to compact JSON on the way in.
+// -----------------------------------------------------------------------------
+#define MSGPACK_KEY_NAME "\xa4name"
+#define MSGPACK_KEY_VAL  "\xa3val"
+#define MSGPACK_KEY_TS   "\xa2ts"
+#define MSGPACK_KEY_META "\xa4meta"
+
+// Appends meta as a map, or an empty map if it is not valid JSON.
+static int msgpack_append_meta(const char *meta_json, WaggleBuf *out) {
+    if (meta_json && msgpack_from_json(meta_json, strlen(meta_json), out) == 0) {
+        return 0;
+    }
+    return wagglebuf_append(out, "\x80", 1);
+}
+
+// Writes m's value: int, float 64, str or bin. `dst` needs
+// MSGPACK_HEADER_MAX_BYTES + data_len (at least MSGPACK_INT_MAX_BYTES) bytes.
+static size_t msgpack_write_value(char *dst, const WaggleMsg *m) {
+    size_t n = m->data ? m->data_len : 0;
+    switch (m->type) {
+    case WAGGLE_VALUE_DOUBLE:
+        return msgpack_write_f64(dst, m->dvalue);
+    case WAGGLE_VALUE_STRING:
+        return msgpack_write_str(dst, m->data, (uint32_t)n);
+    case WAGGLE_VALUE_BYTES: {
+        size_t h = msgpack_write_bin_header(dst, (uint32_t)n);
+        if (n) {
+            memcpy(dst + h, m->data, n);
+        }
+        return h + n;
+    }
+    default:
+        return msgpack_write_i64(dst, m->value);
+    }
+}
+
+int wagglemsg_encode_msgpack_buf(const WaggleMsg *m, WaggleBuf *out) {
+    if (!m || !out) return -1;
+
+    const char *name = m->name ? m->name : "";
+    size_t name_len = strlen(name);
+    size_t data_len = m->type == WAGGLE_VALUE_INT || m->type == WAGGLE_VALUE_DOUBLE || !m->data ? 0 : m->data_len;
+    if (name_len > UINT32_MAX || data_len > UINT32_MAX) return -1;
+    size_t start = out->len;
+    if (wagglebuf_reserve(out, 1 + 5 + MSGPACK_HEADER_MAX_BYTES + name_len +
+                               4 + MSGPACK_HEADER_MAX_BYTES + data_len + MSGPACK_INT_MAX_BYTES +
+                               3 + MSGPACK_INT_MAX_BYTES + 5) != 0) {
+        return -2;
+    }
+    char *dst = out->data + out->len;
+    char *p = dst;
+    p += msgpack_write_map_header(p, 4);
+    memcpy(p, MSGPACK_KEY_NAME, 5);
+    p += 5;
+    p += msgpack_write_str(p, name, (uint32_t)name_len);
+    memcpy(p, MSGPACK_KEY_VAL, 4);
+    p += 4;
+    p += msgpack_write_value(p, m);
+    memcpy(p, MSGPACK_KEY_TS, 3);
+    p += 3;
+    p += msgpack_write_u64(p, m->timestamp);
+    memcpy(p, MSGPACK_KEY_META, 5);
+    p += 5;
+    out->len += (size_t)(p - dst);
+
+    if (msgpack_append_meta(m->meta, out) != 0) {
+        out->len = start;
+        out->data[start] = '\0';
+        return -2;
+    }
+    return 0;
+}
+
+static int msgpack_template_init(WaggleMsgTemplate *t, const char *name, const char *meta_json) {
+    WaggleBuf meta;
+    wagglebuf_init(&meta);
+    if (msgpack_from_json(meta_json, strlen(meta_json), &meta) != 0) {
+        wagglebuf_free(&meta);
+        return -2;
+    }
+
+    size_t name_len = strlen(name);
+    t->format = WAGGLEMSG_FORMAT_MSGPACK;
+    t->prefix = malloc(1 + 5 + MSGPACK_HEADER_MAX_BYTES + name_len + 4);
+    t->suffix = malloc(5 + meta.len);
+    if (name_len > UINT32_MAX || !t->prefix || !t->suffix) {
+        wagglebuf_free(&meta);
+        wagglemsg_template_free(t);
+        return -3;
+    }
+
+    char *out = t->prefix;
+    out += msgpack_write_map_header(out, 4);
+    memcpy(out, MSGPACK_KEY_NAME, 5);
+    out += 5;
+    out += msgpack_write_str(out, name, (uint32_t)name_len);
+    memcpy(out, MSGPACK_KEY_VAL, 4);
+    out += 4;
+    t->prefix_len = (size_t)(out - t->prefix);
+
+    memcpy(t->suffix, MSGPACK_KEY_META, 5);
+    memcpy(t->suffix + 5, meta.data, meta.len);
+    t->suffix_len = 5 + meta.len;
+    wagglebuf_free(&meta);
+    return 0;
+}
+
+// Reads "val" into f: ints that fit in int64 are INT; floats, larger ints
+// and nil (NaN) are DOUBLE; str and bin point f->str into the input.
+static int msgpack_read_value(const char *s, size_t len, size_t *pos, MsgFields *f, uint32_t *n) {
+    if (*pos >= len) return -1;
+    unsigned char tag = (unsigned char)s[*pos];
+    f->type = WAGGLE_VALUE_INT;
+    if (msgpack_read_i64(s, len, pos, &f->value) == 0) {
+        return 0;
+    }
 
-    // Extract timestamp
-    uint64_t uint64_ts = 0;
-    if (cJSON_IsNumber(ts)) {
-        uint64_ts = (uint64_t)ts->valuedouble;
-    } else if (cJSON_IsRaw(ts) || cJSON_IsString(ts)) {
-        uint64_ts = strtoull(ts->valuestring, NULL, 10);
+    f->type = WAGGLE_VALUE_DOUBLE;
+    uint64_t u;
+    if (tag == 0xc0) {
+        f->dvalue = NAN;
+        *pos += 1;
+    } else if (msgpack_read_u64(s, len, pos, &u) == 0) {
+        f->dvalue = (double)u;
+    } else if (msgpack_read_f64(s, len, pos, &f->dvalue) == 0) {
+        if (f->dvalue >= -9223372036854775808.0 && f->dvalue < 9223372036854775808.0) {
+            f->value = (int64_t)f->dvalue;
+        }
+    } else if (msgpack_read_str(s, len, pos, &f->str, n) == 0) {
+        f->type = WAGGLE_VALUE_STRING;
+    } else if (msgpack_read_bin(s, len, pos, &f->str, n) == 0) {
+        f->type = WAGGLE_VALUE_BYTES;
     } else {
-        cJSON_Delete(root);
-        return NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Decodes the map at s[*pos..len) and advances *pos past it. Unlike the JSON
+// decoder, f->name and f->str point at raw (unescaped) bytes, f->str_len is
+// the value's data length, and meta is appended to `meta` as compact JSON
+// (nothing appended means "{}").
+static int msgpack_decode_map(const char *s, size_t len, size_t *pos, MsgFields *f, WaggleBuf *meta) {
+    uint32_t n;
+    if (msgpack_read_map_header(s, len, pos, &n) != 0) {
+        return -1;
+    }
+
+    uint32_t name_len = 0;
+    uint32_t data_len = 0;
+    int have = 0;
+    memset(f, 0, sizeof(*f));
+
+    for (uint32_t i = 0; i < n; i++) {
+        const char *key;
+        uint32_t key_len;
+        if (msgpack_read_str(s, len, pos, &key, &key_len) != 0) return -1;
+        int field = match_key(key, key_len);
+        if (field & have) field = 0;
+
+        int rc = 0;
+        switch (field) {
+        case FIELD_NAME:
+            rc = msgpack_read_str(s, len, pos, &f->name, &name_len);
+            break;
+        case FIELD_VAL:
+            rc = msgpack_read_value(s, len, pos, f, &data_len);
+            break;
+        case FIELD_TS:
+            rc = msgpack_read_u64(s, len, pos, &f->timestamp);
+            break;
+        default: {
+            if (*pos >= len) return -1;
+            unsigned char tag = (unsigned char)s[*pos];
+            int container = (tag & 0xe0) == 0x80 || (tag >= 0xdc && tag <= 0xdf);
+            size_t used;
+            if (field == FIELD_META && container) {
+                rc = msgpack_to_json(s + *pos, len - *pos, &used, meta);
+            } else {
+                used = msgpack_skip(s + *pos, len - *pos);
+                rc = used == 0;
+            }
+            *pos += used;
+            break;
+        }
+        }
+        if (rc != 0) return -1;
+        have |= field;
+    }
+    if ((have & (FIELD_NAME | FIELD_VAL | FIELD_TS)) != (FIELD_NAME | FIELD_VAL | FIELD_TS)) {
+        return -1;
     }
+    f->name_len = name_len;
+    f->str_len = data_len;
+    return 0;
+}
+
+// Bytes msgpack_write_strings needs for a decoded map.
+static size_t msgpack_strings_size(const MsgFields *f, const WaggleBuf *meta) {
+    return f->name_len + 1 + (meta->len ? meta->len : 2) + 1 + f->str_len + 1;
+}
+
+// Copies the NUL-terminated name, meta and value data of a decoded map to
+// `dst` and points `m` at them.
+static void msgpack_write_strings(const MsgFields *f, const WaggleBuf *meta, char *dst, WaggleMsg *m) {
+    m->name = dst;
+    memcpy(dst, f->name, f->name_len);
+    dst[f->name_len] = '\0';
+    dst += f->name_len + 1;
 
-    // Convert meta to string
-    char *meta_str = NULL;
-    if (meta && (cJSON_IsObject(meta) || cJSON_IsArray(meta))) {
-        meta_str = cJSON_PrintUnformatted(meta);
+    m->meta = dst;
+    if (meta->len) {
+        memcpy(dst, meta->data, meta->len + 1);
+        dst += meta->len + 1;
     } else {
-        meta_str = strdup("{}");
+        memcpy(dst, "{}", 3);
+        dst += 3;
+    }
+
+    if (f->type == WAGGLE_VALUE_STRING || f->type == WAGGLE_VALUE_BYTES) {
+        if (f->str_len) memcpy(dst, f->str, f->str_len);
+        dst[f->str_len] = '\0';
+        m->data = dst;
+        m->data_len = f->str_len;
     }
+}
+
+WaggleMsg* wagglemsg_load_msgpack(const void *data, size_t len) {
+    if (!data) {
+        return NULL;
+    }
+    const char *s = (const char*)data;
+    size_t pos = 0;
+    MsgFields f;
+    WaggleBuf meta;
+    wagglebuf_init(&meta);
 
-    WaggleMsg *m = wagglemsg_new(
-        name->valuestring,
-        int64_val,
-        uint64_ts,
-        meta_str ? meta_str : "{}"
-    );
-    free(meta_str);
+    if (msgpack_decode_map(s, len, &pos, &f, &meta) != 0 || pos != len) {
+        goto fail;
+    }
 
-    cJSON_Delete(root);
+    int has_data = f.type == WAGGLE_VALUE_STRING || f.type == WAGGLE_VALUE_BYTES;
+    WaggleMsg *m = (WaggleMsg*)calloc(1, sizeof(WaggleMsg));
+    if (!m) goto fail;
+    set_value(m, &f);
+    m->name = malloc(f.name_len + 1);
+    m->meta = meta.data ? meta.data : strdup("{}");
+    meta.data = NULL;
+    if (has_data) {
+        m->data = malloc(f.str_len + 1);
+        m->data_len = f.str_len;
+    }
+    if (!m->name || !m->meta || (has_data && !m->data)) {
+        wagglemsg_free(m);
+        return NULL;
+    }
+    memcpy(m->name, f.name, f.name_len);
+    m->name[f.name_len] = '\0';
+    if (m->data) {
+        if (f.str_len) memcpy(m->data, f.str, f.str_len);
+        ((char*)m->data)[f.str_len] = '\0';
+    }
     return m;
+
+fail:
+    wagglebuf_free(&meta);
+    return NULL;
+}
+
+WaggleMsg* wagglemsg_load(const void *data, size_t len, WaggleMsgFormat format) {
+    if (format == WAGGLEMSG_FORMAT_MSGPACK) {
+        return wagglemsg_load_msgpack(data, len);
+    }
+    return wagglemsg_load_json_len((const char*)data, len);
+}
+
+const char* wagglemsg_content_type(WaggleMsgFormat format) {
+    return format == WAGGLEMSG_FORMAT_MSGPACK ? WAGGLEMSG_CONTENT_TYPE_MSGPACK
+                                              : WAGGLEMSG_CONTENT_TYPE_JSON;
+}
+
+int wagglemsg_format_of_content_type(const char *content_type, size_t len) {
+    if (!content_type) {
+        return -1;
+    }
+    const char *semi = memchr(content_type, ';', len);
+    if (semi) {
+        len = (size_t)(semi - content_type);
+    }
+    while (len > 0 && content_type[len - 1] == ' ') len--;
+
+    if (len == strlen(WAGGLEMSG_CONTENT_TYPE_JSON) &&
+        strncasecmp(content_type, WAGGLEMSG_CONTENT_TYPE_JSON, len) == 0) {
+        return WAGGLEMSG_FORMAT_JSON;
+    }
+    // "application/x-msgpack" is the older, unregistered name
+    if ((len == strlen(WAGGLEMSG_CONTENT_TYPE_MSGPACK) &&
+         strncasecmp(content_type, WAGGLEMSG_CONTENT_TYPE_MSGPACK, len) == 0) ||
+        (len == strlen("application/x-msgpack") &&
+         strncasecmp(content_type, "application/x-msgpack", len) == 0)) {
+        return WAGGLEMSG_FORMAT_MSGPACK;
+    }
+    return -1;
+}
+
+WaggleMsgFormat wagglemsg_detect_format(const void *data, size_t len) {
+    if (!data || len == 0) {
+        return WAGGLEMSG_FORMAT_JSON;
+    }
+    unsigned char c = *(const unsigned char*)data;
+    return ((c & 0xf0) == 0x80 || c == 0xde || c == 0xdf) ? WAGGLEMSG_FORMAT_MSGPACK
+                                                          : WAGGLEMSG_FORMAT_JSON;
+}
+
+// -----------------------------------------------------------------------------
+// Bulk decoding
+// -----------------------------------------------------------------------------
+#define WAGGLEMSG_BLOCK_MIN (64 * 1024)
+
+struct WaggleMsgBlock {
+    WaggleMsgBlock *next;
+    size_t          size;
+    size_t          used;
+    char            data[];
+};
+
+void wagglemsg_batch_init(WaggleMsgBatch *b) {
+    memset(b, 0, sizeof(*b));
+}
+
+void wagglemsg_batch_reset(WaggleMsgBatch *b) {
+    if (b->blocks) {
+        WaggleMsgBlock *blk = b->blocks->next;
+        while (blk) {
+            WaggleMsgBlock *next = blk->next;
+            free(blk);
+            blk = next;
+        }
+        b->blocks->next = NULL;
+        b->blocks->used = 0;
+    }
+    b->count = 0;
+    b->invalid = 0;
+}
+
+void wagglemsg_batch_free(WaggleMsgBatch *b) {
+    wagglemsg_batch_reset(b);
+    free(b->blocks);
+    free(b->msgs);
+    memset(b, 0, sizeof(*b));
+}
+
+// Makes room for one more message in b->msgs.
+static int batch_grow(WaggleMsgBatch *b) {
+    if (b->count < b->cap) {
+        return 0;
+    }
+    size_t cap = b->cap ? b->cap * 2 : 256;
+    WaggleMsg *grown = realloc(b->msgs, cap * sizeof(WaggleMsg));
+    if (!grown) {
+        return -1;
+    }
+    b->msgs = grown;
+    b->cap = cap;
+    return 0;
+}
+
+// Returns `size` bytes of string storage, starting a new block if the
+// current one is full.
+static char* batch_alloc(WaggleMsgBatch *b, size_t size) {
+    WaggleMsgBlock *blk = b->blocks;
+    if (!blk || blk->size - blk->used < size) {
+        size_t bsize = size > WAGGLEMSG_BLOCK_MIN ? size : WAGGLEMSG_BLOCK_MIN;
+        blk = malloc(sizeof(WaggleMsgBlock) + bsize);
+        if (!blk) {
+            return NULL;
+        }
+        blk->next = b->blocks;
+        blk->size = bsize;
+        blk->used = 0;
+        b->blocks = blk;
+    }
+    char *p = blk->data + blk->used;
+    blk->used += size;
+    return p;
+}
+
+long wagglemsg_decode_ndjson(WaggleMsgBatch *b, const char *data, size_t len) {
+    if (!b) {
+        return -1;
+    }
+    if (!data || len == 0) {
+        return 0;
+    }
+
+    // every message takes at most as many string bytes as its line, so one
+    // block of `len` bytes holds the whole input
+    WaggleMsgBlock *blk = b->blocks;
+    if (!blk || blk->size - blk->used < len) {
+        size_t size = len > WAGGLEMSG_BLOCK_MIN ? len : WAGGLEMSG_BLOCK_MIN;
+        blk = malloc(sizeof(WaggleMsgBlock) + size);
+        if (!blk) {
+            return -1;
+        }
+        blk->next = b->blocks;
+        blk->size = size;
+        blk->used = 0;
+        b->blocks = blk;
+    }
+
+    long added = 0;
+    size_t i = 0;
+    while (i < len) {
+        size_t start = skip_ws(data, len, i);
+        if (start >= len) {
+            break;
+        }
+
+        MsgFields f;
+        size_t end = decode_object(data, len, start, &f);
+        if (end) {
+            while (end < len && (data[end] == ' ' || data[end] == '\t' || data[end] == '\r')) end++;
+            if (end < len && data[end] != '\n') {
+                end = 0;
+            }
+        }
+        if (end) {
+            if (batch_grow(b) != 0) {
+                return -1;
+            }
+            char *name = blk->data + blk->used;
+            char *meta = name + f.name_len + 1;
+            char *data = meta + (f.meta ? f.meta_len : 2) + 1;
+            size_t data_len;
+            if (write_strings(&f, name, meta, data, &data_len) == 0) {
+                WaggleMsg *m = &b->msgs[b->count++];
+                memset(m, 0, sizeof(*m));
+                set_value(m, &f);
+                m->name = name;
+                m->meta = meta;
+                if (f.type == WAGGLE_VALUE_STRING || f.type == WAGGLE_VALUE_BYTES) {
+                    m->data = data;
+                    m->data_len = data_len;
+                }
+                blk->used = (size_t)(data - blk->data) + value_size(&f);
+                added++;
+            } else {
+                end = 0;
+            }
+        }
+        if (!end) {
+            b->invalid++;
+            const char *nl = memchr(data + start, '\n', len - start);
+            end = nl ? (size_t)(nl - data) : len;
+        }
+        i = end + 1;
+    }
+    return added;
+}
+
+long wagglemsg_decode_msgpack_seq(WaggleMsgBatch *b, const void *data, size_t len) {
+    if (!b) {
+        return -1;
+    }
+    if (!data || len == 0) {
+        return 0;
+    }
+
+    const char *s = (const char*)data;
+    WaggleBuf meta;
+    wagglebuf_init(&meta);
+    long added = 0;
+    size_t pos = 0;
+    while (pos < len) {
+        size_t start = pos;
+        MsgFields f;
+        wagglebuf_reset(&meta);
+        if (msgpack_decode_map(s, len, &pos, &f, &meta) != 0) {
+            // skip whatever value is there; stop if even that is truncated
+            b->invalid++;
+            size_t used = msgpack_skip(s + start, len - start);
+            if (used == 0) {
+                break;
+            }
+            pos = start + used;
+            continue;
+        }
+        char *strings;
+        if (batch_grow(b) != 0 || !(strings = batch_alloc(b, msgpack_strings_size(&f, &meta)))) {
+            wagglebuf_free(&meta);
+            return -1;
+        }
+        WaggleMsg *m = &b->msgs[b->count++];
+        memset(m, 0, sizeof(*m));
+        set_value(m, &f);
+        msgpack_write_strings(&f, &meta, strings, m);
+        added++;
+    }
+    wagglebuf_free(&meta);
+    return added;
+}
+
+int wagglemsg_envelope_of_content_type(const char *content_type, size_t len) {
+    if (!content_type) {
+        return -1;
+    }
+    const char *semi = memchr(content_type, ';', len);
+    if (semi) {
+        len = (size_t)(semi - content_type);
+    }
+    while (len > 0 && content_type[len - 1] == ' ') len--;
+
+    if (len == strlen(WAGGLEMSG_CONTENT_TYPE_NDJSON) &&
+        strncasecmp(content_type, WAGGLEMSG_CONTENT_TYPE_NDJSON, len) == 0) {
+        return WAGGLEMSG_FORMAT_JSON;
+    }
+    if (len == strlen(WAGGLEMSG_CONTENT_TYPE_MSGPACK_SEQ) &&
+        strncasecmp(content_type, WAGGLEMSG_CONTENT_TYPE_MSGPACK_SEQ, len) == 0) {
+        return WAGGLEMSG_FORMAT_MSGPACK;
+    }
+    return -1;
+}
+
+const char* wagglemsg_envelope_content_type(WaggleMsgFormat format) {
+    return format == WAGGLEMSG_FORMAT_MSGPACK ? WAGGLEMSG_CONTENT_TYPE_MSGPACK_SEQ
+                                              : WAGGLEMSG_CONTENT_TYPE_NDJSON;
+}
+
+long wagglemsg_unpack(WaggleMsgBatch *b, const void *data, size_t len,
+                      const char *content_type, size_t content_type_len) {
+    if (!b) {
+        return -1;
+    }
+    int envelope = wagglemsg_envelope_of_content_type(content_type, content_type_len);
+    if (envelope == WAGGLEMSG_FORMAT_JSON) {
+        return wagglemsg_decode_ndjson(b, (const char*)data, len);
+    }
+    if (envelope == WAGGLEMSG_FORMAT_MSGPACK) {
+        return wagglemsg_decode_msgpack_seq(b, data, len);
+    }
+
+    int format = wagglemsg_format_of_content_type(content_type, content_type_len);
+    if (format < 0) {
+        format = wagglemsg_detect_format(data, len);
+    }
+    if (format == WAGGLEMSG_FORMAT_MSGPACK) {
+        // a single map is a sequence of one, but trailing bytes are an error
+        size_t used = data ? msgpack_skip((const char*)data, len) : 0;
+        if (used != len) {
+            b->invalid++;
+            return 0;
+        }
+        return wagglemsg_decode_msgpack_seq(b, data, len);
+    }
+
+    // a single JSON body may span lines, so it is not decoded as NDJSON
+    const char *s = (const char*)data;
+    MsgFields f;
+    size_t end = s ? decode_object(s, len, skip_ws(s, len, 0), &f) : 0;
+    if (end == 0 || skip_ws(s, len, end) != len) {
+        b->invalid++;
+        return 0;
+    }
+    size_t meta_len = f.meta ? f.meta_len : 2;
+    char *name;
+    if (batch_grow(b) != 0 || !(name = batch_alloc(b, f.name_len + 1 + meta_len + 1 + value_size(&f)))) {
+        return -1;
+    }
+    char *meta = name + f.name_len + 1;
+    WaggleMsg *m = &b->msgs[b->count];
+    memset(m, 0, sizeof(*m));
+    set_value(m, &f);
+    size_t data_len;
+    if (write_strings(&f, name, meta, meta + meta_len + 1, &data_len) != 0) {
+        b->invalid++;
+        return 0;
+    }
+    m->name = name;
+    m->meta = meta;
+    if (f.type == WAGGLE_VALUE_STRING || f.type == WAGGLE_VALUE_BYTES) {
+        m->data = meta + meta_len + 1;
+        m->data_len = data_len;
+    }
+    b->count++;
+    return 1;
 }
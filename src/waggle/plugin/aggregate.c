@@ -0,0 +1,179 @@
+/**
+ * aggregate.c
+ *
+ * Purpose:
+ *   Striped, lock-free window accumulators for plugin_aggregate_add. Each
+ *   stripe is a writer/reader phaser: writers count themselves in and out
+ *   of the active half, and the reader flips the halves and waits for the
+ *   writers that were still in the old one.
+ */
+
+#include "waggle/aggregate.h"
+#include "waggle/timeutil.h"
+
+#include <math.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef DEBUG
+  #define DBGPRINT(...) do { fprintf(stderr, "[DEBUG aggregate] "); fprintf(stderr, __VA_ARGS__); } while(0)
+#else
+  #define DBGPRINT(...) do {} while(0)
+#endif
+
+#define AGG_STRIPES    16
+#define AGG_PHASE_BIT  ((uint64_t)1 << 63)
+
+// Doubles are kept as their bit patterns so they can live in atomics.
+typedef struct {
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t min;
+    _Atomic uint64_t max;
+    _Atomic uint64_t last_ns;
+    _Atomic uint64_t last;
+} AggAcc;
+
+typedef struct {
+    // adds started; the top bit says which half of `acc` they went to
+    _Atomic uint64_t start;
+    _Atomic uint64_t end[2];  // adds finished, per half
+    AggAcc           acc[2];
+} __attribute__((aligned(64))) AggStripe;
+
+struct Aggregator {
+    AggStripe stripes[AGG_STRIPES];
+    int       track_last;
+    int       active;         // half writers currently use; reader only
+};
+
+static _Atomic unsigned next_thread_id;
+static _Thread_local unsigned thread_stripe = AGG_STRIPES; // unassigned
+
+static inline uint64_t bits_of(double d) {
+    uint64_t u;
+    memcpy(&u, &d, sizeof(u));
+    return u;
+}
+
+static inline double double_of(uint64_t u) {
+    double d;
+    memcpy(&d, &u, sizeof(d));
+    return d;
+}
+
+static void acc_reset(AggAcc *acc) {
+    atomic_store_explicit(&acc->count, 0, memory_order_relaxed);
+    atomic_store_explicit(&acc->sum, bits_of(0.0), memory_order_relaxed);
+    atomic_store_explicit(&acc->min, bits_of(INFINITY), memory_order_relaxed);
+    atomic_store_explicit(&acc->max, bits_of(-INFINITY), memory_order_relaxed);
+    atomic_store_explicit(&acc->last_ns, 0, memory_order_relaxed);
+    atomic_store_explicit(&acc->last, bits_of(NAN), memory_order_relaxed);
+}
+
+Aggregator* aggregator_new(int track_last) {
+    Aggregator *a = aligned_alloc(64, sizeof(Aggregator));
+    if (!a) {
+        DBGPRINT("aggregator_new: out of memory\n");
+        return NULL;
+    }
+    memset(a, 0, sizeof(*a));
+    for (int s = 0; s < AGG_STRIPES; s++) {
+        acc_reset(&a->stripes[s].acc[0]);
+        acc_reset(&a->stripes[s].acc[1]);
+    }
+    a->track_last = track_last;
+    return a;
+}
+
+void aggregator_free(Aggregator *a) {
+    free(a);
+}
+
+// Threads take stripes round robin on first use, so up to AGG_STRIPES
+// threads each get one to themselves.
+static inline AggStripe* my_stripe(Aggregator *a) {
+    if (thread_stripe == AGG_STRIPES) {
+        thread_stripe = atomic_fetch_add_explicit(&next_thread_id, 1, memory_order_relaxed) % AGG_STRIPES;
+    }
+    return &a->stripes[thread_stripe];
+}
+
+void aggregator_add(Aggregator *a, double value) {
+    if (isnan(value)) return;
+    uint64_t now = a->track_last ? waggle_get_monotonic_ns() : 0;
+    AggStripe *st = my_stripe(a);
+
+    uint64_t s = atomic_fetch_add_explicit(&st->start, 1, memory_order_acquire);
+    int half = (s & AGG_PHASE_BIT) ? 1 : 0;
+    AggAcc *acc = &st->acc[half];
+
+    // a stripe usually has a single writer, so these CASes succeed at once
+    atomic_fetch_add_explicit(&acc->count, 1, memory_order_relaxed);
+    uint64_t old = atomic_load_explicit(&acc->sum, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&acc->sum, &old, bits_of(double_of(old) + value),
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+    old = atomic_load_explicit(&acc->min, memory_order_relaxed);
+    while (value < double_of(old) &&
+           !atomic_compare_exchange_weak_explicit(&acc->min, &old, bits_of(value),
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+    old = atomic_load_explicit(&acc->max, memory_order_relaxed);
+    while (value > double_of(old) &&
+           !atomic_compare_exchange_weak_explicit(&acc->max, &old, bits_of(value),
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+    if (a->track_last && now >= atomic_load_explicit(&acc->last_ns, memory_order_relaxed)) {
+        atomic_store_explicit(&acc->last_ns, now, memory_order_relaxed);
+        atomic_store_explicit(&acc->last, bits_of(value), memory_order_relaxed);
+    }
+
+    atomic_fetch_add_explicit(&st->end[half], 1, memory_order_release);
+}
+
+void aggregator_take(Aggregator *a, AggregateWindow *out) {
+    int old = a->active;
+    int next = !old;
+    uint64_t count = 0, last_ns = 0;
+    double sum = 0.0, min = INFINITY, max = -INFINITY, last = NAN;
+
+    for (int i = 0; i < AGG_STRIPES; i++) {
+        AggStripe *st = &a->stripes[i];
+        // the other half was drained and reset by the previous take
+        atomic_store_explicit(&st->end[next], 0, memory_order_relaxed);
+        uint64_t s = atomic_exchange_explicit(&st->start, next ? AGG_PHASE_BIT : 0, memory_order_acq_rel);
+        uint64_t started = s & ~AGG_PHASE_BIT;
+        while (atomic_load_explicit(&st->end[old], memory_order_acquire) != started) {
+            sched_yield(); // a writer is between its start and end
+        }
+
+        AggAcc *acc = &st->acc[old];
+        uint64_t n = atomic_load_explicit(&acc->count, memory_order_relaxed);
+        if (n > 0) {
+            count += n;
+            sum += double_of(atomic_load_explicit(&acc->sum, memory_order_relaxed));
+            double v = double_of(atomic_load_explicit(&acc->min, memory_order_relaxed));
+            if (v < min) min = v;
+            v = double_of(atomic_load_explicit(&acc->max, memory_order_relaxed));
+            if (v > max) max = v;
+            uint64_t ns = atomic_load_explicit(&acc->last_ns, memory_order_relaxed);
+            if (isnan(last) || ns >= last_ns) {
+                last_ns = ns;
+                last = double_of(atomic_load_explicit(&acc->last, memory_order_relaxed));
+            }
+        }
+        acc_reset(acc);
+    }
+    a->active = next;
+
+    out->count = count;
+    out->sum = sum;
+    out->min = count ? min : NAN;
+    out->max = count ? max : NAN;
+    out->last = count ? last : NAN;
+}
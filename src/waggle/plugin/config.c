@@ -1,4 +1,6 @@
 #include "waggle/config.h"
+#include "waggle/uploader.h"
+#include "waggle/subscriber.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -25,6 +27,10 @@ PluginConfig* plugin_config_new(const char *username,
     cfg->password = NULL;
     cfg->host = NULL;
     cfg->app_id = NULL;
+    cfg->spill_dir = NULL;
+    cfg->journal_dir = NULL;
+    cfg->upload_dir = NULL;
+    cfg->transport_path = NULL;
 
     cfg->username = strdup(username ? username : "plugin");
     cfg->password = strdup(password ? password : "plugin");
@@ -32,6 +38,49 @@ PluginConfig* plugin_config_new(const char *username,
     cfg->port     = port ? port : 5672;
     cfg->app_id   = strdup(app_id ? app_id : "");
 
+    cfg->heartbeat_s        = PLUGIN_DEFAULT_HEARTBEAT_S;
+    cfg->connect_timeout_ms = PLUGIN_DEFAULT_CONNECT_TIMEOUT_MS;
+    cfg->tcp_keepalive_s    = PLUGIN_DEFAULT_TCP_KEEPALIVE_S;
+    cfg->reconnect_min_ms   = PLUGIN_DEFAULT_RECONNECT_MIN_MS;
+    cfg->reconnect_max_ms   = PLUGIN_DEFAULT_RECONNECT_MAX_MS;
+    cfg->max_inflight       = PLUGIN_DEFAULT_MAX_INFLIGHT;
+    cfg->confirm_timeout_ms = PLUGIN_DEFAULT_CONFIRM_TIMEOUT_MS;
+    cfg->queue_capacity     = PLUGIN_DEFAULT_QUEUE_CAPACITY;
+    cfg->queue_max_bytes    = PLUGIN_DEFAULT_QUEUE_MAX_BYTES;
+    cfg->overflow_policy    = PLUGIN_OVERFLOW_DROP_NEWEST;
+    cfg->block_timeout_ms   = PLUGIN_DEFAULT_BLOCK_TIMEOUT_MS;
+    cfg->publisher_lanes    = 1;
+    cfg->lane_mode          = PLUGIN_LANES_CONNECTIONS;
+    cfg->shard_key          = PLUGIN_SHARD_SERIES;
+    cfg->wire_format        = WAGGLEMSG_FORMAT_JSON;
+    cfg->envelope_max_messages = 0;
+    cfg->envelope_max_bytes = PLUGIN_DEFAULT_ENVELOPE_MAX_BYTES;
+    cfg->envelope_linger_ms = PLUGIN_DEFAULT_ENVELOPE_LINGER_MS;
+    cfg->compression        = WAGGLE_CODEC_NONE;
+    cfg->compression_level  = 0;
+    cfg->compression_min_bytes = PLUGIN_DEFAULT_COMPRESSION_MIN_BYTES;
+    cfg->transport          = PLUGIN_TRANSPORT_AMQP;
+    cfg->memory_sink_capacity = PLUGIN_DEFAULT_MEMORY_SINK_CAPACITY;
+    cfg->transport_ops      = NULL;
+    cfg->transport_arg      = NULL;
+    cfg->journal_segment_bytes = PLUGIN_DEFAULT_JOURNAL_SEGMENT_BYTES;
+    cfg->journal_sync       = 0;
+    cfg->slab_cache_bytes   = PLUGIN_DEFAULT_SLAB_CACHE_BYTES;
+    cfg->file_log_async     = 0;
+    cfg->file_log_flush_bytes = PLUGIN_DEFAULT_FILE_LOG_FLUSH_BYTES;
+    cfg->file_log_flush_ms  = PLUGIN_DEFAULT_FILE_LOG_FLUSH_MS;
+    cfg->file_log_sync_ms   = 0;
+    cfg->file_log_segment_bytes   = 0;
+    cfg->file_log_segment_ms      = 0;
+    cfg->file_log_compress        = 0;
+    cfg->file_log_retention_bytes = 0;
+    cfg->upload_workers     = UPLOADER_DEFAULT_WORKERS;
+    cfg->upload_queue_capacity = UPLOADER_DEFAULT_QUEUE_CAPACITY;
+    cfg->subscribe_prefetch = SUBSCRIBER_DEFAULT_PREFETCH;
+    cfg->subscribe_ack_batch = SUBSCRIBER_DEFAULT_ACK_BATCH;
+    cfg->subscribe_queue_capacity = SUBSCRIBER_DEFAULT_QUEUE_CAPACITY;
+    cfg->stats_interval_ms  = 0;
+
     if (!cfg->username || !cfg->password || !cfg->host || !cfg->app_id) {
         DBGPRINT("String duplication failed. Freeing.\n");
         plugin_config_free(cfg);
@@ -42,6 +91,62 @@ PluginConfig* plugin_config_new(const char *username,
     return cfg;
 }
 
+int plugin_config_set_spill_dir(PluginConfig *config, const char *dir) {
+    DBGPRINT("plugin_config_set_spill_dir(%s)\n", dir ? dir : "NULL");
+    if (!config) return -1;
+
+    char *copy = NULL;
+    if (dir) {
+        copy = strdup(dir);
+        if (!copy) return -2;
+    }
+    free(config->spill_dir);
+    config->spill_dir = copy;
+    return 0;
+}
+
+int plugin_config_set_journal_dir(PluginConfig *config, const char *dir) {
+    DBGPRINT("plugin_config_set_journal_dir(%s)\n", dir ? dir : "NULL");
+    if (!config) return -1;
+
+    char *copy = NULL;
+    if (dir) {
+        copy = strdup(dir);
+        if (!copy) return -2;
+    }
+    free(config->journal_dir);
+    config->journal_dir = copy;
+    return 0;
+}
+
+int plugin_config_set_upload_dir(PluginConfig *config, const char *dir) {
+    DBGPRINT("plugin_config_set_upload_dir(%s)\n", dir ? dir : "NULL");
+    if (!config) return -1;
+
+    char *copy = NULL;
+    if (dir) {
+        copy = strdup(dir);
+        if (!copy) return -2;
+    }
+    free(config->upload_dir);
+    config->upload_dir = copy;
+    return 0;
+}
+
+int plugin_config_set_transport_path(PluginConfig *config, const char *path) {
+    DBGPRINT("plugin_config_set_transport_path(%s)\n", path ? path : "NULL");
+    if (!config) return -1;
+
+    char *copy = NULL;
+    if (path) {
+        copy = strdup(path);
+        if (!copy) return -2;
+    }
+    free(config->transport_path);
+    config->transport_path = copy;
+    return 0;
+}
+
 void plugin_config_free(PluginConfig *config) {
     DBGPRINT("plugin_config_free() called.\n");
     if (!config) return;
@@ -50,5 +155,9 @@ void plugin_config_free(PluginConfig *config) {
     free(config->password);
     free(config->host);
     free(config->app_id);
+    free(config->spill_dir);
+    free(config->journal_dir);
+    free(config->upload_dir);
+    free(config->transport_path);
     free(config);
 }
@@ -1,10 +1,16 @@
 #include "waggle/filepublisher.h"
 #include "waggle/wagglemsg.h"
-#include <cjson/cJSON.h>
+#include "waggle/jsonutil.h"
+#include "waggle/ringbuf.h"
+#include "waggle/slab.h"
+#include "waggle/segmentlog.h"
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
 
 #ifdef DEBUG
   #define DBGPRINT(...) do { fprintf(stderr, "[DEBUG filepublisher] "); fprintf(stderr, __VA_ARGS__); } while(0)
@@ -12,33 +18,155 @@
   #define DBGPRINT(...) do {} while(0)
 #endif
 
+#define FP_WRITE_ALIGN   4096
+#define FP_SLAB_BYTES    (1024 * 1024)
+#define FP_DRAIN_BATCH   256
+
+// A sample waiting for the writer thread. name, meta and the value's data
+// follow the header.
+typedef struct {
+    int64_t  value;
+    double   dvalue;
+    uint64_t timestamp;
+    uint32_t name_len;
+    uint32_t meta_len;
+    uint32_t data_len;
+    WaggleValueType type;
+    char     strings[];
+} FileEntry;
+
+// Caches the "YYYY-MM-DDTHH:MM:SS" part of the last formatted second.
+typedef struct {
+    int64_t secs;
+    char    prefix[20];
+} IsoCache;
+
 struct FilePublisher {
-    FILE *f;
+    SegmentLog *log;
+    FilePublisherOptions opts;
+
+    // async mode only
+    RingBuf         *ring;
+    SlabPool        *slab;
+    pthread_t        thread;
+    int              thread_started;
+    _Atomic int      stop_flag;
+    _Atomic uint64_t dropped;
+    char            *wbuf;       // FP_WRITE_ALIGN-aligned write buffer
+    size_t           wbuf_cap;
+    size_t           wbuf_len;
+    size_t           wbuf_lines;
+    uint64_t         wbuf_first_ts;
+    uint64_t         wbuf_last_ts;
+    int              dirty;      // written since the last fdatasync
 };
 
+static void* filepublisher_thread_main(void *arg);
+
+static uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// -----------------------------------------------------------------------------
+// Line formatting
+//
+// Writes {"name":...,"val":...,"meta":...,"timestamp":"<ISO8601>"} directly;
+// this is the WaggleMsg JSON with ts replaced by a readable timestamp.
+// -----------------------------------------------------------------------------
+#define ISO_LEN   (sizeof("YYYY-MM-DDTHH:MM:SS.nnnnnnnnnZ") - 1)
+#define LINE_FIXED_LEN (sizeof("{\"name\":\"\",\"val\":,\"meta\":,\"timestamp\":\"\"}\n") - 1)
+
 /**
- * Converts nanoseconds -> ISO8601
+ * Converts nanoseconds -> ISO8601. `buf` needs ISO_LEN bytes.
  */
-static void isoformat_time_ns(int64_t ts, char *buf, size_t bufsize) {
-    if (!buf || bufsize < 1) return;
-    time_t secs = (time_t)(ts / 1000000000LL);
+static void isoformat_time_ns(IsoCache *cache, int64_t ts, char *buf) {
+    int64_t secs = ts / 1000000000LL;
     long nanos = (long)(ts % 1000000000LL);
+    if (nanos < 0) {
+        secs -= 1;
+        nanos += 1000000000L;
+    }
+
+    if (secs != cache->secs) {
+        time_t t = (time_t)secs;
+        struct tm tmv;
+        gmtime_r(&t, &tmv);
+        if (strftime(cache->prefix, sizeof(cache->prefix), "%Y-%m-%dT%H:%M:%S", &tmv) == 0) {
+            memcpy(cache->prefix, "0000-00-00T00:00:00", sizeof(cache->prefix));
+        }
+        cache->secs = secs;
+    }
 
-    struct tm tmv;
-    gmtime_r(&secs, &tmv);
-
-    snprintf(buf, bufsize,
-             "%04d-%02d-%02dT%02d:%02d:%02d.%09ldZ",
-             tmv.tm_year + 1900,
-             tmv.tm_mon + 1,
-             tmv.tm_mday,
-             tmv.tm_hour,
-             tmv.tm_min,
-             tmv.tm_sec,
-             nanos);
+    memcpy(buf, cache->prefix, 19);
+    buf[19] = '.';
+    for (int i = 28; i >= 20; i--) {
+        buf[i] = (char)('0' + nanos % 10);
+        nanos /= 10;
+    }
+    buf[29] = 'Z';
+}
+
+static size_t line_bound(size_t name_len, size_t meta_len, const WaggleMsg *value) {
+    return LINE_FIXED_LEN + JSON_ESCAPED_MAX(name_len) + wagglemsg_value_json_bound(value) + meta_len + ISO_LEN;
+}
+
+// dst must hold line_bound() bytes. Only the value fields of `value` are used.
+static size_t format_line(char *dst, IsoCache *cache,
+                          const char *name, size_t name_len,
+                          const char *meta, size_t meta_len,
+                          const WaggleMsg *value, uint64_t timestamp) {
+    size_t start, end;
+    if (json_validate(meta, meta_len, &start, &end) == 0) {
+        meta += start;
+        meta_len = end - start;
+    } else {
+        meta = "{}";
+        meta_len = 2;
+    }
+
+    char *out = dst;
+    memcpy(out, "{\"name\":\"", 9);
+    out += 9;
+    out += json_escape(out, name, name_len);
+    memcpy(out, "\",\"val\":", 8);
+    out += 8;
+    out += wagglemsg_write_value_json(out, value);
+    memcpy(out, ",\"meta\":", 8);
+    out += 8;
+    memcpy(out, meta, meta_len);
+    out += meta_len;
+    memcpy(out, ",\"timestamp\":\"", 14);
+    out += 14;
+    isoformat_time_ns(cache, (int64_t)timestamp, out);
+    out += ISO_LEN;
+    memcpy(out, "\"}\n", 3);
+    out += 3;
+    return (size_t)(out - dst);
+}
+
+// -----------------------------------------------------------------------------
+// Lifecycle
+// -----------------------------------------------------------------------------
+void filepublisher_options_default(FilePublisherOptions *opts) {
+    if (!opts) return;
+    opts->async          = 0;
+    opts->queue_capacity = FILEPUBLISHER_DEFAULT_QUEUE_CAPACITY;
+    opts->flush_bytes    = FILEPUBLISHER_DEFAULT_FLUSH_BYTES;
+    opts->flush_ms       = FILEPUBLISHER_DEFAULT_FLUSH_MS;
+    opts->sync_ms        = 0;
+    opts->segment_bytes  = 0;
+    opts->segment_ms     = 0;
+    opts->compress       = 0;
+    opts->retention_bytes = 0;
 }
 
 FilePublisher* filepublisher_new(const char *logdir) {
+    return filepublisher_new_with_options(logdir, NULL);
+}
+
+FilePublisher* filepublisher_new_with_options(const char *logdir, const FilePublisherOptions *opts) {
     DBGPRINT("filepublisher_new(logdir=%s)\n", logdir ? logdir : "NULL");
     if (!logdir) {
         DBGPRINT("No logdir. Returning NULL.\n");
@@ -50,30 +178,123 @@ FilePublisher* filepublisher_new(const char *logdir) {
         DBGPRINT("calloc failed.\n");
         return NULL;
     }
+    if (opts) {
+        fp->opts = *opts;
+    } else {
+        filepublisher_options_default(&fp->opts);
+    }
 
-    char path[1024];
-    snprintf(path, sizeof(path), "%s/data.ndjson", logdir);
-
-    fp->f = fopen(path, "a");
-    if (!fp->f) {
-        DBGPRINT("Failed to open file %s\n", path);
+    SegmentLogOptions log_opts = {
+        .segment_bytes = fp->opts.segment_bytes,
+        .segment_ms = fp->opts.segment_ms,
+        .compress = fp->opts.compress,
+        .retention_bytes = fp->opts.retention_bytes,
+    };
+    fp->log = segmentlog_open(logdir, &log_opts);
+    if (!fp->log) {
+        DBGPRINT("Failed to open log in %s\n", logdir);
         free(fp);
         return NULL;
     }
-    DBGPRINT("Opened filepublisher at %s\n", path);
+    DBGPRINT("Opened filepublisher at %s/data.ndjson\n", logdir);
+
+    if (fp->opts.async) {
+        size_t flush_bytes = fp->opts.flush_bytes > 0 ? fp->opts.flush_bytes
+                                                      : FILEPUBLISHER_DEFAULT_FLUSH_BYTES;
+        fp->wbuf_cap = (flush_bytes + FP_WRITE_ALIGN - 1) / FP_WRITE_ALIGN * FP_WRITE_ALIGN;
+        fp->ring = ringbuf_new(fp->opts.queue_capacity > 0 ? fp->opts.queue_capacity
+                                                           : FILEPUBLISHER_DEFAULT_QUEUE_CAPACITY);
+        fp->slab = slab_pool_new(FP_SLAB_BYTES);
+        if (posix_memalign((void**)&fp->wbuf, FP_WRITE_ALIGN, fp->wbuf_cap) != 0) {
+            fp->wbuf = NULL;
+        }
+        atomic_init(&fp->stop_flag, 0);
+        atomic_init(&fp->dropped, 0);
+        if (!fp->ring || !fp->slab || !fp->wbuf ||
+            pthread_create(&fp->thread, NULL, filepublisher_thread_main, fp) != 0) {
+            DBGPRINT("Could not start writer thread.\n");
+            filepublisher_free(fp);
+            return NULL;
+        }
+        fp->thread_started = 1;
+    }
     return fp;
 }
 
 void filepublisher_free(FilePublisher *fp) {
     DBGPRINT("filepublisher_free() called.\n");
     if (!fp) return;
-    if (fp->f) fclose(fp->f);
+    if (fp->thread_started) {
+        atomic_store(&fp->stop_flag, 1);
+        ringbuf_wake(fp->ring);
+        pthread_join(fp->thread, NULL); // drains and writes everything queued
+    }
+    if (fp->ring) {
+        FileEntry *e;
+        while ((e = ringbuf_pop(fp->ring)) != NULL) {
+            slab_release(e);
+        }
+        ringbuf_free(fp->ring);
+    }
+    slab_pool_free(fp->slab);
+    free(fp->wbuf);
+    segmentlog_close(fp->log);
     free(fp);
 }
 
+// -----------------------------------------------------------------------------
+// Logging
+// -----------------------------------------------------------------------------
+static int log_sync(FilePublisher *fp, const WaggleMsg *msg, size_t name_len, size_t meta_len) {
+    IsoCache cache = { -1, {0} };
+    char stackbuf[1024];
+    size_t bound = line_bound(name_len, meta_len, msg);
+    char *buf = bound <= sizeof(stackbuf) ? stackbuf : malloc(bound);
+    if (!buf) return -2;
+
+    size_t len = format_line(buf, &cache, msg->name, name_len, msg->meta, meta_len,
+                             msg, msg->timestamp);
+    int ret = segmentlog_write(fp->log, buf, len, msg->timestamp, msg->timestamp, 1) == 0 ? 0 : -3;
+    if (buf != stackbuf) free(buf);
+    return ret;
+}
+
+static int log_async(FilePublisher *fp, const WaggleMsg *msg, size_t name_len, size_t meta_len) {
+    size_t data_len = 0;
+    if ((msg->type == WAGGLE_VALUE_STRING || msg->type == WAGGLE_VALUE_BYTES) && msg->data) {
+        data_len = msg->data_len;
+    }
+    if (data_len > UINT32_MAX) return -1;
+    FileEntry *e = slab_alloc(fp->slab, sizeof(FileEntry) + name_len + meta_len + data_len);
+    if (!e) {
+        atomic_fetch_add_explicit(&fp->dropped, 1, memory_order_relaxed);
+        return -2;
+    }
+    e->value = msg->value;
+    e->dvalue = msg->dvalue;
+    e->type = msg->type;
+    e->timestamp = msg->timestamp;
+    e->name_len = (uint32_t)name_len;
+    e->meta_len = (uint32_t)meta_len;
+    e->data_len = (uint32_t)data_len;
+    memcpy(e->strings, msg->name, name_len);
+    memcpy(e->strings + name_len, msg->meta, meta_len);
+    if (data_len) {
+        memcpy(e->strings + name_len + meta_len, msg->data, data_len);
+    }
+
+    if (ringbuf_push(fp->ring, e) != 0) {
+        // local logging is best effort: never stall the sampling loop
+        slab_release(e);
+        atomic_fetch_add_explicit(&fp->dropped, 1, memory_order_relaxed);
+        return -3;
+    }
+    return 0;
+}
+
 int filepublisher_log(FilePublisher *fp, const WaggleMsg *msg) {
     DBGPRINT("filepublisher_log() called.\n");
-    if (!fp || !fp->f || !msg) {
+    if (!fp || !msg || !msg->name) {
         DBGPRINT("Invalid args.\n");
         return -1;
     }
@@ -83,34 +304,112 @@ int filepublisher_log(FilePublisher *fp, const WaggleMsg *msg) {
         return 0;
     }
 
-    char *raw_json = wagglemsg_dump_json(msg);
-    if (!raw_json) {
-        DBGPRINT("wagglemsg_dump_json returned NULL.\n");
-        return -2;
+    size_t name_len = strlen(msg->name);
+    size_t meta_len = msg->meta ? strlen(msg->meta) : 0;
+    if (fp->opts.async) {
+        return log_async(fp, msg, name_len, meta_len);
+    }
+    return log_sync(fp, msg, name_len, meta_len);
+}
+
+uint64_t filepublisher_dropped(FilePublisher *fp) {
+    if (!fp || !fp->opts.async) return 0;
+    return atomic_load_explicit(&fp->dropped, memory_order_relaxed);
+}
+
+// -----------------------------------------------------------------------------
+// Writer thread: drain samples, format into wbuf, write in large chunks
+// -----------------------------------------------------------------------------
+static void writer_flush(FilePublisher *fp) {
+    if (fp->wbuf_len == 0) return;
+    if (segmentlog_write(fp->log, fp->wbuf, fp->wbuf_len,
+                         fp->wbuf_first_ts, fp->wbuf_last_ts, fp->wbuf_lines) != 0) {
+        fprintf(stderr, "filepublisher: write failed: %s\n", strerror(errno));
     }
+    fp->wbuf_len = 0;
+    fp->wbuf_lines = 0;
+    fp->dirty = 1;
+}
 
-    cJSON *root = cJSON_Parse(raw_json);
-    free(raw_json);
-    if (!root) {
-        DBGPRINT("cJSON_Parse failed.\n");
-        return -3;
+static void writer_append(FilePublisher *fp, IsoCache *cache, const FileEntry *e) {
+    WaggleMsg value = {
+        .value = e->value,
+        .type = e->type,
+        .dvalue = e->dvalue,
+        .data = (void*)(e->strings + e->name_len + e->meta_len),
+        .data_len = e->data_len,
+    };
+    size_t bound = line_bound(e->name_len, e->meta_len, &value);
+    if (fp->wbuf_len + bound > fp->wbuf_cap) {
+        writer_flush(fp);
+    }
+
+    if (bound > fp->wbuf_cap) {
+        // a single huge line; format it on its own
+        char *buf = malloc(bound);
+        if (!buf) return;
+        size_t len = format_line(buf, cache, e->strings, e->name_len,
+                                 e->strings + e->name_len, e->meta_len, &value, e->timestamp);
+        segmentlog_write(fp->log, buf, len, e->timestamp, e->timestamp, 1);
+        free(buf);
+        fp->dirty = 1;
+        return;
     }
 
-    cJSON_DeleteItemFromObject(root, "ts");
+    if (fp->wbuf_lines == 0 || e->timestamp < fp->wbuf_first_ts) fp->wbuf_first_ts = e->timestamp;
+    if (fp->wbuf_lines == 0 || e->timestamp > fp->wbuf_last_ts) fp->wbuf_last_ts = e->timestamp;
+    fp->wbuf_lines++;
+    fp->wbuf_len += format_line(fp->wbuf + fp->wbuf_len, cache, e->strings, e->name_len,
+                                e->strings + e->name_len, e->meta_len, &value, e->timestamp);
+}
+
+static void* filepublisher_thread_main(void *arg) {
+    FilePublisher *fp = (FilePublisher*)arg;
+    DBGPRINT("writer thread started.\n");
+
+    IsoCache cache = { -1, {0} };
+    FileEntry *batch[FP_DRAIN_BATCH];
+    size_t flush_bytes = fp->opts.flush_bytes > 0 ? fp->opts.flush_bytes : fp->wbuf_cap;
+    int flush_ms = fp->opts.flush_ms > 0 ? fp->opts.flush_ms : FILEPUBLISHER_DEFAULT_FLUSH_MS;
+    uint64_t first_buffered_ms = 0;  // when wbuf went from empty to non-empty
+    uint64_t last_sync_ms = monotonic_ms();
 
-    char iso_buf[64];
-    isoformat_time_ns(msg->timestamp, iso_buf, sizeof(iso_buf));
-    cJSON_AddStringToObject(root, "timestamp", iso_buf);
+    for (;;) {
+        int stopping = atomic_load(&fp->stop_flag);
+        size_t n = ringbuf_pop_bulk(fp->ring, (void**)batch, FP_DRAIN_BATCH);
+        for (size_t i = 0; i < n; i++) {
+            if (fp->wbuf_len == 0) first_buffered_ms = monotonic_ms();
+            writer_append(fp, &cache, batch[i]);
+            slab_release(batch[i]);
+        }
 
-    char *final_str = cJSON_PrintUnformatted(root);
-    cJSON_Delete(root);
-    if (!final_str) {
-        DBGPRINT("cJSON_PrintUnformatted failed.\n");
-        return -4;
+        uint64_t now = monotonic_ms();
+        // group commit: write once enough is buffered or the oldest line is due
+        if (fp->wbuf_len > 0 &&
+            (fp->wbuf_len >= flush_bytes || now - first_buffered_ms >= (uint64_t)flush_ms ||
+             (n == 0 && stopping))) {
+            writer_flush(fp);
+        }
+        if (fp->dirty && fp->opts.sync_ms > 0 &&
+            (now - last_sync_ms >= (uint64_t)fp->opts.sync_ms || stopping)) {
+            segmentlog_sync(fp->log);
+            last_sync_ms = now;
+            fp->dirty = 0;
+        }
+
+        segmentlog_tick(fp->log);
+
+        if (n == 0) {
+            if (stopping) break;
+            int wait_ms = flush_ms;
+            if (fp->wbuf_len > 0) {
+                uint64_t due = first_buffered_ms + (uint64_t)flush_ms;
+                wait_ms = due > now ? (int)(due - now) : 1;
+            }
+            ringbuf_wait(fp->ring, wait_ms);
+        }
     }
-    fprintf(fp->f, "%s\n", final_str);
-    fflush(fp->f);
-    free(final_str);
 
-    return 0;
+    DBGPRINT("writer thread stopped.\n");
+    return NULL;
 }
@@ -0,0 +1,115 @@
+/**
+ * histogram.c
+ *
+ * Purpose:
+ *   Latency histograms for plugin_get_stats. A value's bucket comes from
+ *   its highest set bit plus the next HIST_SUB_BITS bits, so recording
+ *   needs no search, no lock and no floating point.
+ */
+
+#include "waggle/histogram.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef DEBUG
+  #define DBGPRINT(...) do { fprintf(stderr, "[DEBUG histogram] "); fprintf(stderr, __VA_ARGS__); } while(0)
+#else
+  #define DBGPRINT(...) do {} while(0)
+#endif
+
+#define HIST_SUB_BITS    4
+#define HIST_SUB_COUNT   (1 << HIST_SUB_BITS)
+// values below HIST_SUB_COUNT get a bucket each; then 16 per power of two
+#define HIST_NUM_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+struct Histogram {
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+    _Atomic uint64_t buckets[HIST_NUM_BUCKETS];
+};
+
+static inline unsigned bucket_of(uint64_t v) {
+    if (v < HIST_SUB_COUNT) return (unsigned)v;
+    unsigned e = 63u - (unsigned)__builtin_clzll(v); // >= HIST_SUB_BITS
+    unsigned sub = (unsigned)(v >> (e - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB_COUNT + sub;
+}
+
+// Largest value that lands in bucket `b`.
+static uint64_t bucket_upper(unsigned b) {
+    if (b < HIST_SUB_COUNT) return b;
+    unsigned e = b / HIST_SUB_COUNT + HIST_SUB_BITS - 1;
+    uint64_t sub = b % HIST_SUB_COUNT;
+    uint64_t width = (uint64_t)1 << (e - HIST_SUB_BITS);
+    return ((HIST_SUB_COUNT + sub) << (e - HIST_SUB_BITS)) + (width - 1);
+}
+
+Histogram* histogram_new(void) {
+    Histogram *h = calloc(1, sizeof(Histogram));
+    if (!h) {
+        DBGPRINT("histogram_new: out of memory\n");
+    }
+    return h;
+}
+
+void histogram_free(Histogram *h) {
+    free(h);
+}
+
+void histogram_record(Histogram *h, uint64_t value) {
+    atomic_fetch_add_explicit(&h->buckets[bucket_of(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, value, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (value > max &&
+           !atomic_compare_exchange_weak_explicit(&h->max, &max, value,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+void histogram_summarize(Histogram *const *hs, size_t n, HistogramSummary *out) {
+    memset(out, 0, sizeof(*out));
+    uint64_t *counts = calloc(HIST_NUM_BUCKETS, sizeof(uint64_t));
+    if (!counts) return;
+
+    uint64_t sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        Histogram *h = hs[i];
+        if (!h) continue;
+        sum += atomic_load_explicit(&h->sum, memory_order_relaxed);
+        uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+        if (max > out->max) out->max = max;
+        for (unsigned b = 0; b < HIST_NUM_BUCKETS; b++) {
+            counts[b] += atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+        }
+    }
+    // count from the buckets themselves so the percentiles add up even
+    // while other threads are recording
+    for (unsigned b = 0; b < HIST_NUM_BUCKETS; b++) {
+        out->count += counts[b];
+    }
+    if (out->count == 0) {
+        free(counts);
+        return;
+    }
+    out->mean = sum / out->count;
+
+    // ranks are 1-based: the p-th percentile is the ceil(p * count)-th value
+    static const uint64_t per_mille[4] = { 500, 900, 990, 999 };
+    uint64_t *dst[4] = { &out->p50, &out->p90, &out->p99, &out->p999 };
+    uint64_t seen = 0;
+    int q = 0;
+    for (unsigned b = 0; b < HIST_NUM_BUCKETS && q < 4; b++) {
+        seen += counts[b];
+        while (q < 4 && seen * 1000 >= per_mille[q] * out->count) {
+            uint64_t v = bucket_upper(b);
+            *dst[q++] = v < out->max ? v : out->max;
+        }
+    }
+    free(counts);
+}
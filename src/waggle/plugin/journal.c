@@ -0,0 +1,396 @@
+/**
+ * journal.c
+ *
+ * Purpose:
+ *   Crash-safe write-ahead journal for queued messages. Records are
+ *   appended with a single writev to O_APPEND segment files:
+ *
+ *     [u32 crc32][u32 scope_len][u32 data_len][scope][data]
+ *
+ *   where the CRC covers both lengths and the payload. Each segment keeps a
+ *   reference count of unacked records, plus one reference held by the
+ *   journal while the segment is active or being replayed. Whoever drops the
+ *   last reference deletes the file.
+ */
+
+#include "waggle/journal.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#ifdef DEBUG
+  #define DBGPRINT(...) do { fprintf(stderr, "[DEBUG journal] "); fprintf(stderr, __VA_ARGS__); } while(0)
+#else
+  #define DBGPRINT(...) do {} while(0)
+#endif
+
+#define JOURNAL_MAX_RECORD (64u * 1024u * 1024u)
+
+struct JournalSegment {
+    uint64_t        id;
+    _Atomic long    refs;
+    JournalSegment *next;
+};
+
+struct Journal {
+    char   *dir;
+    size_t  segment_bytes;
+    int     sync;
+
+    // append side, guarded by lock
+    pthread_mutex_t lock;
+    JournalSegment *segments;   // every segment file still on disk
+    JournalSegment *active;
+    int             active_fd;
+    size_t          active_size;
+    uint64_t        next_id;
+
+    // replay side (single reader)
+    JournalSegment **replay;
+    size_t           replay_count;
+    size_t           replay_pos;
+    int              replay_fd;
+    off_t            replay_off;
+    char            *buf;
+    size_t           buf_cap;
+};
+
+// -----------------------------------------------------------------------------
+// CRC-32 (IEEE 802.3, same as zlib's crc32)
+// -----------------------------------------------------------------------------
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32_update(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    crc = ~crc;
+    while (len--) {
+        crc = crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static uint32_t record_crc(const uint32_t lens[2], const char *scope, const char *data) {
+    uint32_t crc = crc32_update(0, lens, 2 * sizeof(uint32_t));
+    crc = crc32_update(crc, scope, lens[0]);
+    return crc32_update(crc, data, lens[1]);
+}
+
+// -----------------------------------------------------------------------------
+// helpers
+// -----------------------------------------------------------------------------
+static void segment_path(const Journal *j, uint64_t id, char *buf, size_t bufsize) {
+    snprintf(buf, bufsize, "%s/journal-%020llu.wal", j->dir, (unsigned long long)id);
+}
+
+static int pread_full(int fd, void *buf, size_t len, off_t off) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t r = pread(fd, p, len, off);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (r == 0) return -1; // short file
+        p += r;
+        len -= (size_t)r;
+        off += r;
+    }
+    return 0;
+}
+
+static JournalSegment* segment_new(Journal *j, uint64_t id) {
+    JournalSegment *seg = calloc(1, sizeof(JournalSegment));
+    if (!seg) return NULL;
+    seg->id = id;
+    atomic_init(&seg->refs, 1); // the journal's own reference
+    seg->next = j->segments;
+    j->segments = seg;
+    return seg;
+}
+
+// Caller holds j->lock.
+static void segment_remove_locked(Journal *j, JournalSegment *seg) {
+    char path[1024];
+    segment_path(j, seg->id, path, sizeof(path));
+    if (unlink(path) != 0 && errno != ENOENT) {
+        perror("unlink(journal segment)");
+    }
+    DBGPRINT("Removed fully acked segment %s\n", path);
+
+    JournalSegment **pp = &j->segments;
+    while (*pp && *pp != seg) pp = &(*pp)->next;
+    if (*pp) *pp = seg->next;
+    free(seg);
+}
+
+static void segment_release(Journal *j, JournalSegment *seg) {
+    if (atomic_fetch_sub(&seg->refs, 1) == 1) {
+        pthread_mutex_lock(&j->lock);
+        segment_remove_locked(j, seg);
+        pthread_mutex_unlock(&j->lock);
+    }
+}
+
+// Caller holds j->lock. Seals the active segment and opens a new one.
+static int journal_rotate_locked(Journal *j) {
+    if (j->active) {
+        close(j->active_fd);
+        JournalSegment *old = j->active;
+        j->active = NULL;
+        j->active_fd = -1;
+        if (atomic_fetch_sub(&old->refs, 1) == 1) {
+            segment_remove_locked(j, old);
+        }
+    }
+
+    uint64_t id = j->next_id++;
+    char path[1024];
+    segment_path(j, id, path, sizeof(path));
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0664);
+    if (fd < 0) {
+        perror("open(journal segment)");
+        return -1;
+    }
+    JournalSegment *seg = segment_new(j, id);
+    if (!seg) {
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    j->active = seg;
+    j->active_fd = fd;
+    j->active_size = 0;
+    DBGPRINT("Opened journal segment %s\n", path);
+    return 0;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// -----------------------------------------------------------------------------
+// public API
+// -----------------------------------------------------------------------------
+Journal* journal_open(const char *dir, size_t segment_bytes, int sync) {
+    DBGPRINT("journal_open(dir=%s)\n", dir ? dir : "NULL");
+    if (!dir) return NULL;
+    pthread_once(&crc_once, crc_init);
+
+    if (mkdir(dir, 0775) != 0 && errno != EEXIST) {
+        perror("mkdir(journal)");
+        return NULL;
+    }
+
+    Journal *j = calloc(1, sizeof(Journal));
+    if (!j) return NULL;
+    j->dir = strdup(dir);
+    if (!j->dir) {
+        free(j);
+        return NULL;
+    }
+    j->segment_bytes = segment_bytes ? segment_bytes : (16u * 1024u * 1024u);
+    j->sync = sync;
+    j->active_fd = -1;
+    j->replay_fd = -1;
+    j->next_id = 1;
+    pthread_mutex_init(&j->lock, NULL);
+
+    // collect segments left over from a previous run
+    DIR *d = opendir(dir);
+    if (!d) {
+        perror("opendir(journal)");
+        journal_close(j);
+        return NULL;
+    }
+    uint64_t *ids = NULL;
+    size_t n = 0, cap = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        unsigned long long id;
+        char tail;
+        if (sscanf(de->d_name, "journal-%llu.wa%c", &id, &tail) != 2 || tail != 'l') continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            uint64_t *tmp = realloc(ids, cap * sizeof(uint64_t));
+            if (!tmp) break;
+            ids = tmp;
+        }
+        ids[n++] = id;
+    }
+    closedir(d);
+
+    if (n > 0) {
+        qsort(ids, n, sizeof(uint64_t), compare_u64);
+        j->replay = calloc(n, sizeof(JournalSegment*));
+        for (size_t i = 0; j->replay && i < n; i++) {
+            JournalSegment *seg = segment_new(j, ids[i]);
+            if (!seg) break;
+            j->replay[j->replay_count++] = seg;
+        }
+        j->next_id = ids[n - 1] + 1;
+        DBGPRINT("Found %zu segments to replay\n", j->replay_count);
+    }
+    free(ids);
+    return j;
+}
+
+void journal_close(Journal *j) {
+    DBGPRINT("journal_close() called.\n");
+    if (!j) return;
+
+    if (j->replay_fd >= 0) close(j->replay_fd);
+
+    pthread_mutex_lock(&j->lock);
+    if (j->active) {
+        close(j->active_fd);
+        // nothing outstanding: the segment holds no undelivered messages
+        if (atomic_load(&j->active->refs) == 1) {
+            segment_remove_locked(j, j->active);
+        }
+        j->active = NULL;
+    }
+    // whatever is left stays on disk for the next run
+    while (j->segments) {
+        JournalSegment *seg = j->segments;
+        j->segments = seg->next;
+        free(seg);
+    }
+    pthread_mutex_unlock(&j->lock);
+
+    pthread_mutex_destroy(&j->lock);
+    free(j->replay);
+    free(j->buf);
+    free(j->dir);
+    free(j);
+}
+
+JournalSegment* journal_append(Journal *j, const char *scope, const char *data, int len) {
+    if (!j || !scope || !data || len < 0) return NULL;
+
+    uint32_t lens[2] = { (uint32_t)strlen(scope), (uint32_t)len };
+    uint32_t crc = record_crc(lens, scope, data);
+    struct iovec iov[4] = {
+        { .iov_base = &crc,         .iov_len = sizeof(crc) },
+        { .iov_base = lens,         .iov_len = sizeof(lens) },
+        { .iov_base = (void*)scope, .iov_len = lens[0] },
+        { .iov_base = (void*)data,  .iov_len = lens[1] },
+    };
+    size_t total = sizeof(crc) + sizeof(lens) + lens[0] + lens[1];
+
+    pthread_mutex_lock(&j->lock);
+    if (!j->active || j->active_size >= j->segment_bytes) {
+        if (journal_rotate_locked(j) != 0) {
+            pthread_mutex_unlock(&j->lock);
+            return NULL;
+        }
+    }
+
+    ssize_t w = writev(j->active_fd, iov, 4);
+    if (w != (ssize_t)total) {
+        perror("writev(journal)");
+        // a torn record fails its checksum on replay; start a fresh segment
+        j->active_size = j->segment_bytes;
+        pthread_mutex_unlock(&j->lock);
+        return NULL;
+    }
+    if (j->sync && fdatasync(j->active_fd) != 0) {
+        perror("fdatasync(journal)");
+    }
+    j->active_size += total;
+
+    JournalSegment *seg = j->active;
+    atomic_fetch_add(&seg->refs, 1);
+    pthread_mutex_unlock(&j->lock);
+    return seg;
+}
+
+void journal_ack(Journal *j, JournalSegment *seg) {
+    if (!j || !seg) return;
+    segment_release(j, seg);
+}
+
+int journal_replay_next(Journal *j, JournalSegment **seg,
+                        const char **scope, const char **data, int *len) {
+    if (!j) return 0;
+
+    while (j->replay_pos < j->replay_count) {
+        JournalSegment *cur = j->replay[j->replay_pos];
+
+        if (j->replay_fd < 0) {
+            char path[1024];
+            segment_path(j, cur->id, path, sizeof(path));
+            j->replay_fd = open(path, O_RDONLY | O_CLOEXEC);
+            j->replay_off = 0;
+            if (j->replay_fd < 0) {
+                perror("open(journal replay)");
+                goto next_segment;
+            }
+            DBGPRINT("Replaying %s\n", path);
+        }
+
+        uint32_t hdr[3]; // crc, scope_len, data_len
+        if (pread_full(j->replay_fd, hdr, sizeof(hdr), j->replay_off) != 0 ||
+            hdr[1] > JOURNAL_MAX_RECORD || hdr[2] > JOURNAL_MAX_RECORD) {
+            goto next_segment; // end of segment or torn header
+        }
+
+        size_t need = (size_t)hdr[1] + 1 + hdr[2];
+        if (need > j->buf_cap) {
+            char *nb = realloc(j->buf, need);
+            if (!nb) return 0;
+            j->buf = nb;
+            j->buf_cap = need;
+        }
+        char *s = j->buf;
+        char *d = j->buf + hdr[1] + 1;
+        off_t off = j->replay_off + (off_t)sizeof(hdr);
+        if (pread_full(j->replay_fd, s, hdr[1], off) != 0 ||
+            pread_full(j->replay_fd, d, hdr[2], off + hdr[1]) != 0 ||
+            record_crc(&hdr[1], s, d) != hdr[0]) {
+            fprintf(stderr, "journal_replay_next: bad record in segment %llu at offset %lld\n",
+                    (unsigned long long)cur->id, (long long)j->replay_off);
+            goto next_segment;
+        }
+        s[hdr[1]] = '\0';
+        j->replay_off = off + hdr[1] + hdr[2];
+
+        atomic_fetch_add(&cur->refs, 1);
+        *seg = cur;
+        *scope = s;
+        *data = d;
+        *len = (int)hdr[2];
+        return 1;
+
+    next_segment:
+        if (j->replay_fd >= 0) {
+            close(j->replay_fd);
+            j->replay_fd = -1;
+        }
+        j->replay_pos++;
+        segment_release(j, cur); // deleted now if every replayed record was acked
+    }
+    return 0;
+}
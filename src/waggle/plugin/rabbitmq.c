@@ -2,16 +2,22 @@
  * rabbitmq.c
  *
  * Purpose:
- *   Manages a persistent RabbitMQ connection (no heartbeats).
- *   Allows repeated connect, publish, and close logic.
+ *   Manages a persistent RabbitMQ connection with AMQP heartbeats and TCP
+ *   keepalive. Allows repeated connect, publish, and close logic, and
+ *   provides the AMQP transport (transport_amqp) for publisher lanes.
  */
 
 #include "waggle/config.h"
 #include "waggle/rabbitmq.h"
+#include "waggle/transport.h"
 
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <rabbitmq-c/amqp.h>
 #include <rabbitmq-c/tcp_socket.h>
 
@@ -60,13 +66,49 @@ static void print_amqp_error(amqp_rpc_reply_t r, const char *ctx) {
 }
 
 // -----------------------------------------------------------------------------
-RabbitMQConn* rabbitmq_conn_create(const PluginConfig *config) {
+// Frees a connection that failed while being set up.
+static void conn_abort(RabbitMQConn *rc) {
+    amqp_destroy_connection(rc->conn);
+    free(rc);
+}
+
+// Turns on TCP keepalive so a peer that vanished without closing the
+// connection is noticed after roughly idle_s + 3 * idle_s / 3 seconds,
+// and bounds how long sent data may stay unacknowledged to the same.
+static void set_keepalive(int fd, int idle_s) {
+    if (fd < 0 || idle_s <= 0) return;
+    int on = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) != 0) {
+        DBGPRINT("SO_KEEPALIVE failed.\n");
+        return;
+    }
+    int intvl = idle_s / 3 > 0 ? idle_s / 3 : 1;
+    int cnt = 3;
+#ifdef TCP_KEEPIDLE
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle_s, sizeof(idle_s));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt));
+#endif
+#ifdef TCP_USER_TIMEOUT
+    unsigned int user_timeout_ms = (unsigned int)(idle_s + intvl * cnt) * 1000u;
+    setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout_ms, sizeof(user_timeout_ms));
+#endif
+}
+
+// -----------------------------------------------------------------------------
+// Connects, logs in and opens channels 1..`channels`, with publisher
+// confirms enabled on each if `confirms` is set.
+static RabbitMQConn* conn_open(const PluginConfig *config, int channels, int confirms) {
     if (!config) {
         fprintf(stderr, "rabbitmq_conn_create: config is NULL\n");
         return NULL;
     }
+    if (channels < 1 || channels > RABBITMQ_MAX_CHANNELS) {
+        fprintf(stderr, "rabbitmq_conn_create: invalid channel count %d\n", channels);
+        return NULL;
+    }
 
-    DBGPRINT("rabbitmq_conn_create(%s:%d)\n", config->host, config->port);
+    DBGPRINT("rabbitmq_conn_create(%s:%d, %d channels)\n", config->host, config->port, channels);
 
     RabbitMQConn *rc = calloc(1, sizeof(RabbitMQConn));
     if (!rc) {
@@ -78,50 +120,87 @@ RabbitMQConn* rabbitmq_conn_create(const PluginConfig *config) {
     amqp_socket_t *sock = amqp_tcp_socket_new(rc->conn);
     if (!sock) {
         fprintf(stderr, "Cannot create TCP socket.\n");
-        free(rc);
+        conn_abort(rc);
         return NULL;
     }
 
-    if (amqp_socket_open(sock, config->host, config->port)) {
-        fprintf(stderr, "Cannot open socket to %s:%d.\n", config->host, config->port);
-        free(rc);
+    // bound the TCP connect, the login handshake and each RPC reply, so an
+    // unreachable broker fails fast instead of hanging the publisher
+    struct timeval tv = { .tv_sec = 0, .tv_usec = 0 };
+    const struct timeval *timeout = NULL;
+    if (config->connect_timeout_ms > 0) {
+        tv.tv_sec  = config->connect_timeout_ms / 1000;
+        tv.tv_usec = (config->connect_timeout_ms % 1000) * 1000;
+        timeout = &tv;
+    }
+    amqp_set_handshake_timeout(rc->conn, timeout);
+    amqp_set_rpc_timeout(rc->conn, timeout);
+
+    int status = amqp_socket_open_noblock(sock, config->host, config->port, timeout);
+    if (status != AMQP_STATUS_OK) {
+        fprintf(stderr, "Cannot open socket to %s:%d: %s\n", config->host, config->port,
+                amqp_error_string2(status));
+        conn_abort(rc);
         return NULL;
     }
+    set_keepalive(amqp_get_sockfd(rc->conn), config->tcp_keepalive_s);
 
-    // No heartbeat => request = 0
-    amqp_rpc_reply_t r = amqp_login(rc->conn, "/", 0, 131072, 0,
+    // the broker may lower the heartbeat; rabbitmq-c sends ours and reports
+    // AMQP_STATUS_HEARTBEAT_TIMEOUT once the broker's heartbeats stop arriving
+    amqp_rpc_reply_t r = amqp_login(rc->conn, "/", 0, 131072,
+                                    config->heartbeat_s > 0 ? config->heartbeat_s : 0,
                                     AMQP_SASL_METHOD_PLAIN,
                                     config->username,
                                     config->password);
     if (r.reply_type != AMQP_RESPONSE_NORMAL) {
         print_amqp_error(r, "amqp_login");
-        free(rc);
+        conn_abort(rc);
         return NULL;
     }
+    DBGPRINT("negotiated heartbeat: %ds\n", amqp_get_heartbeat(rc->conn));
 
-    // Open channel #1
-    amqp_channel_open(rc->conn, 1);
-    r = amqp_get_rpc_reply(rc->conn);
-    if (r.reply_type != AMQP_RESPONSE_NORMAL) {
-        print_amqp_error(r, "amqp_channel_open");
-        free(rc);
-        return NULL;
-    }
+    // Open the channels, each with publisher confirms enabled if asked
+    for (int ch = 1; ch <= channels; ch++) {
+        amqp_channel_open(rc->conn, (amqp_channel_t)ch);
+        r = amqp_get_rpc_reply(rc->conn);
+        if (r.reply_type != AMQP_RESPONSE_NORMAL) {
+            print_amqp_error(r, "amqp_channel_open");
+            conn_abort(rc);
+            return NULL;
+        }
+        if (!confirms) continue;
 
-    // Enable publisher confirms
-    amqp_confirm_select(rc->conn, 1);
-    r = amqp_get_rpc_reply(rc->conn);
-    if (r.reply_type != AMQP_RESPONSE_NORMAL) {
-        fprintf(stderr, "Failed to enable publisher confirms.\n");
-        free(rc);
-        return NULL;
+        amqp_confirm_select(rc->conn, (amqp_channel_t)ch);
+        r = amqp_get_rpc_reply(rc->conn);
+        if (r.reply_type != AMQP_RESPONSE_NORMAL) {
+            fprintf(stderr, "Failed to enable publisher confirms on channel %d.\n", ch);
+            conn_abort(rc);
+            return NULL;
+        }
+        rc->next_delivery_tag[ch - 1] = 1; // confirm.select starts numbering at 1
     }
 
     rc->connected = 1;
+    rc->num_channels = channels;
     DBGPRINT("rabbitmq_conn_create: connection established.\n");
     return rc;
 }
 
+// -----------------------------------------------------------------------------
+RabbitMQConn* rabbitmq_conn_create_channels(const PluginConfig *config, int channels) {
+    return conn_open(config, channels, 1);
+}
+
+// -----------------------------------------------------------------------------
+RabbitMQConn* rabbitmq_conn_create(const PluginConfig *config) {
+    return conn_open(config, 1, 1);
+}
+
+// -----------------------------------------------------------------------------
+RabbitMQConn* rabbitmq_conn_create_consumer(const PluginConfig *config) {
+    return conn_open(config, 1, 0);
+}
+
 // -----------------------------------------------------------------------------
 void rabbitmq_conn_close(RabbitMQConn *rc) {
     DBGPRINT("rabbitmq_conn_close() called.\n");
@@ -129,27 +208,36 @@ void rabbitmq_conn_close(RabbitMQConn *rc) {
         return;
     }
     if (rc->connected) {
-        amqp_channel_close(rc->conn, 1, AMQP_REPLY_SUCCESS);
+        for (int ch = 1; ch <= rc->num_channels; ch++) {
+            amqp_channel_close(rc->conn, (amqp_channel_t)ch, AMQP_REPLY_SUCCESS);
+        }
         amqp_connection_close(rc->conn, AMQP_REPLY_SUCCESS);
         amqp_destroy_connection(rc->conn);
     }
+    amqp_bytes_free(rc->queue);
+    amqp_bytes_free(rc->consumer_tag);
     free(rc);
 }
 
 // -----------------------------------------------------------------------------
-int rabbitmq_publish_message(
+int rabbitmq_publish_message_on(
     RabbitMQConn *rc,
+    int channel,
     const char *app_id,
     const char *username,
     const char *scope,
     const void *data,
     int app_id_len,
     int username_len,
-    int data_len
+    int data_len,
+    const char *content_type,
+    const char *content_encoding,
+    uint64_t *delivery_tag
 ) {
 
     if (!rc || !rc->connected) return -1;
     if (!scope || !data) return -2;
+    if (channel < 1 || channel > rc->num_channels) return -2;
 
     amqp_bytes_t msg_bytes = { .len = data_len, .bytes = (void*) data };
     amqp_bytes_t app_bytes = { .len = app_id_len, .bytes = (void*) app_id };
@@ -164,10 +252,18 @@ int rabbitmq_publish_message(
     props.delivery_mode = 2; // persistent
     props.app_id = app_bytes;
     props.user_id = usr_bytes;
+    if (content_type) {
+        props._flags |= AMQP_BASIC_CONTENT_TYPE_FLAG;
+        props.content_type = amqp_cstring_bytes(content_type);
+    }
+    if (content_encoding) {
+        props._flags |= AMQP_BASIC_CONTENT_ENCODING_FLAG;
+        props.content_encoding = amqp_cstring_bytes(content_encoding);
+    }
 
     int status = amqp_basic_publish(
         rc->conn,
-        1, // channel
+        (amqp_channel_t)channel,
         amqp_cstring_bytes("to-validator"),
         amqp_cstring_bytes(scope),
         0, // mandatory
@@ -180,13 +276,129 @@ int rabbitmq_publish_message(
         return -3;
     }
 
-    // Wait for confirm
-    struct timeval timeout = {1, 0};
+    if (delivery_tag) {
+        *delivery_tag = rc->next_delivery_tag[channel - 1];
+    }
+    rc->next_delivery_tag[channel - 1]++;
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+int rabbitmq_publish_message_async(
+    RabbitMQConn *rc,
+    const char *app_id,
+    const char *username,
+    const char *scope,
+    const void *data,
+    int app_id_len,
+    int username_len,
+    int data_len,
+    uint64_t *delivery_tag
+) {
+    return rabbitmq_publish_message_on(rc, 1, app_id, username, scope, data,
+                                       app_id_len, username_len, data_len, NULL, NULL, delivery_tag);
+}
+
+// -----------------------------------------------------------------------------
+int rabbitmq_wait_confirm(RabbitMQConn *rc, int timeout_ms, RabbitMQConfirm *out) {
+    if (!rc || !rc->connected || !out) return -1;
+
+    struct timeval timeout;
+    timeout.tv_sec  = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+
     amqp_publisher_confirm_t cresult;
     amqp_rpc_reply_t r = amqp_publisher_confirm_wait(rc->conn, &timeout, &cresult);
+    amqp_maybe_release_buffers(rc->conn);
+
+    if (r.reply_type == AMQP_RESPONSE_LIBRARY_EXCEPTION &&
+        r.library_error == AMQP_STATUS_TIMEOUT) {
+        return 1;
+    }
     if (r.reply_type != AMQP_RESPONSE_NORMAL) {
         print_amqp_error(r, "publisher_confirm_wait");
-        return -4;
+        return -2;
+    }
+
+    out->channel = cresult.channel;
+    switch (cresult.method.id) {
+    case AMQP_BASIC_ACK_METHOD: {
+        amqp_basic_ack_t *m = (amqp_basic_ack_t*) cresult.method.decoded;
+        out->delivery_tag = m->delivery_tag;
+        out->multiple = m->multiple;
+        out->ack = 1;
+        break;
+    }
+    case AMQP_BASIC_NACK_METHOD: {
+        amqp_basic_nack_t *m = (amqp_basic_nack_t*) cresult.method.decoded;
+        out->delivery_tag = m->delivery_tag;
+        out->multiple = m->multiple;
+        out->ack = 0;
+        break;
+    }
+    case AMQP_BASIC_REJECT_METHOD: {
+        amqp_basic_reject_t *m = (amqp_basic_reject_t*) cresult.method.decoded;
+        out->delivery_tag = m->delivery_tag;
+        out->multiple = 0;
+        out->ack = 0;
+        break;
+    }
+    default:
+        fprintf(stderr, "publisher_confirm_wait: unexpected method 0x%08X\n", cresult.method.id);
+        return -3;
+    }
+
+    DBGPRINT("confirm: channel=%d tag=%llu multiple=%d ack=%d\n",
+             out->channel, (unsigned long long) out->delivery_tag, out->multiple, out->ack);
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+int rabbitmq_conn_poll(RabbitMQConn *rc) {
+    RabbitMQConfirm c;
+    int r;
+    while ((r = rabbitmq_wait_confirm(rc, 0, &c)) == 0) {
+        DBGPRINT("rabbitmq_conn_poll: dropping stray confirm %llu\n",
+                 (unsigned long long) c.delivery_tag);
+    }
+    return r < 0 ? r : 0;
+}
+
+// -----------------------------------------------------------------------------
+int rabbitmq_publish_message(
+    RabbitMQConn *rc,
+    const char *app_id,
+    const char *username,
+    const char *scope,
+    const void *data,
+    int app_id_len,
+    int username_len,
+    int data_len
+) {
+    uint64_t tag = 0;
+    int status = rabbitmq_publish_message_async(rc, app_id, username, scope, data,
+                                                app_id_len, username_len, data_len, &tag);
+    if (status != 0) {
+        return status;
+    }
+
+    // Wait for the confirm covering our tag
+    RabbitMQConfirm c;
+    while (1) {
+        int r = rabbitmq_wait_confirm(rc, 1000, &c);
+        if (r != 0) {
+            return -4;
+        }
+        if (c.channel != 1) {
+            continue;
+        }
+        if (c.delivery_tag == tag || (c.multiple && c.delivery_tag > tag)) {
+            break;
+        }
+    }
+    if (!c.ack) {
+        fprintf(stderr, "rabbitmq_publish_message: broker rejected message.\n");
+        return -5;
     }
 
     DBGPRINT("rabbitmq_publish_message: success.\n");
@@ -194,14 +406,258 @@ int rabbitmq_publish_message(
 }
 
 // -----------------------------------------------------------------------------
-int rabbitmq_subscribe_topics(RabbitMQConn *rc, const char **topics, int n) {
+int rabbitmq_reconnect_delay_ms(const PluginConfig *config, int attempt, unsigned int *seed) {
+    long min_ms = config->reconnect_min_ms > 0 ? config->reconnect_min_ms : 1;
+    long max_ms = config->reconnect_max_ms > min_ms ? config->reconnect_max_ms : min_ms;
+    long cap = min_ms;
+    for (int i = 0; i < attempt && cap < max_ms; i++) {
+        cap *= 2;
+    }
+    if (cap > max_ms) cap = max_ms;
+    return (int)(cap / 2 + rand_r(seed) % (cap - cap / 2 + 1));
+}
+
+uint64_t rabbitmq_stable_uptime_ns(const PluginConfig *config) {
+    long ms = 3L * (config->heartbeat_s > 0 ? config->heartbeat_s : 0) * 1000;
+    if (ms < config->reconnect_max_ms) ms = config->reconnect_max_ms;
+    if (ms < RABBITMQ_STABLE_MIN_MS) ms = RABBITMQ_STABLE_MIN_MS;
+    return (uint64_t)ms * 1000000ULL;
+}
+
+// -----------------------------------------------------------------------------
+// transport_amqp: the publishing functions above behind TransportOps
+// -----------------------------------------------------------------------------
+typedef struct {
+    RabbitMQConn       *rc;
+    const PluginConfig *config;
+    int                 app_id_len;
+    int                 username_len;
+} AmqpTransportConn;
+
+static void* amqp_transport_connect(void *arg, const PluginConfig *config, int channels, uint64_t *first_tags) {
+    (void)arg;
+    AmqpTransportConn *tc = calloc(1, sizeof(AmqpTransportConn));
+    if (!tc) return NULL;
+    tc->rc = rabbitmq_conn_create_channels(config, channels);
+    if (!tc->rc) {
+        free(tc);
+        return NULL;
+    }
+    tc->config = config;
+    tc->app_id_len = (int)strlen(config->app_id);
+    tc->username_len = (int)strlen(config->username);
+    for (int ch = 1; ch <= channels; ch++) {
+        first_tags[ch - 1] = tc->rc->next_delivery_tag[ch - 1];
+    }
+    return tc;
+}
+
+static size_t amqp_transport_publish_batch(void *conn, TransportMessage *msgs, size_t n) {
+    AmqpTransportConn *tc = (AmqpTransportConn*)conn;
+    for (size_t i = 0; i < n; i++) {
+        TransportMessage *m = &msgs[i];
+        if (m->len > INT_MAX ||
+            rabbitmq_publish_message_on(tc->rc, m->channel,
+                                        tc->config->app_id, tc->config->username, m->scope, m->data,
+                                        tc->app_id_len, tc->username_len, (int)m->len,
+                                        m->content_type, m->content_encoding, &m->delivery_tag) != 0) {
+            return i;
+        }
+    }
+    return n;
+}
+
+static int amqp_transport_poll_confirms(void *conn, int timeout_ms, TransportConfirm *out, int max) {
+    AmqpTransportConn *tc = (AmqpTransportConn*)conn;
+    int n = 0;
+    while (n < max) {
+        RabbitMQConfirm c;
+        int r = rabbitmq_wait_confirm(tc->rc, n == 0 ? timeout_ms : 0, &c);
+        if (r == 1) break;  // nothing more right now
+        if (r < 0) return -1;
+        out[n].channel = c.channel;
+        out[n].delivery_tag = c.delivery_tag;
+        out[n].multiple = c.multiple;
+        out[n].ack = c.ack;
+        n++;
+    }
+    return n;
+}
+
+static void amqp_transport_close(void *conn) {
+    AmqpTransportConn *tc = (AmqpTransportConn*)conn;
+    if (!tc) return;
+    rabbitmq_conn_close(tc->rc);
+    free(tc);
+}
+
+const TransportOps transport_amqp = {
+    .name = "amqp",
+    .connect = amqp_transport_connect,
+    .publish_batch = amqp_transport_publish_batch,
+    .poll_confirms = amqp_transport_poll_confirms,
+    .close = amqp_transport_close,
+};
+
+// -----------------------------------------------------------------------------
+// Consuming
+// -----------------------------------------------------------------------------
+// Declares the connection's private queue on channel 1 if it has none yet.
+static int ensure_queue(RabbitMQConn *rc) {
+    if (rc->queue.bytes) return 0;
+
+    amqp_queue_declare_ok_t *ok = amqp_queue_declare(rc->conn, 1, amqp_empty_bytes,
+                                                     0,  // passive
+                                                     0,  // durable
+                                                     1,  // exclusive
+                                                     1,  // auto_delete
+                                                     amqp_empty_table);
+    amqp_rpc_reply_t r = amqp_get_rpc_reply(rc->conn);
+    if (!ok || r.reply_type != AMQP_RESPONSE_NORMAL) {
+        print_amqp_error(r, "amqp_queue_declare");
+        return -1;
+    }
+    rc->queue = amqp_bytes_malloc_dup(ok->queue);
+    if (!rc->queue.bytes) return -1;
+    DBGPRINT("declared queue %.*s\n", (int) rc->queue.len, (char*) rc->queue.bytes);
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+int rabbitmq_subscribe(RabbitMQConn *rc, const char **topics, int n) {
     if (!rc || !rc->connected) return -1;
     if (!topics || n <= 0) return 0;
+    if (ensure_queue(rc) != 0) return -2;
 
-    DBGPRINT("rabbitmq_subscribe_topics: %d topics\n", n);
-    // Real usage would declare queues and bind them to each topic
     for (int i = 0; i < n; i++) {
-        printf("[RabbitMQ] Subscribing to topic: %s\n", topics[i]);
+        DBGPRINT("rabbitmq_subscribe: binding %s\n", topics[i]);
+        amqp_queue_bind(rc->conn, 1, rc->queue, amqp_cstring_bytes("data.topic"),
+                        amqp_cstring_bytes(topics[i]), amqp_empty_table);
+        amqp_rpc_reply_t r = amqp_get_rpc_reply(rc->conn);
+        if (r.reply_type != AMQP_RESPONSE_NORMAL) {
+            print_amqp_error(r, "amqp_queue_bind");
+            return -3;
+        }
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+int rabbitmq_consume_start(RabbitMQConn *rc, int prefetch) {
+    if (!rc || !rc->connected) return -1;
+    if (rc->consuming) return 0;
+    if (ensure_queue(rc) != 0) return -2;
+
+    if (prefetch > 0) {
+        amqp_basic_qos(rc->conn, 1, 0, (uint16_t)(prefetch > 65535 ? 65535 : prefetch), 0);
+        amqp_rpc_reply_t r = amqp_get_rpc_reply(rc->conn);
+        if (r.reply_type != AMQP_RESPONSE_NORMAL) {
+            print_amqp_error(r, "amqp_basic_qos");
+            return -3;
+        }
+    }
+
+    amqp_basic_consume_ok_t *ok = amqp_basic_consume(rc->conn, 1, rc->queue, amqp_empty_bytes,
+                                                     0,  // no_local
+                                                     0,  // no_ack: we ack explicitly
+                                                     1,  // exclusive
+                                                     amqp_empty_table);
+    amqp_rpc_reply_t r = amqp_get_rpc_reply(rc->conn);
+    if (!ok || r.reply_type != AMQP_RESPONSE_NORMAL) {
+        print_amqp_error(r, "amqp_basic_consume");
+        return -4;
+    }
+    amqp_bytes_free(rc->consumer_tag);
+    rc->consumer_tag = amqp_bytes_malloc_dup(ok->consumer_tag);
+    if (!rc->consumer_tag.bytes) return -5;
+    rc->consuming = 1;
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+int rabbitmq_consume_cancel(RabbitMQConn *rc) {
+    if (!rc || !rc->connected) return -1;
+    if (!rc->consuming) return 0;
+
+    // deliveries sent before the cancel-ok are kept for rabbitmq_consume
+    amqp_basic_cancel(rc->conn, 1, rc->consumer_tag);
+    amqp_rpc_reply_t r = amqp_get_rpc_reply(rc->conn);
+    if (r.reply_type != AMQP_RESPONSE_NORMAL) {
+        print_amqp_error(r, "amqp_basic_cancel");
+        return -2;
+    }
+    rc->consuming = 0;
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+int rabbitmq_consume(RabbitMQConn *rc, int timeout_ms, RabbitMQDelivery *out) {
+    if (!rc || !rc->connected || !out) return -1;
+
+    struct timeval timeout;
+    timeout.tv_sec  = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+
+    amqp_maybe_release_buffers(rc->conn);
+    amqp_rpc_reply_t r = amqp_consume_message(rc->conn, &out->envelope, &timeout, 0);
+    if (r.reply_type == AMQP_RESPONSE_LIBRARY_EXCEPTION &&
+        r.library_error == AMQP_STATUS_TIMEOUT) {
+        return 1;
+    }
+    if (r.reply_type != AMQP_RESPONSE_NORMAL) {
+        // AMQP_STATUS_UNEXPECTED_STATE means a method other than a delivery
+        // arrived; on a consume-only connection that is a channel or
+        // connection close, so it is treated as a failure too
+        print_amqp_error(r, "amqp_consume_message");
+        return -2;
+    }
+
+    amqp_envelope_t *env = &out->envelope;
+    out->channel = env->channel;
+    out->delivery_tag = env->delivery_tag;
+    out->routing_key = (const char*) env->routing_key.bytes;
+    out->routing_key_len = env->routing_key.len;
+    out->body = env->message.body.bytes;
+    out->body_len = env->message.body.len;
+    out->content_type = NULL;
+    out->content_type_len = 0;
+    if (env->message.properties._flags & AMQP_BASIC_CONTENT_TYPE_FLAG) {
+        out->content_type = (const char*) env->message.properties.content_type.bytes;
+        out->content_type_len = env->message.properties.content_type.len;
+    }
+    out->content_encoding = NULL;
+    out->content_encoding_len = 0;
+    if (env->message.properties._flags & AMQP_BASIC_CONTENT_ENCODING_FLAG) {
+        out->content_encoding = (const char*) env->message.properties.content_encoding.bytes;
+        out->content_encoding_len = env->message.properties.content_encoding.len;
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+void rabbitmq_delivery_free(RabbitMQDelivery *d) {
+    if (!d) return;
+    amqp_destroy_envelope(&d->envelope);
+}
+
+// -----------------------------------------------------------------------------
+int rabbitmq_ack(RabbitMQConn *rc, int channel, uint64_t delivery_tag, int multiple) {
+    if (!rc || !rc->connected) return -1;
+    int status = amqp_basic_ack(rc->conn, (amqp_channel_t)channel, delivery_tag, multiple);
+    if (status != AMQP_STATUS_OK) {
+        fprintf(stderr, "amqp_basic_ack failed: %s\n", amqp_error_string2(status));
+        return -2;
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+int rabbitmq_reject(RabbitMQConn *rc, int channel, uint64_t delivery_tag, int requeue) {
+    if (!rc || !rc->connected) return -1;
+    int status = amqp_basic_nack(rc->conn, (amqp_channel_t)channel, delivery_tag, 0, requeue ? 1 : 0);
+    if (status != AMQP_STATUS_OK) {
+        fprintf(stderr, "amqp_basic_nack failed: %s\n", amqp_error_string2(status));
+        return -2;
     }
     return 0;
 }
@@ -0,0 +1,251 @@
+/**
+ * ringbuf.c
+ *
+ * Purpose:
+ *   Bounded lock-free queue of pointers (Vyukov's sequence-numbered ring).
+ *   Producers claim a slot with one CAS on the tail; the consumer claims a
+ *   run of ready slots with one CAS on the head. The consumer only sleeps
+ *   (on a futex) when the ring is empty, and producers only issue a wake
+ *   syscall when it is actually sleeping.
+ */
+
+#include "waggle/ringbuf.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#ifdef DEBUG
+  #define DBGPRINT(...) do { fprintf(stderr, "[DEBUG ringbuf] "); fprintf(stderr, __VA_ARGS__); } while(0)
+#else
+  #define DBGPRINT(...) do {} while(0)
+#endif
+
+#define CACHE_LINE 64
+
+typedef struct {
+    _Atomic size_t seq;
+    void          *data;
+} RingCell;
+
+struct RingBuf {
+    // producer side
+    _Alignas(CACHE_LINE) _Atomic size_t tail;
+
+    // consumer side
+    _Alignas(CACHE_LINE) _Atomic size_t head;
+
+    // wakeup state: consumer_idle is set while the consumer sleeps on wake_seq
+    _Alignas(CACHE_LINE) _Atomic uint32_t wake_seq;
+    _Atomic int consumer_idle;
+
+    _Alignas(CACHE_LINE) RingCell *cells;
+    size_t mask;
+};
+
+static long futex_wait(_Atomic uint32_t *addr, uint32_t expected, const struct timespec *timeout) {
+    return syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAIT_PRIVATE, expected, timeout, NULL, 0);
+}
+
+static long futex_wake(_Atomic uint32_t *addr, int n) {
+    return syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+RingBuf* ringbuf_new(size_t capacity) {
+    DBGPRINT("ringbuf_new(capacity=%zu)\n", capacity);
+    size_t cap = 2;
+    while (cap < capacity) cap <<= 1;
+
+    RingBuf *rb = aligned_alloc(CACHE_LINE, sizeof(RingBuf));
+    if (!rb) return NULL;
+    memset(rb, 0, sizeof(RingBuf));
+
+    rb->cells = malloc(cap * sizeof(RingCell));
+    if (!rb->cells) {
+        free(rb);
+        return NULL;
+    }
+    for (size_t i = 0; i < cap; i++) {
+        atomic_init(&rb->cells[i].seq, i);
+        rb->cells[i].data = NULL;
+    }
+    rb->mask = cap - 1;
+    atomic_init(&rb->head, 0);
+    atomic_init(&rb->tail, 0);
+    atomic_init(&rb->wake_seq, 0);
+    atomic_init(&rb->consumer_idle, 0);
+    return rb;
+}
+
+void ringbuf_free(RingBuf *rb) {
+    if (!rb) return;
+    free(rb->cells);
+    free(rb);
+}
+
+size_t ringbuf_capacity(const RingBuf *rb) {
+    return rb->mask + 1;
+}
+
+size_t ringbuf_size(const RingBuf *rb) {
+    size_t tail = atomic_load_explicit(&((RingBuf*)rb)->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&((RingBuf*)rb)->head, memory_order_relaxed);
+    return (tail > head) ? tail - head : 0;
+}
+
+int ringbuf_push(RingBuf *rb, void *item) {
+    size_t pos = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+    RingCell *cell;
+    for (;;) {
+        cell = &rb->cells[pos & rb->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&rb->tail, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return -1; // full
+        } else {
+            pos = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+        }
+    }
+
+    cell->data = item;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_seq_cst);
+
+    // pairs with the idle flag / emptiness re-check in ringbuf_wait;
+    // only the producer that clears the flag pays for the syscall
+    if (atomic_load_explicit(&rb->consumer_idle, memory_order_seq_cst) &&
+        atomic_exchange_explicit(&rb->consumer_idle, 0, memory_order_seq_cst)) {
+        ringbuf_wake(rb);
+    }
+    return 0;
+}
+
+int ringbuf_push_bulk(RingBuf *rb, void *const *items, size_t n) {
+    if (n == 0) return 0;
+    if (n > rb->mask + 1) return -1;
+
+    // claim [pos, pos + n) in one CAS. The last slot being free means
+    // consumers have claimed every earlier one too; they may still be
+    // releasing them, which is waited out below.
+    size_t pos = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+    for (;;) {
+        RingCell *last = &rb->cells[(pos + n - 1) & rb->mask];
+        size_t seq = atomic_load_explicit(&last->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + n - 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&rb->tail, &pos, pos + n,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            size_t now = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+            if (now == pos) return -1; // not enough room
+            pos = now;
+        } else {
+            pos = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        RingCell *cell = &rb->cells[(pos + i) & rb->mask];
+        // a consumer may be between claiming and releasing this slot
+        for (int spins = 0; atomic_load_explicit(&cell->seq, memory_order_acquire) != pos + i; spins++) {
+            if (spins >= 64) sched_yield();
+        }
+        cell->data = items[i];
+        atomic_store_explicit(&cell->seq, pos + i + 1, memory_order_seq_cst);
+    }
+
+    if (atomic_load_explicit(&rb->consumer_idle, memory_order_seq_cst) &&
+        atomic_exchange_explicit(&rb->consumer_idle, 0, memory_order_seq_cst)) {
+        ringbuf_wake(rb);
+    }
+    return 0;
+}
+
+size_t ringbuf_pop_bulk(RingBuf *rb, void **out, size_t max) {
+    if (max == 0) return 0;
+
+    size_t pos = atomic_load_explicit(&rb->head, memory_order_relaxed);
+    size_t n;
+    for (;;) {
+        // count the run of ready slots starting at pos
+        n = 0;
+        while (n < max) {
+            RingCell *cell = &rb->cells[(pos + n) & rb->mask];
+            size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+            if (seq != pos + n + 1) break;
+            n++;
+        }
+        if (n == 0) {
+            size_t now = atomic_load_explicit(&rb->head, memory_order_relaxed);
+            if (now == pos) return 0; // empty
+            pos = now;
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(&rb->head, &pos, pos + n,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        RingCell *cell = &rb->cells[(pos + i) & rb->mask];
+        out[i] = cell->data;
+        atomic_store_explicit(&cell->seq, pos + i + rb->mask + 1, memory_order_release);
+    }
+    return n;
+}
+
+void* ringbuf_pop(RingBuf *rb) {
+    void *item = NULL;
+    return ringbuf_pop_bulk(rb, &item, 1) ? item : NULL;
+}
+
+static int ringbuf_has_items(RingBuf *rb) {
+    size_t pos = atomic_load_explicit(&rb->head, memory_order_seq_cst);
+    RingCell *cell = &rb->cells[pos & rb->mask];
+    return atomic_load_explicit(&cell->seq, memory_order_seq_cst) == pos + 1;
+}
+
+int ringbuf_wait(RingBuf *rb, int timeout_ms) {
+    if (ringbuf_has_items(rb)) return 1;
+    if (timeout_ms <= 0) return 0;
+
+    uint32_t seq = atomic_load_explicit(&rb->wake_seq, memory_order_seq_cst);
+    atomic_store_explicit(&rb->consumer_idle, 1, memory_order_seq_cst);
+
+    // re-check after announcing we're idle, so a racing push can't be missed
+    if (!ringbuf_has_items(rb)) {
+        struct timespec ts;
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000L;
+        if (futex_wait(&rb->wake_seq, seq, &ts) != 0 && errno != EAGAIN &&
+            errno != ETIMEDOUT && errno != EINTR) {
+            DBGPRINT("futex_wait failed: %s\n", strerror(errno));
+        }
+    }
+
+    atomic_store_explicit(&rb->consumer_idle, 0, memory_order_seq_cst);
+    return ringbuf_has_items(rb);
+}
+
+void ringbuf_wake(RingBuf *rb) {
+    atomic_fetch_add_explicit(&rb->wake_seq, 1, memory_order_seq_cst);
+    futex_wake(&rb->wake_seq, 1);
+}
@@ -0,0 +1,491 @@
+/**
+ * segmentlog.c
+ *
+ * Purpose:
+ *   Keeps the local data.ndjson log bounded: rotates it into sealed
+ *   segments, compresses sealed segments on a background thread, records
+ *   each segment's time range in a manifest and enforces a retention
+ *   budget. Writers only ever append to the active segment.
+ */
+
+#include "waggle/segmentlog.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <inttypes.h>
+
+#ifdef WAGGLE_HAVE_ZLIB
+  #include <zlib.h>
+#endif
+
+#ifdef DEBUG
+  #define DBGPRINT(...) do { fprintf(stderr, "[DEBUG segmentlog] "); fprintf(stderr, __VA_ARGS__); } while(0)
+#else
+  #define DBGPRINT(...) do {} while(0)
+#endif
+
+#define SEGMENT_PATH_MAX  1024
+#define SEGMENT_NAME_MAX  64
+#define COMPRESS_CHUNK    (128 * 1024)
+
+typedef struct {
+    char     file[SEGMENT_NAME_MAX];
+    uint64_t first_ts;
+    uint64_t last_ts;
+    uint64_t lines;
+    uint64_t bytes;   // size on disk
+    int      busy;    // being compressed; not eligible for deletion
+} SegmentEntry;
+
+struct SegmentLog {
+    char *dir;
+    SegmentLogOptions opts;
+    int   rotating;
+
+    // active segment
+    pthread_mutex_t lock;
+    int      fd;
+    size_t   active_bytes;
+    uint64_t active_first_ts;
+    uint64_t active_last_ts;
+    uint64_t active_lines;
+    uint64_t opened_ms;
+
+    // sealed segments, oldest first, plus the compression thread state.
+    // Lock order: lock before mlock.
+    pthread_mutex_t mlock;
+    pthread_cond_t  mcond;
+    SegmentEntry   *entries;
+    size_t          count;
+    size_t          cap;
+    int             stop;
+    pthread_t       thread;
+    int             thread_started;
+};
+
+static void* compress_thread_main(void *arg);
+
+static uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void path_join(char *out, const char *dir, const char *name) {
+    snprintf(out, SEGMENT_PATH_MAX, "%s/%s", dir, name);
+}
+
+static int ends_with(const char *s, const char *suffix) {
+    size_t n = strlen(s), m = strlen(suffix);
+    return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+static int needs_compress(const SegmentLog *log, const SegmentEntry *e) {
+    return log->opts.compress && !e->busy && !ends_with(e->file, ".gz");
+}
+
+// -----------------------------------------------------------------------------
+// Manifest (caller holds mlock)
+// -----------------------------------------------------------------------------
+static int manifest_write(SegmentLog *log) {
+    char path[SEGMENT_PATH_MAX], tmp[SEGMENT_PATH_MAX];
+    path_join(path, log->dir, "manifest.ndjson");
+    path_join(tmp, log->dir, "manifest.ndjson.tmp");
+
+    FILE *f = fopen(tmp, "w");
+    if (!f) {
+        fprintf(stderr, "segmentlog: cannot write %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    for (size_t i = 0; i < log->count; i++) {
+        const SegmentEntry *e = &log->entries[i];
+        fprintf(f, "{\"file\":\"%s\",\"first_ts\":%" PRIu64 ",\"last_ts\":%" PRIu64
+                   ",\"lines\":%" PRIu64 ",\"bytes\":%" PRIu64 "}\n",
+                e->file, e->first_ts, e->last_ts, e->lines, e->bytes);
+    }
+    int ret = (fflush(f) == 0 && fsync(fileno(f)) == 0) ? 0 : -1;
+    fclose(f);
+    if (ret == 0 && rename(tmp, path) != 0) ret = -1;
+    return ret;
+}
+
+// Reads an unsigned integer field from a manifest line we wrote ourselves.
+static uint64_t manifest_field(const char *line, const char *key) {
+    const char *p = strstr(line, key);
+    return p ? strtoull(p + strlen(key), NULL, 10) : 0;
+}
+
+static int entry_append(SegmentLog *log, const SegmentEntry *e) {
+    if (log->count == log->cap) {
+        size_t cap = log->cap ? log->cap * 2 : 16;
+        SegmentEntry *ne = realloc(log->entries, cap * sizeof(SegmentEntry));
+        if (!ne) return -1;
+        log->entries = ne;
+        log->cap = cap;
+    }
+    log->entries[log->count++] = *e;
+    return 0;
+}
+
+static void manifest_load(SegmentLog *log) {
+    char path[SEGMENT_PATH_MAX];
+    path_join(path, log->dir, "manifest.ndjson");
+    FILE *f = fopen(path, "r");
+    if (!f) return;
+
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        const char *p = strstr(line, "\"file\":\"");
+        if (!p) continue;
+        p += 8;
+        const char *q = strchr(p, '"');
+        if (!q || (size_t)(q - p) >= SEGMENT_NAME_MAX) continue;
+
+        SegmentEntry e;
+        memset(&e, 0, sizeof(e));
+        memcpy(e.file, p, (size_t)(q - p));
+        e.first_ts = manifest_field(line, "\"first_ts\":");
+        e.last_ts = manifest_field(line, "\"last_ts\":");
+        e.lines = manifest_field(line, "\"lines\":");
+
+        // drop entries whose file is gone, e.g. deleted by hand
+        char seg[SEGMENT_PATH_MAX];
+        struct stat st;
+        path_join(seg, log->dir, e.file);
+        if (stat(seg, &st) != 0) continue;
+        e.bytes = (uint64_t)st.st_size;
+        entry_append(log, &e);
+    }
+    fclose(f);
+}
+
+// Deletes the oldest sealed segments until they fit the retention budget.
+// Segments still waiting for compression are neither counted nor deleted;
+// they are judged by their compressed size once that is known.
+static void enforce_retention(SegmentLog *log) {
+    if (log->opts.retention_bytes == 0) return;
+
+    uint64_t total = 0;
+    for (size_t i = 0; i < log->count; i++) {
+        const SegmentEntry *e = &log->entries[i];
+        if (!e->busy && !needs_compress(log, e)) total += e->bytes;
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < log->count; i++) {
+        SegmentEntry *e = &log->entries[i];
+        int eligible = !e->busy && !needs_compress(log, e);
+        if (eligible && total > log->opts.retention_bytes) {
+            char path[SEGMENT_PATH_MAX];
+            path_join(path, log->dir, e->file);
+            if (unlink(path) == 0 || errno == ENOENT) {
+                DBGPRINT("retention: deleted %s\n", e->file);
+                total -= e->bytes;
+                continue;
+            }
+            fprintf(stderr, "segmentlog: cannot delete %s: %s\n", path, strerror(errno));
+        }
+        log->entries[kept++] = *e;
+    }
+    log->count = kept;
+}
+
+// -----------------------------------------------------------------------------
+// Rotation (caller holds lock)
+// -----------------------------------------------------------------------------
+static int open_active(SegmentLog *log) {
+    char path[SEGMENT_PATH_MAX];
+    path_join(path, log->dir, "data.ndjson");
+    log->fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (log->fd < 0) return -1;
+
+    struct stat st;
+    log->active_bytes = fstat(log->fd, &st) == 0 ? (size_t)st.st_size : 0;
+    log->active_first_ts = 0;
+    log->active_last_ts = 0;
+    log->active_lines = 0;
+    log->opened_ms = monotonic_ms();
+    return 0;
+}
+
+static int seal_active(SegmentLog *log) {
+    if (log->active_bytes == 0) {
+        log->opened_ms = monotonic_ms();
+        return 0;
+    }
+
+    char active[SEGMENT_PATH_MAX], sealed[SEGMENT_PATH_MAX];
+    SegmentEntry e;
+    memset(&e, 0, sizeof(e));
+    e.first_ts = log->active_first_ts;
+    e.last_ts = log->active_last_ts;
+    e.lines = log->active_lines;
+    e.bytes = log->active_bytes;
+
+    // named by first timestamp so a directory listing sorts by time
+    uint64_t key = e.first_ts;
+    for (;;) {
+        snprintf(e.file, sizeof(e.file), "data-%020" PRIu64 ".ndjson", key);
+        path_join(sealed, log->dir, e.file);
+        char gz[SEGMENT_PATH_MAX + 4];
+        snprintf(gz, sizeof(gz), "%s.gz", sealed);
+        if (access(sealed, F_OK) != 0 && access(gz, F_OK) != 0) break;
+        key++;
+    }
+
+    path_join(active, log->dir, "data.ndjson");
+    close(log->fd);
+    log->fd = -1;
+    if (rename(active, sealed) != 0) {
+        fprintf(stderr, "segmentlog: cannot seal %s: %s\n", active, strerror(errno));
+        return open_active(log);
+    }
+    DBGPRINT("sealed %s (%" PRIu64 " bytes)\n", e.file, e.bytes);
+    int ret = open_active(log);
+
+    pthread_mutex_lock(&log->mlock);
+    if (entry_append(log, &e) != 0) {
+        fprintf(stderr, "segmentlog: out of memory recording %s\n", e.file);
+    }
+    enforce_retention(log);
+    manifest_write(log);
+    pthread_cond_signal(&log->mcond);
+    pthread_mutex_unlock(&log->mlock);
+    return ret;
+}
+
+static int rotation_due(const SegmentLog *log, uint64_t now_ms) {
+    if (log->active_bytes == 0) return 0;
+    if (log->opts.segment_bytes && log->active_bytes >= log->opts.segment_bytes) return 1;
+    if (log->opts.segment_ms > 0 && now_ms - log->opened_ms >= (uint64_t)log->opts.segment_ms) return 1;
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Compression thread
+// -----------------------------------------------------------------------------
+#ifdef WAGGLE_HAVE_ZLIB
+static int compress_file(const char *src, const char *dst) {
+    char tmp[SEGMENT_PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", dst);
+
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    if (in < 0) return -1;
+    gzFile gz = gzopen(tmp, "wb6");
+    if (!gz) {
+        close(in);
+        return -1;
+    }
+    gzbuffer(gz, COMPRESS_CHUNK);
+
+    char *buf = malloc(COMPRESS_CHUNK);
+    int ret = buf ? 0 : -1;
+    while (ret == 0) {
+        ssize_t n = read(in, buf, COMPRESS_CHUNK);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) ret = -1;
+        if (n <= 0) break;
+        if (gzwrite(gz, buf, (unsigned)n) != (int)n) ret = -1;
+    }
+    free(buf);
+    close(in);
+    if (gzclose(gz) != Z_OK) ret = -1;
+
+    if (ret == 0 && rename(tmp, dst) == 0) {
+        unlink(src);
+        return 0;
+    }
+    unlink(tmp);
+    return -1;
+}
+#endif
+
+static void* compress_thread_main(void *arg) {
+    SegmentLog *log = (SegmentLog*)arg;
+    DBGPRINT("compression thread started.\n");
+
+    pthread_mutex_lock(&log->mlock);
+    for (;;) {
+        SegmentEntry *job = NULL;
+        for (size_t i = 0; i < log->count; i++) {
+            if (needs_compress(log, &log->entries[i])) {
+                job = &log->entries[i];
+                break;
+            }
+        }
+        if (!job) {
+            if (log->stop) break;
+            pthread_cond_wait(&log->mcond, &log->mlock);
+            continue;
+        }
+
+        char name[SEGMENT_NAME_MAX];
+        memcpy(name, job->file, sizeof(name));
+        job->busy = 1;
+        pthread_mutex_unlock(&log->mlock);
+
+        char src[SEGMENT_PATH_MAX], dst[SEGMENT_PATH_MAX + 4];
+        path_join(src, log->dir, name);
+        snprintf(dst, sizeof(dst), "%s.gz", src);
+        int ok = 0;
+#ifdef WAGGLE_HAVE_ZLIB
+        ok = compress_file(src, dst) == 0;
+#endif
+        struct stat st;
+        uint64_t size = (ok && stat(dst, &st) == 0) ? (uint64_t)st.st_size : 0;
+
+        pthread_mutex_lock(&log->mlock);
+        // retention may have compacted the array meanwhile, so look our
+        // entry up again by name
+        for (size_t i = 0; i < log->count; i++) {
+            SegmentEntry *e = &log->entries[i];
+            if (strcmp(e->file, name) != 0) continue;
+            e->busy = 0;
+            if (ok) {
+                snprintf(e->file, sizeof(e->file), "%s.gz", name);
+                e->bytes = size;
+            } else {
+                fprintf(stderr, "segmentlog: could not compress %s, keeping it as is\n", name);
+                log->opts.compress = 0;
+            }
+            break;
+        }
+        enforce_retention(log);
+        manifest_write(log);
+    }
+    pthread_mutex_unlock(&log->mlock);
+
+    DBGPRINT("compression thread stopped.\n");
+    return NULL;
+}
+
+// -----------------------------------------------------------------------------
+// Public API
+// -----------------------------------------------------------------------------
+SegmentLog* segmentlog_open(const char *dir, const SegmentLogOptions *opts) {
+    DBGPRINT("segmentlog_open(dir=%s)\n", dir ? dir : "NULL");
+    if (!dir) return NULL;
+
+    SegmentLog *log = calloc(1, sizeof(SegmentLog));
+    if (!log) return NULL;
+    log->dir = strdup(dir);
+    if (!log->dir) {
+        free(log);
+        return NULL;
+    }
+    if (opts) log->opts = *opts;
+    log->rotating = log->opts.segment_bytes > 0 || log->opts.segment_ms > 0;
+#ifndef WAGGLE_HAVE_ZLIB
+    if (log->opts.compress) {
+        fprintf(stderr, "segmentlog: built without zlib, sealed segments stay uncompressed\n");
+        log->opts.compress = 0;
+    }
+#endif
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_mutex_init(&log->mlock, NULL);
+    pthread_cond_init(&log->mcond, NULL);
+
+    if (open_active(log) != 0) {
+        fprintf(stderr, "segmentlog: cannot open %s/data.ndjson: %s\n", dir, strerror(errno));
+        segmentlog_close(log);
+        return NULL;
+    }
+    if (!log->rotating) return log;
+
+    manifest_load(log);
+    // whatever a previous run left in data.ndjson has an unknown range
+    pthread_mutex_lock(&log->lock);
+    seal_active(log);
+    pthread_mutex_unlock(&log->lock);
+
+    if (log->opts.compress) {
+        if (pthread_create(&log->thread, NULL, compress_thread_main, log) == 0) {
+            log->thread_started = 1;
+        } else {
+            fprintf(stderr, "segmentlog: cannot start compression thread\n");
+            log->opts.compress = 0;
+        }
+    }
+    return log;
+}
+
+int segmentlog_write(SegmentLog *log, const char *buf, size_t len,
+                     uint64_t first_ts, uint64_t last_ts, size_t lines) {
+    if (!log) return -1;
+    pthread_mutex_lock(&log->lock);
+    if (log->fd < 0) {
+        pthread_mutex_unlock(&log->lock);
+        return -1;
+    }
+
+    int ret = 0;
+    const char *p = buf;
+    size_t left = len;
+    while (left > 0) {
+        ssize_t n = write(log->fd, p, left);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            ret = -1;
+            break;
+        }
+        p += n;
+        left -= (size_t)n;
+    }
+    log->active_bytes += len - left;
+
+    if (lines > 0) {
+        if (log->active_lines == 0 || first_ts < log->active_first_ts) log->active_first_ts = first_ts;
+        if (log->active_lines == 0 || last_ts > log->active_last_ts) log->active_last_ts = last_ts;
+        log->active_lines += lines;
+    }
+
+    if (log->rotating && rotation_due(log, monotonic_ms())) {
+        seal_active(log);
+    }
+    pthread_mutex_unlock(&log->lock);
+    return ret;
+}
+
+void segmentlog_tick(SegmentLog *log) {
+    if (!log || log->opts.segment_ms <= 0) return;
+    pthread_mutex_lock(&log->lock);
+    if (log->fd >= 0 && rotation_due(log, monotonic_ms())) {
+        seal_active(log);
+    }
+    pthread_mutex_unlock(&log->lock);
+}
+
+int segmentlog_sync(SegmentLog *log) {
+    if (!log) return -1;
+    pthread_mutex_lock(&log->lock);
+    int ret = log->fd >= 0 ? fdatasync(log->fd) : -1;
+    pthread_mutex_unlock(&log->lock);
+    return ret;
+}
+
+void segmentlog_close(SegmentLog *log) {
+    DBGPRINT("segmentlog_close()\n");
+    if (!log) return;
+    if (log->thread_started) {
+        pthread_mutex_lock(&log->mlock);
+        log->stop = 1;
+        pthread_cond_signal(&log->mcond);
+        pthread_mutex_unlock(&log->mlock);
+        pthread_join(log->thread, NULL);
+    }
+    if (log->fd >= 0) close(log->fd);
+    pthread_mutex_destroy(&log->lock);
+    pthread_mutex_destroy(&log->mlock);
+    pthread_cond_destroy(&log->mcond);
+    free(log->entries);
+    free(log->dir);
+    free(log);
+}
@@ -0,0 +1,143 @@
+/**
+ * slab.c
+ *
+ * Purpose:
+ *   Recycles message buffers between producer threads and the publisher
+ *   thread. Each size class keeps its free blocks in a RingBuf, so both
+ *   allocation and release are a single lock-free ring operation.
+ */
+
+#include "waggle/slab.h"
+#include "waggle/ringbuf.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef DEBUG
+  #define DBGPRINT(...) do { fprintf(stderr, "[DEBUG slab] "); fprintf(stderr, __VA_ARGS__); } while(0)
+#else
+  #define DBGPRINT(...) do {} while(0)
+#endif
+
+#define SLAB_MIN_SHIFT   6                 // 64 B
+#define SLAB_NUM_CLASSES 11                // up to 64 KiB
+#define SLAB_CLASS_NONE  SLAB_NUM_CLASSES  // plain malloc block
+
+// Sits in front of every block so slab_release needs only the pointer.
+typedef struct {
+    _Alignas(16) SlabPool *pool;
+    uint32_t cls;
+} SlabHeader;
+
+struct SlabPool {
+    RingBuf *free_lists[SLAB_NUM_CLASSES];
+    size_t   cache_limit;
+
+    _Atomic uint64_t hits;
+    _Atomic uint64_t misses;
+    _Atomic uint64_t in_use_bytes;
+};
+
+static size_t class_size(uint32_t cls) {
+    return (size_t)1 << (cls + SLAB_MIN_SHIFT);
+}
+
+// Smallest class whose blocks fit `total` bytes (header included).
+static uint32_t class_for(size_t total) {
+    if (total <= class_size(0)) return 0;
+    uint32_t bits = (uint32_t)(sizeof(unsigned long long) * 8) - (uint32_t)__builtin_clzll(total - 1);
+    uint32_t cls = bits - SLAB_MIN_SHIFT;
+    return cls < SLAB_NUM_CLASSES ? cls : SLAB_CLASS_NONE;
+}
+
+SlabPool* slab_pool_new(size_t cache_bytes) {
+    DBGPRINT("slab_pool_new(cache_bytes=%zu)\n", cache_bytes);
+    SlabPool *pool = calloc(1, sizeof(SlabPool));
+    if (!pool) return NULL;
+
+    pool->cache_limit = cache_bytes;
+    if (cache_bytes > 0) {
+        size_t per_class = cache_bytes / SLAB_NUM_CLASSES;
+        for (uint32_t c = 0; c < SLAB_NUM_CLASSES; c++) {
+            size_t blocks = per_class / class_size(c);
+            if (blocks < 2) blocks = 2;
+            pool->free_lists[c] = ringbuf_new(blocks);
+            if (!pool->free_lists[c]) {
+                slab_pool_free(pool);
+                return NULL;
+            }
+        }
+    }
+    atomic_init(&pool->hits, 0);
+    atomic_init(&pool->misses, 0);
+    atomic_init(&pool->in_use_bytes, 0);
+    return pool;
+}
+
+void slab_pool_free(SlabPool *pool) {
+    if (!pool) return;
+    for (uint32_t c = 0; c < SLAB_NUM_CLASSES; c++) {
+        if (!pool->free_lists[c]) continue;
+        void *block;
+        while ((block = ringbuf_pop(pool->free_lists[c])) != NULL) {
+            free(block);
+        }
+        ringbuf_free(pool->free_lists[c]);
+    }
+    free(pool);
+}
+
+void* slab_alloc(SlabPool *pool, size_t size) {
+    size_t total = sizeof(SlabHeader) + size;
+    uint32_t cls = class_for(total);
+
+    SlabHeader *h = NULL;
+    if (cls != SLAB_CLASS_NONE && pool->free_lists[cls]) {
+        h = ringbuf_pop(pool->free_lists[cls]);
+    }
+    if (h) {
+        atomic_fetch_add_explicit(&pool->hits, 1, memory_order_relaxed);
+    } else {
+        h = malloc(cls != SLAB_CLASS_NONE ? class_size(cls) : total);
+        if (!h) return NULL;
+        atomic_fetch_add_explicit(&pool->misses, 1, memory_order_relaxed);
+        h->pool = pool;
+        h->cls = cls;
+    }
+    if (cls != SLAB_CLASS_NONE) {
+        atomic_fetch_add_explicit(&pool->in_use_bytes, class_size(cls), memory_order_relaxed);
+    }
+    return h + 1;
+}
+
+void slab_release(void *ptr) {
+    if (!ptr) return;
+    SlabHeader *h = (SlabHeader*)ptr - 1;
+    SlabPool *pool = h->pool;
+    if (h->cls == SLAB_CLASS_NONE) {
+        free(h);
+        return;
+    }
+    atomic_fetch_sub_explicit(&pool->in_use_bytes, class_size(h->cls), memory_order_relaxed);
+    RingBuf *list = pool->free_lists[h->cls];
+    if (!list || ringbuf_push(list, h) != 0) {
+        free(h);
+    }
+}
+
+void slab_pool_stats(SlabPool *pool, SlabStats *out) {
+    memset(out, 0, sizeof(*out));
+    if (!pool) return;
+    out->hits = atomic_load_explicit(&pool->hits, memory_order_relaxed);
+    out->misses = atomic_load_explicit(&pool->misses, memory_order_relaxed);
+    out->in_use_bytes = atomic_load_explicit(&pool->in_use_bytes, memory_order_relaxed);
+    out->cache_limit = pool->cache_limit;
+    for (uint32_t c = 0; c < SLAB_NUM_CLASSES; c++) {
+        if (pool->free_lists[c]) {
+            out->cached_bytes += ringbuf_size(pool->free_lists[c]) * class_size(c);
+        }
+    }
+}
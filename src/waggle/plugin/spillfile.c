@@ -0,0 +1,193 @@
+/**
+ * spillfile.c
+ *
+ * Purpose:
+ *   Append-only overflow file for the publish queue. Each record is
+ *   [u32 scope_len][u32 data_len][scope][data]. Reads advance an offset and
+ *   the file is truncated back to zero once the reader has caught up and
+ *   comes back for more.
+ */
+
+#include "waggle/spillfile.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#ifdef DEBUG
+  #define DBGPRINT(...) do { fprintf(stderr, "[DEBUG spillfile] "); fprintf(stderr, __VA_ARGS__); } while(0)
+#else
+  #define DBGPRINT(...) do {} while(0)
+#endif
+
+#define SPILL_MAX_RECORD (64u * 1024u * 1024u)
+
+struct SpillFile {
+    int    fd;
+    off_t  read_off;
+    off_t  write_off;
+    int    sync;      // fdatasync every append
+    char  *buf;       // holds the last record returned by spillfile_read
+    size_t buf_cap;
+    pthread_mutex_t lock;
+};
+
+static int pread_full(int fd, void *buf, size_t len, off_t off) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t r = pread(fd, p, len, off);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (r == 0) return -1; // short file
+        p += r;
+        len -= (size_t)r;
+        off += r;
+    }
+    return 0;
+}
+
+SpillFile* spillfile_open(const char *dir, int sync) {
+    DBGPRINT("spillfile_open(dir=%s, sync=%d)\n", dir ? dir : "NULL", sync);
+    if (!dir) return NULL;
+
+    SpillFile *sf = calloc(1, sizeof(SpillFile));
+    if (!sf) return NULL;
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/spill.bin", dir);
+
+    sf->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0664);
+    if (sf->fd < 0) {
+        perror("open(spill)");
+        free(sf);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(sf->fd, &st) != 0) {
+        perror("fstat(spill)");
+        close(sf->fd);
+        free(sf);
+        return NULL;
+    }
+    sf->read_off = 0;
+    sf->write_off = st.st_size;
+    sf->sync = sync;
+    pthread_mutex_init(&sf->lock, NULL);
+
+    DBGPRINT("Opened spill file %s with %lld bytes pending\n", path, (long long)st.st_size);
+    return sf;
+}
+
+void spillfile_close(SpillFile *sf) {
+    if (!sf) return;
+    close(sf->fd);
+    pthread_mutex_destroy(&sf->lock);
+    free(sf->buf);
+    free(sf);
+}
+
+int spillfile_append(SpillFile *sf, const char *scope, const char *data, int len) {
+    if (!sf || !scope || !data || len < 0) return -1;
+
+    uint32_t hdr[2] = { (uint32_t)strlen(scope), (uint32_t)len };
+    struct iovec iov[3] = {
+        { .iov_base = hdr,          .iov_len = sizeof(hdr) },
+        { .iov_base = (void*)scope, .iov_len = hdr[0] },
+        { .iov_base = (void*)data,  .iov_len = hdr[1] },
+    };
+    size_t total = sizeof(hdr) + hdr[0] + hdr[1];
+
+    pthread_mutex_lock(&sf->lock);
+    ssize_t w = pwritev(sf->fd, iov, 3, sf->write_off);
+    if (w != (ssize_t)total) {
+        // drop the partial record; the next append overwrites it
+        pthread_mutex_unlock(&sf->lock);
+        perror("pwritev(spill)");
+        return -2;
+    }
+    if (sf->sync && fdatasync(sf->fd) != 0) {
+        // the record may not survive power loss, so don't report it stored
+        pthread_mutex_unlock(&sf->lock);
+        perror("fdatasync(spill)");
+        return -3;
+    }
+    sf->write_off += (off_t)total;
+    pthread_mutex_unlock(&sf->lock);
+    return 0;
+}
+
+int spillfile_read(SpillFile *sf, const char **scope, const char **data, int *len) {
+    if (!sf || !scope || !data || !len) return -1;
+
+    pthread_mutex_lock(&sf->lock);
+    if (sf->read_off >= sf->write_off) {
+        // only now, once the caller has taken the last record, is it safe
+        // to let the file go
+        goto drained;
+    }
+
+    uint32_t hdr[2];
+    if (pread_full(sf->fd, hdr, sizeof(hdr), sf->read_off) != 0 ||
+        hdr[0] > SPILL_MAX_RECORD || hdr[1] > SPILL_MAX_RECORD ||
+        sf->read_off + (off_t)(sizeof(hdr) + hdr[0] + hdr[1]) > sf->write_off) {
+        // torn record at the end (e.g. crash mid-append): discard the rest
+        fprintf(stderr, "spillfile_read: corrupt record at offset %lld, discarding tail\n",
+                (long long)sf->read_off);
+        sf->write_off = sf->read_off;
+        goto drained;
+    }
+
+    size_t need = (size_t)hdr[0] + 1 + hdr[1];
+    if (need > sf->buf_cap) {
+        char *nb = realloc(sf->buf, need);
+        if (!nb) {
+            pthread_mutex_unlock(&sf->lock);
+            return -2;
+        }
+        sf->buf = nb;
+        sf->buf_cap = need;
+    }
+    if (pread_full(sf->fd, sf->buf, hdr[0], sf->read_off + (off_t)sizeof(hdr)) != 0 ||
+        pread_full(sf->fd, sf->buf + hdr[0] + 1, hdr[1],
+                   sf->read_off + (off_t)(sizeof(hdr) + hdr[0])) != 0) {
+        pthread_mutex_unlock(&sf->lock);
+        return -3;
+    }
+    sf->buf[hdr[0]] = '\0';
+    sf->read_off += (off_t)(sizeof(hdr) + hdr[0] + hdr[1]);
+
+    *scope = sf->buf;
+    *data = sf->buf + hdr[0] + 1;
+    *len = (int)hdr[1];
+    pthread_mutex_unlock(&sf->lock);
+    return 1;
+
+drained:
+    if (sf->write_off > 0) {
+        if (ftruncate(sf->fd, 0) != 0) {
+            perror("ftruncate(spill)");
+        }
+        sf->read_off = 0;
+        sf->write_off = 0;
+    }
+    pthread_mutex_unlock(&sf->lock);
+    return 0;
+}
+
+size_t spillfile_pending(SpillFile *sf) {
+    if (!sf) return 0;
+    pthread_mutex_lock(&sf->lock);
+    size_t n = (size_t)(sf->write_off - sf->read_off);
+    pthread_mutex_unlock(&sf->lock);
+    return n;
+}
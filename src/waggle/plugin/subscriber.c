@@ -0,0 +1,546 @@
+/**
+ * subscriber.c
+ *
+ * Purpose:
+ *   Consumes messages from the "data.topic" exchange on a background
+ *   thread, with prefetch and batched acks, and hands them to a callback
+ *   or a lock-free inbox.
+ */
+
+#include "waggle/subscriber.h"
+#include "waggle/rabbitmq.h"
+#include "waggle/ringbuf.h"
+#include "waggle/timeutil.h"
+#include "waggle/compress.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef DEBUG
+  #define DBGPRINT(...) \
+    do { fprintf(stderr, "[DEBUG subscriber] "); fprintf(stderr, __VA_ARGS__); } while(0)
+#else
+  #define DBGPRINT(...) do {} while(0)
+#endif
+
+// how long one consume call waits; bounds how quickly new topics are bound
+// and a stop request is noticed
+#define SUBSCRIBER_POLL_MS 100
+// how long one consume call waits while messages are held for a full
+// inbox; bounds how quickly they move once the application catches up
+#define SUBSCRIBER_HELD_POLL_MS 5
+// largest body a compressed delivery may expand to
+#define SUBSCRIBER_MAX_BODY (64 * 1024 * 1024)
+
+// consume_connection results
+#define SUB_STOPPED          0
+#define SUB_CONNECT_FAILED  -1
+#define SUB_CONNECTION_LOST -2
+
+struct Subscriber {
+    const PluginConfig *config;
+    SubscriberOptions   opts;
+    SubscriberHandler   handler;
+    void               *arg;
+    RingBuf            *inbox;      // NULL with a handler
+    pthread_t           thread;
+    int                 started;
+    unsigned int        seed;       // reconnect jitter
+
+    // topics and stop; the thread binds topics[bound..ntopics) as they appear
+    pthread_mutex_t     lock;
+    pthread_cond_t      stop_cond;
+    char              **topics;
+    int                 ntopics;
+    int                 topics_cap;
+    _Atomic int         stop_flag;
+
+    _Atomic uint64_t    received;
+    _Atomic uint64_t    invalid;
+    _Atomic uint64_t    acks;
+    _Atomic uint64_t    pauses;
+    _Atomic uint64_t    requeued;
+};
+
+// A message waiting for room in the inbox. `tag` is set on the last
+// message of its delivery, which is acked once that message is handed over.
+typedef struct {
+    WaggleMsg *msg;
+    uint64_t   tag;
+} HeldMessage;
+
+// Per-connection consumer state (subscriber thread only).
+typedef struct {
+    RabbitMQConn *rc;
+    int           bound;       // topics bound on this connection
+    uint64_t      last_tag;    // newest delivery handed over
+    int           unacked;     // handed over since the last ack
+    WaggleMsgBatch batch;      // envelope being handed over
+    WaggleCodecCtx *codec;     // for compressed deliveries; created on first use
+    WaggleBuf     plain;       // a compressed delivery's body, decompressed
+
+    // messages that did not fit in the inbox, oldest first (a ring). At
+    // most queue_capacity, plus the rest of the delivery that reached it;
+    // deliveries arriving after that are requeued.
+    HeldMessage  *held;
+    size_t        held_head;
+    size_t        held_count;
+    size_t        held_cap;
+    int           paused;      // consumer cancelled until they are handed over
+} ConsumerState;
+
+static void* subscriber_thread_main(void *arg);
+
+void subscriber_options_default(SubscriberOptions *opts) {
+    if (!opts) return;
+    opts->prefetch = SUBSCRIBER_DEFAULT_PREFETCH;
+    opts->ack_batch = SUBSCRIBER_DEFAULT_ACK_BATCH;
+    opts->queue_capacity = SUBSCRIBER_DEFAULT_QUEUE_CAPACITY;
+}
+
+Subscriber* subscriber_new(const PluginConfig *config,
+                           const SubscriberOptions *opts,
+                           SubscriberHandler handler,
+                           void *arg) {
+    DBGPRINT("subscriber_new()\n");
+    if (!config) return NULL;
+
+    Subscriber *s = calloc(1, sizeof(Subscriber));
+    if (!s) return NULL;
+
+    s->config = config;
+    subscriber_options_default(&s->opts);
+    if (opts) {
+        if (opts->prefetch >= 0) s->opts.prefetch = opts->prefetch;
+        if (opts->ack_batch > 0) s->opts.ack_batch = opts->ack_batch;
+        if (opts->queue_capacity > 0) s->opts.queue_capacity = opts->queue_capacity;
+    }
+    // acking only after a full prefetch window would stall the broker until
+    // the idle timeout; ack at least twice per window
+    if (s->opts.prefetch > 0 && s->opts.ack_batch > s->opts.prefetch / 2) {
+        s->opts.ack_batch = s->opts.prefetch / 2 > 0 ? s->opts.prefetch / 2 : 1;
+    }
+    s->handler = handler;
+    s->arg = arg;
+    uint64_t now = waggle_get_monotonic_ns();
+    s->seed = (unsigned int)(now ^ (now >> 32));
+
+    if (!handler) {
+        s->inbox = ringbuf_new((size_t)s->opts.queue_capacity);
+        if (!s->inbox) {
+            free(s);
+            return NULL;
+        }
+    }
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_condattr_t cattr;
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&s->stop_cond, &cattr);
+    pthread_condattr_destroy(&cattr);
+    atomic_init(&s->stop_flag, 0);
+
+    if (pthread_create(&s->thread, NULL, subscriber_thread_main, s) != 0) {
+        fprintf(stderr, "subscriber_new: could not create subscriber thread\n");
+        subscriber_free(s);
+        return NULL;
+    }
+    s->started = 1;
+    return s;
+}
+
+int subscriber_add_topics(Subscriber *s, const char **topics, int n) {
+    if (!s || (n > 0 && !topics)) return -1;
+
+    pthread_mutex_lock(&s->lock);
+    if (s->ntopics + n > s->topics_cap) {
+        int cap = s->topics_cap ? s->topics_cap : 8;
+        while (cap < s->ntopics + n) cap *= 2;
+        char **grown = realloc(s->topics, (size_t)cap * sizeof(char*));
+        if (!grown) {
+            pthread_mutex_unlock(&s->lock);
+            return -2;
+        }
+        s->topics = grown;
+        s->topics_cap = cap;
+    }
+    int ret = 0;
+    for (int i = 0; i < n; i++) {
+        char *copy = topics[i] ? strdup(topics[i]) : NULL;
+        if (!copy) {
+            ret = -2;
+            break;
+        }
+        s->topics[s->ntopics++] = copy;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return ret;
+}
+
+WaggleMsg* subscriber_poll(Subscriber *s) {
+    if (!s || !s->inbox) return NULL;
+    return ringbuf_pop(s->inbox);
+}
+
+size_t subscriber_poll_bulk(Subscriber *s, WaggleMsg **out, size_t max) {
+    if (!s || !s->inbox || !out) return 0;
+    return ringbuf_pop_bulk(s->inbox, (void**)out, max);
+}
+
+void subscriber_stats(Subscriber *s, SubscriberStats *out) {
+    if (!out) return;
+    memset(out, 0, sizeof(*out));
+    if (!s) return;
+    out->received = atomic_load(&s->received);
+    out->invalid = atomic_load(&s->invalid);
+    out->acks = atomic_load(&s->acks);
+    out->pauses = atomic_load(&s->pauses);
+    out->requeued = atomic_load(&s->requeued);
+    out->inbox_messages = s->inbox ? ringbuf_size(s->inbox) : 0;
+}
+
+void subscriber_free(Subscriber *s) {
+    if (!s) return;
+    DBGPRINT("subscriber_free()\n");
+
+    pthread_mutex_lock(&s->lock);
+    atomic_store(&s->stop_flag, 1);
+    pthread_cond_broadcast(&s->stop_cond);
+    pthread_mutex_unlock(&s->lock);
+    if (s->started) {
+        pthread_join(s->thread, NULL);
+    }
+
+    if (s->inbox) {
+        WaggleMsg *msg;
+        while ((msg = ringbuf_pop(s->inbox)) != NULL) {
+            wagglemsg_free(msg);
+        }
+        ringbuf_free(s->inbox);
+    }
+    for (int i = 0; i < s->ntopics; i++) {
+        free(s->topics[i]);
+    }
+    free(s->topics);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->stop_cond);
+    free(s);
+}
+
+// -----------------------------------------------------------------------------
+// Subscriber thread
+// -----------------------------------------------------------------------------
+// Binds topics added since the last call. The strings are never freed
+// while the thread runs, so only the pointers are copied under the lock.
+static int bind_new_topics(Subscriber *s, ConsumerState *cs) {
+    pthread_mutex_lock(&s->lock);
+    int n = s->ntopics - cs->bound;
+    const char **fresh = n > 0 ? malloc((size_t)n * sizeof(char*)) : NULL;
+    if (fresh) {
+        memcpy(fresh, s->topics + cs->bound, (size_t)n * sizeof(char*));
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (n <= 0) return 0;
+    if (!fresh) return -1;
+
+    int ret = rabbitmq_subscribe(cs->rc, fresh, n);
+    free(fresh);
+    if (ret != 0) return -1;
+    cs->bound += n;
+    return 0;
+}
+
+// Acks everything handed over so far with one basic.ack.
+static int flush_acks(Subscriber *s, ConsumerState *cs) {
+    if (cs->unacked == 0) return 0;
+    if (rabbitmq_ack(cs->rc, 1, cs->last_tag, 1) != 0) return -1;
+    atomic_fetch_add(&s->acks, 1);
+    cs->unacked = 0;
+    return 0;
+}
+
+// Copies a message decoded into a batch, for the inbox.
+static WaggleMsg* copy_message(const WaggleMsg *src) {
+    WaggleMsg *m = calloc(1, sizeof(WaggleMsg));
+    if (!m) return NULL;
+    m->type = src->type;
+    m->value = src->value;
+    m->dvalue = src->dvalue;
+    m->timestamp = src->timestamp;
+    m->name = strdup(src->name);
+    m->meta = strdup(src->meta);
+    if (src->data) {
+        m->data = malloc(src->data_len + 1);
+        if (m->data) {
+            memcpy(m->data, src->data, src->data_len);
+            ((char*)m->data)[src->data_len] = '\0';
+            m->data_len = src->data_len;
+        }
+    }
+    if (!m->name || !m->meta || (src->data && !m->data)) {
+        wagglemsg_free(m);
+        return NULL;
+    }
+    return m;
+}
+
+// Counts a message as handed over; `tag` != 0 makes its delivery ackable.
+static void handed(Subscriber *s, ConsumerState *cs, uint64_t tag) {
+    atomic_fetch_add(&s->received, 1);
+    if (tag) {
+        cs->last_tag = tag;
+        cs->unacked++;
+    }
+}
+
+// Queues a message the inbox has no room for. The first one acks what was
+// handed over so far and cancels the consumer, so the broker sends nothing
+// more, while the consume loop keeps reading (and answering heartbeats)
+// until the application catches up.
+static int hold(Subscriber *s, ConsumerState *cs, WaggleMsg *msg, uint64_t tag) {
+    if (cs->held_count == cs->held_cap) {
+        size_t cap = cs->held_cap ? cs->held_cap * 2 : 64;
+        HeldMessage *grown = malloc(cap * sizeof(HeldMessage));
+        if (!grown) {
+            fprintf(stderr, "subscriber: out of memory\n");
+            wagglemsg_free(msg);
+            return -1;
+        }
+        for (size_t i = 0; i < cs->held_count; i++) {
+            grown[i] = cs->held[(cs->held_head + i) % cs->held_cap];
+        }
+        free(cs->held);
+        cs->held = grown;
+        cs->held_head = 0;
+        cs->held_cap = cap;
+    }
+    cs->held[(cs->held_head + cs->held_count) % cs->held_cap] = (HeldMessage){ msg, tag };
+    cs->held_count++;
+
+    if (!cs->paused) {
+        DBGPRINT("inbox full, pausing consumption\n");
+        if (flush_acks(s, cs) != 0 || rabbitmq_consume_cancel(cs->rc) != 0) return -1;
+        atomic_fetch_add(&s->pauses, 1);
+        cs->paused = 1;
+    }
+    return 0;
+}
+
+// Moves held messages into the inbox while it has room, and resumes
+// consumption once none are left. Returns 0 on success, -1 if the
+// connection failed.
+static int drain_held(Subscriber *s, ConsumerState *cs) {
+    while (cs->held_count > 0) {
+        HeldMessage *h = &cs->held[cs->held_head];
+        if (ringbuf_push(s->inbox, h->msg) != 0) return 0;
+        handed(s, cs, h->tag);
+        cs->held_head = (cs->held_head + 1) % cs->held_cap;
+        cs->held_count--;
+    }
+    if (cs->paused) {
+        DBGPRINT("inbox drained, resuming consumption\n");
+        if (rabbitmq_consume_start(cs->rc, s->opts.prefetch) != 0) return -1;
+        cs->paused = 0;
+    }
+    return 0;
+}
+
+// Hands one message to the handler, or queues it (taking ownership) for
+// subscriber_poll; messages behind a held one are held too, to keep their
+// order. `tag` is the delivery to ack with this message, or 0.
+// Returns 0 on success, or -1 if the connection failed.
+static int hand_over(Subscriber *s, ConsumerState *cs, const char *topic, WaggleMsg *msg, uint64_t tag) {
+    if (s->handler) {
+        s->handler(msg, topic, s->arg);
+        wagglemsg_free(msg);
+    } else if (cs->held_count > 0 || ringbuf_push(s->inbox, msg) != 0) {
+        return hold(s, cs, msg, tag);
+    }
+    handed(s, cs, tag);
+    return 0;
+}
+
+// Decodes one delivery, a single message or an envelope of several, and
+// hands its messages over. Returns 0 on success, or -1 if the connection
+// failed.
+static int handle_delivery(Subscriber *s, ConsumerState *cs, const RabbitMQDelivery *delivery) {
+    WaggleMsg *msg = NULL;
+    long count = 1;
+    size_t invalid = 0;
+
+    // deliveries that were already on the way when the consumer was
+    // cancelled; holding them all could take unbounded memory with an
+    // unlimited prefetch, so past a full inbox's worth the broker keeps them
+    if (cs->held_count >= (size_t)s->opts.queue_capacity) {
+        atomic_fetch_add(&s->requeued, 1);
+        return rabbitmq_reject(cs->rc, delivery->channel, delivery->delivery_tag, 1) == 0 ? 0 : -1;
+    }
+
+    RabbitMQDelivery plain;
+    const RabbitMQDelivery *d = delivery;
+    if (delivery->content_encoding) {
+        int codec = waggle_codec_of_encoding(delivery->content_encoding, delivery->content_encoding_len);
+        if (!cs->codec) cs->codec = waggle_codec_ctx_new();
+        wagglebuf_reset(&cs->plain);
+        if (codec < 0 || !cs->codec ||
+            waggle_decompress(cs->codec, (WaggleCodec)codec, delivery->body, delivery->body_len,
+                              SUBSCRIBER_MAX_BODY, &cs->plain) != 0) {
+            DBGPRINT("delivery %llu does not decompress\n", (unsigned long long) delivery->delivery_tag);
+            count = 0;
+        } else {
+            plain = *delivery;
+            plain.body = cs->plain.data;
+            plain.body_len = cs->plain.len;
+            d = &plain;
+        }
+    }
+    int envelope = wagglemsg_envelope_of_content_type(d->content_type, d->content_type_len);
+    if (count > 0 && envelope < 0) {
+        int format = wagglemsg_format_of_content_type(d->content_type, d->content_type_len);
+        if (format < 0) {
+            format = wagglemsg_detect_format(d->body, d->body_len);
+        }
+        msg = wagglemsg_load(d->body, d->body_len, (WaggleMsgFormat)format);
+        if (!msg) count = 0;
+    } else if (count > 0) {
+        wagglemsg_batch_reset(&cs->batch);
+        count = wagglemsg_unpack(&cs->batch, d->body, d->body_len,
+                                 d->content_type, d->content_type_len);
+        invalid = cs->batch.invalid;
+    }
+    if (count <= 0 && invalid == 0) {
+        invalid = 1;
+    }
+    if (invalid) {
+        atomic_fetch_add(&s->invalid, invalid);
+    }
+    if (count <= 0) {
+        DBGPRINT("rejecting undecodable delivery %llu\n", (unsigned long long) d->delivery_tag);
+        // earlier deliveries are acked first, so the later multiple ack
+        // never covers this one
+        if (flush_acks(s, cs) != 0) return -1;
+        return rabbitmq_reject(cs->rc, d->channel, d->delivery_tag, 0) == 0 ? 0 : -1;
+    }
+
+    char topic[256]; // AMQP short strings are at most 255 bytes
+    size_t len = d->routing_key_len < sizeof(topic) ? d->routing_key_len : sizeof(topic) - 1;
+    memcpy(topic, d->routing_key, len);
+    topic[len] = '\0';
+
+    if (msg) {
+        return hand_over(s, cs, topic, msg, d->delivery_tag);
+    }
+    for (size_t i = 0; i < cs->batch.count; i++) {
+        uint64_t tag = i + 1 == cs->batch.count ? d->delivery_tag : 0;
+        if (s->handler) {
+            s->handler(&cs->batch.msgs[i], topic, s->arg);
+            handed(s, cs, tag);
+            continue;
+        }
+        WaggleMsg *m = copy_message(&cs->batch.msgs[i]);
+        if (!m) {
+            fprintf(stderr, "subscriber: out of memory\n");
+            return -1;
+        }
+        if (hand_over(s, cs, topic, m, tag) != 0) return -1;
+    }
+    return 0;
+}
+
+// Connects, consumes until stopped or the connection fails, then closes.
+static int consume_connection(Subscriber *s) {
+    ConsumerState cs;
+    memset(&cs, 0, sizeof(cs));
+    cs.rc = rabbitmq_conn_create_consumer(s->config);
+    if (!cs.rc) {
+        return SUB_CONNECT_FAILED;
+    }
+    if (rabbitmq_consume_start(cs.rc, s->opts.prefetch) != 0) {
+        rabbitmq_conn_close(cs.rc);
+        return SUB_CONNECT_FAILED;
+    }
+    DBGPRINT("consuming.\n");
+
+    int ret = SUB_STOPPED;
+    while (!atomic_load(&s->stop_flag)) {
+        if (bind_new_topics(s, &cs) != 0) {
+            ret = SUB_CONNECTION_LOST;
+            break;
+        }
+
+        if (drain_held(s, &cs) != 0) {
+            ret = SUB_CONNECTION_LOST;
+            break;
+        }
+
+        RabbitMQDelivery d;
+        int r = rabbitmq_consume(cs.rc, cs.held_count > 0 ? SUBSCRIBER_HELD_POLL_MS : SUBSCRIBER_POLL_MS, &d);
+        if (r == 1) {
+            // quiet: ack what we have rather than wait for a full batch
+            if (flush_acks(s, &cs) != 0) {
+                ret = SUB_CONNECTION_LOST;
+                break;
+            }
+            continue;
+        }
+        if (r < 0) {
+            ret = SUB_CONNECTION_LOST;
+            break;
+        }
+
+        int h = handle_delivery(s, &cs, &d);
+        rabbitmq_delivery_free(&d);
+        if (h < 0) {
+            ret = SUB_CONNECTION_LOST;
+            break;
+        }
+        if (cs.unacked >= s->opts.ack_batch && flush_acks(s, &cs) != 0) {
+            ret = SUB_CONNECTION_LOST;
+            break;
+        }
+    }
+
+    if (ret == SUB_STOPPED) {
+        flush_acks(s, &cs);
+    }
+    rabbitmq_conn_close(cs.rc);
+    // held messages were never acked, so the broker delivers them again
+    for (size_t i = 0; i < cs.held_count; i++) {
+        wagglemsg_free(cs.held[(cs.held_head + i) % cs.held_cap].msg);
+    }
+    free(cs.held);
+    wagglemsg_batch_free(&cs.batch);
+    waggle_codec_ctx_free(cs.codec);
+    wagglebuf_free(&cs.plain);
+    return ret;
+}
+
+static void* subscriber_thread_main(void *arg) {
+    Subscriber *s = (Subscriber*)arg;
+    DBGPRINT("subscriber thread started.\n");
+
+    int attempt = 0;
+    while (!atomic_load(&s->stop_flag)) {
+        uint64_t started = waggle_get_monotonic_ns();
+        int ret = consume_connection(s);
+        if (ret == SUB_STOPPED || atomic_load(&s->stop_flag)) {
+            continue;
+        }
+        if (ret == SUB_CONNECTION_LOST &&
+            waggle_get_monotonic_ns() - started >= rabbitmq_stable_uptime_ns(s->config)) {
+            attempt = 0;
+        }
+        int delay = rabbitmq_reconnect_delay_ms(s->config, attempt, &s->seed);
+        if (attempt < 30) attempt++;
+        DBGPRINT("reconnecting in %dms...\n", delay);
+        waggle_wait_stop(&s->lock, &s->stop_cond, &s->stop_flag, delay);
+    }
+
+    DBGPRINT("subscriber thread stopped.\n");
+    return NULL;
+}
@@ -0,0 +1,464 @@
+/**
+ * transport.c
+ *
+ * Purpose:
+ *   The transports that never leave the process or the machine: null,
+ *   memory and file (see transport.h). They confirm every message as soon
+ *   as it is handled, so a lane runs at the speed of its queue and
+ *   encoder. The AMQP transport lives in rabbitmq.c.
+ */
+
+#include "waggle/transport.h"
+#include "waggle/buffer.h"
+#include "waggle/compress.h"
+#include "waggle/wagglemsg.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef DEBUG
+  #define DBGPRINT(...) do { fprintf(stderr, "[DEBUG transport] "); fprintf(stderr, __VA_ARGS__); } while(0)
+#else
+  #define DBGPRINT(...) do {} while(0)
+#endif
+
+// -----------------------------------------------------------------------------
+// LocalConn: a connection to one of the local transports. Every message is
+// handled by the time publish_batch returns, so confirming is just
+// reporting each channel's newest tag once.
+// -----------------------------------------------------------------------------
+typedef struct {
+    int         channels;
+    uint64_t   *next_tag;   // per channel
+    uint64_t   *confirmed;  // per channel: tags below this were reported
+    MemorySink *sink;       // memory
+    int         fd;         // file
+    WaggleBuf   out;        // file: lines of the current batch
+    WaggleBuf   json;       // file: a message converted to JSON
+    WaggleMsgBatch batch;   // file: MessagePack bodies decoded for conversion
+    WaggleCodecCtx *codec;  // file: for compressed bodies; created on first use
+    WaggleBuf   plain;      // file: a compressed body, decompressed
+    size_t     *ends;       // file: end offset of each message in `out`
+    size_t      ends_cap;
+} LocalConn;
+
+static void local_close(void *conn) {
+    LocalConn *lc = (LocalConn*)conn;
+    if (!lc) return;
+    if (lc->fd >= 0) close(lc->fd);
+    wagglebuf_free(&lc->out);
+    wagglebuf_free(&lc->json);
+    wagglemsg_batch_free(&lc->batch);
+    waggle_codec_ctx_free(lc->codec);
+    wagglebuf_free(&lc->plain);
+    free(lc->ends);
+    free(lc->next_tag);
+    free(lc->confirmed);
+    free(lc);
+}
+
+static LocalConn* local_connect(int channels, uint64_t *first_tags) {
+    if (channels < 1) return NULL;
+    LocalConn *lc = calloc(1, sizeof(LocalConn));
+    if (!lc) return NULL;
+    lc->channels = channels;
+    lc->fd = -1;
+    wagglebuf_init(&lc->out);
+    wagglebuf_init(&lc->json);
+    wagglemsg_batch_init(&lc->batch);
+    wagglebuf_init(&lc->plain);
+    lc->next_tag = calloc((size_t)channels, sizeof(uint64_t));
+    lc->confirmed = calloc((size_t)channels, sizeof(uint64_t));
+    if (!lc->next_tag || !lc->confirmed) {
+        local_close(lc);
+        return NULL;
+    }
+    for (int c = 0; c < channels; c++) {
+        lc->next_tag[c] = lc->confirmed[c] = 1;
+        first_tags[c] = 1;
+    }
+    return lc;
+}
+
+// Assigns msgs[0..n) their tags.
+static void local_assign_tags(LocalConn *lc, TransportMessage *msgs, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        msgs[i].delivery_tag = lc->next_tag[msgs[i].channel - 1]++;
+    }
+}
+
+static int local_poll_confirms(void *conn, int timeout_ms, TransportConfirm *out, int max) {
+    (void)timeout_ms; // nothing is ever left to wait for
+    LocalConn *lc = (LocalConn*)conn;
+    int n = 0;
+    for (int c = 0; c < lc->channels && n < max; c++) {
+        if (lc->confirmed[c] == lc->next_tag[c]) continue;
+        out[n].channel = c + 1;
+        out[n].delivery_tag = lc->next_tag[c] - 1;
+        out[n].multiple = 1;
+        out[n].ack = 1;
+        lc->confirmed[c] = lc->next_tag[c];
+        n++;
+    }
+    return n;
+}
+
+static int local_check_channels(const LocalConn *lc, const TransportMessage *msgs, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (msgs[i].channel < 1 || msgs[i].channel > lc->channels) return -1;
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// null
+// -----------------------------------------------------------------------------
+static void* null_connect(void *arg, const PluginConfig *config, int channels, uint64_t *first_tags) {
+    (void)arg;
+    (void)config;
+    return local_connect(channels, first_tags);
+}
+
+static size_t null_publish_batch(void *conn, TransportMessage *msgs, size_t n) {
+    LocalConn *lc = (LocalConn*)conn;
+    if (local_check_channels(lc, msgs, n) != 0) return 0;
+    local_assign_tags(lc, msgs, n);
+    return n;
+}
+
+const TransportOps transport_null = {
+    .name = "null",
+    .connect = null_connect,
+    .publish_batch = null_publish_batch,
+    .poll_confirms = local_poll_confirms,
+    .close = local_close,
+};
+
+// -----------------------------------------------------------------------------
+// MemorySink: a mutex-protected ring of slots. A slot's buffer holds the
+// scope, content type, content encoding and data back to back and is reused when the ring
+// wraps, so a steady stream of similar messages does not allocate.
+// -----------------------------------------------------------------------------
+typedef struct {
+    char   *buf;
+    size_t  cap;
+    size_t  scope_len;
+    size_t  ct_len;     // SIZE_MAX = no content type
+    size_t  ce_len;     // SIZE_MAX = no content encoding
+    size_t  len;
+} SinkSlot;
+
+struct MemorySink {
+    pthread_mutex_t lock;
+    SinkSlot *slots;
+    size_t    capacity;
+    size_t    head;     // oldest message
+    size_t    count;
+    uint64_t  received;
+    uint64_t  overwritten;
+};
+
+MemorySink* memory_sink_new(size_t capacity) {
+    if (capacity == 0) return NULL;
+    MemorySink *s = calloc(1, sizeof(MemorySink));
+    if (!s) return NULL;
+    s->slots = calloc(capacity, sizeof(SinkSlot));
+    if (!s->slots) {
+        free(s);
+        return NULL;
+    }
+    s->capacity = capacity;
+    pthread_mutex_init(&s->lock, NULL);
+    return s;
+}
+
+void memory_sink_free(MemorySink *s) {
+    if (!s) return;
+    for (size_t i = 0; i < s->capacity; i++) {
+        free(s->slots[i].buf);
+    }
+    free(s->slots);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
+
+// Copies one message into the ring. Caller holds the lock.
+static int memory_sink_put(MemorySink *s, const TransportMessage *m) {
+    size_t scope_len = strlen(m->scope);
+    size_t ct_len = m->content_type ? strlen(m->content_type) : SIZE_MAX;
+    size_t ce_len = m->content_encoding ? strlen(m->content_encoding) : SIZE_MAX;
+    size_t need = scope_len + 1 + (m->content_type ? ct_len + 1 : 0) +
+                  (m->content_encoding ? ce_len + 1 : 0) + m->len;
+
+    SinkSlot *slot;
+    if (s->count == s->capacity) {
+        slot = &s->slots[s->head];
+        s->head = (s->head + 1) % s->capacity;
+        s->overwritten++;
+    } else {
+        slot = &s->slots[(s->head + s->count) % s->capacity];
+        s->count++;
+    }
+    if (slot->cap < need || !slot->buf) {
+        char *grown = realloc(slot->buf, need ? need : 1);
+        if (!grown) {
+            // leave an empty message rather than a stale one
+            slot->scope_len = slot->len = 0;
+            slot->ct_len = slot->ce_len = SIZE_MAX;
+            if (slot->buf) slot->buf[0] = '\0';
+            return -1;
+        }
+        slot->buf = grown;
+        slot->cap = need;
+    }
+    char *p = slot->buf;
+    memcpy(p, m->scope, scope_len + 1);
+    p += scope_len + 1;
+    if (m->content_type) {
+        memcpy(p, m->content_type, ct_len + 1);
+        p += ct_len + 1;
+    }
+    if (m->content_encoding) {
+        memcpy(p, m->content_encoding, ce_len + 1);
+        p += ce_len + 1;
+    }
+    if (m->len) memcpy(p, m->data, m->len);
+    slot->scope_len = scope_len;
+    slot->ct_len = ct_len;
+    slot->ce_len = ce_len;
+    slot->len = m->len;
+    s->received++;
+    return 0;
+}
+
+size_t memory_sink_take(MemorySink *s, MemorySinkRecord *out, size_t max) {
+    if (!s || !out) return 0;
+    pthread_mutex_lock(&s->lock);
+    size_t n = 0;
+    while (n < max && s->count > 0) {
+        SinkSlot *slot = &s->slots[s->head];
+        s->head = (s->head + 1) % s->capacity;
+        s->count--;
+        if (!slot->buf) continue; // lost to an allocation failure
+
+        // the record takes the slot's buffer over
+        MemorySinkRecord *r = &out[n++];
+        r->scope = slot->buf;
+        char *p = slot->buf + slot->scope_len + 1;
+        r->content_type = slot->ct_len == SIZE_MAX ? NULL : p;
+        if (r->content_type) p += slot->ct_len + 1;
+        r->content_encoding = slot->ce_len == SIZE_MAX ? NULL : p;
+        if (r->content_encoding) p += slot->ce_len + 1;
+        r->data = p;
+        r->len = slot->len;
+        slot->buf = NULL;
+        slot->cap = 0;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return n;
+}
+
+void memory_sink_record_free(MemorySinkRecord *rec) {
+    if (!rec) return;
+    free(rec->scope); // start of the record's single allocation
+    memset(rec, 0, sizeof(*rec));
+}
+
+void memory_sink_clear(MemorySink *s) {
+    if (!s) return;
+    pthread_mutex_lock(&s->lock);
+    s->head = 0;
+    s->count = 0;
+    pthread_mutex_unlock(&s->lock);
+}
+
+uint64_t memory_sink_received(MemorySink *s) {
+    if (!s) return 0;
+    pthread_mutex_lock(&s->lock);
+    uint64_t v = s->received;
+    pthread_mutex_unlock(&s->lock);
+    return v;
+}
+
+uint64_t memory_sink_overwritten(MemorySink *s) {
+    if (!s) return 0;
+    pthread_mutex_lock(&s->lock);
+    uint64_t v = s->overwritten;
+    pthread_mutex_unlock(&s->lock);
+    return v;
+}
+
+// -----------------------------------------------------------------------------
+// memory
+// -----------------------------------------------------------------------------
+static void* memory_connect(void *arg, const PluginConfig *config, int channels, uint64_t *first_tags) {
+    (void)config;
+    if (!arg) {
+        fprintf(stderr, "transport_memory: no MemorySink\n");
+        return NULL;
+    }
+    LocalConn *lc = local_connect(channels, first_tags);
+    if (lc) lc->sink = (MemorySink*)arg;
+    return lc;
+}
+
+static size_t memory_publish_batch(void *conn, TransportMessage *msgs, size_t n) {
+    LocalConn *lc = (LocalConn*)conn;
+    if (local_check_channels(lc, msgs, n) != 0) return 0;
+    pthread_mutex_lock(&lc->sink->lock);
+    for (size_t i = 0; i < n; i++) {
+        if (memory_sink_put(lc->sink, &msgs[i]) != 0) {
+            DBGPRINT("memory_publish_batch: out of memory, message lost\n");
+        }
+    }
+    pthread_mutex_unlock(&lc->sink->lock);
+    local_assign_tags(lc, msgs, n);
+    return n;
+}
+
+const TransportOps transport_memory = {
+    .name = "memory",
+    .connect = memory_connect,
+    .publish_batch = memory_publish_batch,
+    .poll_confirms = local_poll_confirms,
+    .close = local_close,
+};
+
+// -----------------------------------------------------------------------------
+// file: one line per message. Each connection has its own O_APPEND
+// descriptor and writes a whole batch at once, so lanes do not interleave
+// within a line. Writes are serialized within the process so that a write
+// that fails part way can be cut back to its last complete line.
+// -----------------------------------------------------------------------------
+static pthread_mutex_t file_write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void* file_connect(void *arg, const PluginConfig *config, int channels, uint64_t *first_tags) {
+    (void)config;
+    const char *path = (const char*)arg;
+    if (!path) {
+        fprintf(stderr, "transport_file: no path\n");
+        return NULL;
+    }
+    LocalConn *lc = local_connect(channels, first_tags);
+    if (!lc) return NULL;
+    lc->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0664);
+    if (lc->fd < 0) {
+        fprintf(stderr, "transport_file: cannot open %s: %s\n", path, strerror(errno));
+        local_close(lc);
+        return NULL;
+    }
+    return lc;
+}
+
+// Appends one message as a JSON line. Returns 0 on success, -1 if out of
+// memory or the body is compressed with an encoding that is unknown or
+// does not decompress. JSON bodies, single or NDJSON envelopes, are
+// written as they are; others are decoded and written as one JSON line per
+// message.
+static int file_append_line(LocalConn *lc, const TransportMessage *msg) {
+    TransportMessage plain;
+    const TransportMessage *m = msg;
+    if (msg->content_encoding) {
+        int codec = waggle_codec_of_encoding(msg->content_encoding, strlen(msg->content_encoding));
+        if (!lc->codec) lc->codec = waggle_codec_ctx_new();
+        wagglebuf_reset(&lc->plain);
+        if (codec < 0 || !lc->codec ||
+            waggle_decompress(lc->codec, (WaggleCodec)codec, msg->data, msg->len, 0, &lc->plain) != 0) {
+            fprintf(stderr, "transport_file: cannot decompress a message (content encoding %s)\n",
+                    msg->content_encoding);
+            return -1;
+        }
+        plain = *msg;
+        plain.data = lc->plain.data;
+        plain.len = lc->plain.len;
+        m = &plain;
+    }
+
+    size_t ct_len = m->content_type ? strlen(m->content_type) : 0;
+    int envelope = wagglemsg_envelope_of_content_type(m->content_type, ct_len);
+    int format = m->content_type ? wagglemsg_format_of_content_type(m->content_type, ct_len)
+                                 : (int)wagglemsg_detect_format(m->data, m->len);
+    if (envelope == WAGGLEMSG_FORMAT_JSON || (envelope < 0 && format != WAGGLEMSG_FORMAT_MSGPACK)) {
+        if (wagglebuf_append(&lc->out, m->data, m->len) != 0) return -1;
+        // an NDJSON envelope already ends its last line
+        if (m->len > 0 && ((const char*)m->data)[m->len - 1] == '\n') return 0;
+        return wagglebuf_append(&lc->out, "\n", 1);
+    }
+
+    wagglemsg_batch_reset(&lc->batch);
+    if (wagglemsg_unpack(&lc->batch, m->data, m->len, m->content_type, ct_len) < 0) return -1;
+    if (lc->batch.invalid) {
+        fprintf(stderr, "transport_file: skipping %zu messages that do not decode\n", lc->batch.invalid);
+    }
+    for (size_t i = 0; i < lc->batch.count; i++) {
+        wagglebuf_reset(&lc->json);
+        if (wagglemsg_encode_json_buf(&lc->batch.msgs[i], &lc->json) != 0 ||
+            wagglebuf_append(&lc->out, lc->json.data, lc->json.len) != 0 ||
+            wagglebuf_append(&lc->out, "\n", 1) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static size_t file_publish_batch(void *conn, TransportMessage *msgs, size_t n) {
+    LocalConn *lc = (LocalConn*)conn;
+    if (local_check_channels(lc, msgs, n) != 0) return 0;
+    if (n > lc->ends_cap) {
+        size_t *grown = realloc(lc->ends, n * sizeof(size_t));
+        if (!grown) return 0;
+        lc->ends = grown;
+        lc->ends_cap = n;
+    }
+
+    // a message that cannot be converted ends the batch, unsent, after the
+    // lines before it
+    wagglebuf_reset(&lc->out);
+    size_t lines = 0;
+    while (lines < n && file_append_line(lc, &msgs[lines]) == 0) {
+        lc->ends[lines] = lc->out.len;
+        lines++;
+    }
+    lc->out.len = lines > 0 ? lc->ends[lines - 1] : 0;
+
+    pthread_mutex_lock(&file_write_lock);
+    size_t off = 0;
+    while (off < lc->out.len) {
+        ssize_t w = write(lc->fd, lc->out.data + off, lc->out.len - off);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "transport_file: write failed: %s\n", strerror(errno));
+            break;
+        }
+        off += (size_t)w;
+    }
+
+    // only lines written in full count as sent; the rest of a partial one
+    // is removed so the next write starts on a line of its own
+    size_t sent = 0;
+    while (sent < lines && lc->ends[sent] <= off) sent++;
+    size_t keep = sent > 0 ? lc->ends[sent - 1] : 0;
+    if (off > keep) {
+        off_t end = lseek(lc->fd, 0, SEEK_CUR); // O_APPEND: just past our write
+        if (end < 0 || ftruncate(lc->fd, end - (off_t)(off - keep)) != 0) {
+            fprintf(stderr, "transport_file: cannot remove a partly written line: %s\n", strerror(errno));
+        }
+    }
+    pthread_mutex_unlock(&file_write_lock);
+    local_assign_tags(lc, msgs, sent);
+    return sent;
+}
+
+const TransportOps transport_file = {
+    .name = "file",
+    .connect = file_connect,
+    .publish_batch = file_publish_batch,
+    .poll_confirms = local_poll_confirms,
+    .close = local_close,
+};
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // copy_file_range
 #include "waggle/uploader.h"
 #include <stdlib.h>
 #include <string.h>
@@ -7,6 +8,11 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h> // FICLONE
 
 #ifdef DEBUG
   #define DBGPRINT(...) do { fprintf(stderr, "[DEBUG uploader] "); fprintf(stderr, __VA_ARGS__); } while(0)
@@ -14,10 +20,27 @@
   #define DBGPRINT(...) do {} while(0)
 #endif
 
+#define UPLOADER_KERNEL_CHUNK (64 * 1024 * 1024) // per copy_file_range/sendfile call
+#define UPLOADER_RW_CHUNK     (1024 * 1024)
+#define UPLOADER_PATH_MAX     1024
+
 struct Uploader {
     char *root;
 };
 
+static int write_full(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, buf, len);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += w;
+        len -= (size_t)w;
+    }
+    return 0;
+}
+
 static int ensure_directory(const char *path) {
     DBGPRINT("ensure_directory(path=%s)\n", path);
     int rc = mkdir(path, 0775);
@@ -58,38 +81,143 @@ void uploader_free(Uploader *u) {
     free(u);
 }
 
+// Copies through the page cache in userspace; the last resort.
+static int copy_fd_readwrite(int in_fd, int out_fd) {
+    char *buf = malloc(UPLOADER_RW_CHUNK);
+    if (!buf) return -1;
+
+    int ret = 0;
+    for (;;) {
+        ssize_t r = read(in_fd, buf, UPLOADER_RW_CHUNK);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) {
+            perror("read(src)");
+            ret = -1;
+            break;
+        }
+        if (r == 0) break;
+        if (write_full(out_fd, buf, (size_t)r) != 0) {
+            perror("write(dst)");
+            ret = -1;
+            break;
+        }
+    }
+    free(buf);
+    return ret;
+}
+
+// Errors meaning "this mechanism does not apply here", as opposed to I/O
+// errors; the caller then falls back to the next strategy.
+static int unsupported(int err) {
+    return err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP ||
+           err == ENOTTY || err == EBADF || err == ENOTSUP;
+}
+
+// In-kernel copy of `size` bytes. Returns 0 on success, 1 if the kernel
+// can't copy between these files (nothing was written), -1 on error.
+static int copy_fd_kernel(int in_fd, int out_fd, off_t size) {
+    off_t done = 0;
+    int use_sendfile = 0;
+    while (done < size) {
+        size_t want = (size - done) > UPLOADER_KERNEL_CHUNK ? UPLOADER_KERNEL_CHUNK : (size_t)(size - done);
+        ssize_t n = use_sendfile ? sendfile(out_fd, in_fd, NULL, want)
+                                 : copy_file_range(in_fd, NULL, out_fd, NULL, want, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && done == 0 && unsupported(errno)) {
+            if (use_sendfile) return 1;
+            use_sendfile = 1;
+            continue;
+        }
+        if (n < 0) {
+            perror(use_sendfile ? "sendfile" : "copy_file_range");
+            return -1;
+        }
+        if (n == 0) {
+            // some filesystems report no data via copy_file_range
+            if (done == 0) {
+                if (use_sendfile) return 1;
+                use_sendfile = 1;
+                continue;
+            }
+            break; // file shrank underneath us
+        }
+        done += n;
+    }
+    return 0;
+}
+
 static int copy_file(const char *src, const char *dst) {
     DBGPRINT("copy_file(src=%s, dst=%s)\n", src, dst);
-    int in_fd = open(src, O_RDONLY);
+    int in_fd = open(src, O_RDONLY | O_CLOEXEC);
     if (in_fd < 0) {
         perror("open(src)");
         return -1;
     }
-    int out_fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+    struct stat st;
+    if (fstat(in_fd, &st) != 0) {
+        perror("fstat(src)");
+        close(in_fd);
+        return -1;
+    }
+    int out_fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0664);
     if (out_fd < 0) {
         perror("open(dst)");
         close(in_fd);
         return -2;
     }
 
-    char buf[4096];
-    ssize_t r;
-    while ((r = read(in_fd, buf, sizeof(buf))) > 0) {
-        ssize_t w = write(out_fd, buf, r);
-        if (w < 0) {
-            perror("write(dst)");
-            close(in_fd);
-            close(out_fd);
-            return -3;
+    int rc;
+    if (ioctl(out_fd, FICLONE, in_fd) == 0) {
+        // reflink: shares extents with src, no data is copied
+        DBGPRINT("copy_file: reflinked\n");
+        rc = 0;
+    } else {
+        posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        rc = copy_fd_kernel(in_fd, out_fd, st.st_size);
+        if (rc == 1) {
+            DBGPRINT("copy_file: no in-kernel copy, using read/write\n");
+            rc = copy_fd_readwrite(in_fd, out_fd);
         }
+        // the upload is rarely read back soon; don't let it evict hotter pages
+        posix_fadvise(in_fd, 0, 0, POSIX_FADV_DONTNEED);
     }
+
     close(in_fd);
-    close(out_fd);
-    return (r < 0) ? -4 : 0;
+    if (close(out_fd) != 0 && rc == 0) {
+        perror("close(dst)");
+        rc = -3;
+    }
+    if (rc != 0) {
+        unlink(dst);
+        return rc < 0 ? rc : -4;
+    }
+    return 0;
 }
 
-int uploader_upload_file(Uploader *u, const char *src_path, int64_t timestamp) {
-    DBGPRINT("uploader_upload_file(src=%s, ts=%ld)\n", src_path ? src_path : "NULL", (long)timestamp);
+// Moves or links `src` to `dst` without copying data, if the flags allow
+// it and both are on the same filesystem. Returns 0 if done, nonzero if
+// the caller should copy instead.
+static int place_without_copy(const char *src, const char *dst, int flags) {
+    if (flags & UPLOADER_MOVE) {
+        if (rename(src, dst) == 0) {
+            DBGPRINT("place_without_copy: renamed\n");
+            return 0;
+        }
+        if (errno != EXDEV) perror("rename");
+    } else if (flags & UPLOADER_LINK) {
+        if (link(src, dst) == 0) {
+            DBGPRINT("place_without_copy: hardlinked\n");
+            return 0;
+        }
+        if (errno != EXDEV && errno != EPERM && errno != EMLINK) perror("link");
+    }
+    return -1;
+}
+
+// Places one file in its own upload directory; `dst_path` receives where.
+static int upload_one(Uploader *u, const char *src_path, int64_t timestamp, int flags,
+                      char dst_path[UPLOADER_PATH_MAX]) {
+    DBGPRINT("uploader_upload_file(src=%s, ts=%ld, flags=%d)\n", src_path ? src_path : "NULL", (long)timestamp, flags);
     if (!u || !src_path) return -1;
 
     char dirname[512];
@@ -99,12 +227,219 @@ int uploader_upload_file(Uploader *u, const char *src_path, int64_t timestamp) {
         return -2;
     }
 
-    char dst_path[1024];
-    snprintf(dst_path, sizeof(dst_path), "%s/data", dirname);
+    snprintf(dst_path, UPLOADER_PATH_MAX, "%s/data", dirname);
+
+    if (place_without_copy(src_path, dst_path, flags) == 0) {
+        printf("[Uploader] %s file '%s' -> '%s'\n",
+               (flags & UPLOADER_MOVE) ? "Moved" : "Linked", src_path, dst_path);
+        return 0;
+    }
 
     int rc = copy_file(src_path, dst_path);
     if (rc == 0) {
         printf("[Uploader] Copied file '%s' -> '%s'\n", src_path, dst_path);
+        if ((flags & UPLOADER_MOVE) && unlink(src_path) != 0) {
+            perror("unlink(src)");
+        }
     }
     return rc;
 }
+
+int uploader_upload_file(Uploader *u, const char *src_path, int64_t timestamp) {
+    return uploader_upload_file_ex(u, src_path, timestamp, 0);
+}
+
+int uploader_upload_file_ex(Uploader *u, const char *src_path, int64_t timestamp, int flags) {
+    char dst_path[UPLOADER_PATH_MAX];
+    return upload_one(u, src_path, timestamp, flags, dst_path);
+}
+
+// -----------------------------------------------------------------------------
+// UploadQueue: worker pool with a bounded job queue. Uploads are large and
+// rare compared to samples, so a mutex and condvars are plenty here.
+// -----------------------------------------------------------------------------
+struct UploadJob {
+    char    *src_path;
+    char     dst_path[UPLOADER_PATH_MAX];
+    int64_t  timestamp;
+    int      flags;
+    UploadDoneFn done;
+    void    *arg;
+
+    _Atomic int status;   // UploadStatus
+    int          rc;
+    _Atomic int  refs;    // caller's handle + the queue's
+    struct UploadJob *next;
+};
+
+struct UploadQueue {
+    Uploader *u;
+    pthread_mutex_t lock;
+    pthread_cond_t  not_empty;
+    pthread_cond_t  idle;
+    UploadJob *head;
+    UploadJob *tail;
+    int        queued;
+    int        capacity;
+    int        running;
+    int        stop;
+    int        nthreads;
+    pthread_t *threads;
+};
+
+void upload_job_release(UploadJob *job) {
+    if (!job) return;
+    if (atomic_fetch_sub(&job->refs, 1) == 1) {
+        free(job->src_path);
+        free(job);
+    }
+}
+
+UploadStatus upload_job_status(const UploadJob *job) {
+    return job ? (UploadStatus)atomic_load(&((UploadJob*)job)->status) : UPLOAD_FAILED;
+}
+
+int upload_job_result(const UploadJob *job) {
+    return (job && upload_job_status(job) >= UPLOAD_DONE) ? job->rc : -1;
+}
+
+const char* upload_job_path(const UploadJob *job) {
+    return (job && upload_job_status(job) == UPLOAD_DONE) ? job->dst_path : NULL;
+}
+
+static void* upload_worker_main(void *arg) {
+    UploadQueue *q = (UploadQueue*)arg;
+    DBGPRINT("upload worker started.\n");
+
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        while (!q->head && !q->stop) {
+            pthread_cond_wait(&q->not_empty, &q->lock);
+        }
+        UploadJob *job = q->head;
+        if (!job) break; // stopping and drained
+        q->head = job->next;
+        if (!q->head) q->tail = NULL;
+        q->queued--;
+        q->running++;
+        pthread_mutex_unlock(&q->lock);
+
+        atomic_store(&job->status, UPLOAD_RUNNING);
+        job->rc = upload_one(q->u, job->src_path, job->timestamp, job->flags, job->dst_path);
+        if (job->done) {
+            job->done(job, job->rc, job->rc == 0 ? job->dst_path : NULL, job->arg);
+        }
+        atomic_store(&job->status, job->rc == 0 ? UPLOAD_DONE : UPLOAD_FAILED);
+        upload_job_release(job);
+
+        pthread_mutex_lock(&q->lock);
+        q->running--;
+        if (!q->head && q->running == 0) {
+            pthread_cond_broadcast(&q->idle);
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    DBGPRINT("upload worker stopped.\n");
+    return NULL;
+}
+
+UploadQueue* upload_queue_new(Uploader *u, int workers, int capacity) {
+    DBGPRINT("upload_queue_new(workers=%d, capacity=%d)\n", workers, capacity);
+    if (!u) return NULL;
+    UploadQueue *q = calloc(1, sizeof(UploadQueue));
+    if (!q) return NULL;
+
+    q->u = u;
+    q->capacity = capacity > 0 ? capacity : UPLOADER_DEFAULT_QUEUE_CAPACITY;
+    workers = workers > 0 ? workers : UPLOADER_DEFAULT_WORKERS;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->idle, NULL);
+
+    q->threads = calloc((size_t)workers, sizeof(pthread_t));
+    if (!q->threads) {
+        upload_queue_free(q);
+        return NULL;
+    }
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&q->threads[i], NULL, upload_worker_main, q) != 0) {
+            fprintf(stderr, "upload_queue_new: could only start %d of %d workers\n", i, workers);
+            break;
+        }
+        q->nthreads++;
+    }
+    if (q->nthreads == 0) {
+        upload_queue_free(q);
+        return NULL;
+    }
+    return q;
+}
+
+UploadJob* upload_queue_submit(UploadQueue *q,
+                               const char *src_path,
+                               int64_t timestamp,
+                               int flags,
+                               UploadDoneFn done,
+                               void *arg) {
+    if (!q || !src_path) return NULL;
+
+    UploadJob *job = calloc(1, sizeof(UploadJob));
+    if (!job) return NULL;
+    job->src_path = strdup(src_path);
+    if (!job->src_path) {
+        free(job);
+        return NULL;
+    }
+    job->timestamp = timestamp;
+    job->flags = flags;
+    job->done = done;
+    job->arg = arg;
+    atomic_init(&job->status, UPLOAD_PENDING);
+    atomic_init(&job->refs, 2);
+
+    pthread_mutex_lock(&q->lock);
+    if (q->stop || q->queued >= q->capacity) {
+        pthread_mutex_unlock(&q->lock);
+        DBGPRINT("upload_queue_submit: queue full\n");
+        free(job->src_path);
+        free(job);
+        return NULL;
+    }
+    if (q->tail) {
+        q->tail->next = job;
+    } else {
+        q->head = job;
+    }
+    q->tail = job;
+    q->queued++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+    return job;
+}
+
+void upload_queue_wait(UploadQueue *q) {
+    if (!q) return;
+    pthread_mutex_lock(&q->lock);
+    while (q->head || q->running > 0) {
+        pthread_cond_wait(&q->idle, &q->lock);
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+void upload_queue_free(UploadQueue *q) {
+    DBGPRINT("upload_queue_free() called.\n");
+    if (!q) return;
+    pthread_mutex_lock(&q->lock);
+    q->stop = 1;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+    for (int i = 0; i < q->nthreads; i++) {
+        pthread_join(q->threads[i], NULL); // workers finish queued jobs first
+    }
+    free(q->threads);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->idle);
+    free(q);
+}
@@ -0,0 +1,143 @@
+/**
+ * test_subscriber.c
+ *
+ * Purpose:
+ *   Checks that a subscriber whose inbox fills up stops the broker's
+ *   deliveries, keeps its connection alive through heartbeats while the
+ *   application is not polling, and resumes once the inbox drains, with
+ *   every message delivered once and in order. The broker is the stand-in
+ *   from bench/amqp_standin.c, served from a thread of this process.
+ *
+ * Usage:
+ *   test_subscriber
+ */
+
+#include "waggle/subscriber.h"
+#include "waggle/config.h"
+#include "waggle/timeutil.h"
+#include "amqp_standin.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MESSAGES       2000
+#define PREFETCH       32
+#define INBOX          16
+#define HEARTBEAT_S    1
+#define STALL_MS       3500     // more than two heartbeat intervals
+#define DRAIN_TIMEOUT_MS 20000
+
+static int failures;
+
+#define CHECK(cond, ...) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+            fprintf(stderr, __VA_ARGS__); \
+            fprintf(stderr, "\n"); \
+            failures++; \
+        } \
+    } while (0)
+
+static void* standin_main(void *arg) {
+    standin_serve(*(int*)arg, 0);
+    return NULL;
+}
+
+int main(void) {
+    int port = 0;
+    int listen_fd = standin_listen(0, &port);
+    if (listen_fd < 0) {
+        perror("standin_listen");
+        return 1;
+    }
+    pthread_t server;
+    if (pthread_create(&server, NULL, standin_main, &listen_fd) != 0) {
+        fprintf(stderr, "could not start the stand-in\n");
+        return 1;
+    }
+
+    for (int i = 0; i < MESSAGES; i++) {
+        char body[96];
+        int len = snprintf(body, sizeof(body), "{\"name\":\"env.test\",\"val\":%d,\"ts\":%d,\"meta\":{}}", i, i + 1);
+        if (standin_enqueue("env.test", "application/json", body, (size_t)len) != 0) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+    }
+
+    PluginConfig *config = plugin_config_new("guest", "guest", "127.0.0.1", port, "test_subscriber");
+    if (!config) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    config->heartbeat_s = HEARTBEAT_S;
+
+    SubscriberOptions opts;
+    subscriber_options_default(&opts);
+    opts.prefetch = PREFETCH;
+    opts.queue_capacity = INBOX;
+    Subscriber *sub = subscriber_new(config, &opts, NULL, NULL);
+    if (!sub) {
+        fprintf(stderr, "subscriber_new failed\n");
+        return 1;
+    }
+    const char *topics[] = { "env.#" };
+    subscriber_add_topics(sub, topics, 1);
+
+    // The application does not poll: the inbox fills, deliveries stop
+    // and the connection has to survive on heartbeats alone.
+    StandinStats early, stalled;
+    usleep(1000 * 1000);
+    standin_get_stats(&early);
+    usleep((STALL_MS - 1000) * 1000);
+    standin_get_stats(&stalled);
+
+    CHECK(stalled.cancels >= 1, "a full inbox did not cancel the consumer");
+    CHECK(stalled.deliveries == early.deliveries,
+          "deliveries went on while the inbox was full (%" PRIu64 " -> %" PRIu64 ")",
+          early.deliveries, stalled.deliveries);
+    CHECK(stalled.deliveries <= INBOX + 2 * PREFETCH,
+          "%" PRIu64 " deliveries sent to a full inbox", stalled.deliveries);
+    CHECK(stalled.heartbeat_timeouts == 0, "the connection missed its heartbeats while paused");
+    CHECK(stalled.connections == 1, "%" PRIu64 " connections while paused", stalled.connections);
+
+    // Now drain: consumption resumes and everything arrives in order.
+    long got = 0, next = 0, out_of_order = 0;
+    uint64_t deadline = waggle_get_monotonic_ns() + (uint64_t)DRAIN_TIMEOUT_MS * 1000000ULL;
+    while (got < MESSAGES && waggle_get_monotonic_ns() < deadline) {
+        WaggleMsg *msgs[INBOX];
+        size_t n = subscriber_poll_bulk(sub, msgs, INBOX);
+        for (size_t i = 0; i < n; i++) {
+            if (msgs[i]->value != next) out_of_order++;
+            next = msgs[i]->value + 1;
+            got++;
+            wagglemsg_free(msgs[i]);
+        }
+        if (n == 0) usleep(1000);
+    }
+
+    SubscriberStats sst;
+    subscriber_stats(sub, &sst);
+    subscriber_free(sub);
+    StandinStats done;
+    standin_get_stats(&done);
+
+    CHECK(got == MESSAGES, "received %ld of %d messages", got, MESSAGES);
+    CHECK(out_of_order == 0, "%ld messages out of order", out_of_order);
+    CHECK(sst.pauses >= 1 && done.consumes >= sst.pauses + 1,
+          "consumption did not resume (%" PRIu64 " pauses, %" PRIu64 " consumes)",
+          sst.pauses, done.consumes);
+    CHECK(done.acked == MESSAGES, "%" PRIu64 " of %d deliveries acked", done.acked, MESSAGES);
+    CHECK(done.heartbeat_timeouts == 0 && done.connections == 1,
+          "%" PRIu64 " connections, %" PRIu64 " heartbeat timeouts",
+          done.connections, done.heartbeat_timeouts);
+
+    printf("%s: %ld messages, %" PRIu64 " pauses, %" PRIu64 " deliveries, %" PRIu64 " requeued\n",
+           failures ? "FAILED" : "ok", got, sst.pauses, done.deliveries, done.requeued);
+    plugin_config_free(config);
+    return failures ? 1 : 0;
+}